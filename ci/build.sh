@@ -38,7 +38,6 @@ find AppDir
 
 cp "$(which desktop-file-validate)" AppDir/usr/bin
 cp "$(which mksquashfs)" AppDir/usr/bin
-cp "$(which zsyncmake)" AppDir/usr/bin
 
 cp "$repo_root"/resources/AppRun.sh AppDir/AppRun
 chmod +x AppDir/AppRun
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * libappimagetool builds AppImages from AppDirs. The appimagetool command line tool is a thin wrapper around it.
+ *
+ * All state of a build is kept in its context, so several AppImages can be built at the same time in one process,
+ * from different threads, each with its own context. A context can be reused for another build once its build has
+ * finished. The working directory and the environment of a build are part of its options, the process' ones are
+ * never changed.
+ *
+ * Progress and diagnostics are printed to the standard output and error streams, like the command line tool does.
+ * The reason why a build failed is available from the context.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct appimagetool_context appimagetool_context_t;
+
+/**
+ * Called when a stage of the build has finished, e.g., to collect metrics.
+ * @param microseconds duration of the stage
+ */
+typedef void (*appimagetool_stage_callback_t)(const char* stage, long microseconds, void* user_data);
+
+typedef struct {
+    // AppDir to package
+    const char* source;
+    // path of the AppImage, NULL derives it from the application's name, $VERSION and the architecture
+    const char* destination;
+    // directory relative paths are resolved against, NULL uses the process' working directory
+    const char* working_directory;
+    // NULL terminated list of NAME=VALUE strings, used instead of the process' environment, e.g., for $ARCH,
+    // $VERSION, $SOURCE_DATE_EPOCH and the tools run during the build. NULL uses the process' environment.
+    const char* const* environment;
+
+    // squashfs compression, NULL uses zstd
+    const char* compression;
+    // NULL terminated list of arguments passed through to mksquashfs, may be NULL
+    const char* const* mksquashfs_options;
+    // exclude file for mksquashfs, in addition to .appimageignore, may be NULL
+    const char* exclude_file;
+    // auto, libsquashfs or mksquashfs, NULL means mksquashfs
+    const char* squashfs_backend;
+    // keep the squashfs layout stable across versions to reduce the size of zsync updates
+    bool zsync_friendly;
+
+    // runtime to embed, NULL downloads it (or uses the cached one)
+    const char* runtime_file;
+    // do not download the runtime, use the one cached by a previous build
+    bool offline;
+
+    // update information to embed, a zsync file is generated along with the AppImage, may be NULL
+    const char* update_information;
+    // guess the update information from GitHub Actions, Travis CI or GitLab CI environment variables
+    bool guess_update_information;
+    // URL of the AppImage in the zsync file, relative to the zsync file or absolute, NULL uses its file name
+    const char* file_url;
+
+    // sign the AppImage with gpg, using the key with the given ID, or the first secret key if NULL
+    bool sign;
+    const char* sign_key;
+
+    // do not validate AppStream metadata
+    bool no_appstream;
+    // add the AppImage's digests to SHA256SUMS and MD5SUMS next to it
+    bool write_checksums;
+    bool verbose;
+
+    // directory of a cache of finished AppImages, shared by builds with the same inputs, and of compressed squashfs
+    // blocks, shared by all builds with libsquashfs; NULL disables the cache
+    const char* cache_directory;
+    // bytes the cached AppImages, and the compressed blocks, may each take up before the least recently used ones are
+    // evicted, 0 for no limit
+    uint64_t cache_size;
+    // record checkpoints while building, in a journal next to the destination, and continue a build with the same
+    // inputs which has failed afterwards, e.g., while signing, from the last one instead of starting over
+    bool resume;
+
+    // CPUs and bytes of memory the build may use, 0 uses all available, respecting cgroup limits
+    unsigned int jobs;
+    uint64_t memory;
+
+    // called from the thread which has run the stage, may be NULL
+    appimagetool_stage_callback_t stage_callback;
+    void* stage_callback_data;
+} appimagetool_options_t;
+
+/**
+ * Set all options to their defaults. Only the source has to be set afterwards.
+ */
+void appimagetool_options_init(appimagetool_options_t* options);
+
+appimagetool_context_t* appimagetool_context_new(void);
+
+void appimagetool_context_free(appimagetool_context_t* context);
+
+/**
+ * Build an AppImage. Blocks until the AppImage has been published at its destination, or the build has failed.
+ * Thread safe, as long as no other build uses the same context at the same time.
+ * @return true on success, false otherwise, see appimagetool_context_error
+ */
+bool appimagetool_build(appimagetool_context_t* context, const appimagetool_options_t* options);
+
+/**
+ * Reason why the last build has failed, or NULL.
+ */
+const char* appimagetool_context_error(const appimagetool_context_t* context);
+
+/**
+ * Path of the AppImage built last, or NULL.
+ */
+const char* appimagetool_context_destination(const appimagetool_context_t* context);
+
+/**
+ * Remove the temporary files of all builds in this process which have not been published yet, except for the ones
+ * kept for --resume, which have reached a checkpoint. Builds still running fail afterwards.
+ * Async-signal-safe, so that programs can call it from their SIGINT and SIGTERM handlers, as well as at exit.
+ */
+void appimagetool_discard_unpublished(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,489 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "appimagetool_arch.h"
+
+// sanity limits for malformed files
+static const uint16_t max_program_headers = 128;
+static const size_t max_dynamic_entries = 4096;
+#define MAX_NEEDED_LIBRARIES 64
+
+#define ELF_PROBE_SIZE 64
+
+#define ELFCLASS32 1
+#define ELFCLASS64 2
+#define ELFDATA2LSB 1
+#define ELFDATA2MSB 2
+#define PT_LOAD 1
+#define PT_DYNAMIC 2
+#define DT_NULL 0
+#define DT_NEEDED 1
+#define DT_STRTAB 5
+#define DT_STRSZ 10
+
+typedef struct {
+    int fd;
+    bool is_64bit;
+    bool big_endian;
+    uint16_t machine;
+    uint64_t program_headers_offset;
+    uint16_t program_header_size;
+    uint16_t program_headers_count;
+} elf_info_t;
+
+typedef struct {
+    uint16_t* machines;
+    size_t max_machines;
+    size_t count;
+} machine_set_t;
+
+static uint64_t read_value(const unsigned char* data, size_t size, bool big_endian) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        const size_t index = big_endian ? i : size - 1 - i;
+        value = (value << 8) | data[index];
+    }
+    return value;
+}
+
+static bool read_exactly(int fd, void* buffer, size_t size, uint64_t offset) {
+    char* position = buffer;
+    while (size > 0) {
+        ssize_t bytes_read = pread(fd, position, size, (off_t) offset);
+        if (bytes_read <= 0) {
+            return false;
+        }
+        position += bytes_read;
+        offset += (uint64_t) bytes_read;
+        size -= (size_t) bytes_read;
+    }
+    return true;
+}
+
+// the ELF class every supported machine type must have, 0 if we don't know the machine
+static int expected_class(uint16_t machine) {
+    switch (machine) {
+        case 3: // i386
+        case 40: // ARM
+            return ELFCLASS32;
+        case 62: // x86_64
+        case 183: // AArch64
+            return ELFCLASS64;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Read and validate the ELF header of an open file
+ * Shell scripts, data files and truncated or inconsistent headers are rejected
+ */
+static bool read_elf_info(int fd, elf_info_t* info) {
+    unsigned char header[ELF_PROBE_SIZE];
+
+    if (!read_exactly(fd, header, 52, 0) || memcmp(header, "\x7f" "ELF", 4) != 0) {
+        return false;
+    }
+
+    const unsigned char elf_class = header[4];
+    const unsigned char elf_data = header[5];
+
+    if ((elf_class != ELFCLASS32 && elf_class != ELFCLASS64) || (elf_data != ELFDATA2LSB && elf_data != ELFDATA2MSB)) {
+        return false;
+    }
+
+    info->fd = fd;
+    info->is_64bit = elf_class == ELFCLASS64;
+    info->big_endian = elf_data == ELFDATA2MSB;
+    info->machine = (uint16_t) read_value(header + 18, 2, info->big_endian);
+
+    const int required_class = expected_class(info->machine);
+    if (required_class != 0 && required_class != elf_class) {
+        return false;
+    }
+
+    if (info->is_64bit) {
+        if (!read_exactly(fd, header + 52, 64 - 52, 52)) {
+            return false;
+        }
+        info->program_headers_offset = read_value(header + 32, 8, info->big_endian);
+        info->program_header_size = (uint16_t) read_value(header + 54, 2, info->big_endian);
+        info->program_headers_count = (uint16_t) read_value(header + 56, 2, info->big_endian);
+    } else {
+        info->program_headers_offset = read_value(header + 28, 4, info->big_endian);
+        info->program_header_size = (uint16_t) read_value(header + 42, 2, info->big_endian);
+        info->program_headers_count = (uint16_t) read_value(header + 44, 2, info->big_endian);
+    }
+
+    return true;
+}
+
+typedef struct {
+    uint32_t type;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t filesz;
+} program_header_t;
+
+static bool read_program_header(const elf_info_t* info, uint16_t index, program_header_t* phdr) {
+    unsigned char buffer[56];
+    const size_t size = info->is_64bit ? 56 : 32;
+
+    if (info->program_header_size < size) {
+        return false;
+    }
+
+    if (!read_exactly(info->fd, buffer, size, info->program_headers_offset + (uint64_t) index * info->program_header_size)) {
+        return false;
+    }
+
+    phdr->type = (uint32_t) read_value(buffer, 4, info->big_endian);
+    if (info->is_64bit) {
+        phdr->offset = read_value(buffer + 8, 8, info->big_endian);
+        phdr->vaddr = read_value(buffer + 16, 8, info->big_endian);
+        phdr->filesz = read_value(buffer + 32, 8, info->big_endian);
+    } else {
+        phdr->offset = read_value(buffer + 4, 4, info->big_endian);
+        phdr->vaddr = read_value(buffer + 8, 4, info->big_endian);
+        phdr->filesz = read_value(buffer + 16, 4, info->big_endian);
+    }
+
+    return true;
+}
+
+// translate a virtual address into a file offset using the PT_LOAD segments
+static bool vaddr_to_offset(const elf_info_t* info, uint64_t vaddr, uint64_t* offset) {
+    const uint16_t count = info->program_headers_count < max_program_headers ? info->program_headers_count : max_program_headers;
+
+    for (uint16_t i = 0; i < count; ++i) {
+        program_header_t phdr;
+        if (!read_program_header(info, i, &phdr)) {
+            return false;
+        }
+        if (phdr.type == PT_LOAD && vaddr >= phdr.vaddr && vaddr < phdr.vaddr + phdr.filesz) {
+            *offset = vaddr - phdr.vaddr + phdr.offset;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Call the callback for every DT_NEEDED entry, until it returns true
+ * Only the program headers, the dynamic section and the needed strings are read
+ */
+static bool for_each_needed_library(const elf_info_t* info, bool (*callback)(const char*, void*), void* user_data) {
+    const uint16_t count = info->program_headers_count < max_program_headers ? info->program_headers_count : max_program_headers;
+
+    program_header_t dynamic = {0};
+    bool found_dynamic = false;
+
+    for (uint16_t i = 0; i < count && !found_dynamic; ++i) {
+        if (!read_program_header(info, i, &dynamic)) {
+            return false;
+        }
+        found_dynamic = dynamic.type == PT_DYNAMIC;
+    }
+
+    // statically linked
+    if (!found_dynamic) {
+        return false;
+    }
+
+    const size_t entry_size = info->is_64bit ? 16 : 8;
+    const size_t half_size = entry_size / 2;
+    size_t entries_count = (size_t) (dynamic.filesz / entry_size);
+    if (entries_count > max_dynamic_entries) {
+        entries_count = max_dynamic_entries;
+    }
+
+    unsigned char* entries = malloc(entries_count * entry_size);
+    if (entries == NULL || !read_exactly(info->fd, entries, entries_count * entry_size, dynamic.offset)) {
+        free(entries);
+        return false;
+    }
+
+    uint64_t string_table_address = 0;
+    uint64_t string_table_size = 0;
+    uint64_t needed[MAX_NEEDED_LIBRARIES];
+    size_t needed_count = 0;
+
+    for (size_t i = 0; i < entries_count; ++i) {
+        const uint64_t tag = read_value(entries + i * entry_size, half_size, info->big_endian);
+        const uint64_t value = read_value(entries + i * entry_size + half_size, half_size, info->big_endian);
+
+        if (tag == DT_NULL) {
+            break;
+        } else if (tag == DT_STRTAB) {
+            string_table_address = value;
+        } else if (tag == DT_STRSZ) {
+            string_table_size = value;
+        } else if (tag == DT_NEEDED && needed_count < MAX_NEEDED_LIBRARIES) {
+            needed[needed_count++] = value;
+        }
+    }
+
+    free(entries);
+
+    uint64_t string_table_offset;
+    if (needed_count == 0 || !vaddr_to_offset(info, string_table_address, &string_table_offset)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < needed_count; ++i) {
+        if (string_table_size != 0 && needed[i] >= string_table_size) {
+            continue;
+        }
+
+        char name[NAME_MAX + 1] = {0};
+        ssize_t bytes_read = pread(info->fd, name, NAME_MAX, (off_t) (string_table_offset + needed[i]));
+        if (bytes_read <= 0 || memchr(name, '\0', (size_t) bytes_read) == NULL) {
+            continue;
+        }
+
+        if (callback(name, user_data)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// returns whether the machine type is new to the set
+static bool add_machine(machine_set_t* set, uint16_t machine) {
+    for (size_t i = 0; i < set->count; ++i) {
+        if (set->machines[i] == machine) {
+            return false;
+        }
+    }
+    if (set->count < set->max_machines) {
+        set->machines[set->count++] = machine;
+        return true;
+    }
+    return false;
+}
+
+// open a regular file relative to the AppDir, following symlinks
+static int open_in_appdir(int appdir_fd, const char* path) {
+    while (*path == '/') {
+        path++;
+    }
+
+    int fd = openat(appdir_fd, path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Exec= usually names a binary in usr/bin, which AppRun puts on the $PATH
+static int open_exec_target(int appdir_fd, const char* exec_program, char* resolved, size_t resolved_size) {
+    if (strchr(exec_program, '/') != NULL) {
+        snprintf(resolved, resolved_size, "%s", exec_program);
+        return open_in_appdir(appdir_fd, exec_program);
+    }
+
+    static const char* const prefixes[] = {"usr/bin/", "", "bin/", "usr/sbin/"};
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+        if (snprintf(resolved, resolved_size, "%s%s", prefixes[i], exec_program) >= (int) resolved_size) {
+            continue;
+        }
+        int fd = open_in_appdir(appdir_fd, resolved);
+        if (fd >= 0) {
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+typedef struct {
+    int appdir_fd;
+    const appdir_scan_t* scan;
+    uint16_t expected_machine;
+    bool found;
+    bool consistent;
+    const char* library_path;
+} needed_lookup_t;
+
+// the scan reads the ELF headers of these files, see APPDIR_SCAN_PROBE_ELF
+static bool looks_like_elf_candidate(const appdir_entry_t* entry) {
+    return S_ISREG(entry->mode) && ((entry->mode & 0111) != 0 || strstr(entry->name, ".so.") != NULL);
+}
+
+// the machine type from the ELF header the scan has read, checked like read_elf_info does
+static bool probed_elf_machine(const appdir_entry_t* entry, uint16_t* machine) {
+    if ((entry->flags & APPDIR_ENTRY_ELF) == 0 ||
+        (entry->elf_class != ELFCLASS32 && entry->elf_class != ELFCLASS64) ||
+        (entry->elf_data != ELFDATA2LSB && entry->elf_data != ELFDATA2MSB)) {
+        return false;
+    }
+
+    const int required_class = expected_class(entry->elf_machine);
+    if (required_class != 0 && required_class != entry->elf_class) {
+        return false;
+    }
+
+    *machine = entry->elf_machine;
+    return true;
+}
+
+// look for the library in the AppDir, the first bundled one decides
+static bool check_bundled_library(const char* name, void* user_data) {
+    needed_lookup_t* lookup = user_data;
+
+    const size_t* indexes;
+    const size_t count = appdir_scan_find_name(lookup->scan, name, &indexes);
+
+    for (size_t i = 0; i < count; ++i) {
+        const appdir_entry_t* entry = appdir_scan_entry(lookup->scan, indexes[i]);
+        uint16_t machine;
+
+        if (looks_like_elf_candidate(entry)) {
+            if (!probed_elf_machine(entry, &machine)) {
+                continue;
+            }
+        } else {
+            // usually a symlink to the versioned file, which the scan does not follow
+            int fd = open_in_appdir(lookup->appdir_fd, entry->path);
+            if (fd < 0) {
+                continue;
+            }
+
+            elf_info_t info;
+            const bool valid = read_elf_info(fd, &info);
+            close(fd);
+
+            if (!valid) {
+                continue;
+            }
+            machine = info.machine;
+        }
+
+        lookup->found = true;
+        lookup->consistent = machine == lookup->expected_machine;
+        lookup->library_path = entry->path;
+        return true;
+    }
+
+    return false;
+}
+
+// collect the machine types of all executables and libraries, without opening any of them again
+static void collect_elf_machines(const appdir_scan_t* scan, machine_set_t* set, bool verbose) {
+    size_t elf_files_count = 0;
+
+    for (size_t i = 0; i < appdir_scan_entries_count(scan); ++i) {
+        const appdir_entry_t* entry = appdir_scan_entry(scan, i);
+
+        uint16_t machine;
+        if (!probed_elf_machine(entry, &machine)) {
+            continue;
+        }
+        elf_files_count++;
+
+        if (add_machine(set, machine) && verbose && expected_class(machine) != 0) {
+            fprintf(stderr, "%s used for determining architecture\n", entry->path);
+        }
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Inspected %zu executables and libraries\n", elf_files_count);
+    }
+}
+
+size_t appimage_detect_elf_machines(
+    const char* appdir,
+    const appdir_scan_t* scan,
+    const char* exec_program,
+    uint16_t* machines,
+    size_t max_machines,
+    bool verbose
+) {
+    machine_set_t set = {machines, max_machines, 0};
+
+    int appdir_fd = open(appdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (appdir_fd < 0) {
+        return 0;
+    }
+
+    // the main binaries, in order of relevance
+    char exec_path[PATH_MAX] = {0};
+    int fds[2] = {-1, -1};
+    const char* paths[2] = {exec_path, "AppRun"};
+
+    if (exec_program != NULL && *exec_program != '\0') {
+        fds[0] = open_exec_target(appdir_fd, exec_program, exec_path, sizeof(exec_path));
+    }
+    fds[1] = open_in_appdir(appdir_fd, "AppRun");
+
+    bool have_answer = false;
+    bool consistent = true;
+    uint16_t machine = 0;
+    elf_info_t primary = {0};
+
+    for (size_t i = 0; i < 2; ++i) {
+        elf_info_t info;
+        // scripts are skipped, they don't tell us anything
+        if (fds[i] < 0 || !read_elf_info(fds[i], &info) || expected_class(info.machine) == 0) {
+            continue;
+        }
+
+        if (verbose) {
+            fprintf(stderr, "%s used for determining architecture\n", paths[i]);
+        }
+
+        if (!have_answer) {
+            have_answer = true;
+            machine = info.machine;
+            primary = info;
+        } else if (info.machine != machine) {
+            consistent = false;
+        }
+    }
+
+    // a bundled library the main binary links to must agree, too; system libraries can't be checked
+    if (have_answer && consistent) {
+        needed_lookup_t lookup = {appdir_fd, scan, machine, false, true, NULL};
+        for_each_needed_library(&primary, check_bundled_library, &lookup);
+
+        if (lookup.found) {
+            if (verbose) {
+                fprintf(stderr, "%s used for confirming architecture\n", lookup.library_path);
+            }
+            consistent = lookup.consistent;
+        }
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    if (have_answer && consistent) {
+        add_machine(&set, machine);
+    } else {
+        if (verbose) {
+            fprintf(stderr, "Main executable does not determine the architecture, inspecting other files\n");
+        }
+        collect_elf_machines(scan, &set, verbose);
+    }
+
+    close(appdir_fd);
+    return set.count;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "appimagetool_scan.h"
+
+/**
+ * Determine the ELF machine type(s) (e_machine) of the binaries in an AppDir.
+ *
+ * The binary the desktop file's Exec= key refers to and AppRun are checked first. If they agree, the first bundled
+ * library from their DT_NEEDED entries is used to confirm the result. Only if that does not give a consistent answer,
+ * the machine types of all executables and shared libraries are taken from the ELF headers the scan has read.
+ * Files are only counted if they have a valid ELF header whose class matches the machine type.
+ *
+ * @param appdir absolute path of the AppDir
+ * @param scan result of appdir_scan for the AppDir made with APPDIR_SCAN_PROBE_ELF, used to locate bundled libraries
+ *        and for the fallback
+ * @param exec_program first word of the Exec= command line, may be NULL
+ * @param machines receives the distinct machine types found
+ * @return number of distinct machine types stored in machines
+ */
+size_t appimage_detect_elf_machines(
+    const char* appdir,
+    const appdir_scan_t* scan,
+    const char* exec_program,
+    uint16_t* machines,
+    size_t max_machines,
+    bool verbose
+);
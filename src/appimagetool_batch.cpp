@@ -0,0 +1,889 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "appimagetool_batch.h"
+#include "appimagetool_fetch_runtime.h"
+
+extern char** environ;
+
+namespace {
+    // a minimal JSON document model, the manifest is small and read once
+    class JsonValue {
+    public:
+        enum class Type {
+            Null,
+            Boolean,
+            Number,
+            String,
+            Array,
+            Object,
+        };
+
+        Type type = Type::Null;
+        bool boolean = false;
+        double number = 0;
+        std::string string;
+        std::vector<JsonValue> array;
+        // keeps the order of the document, so that errors can be reported in that order
+        std::vector<std::pair<std::string, JsonValue>> object;
+
+        static const char* typeName(Type type) {
+            switch (type) {
+                case Type::Null:
+                    return "null";
+                case Type::Boolean:
+                    return "a boolean";
+                case Type::Number:
+                    return "a number";
+                case Type::String:
+                    return "a string";
+                case Type::Array:
+                    return "an array";
+                case Type::Object:
+                    return "an object";
+            }
+            return "unknown";
+        }
+
+        const JsonValue* find(const std::string& key) const {
+            for (const auto& [name, value] : object) {
+                if (name == key) {
+                    return &value;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    class JsonParser {
+    private:
+        const std::string& _text;
+        size_t _position = 0;
+        std::string _error;
+
+        // nesting limit, so that a broken manifest cannot exhaust the stack
+        static constexpr int maximumDepth = 64;
+
+        bool fail(const std::string& message) {
+            if (_error.empty()) {
+                _error = message;
+            }
+            return false;
+        }
+
+        void skipWhitespace() {
+            while (_position < _text.size() && (_text[_position] == ' ' || _text[_position] == '\t' ||
+                                                _text[_position] == '\n' || _text[_position] == '\r')) {
+                ++_position;
+            }
+        }
+
+        bool consume(const char* literal) {
+            const size_t length = strlen(literal);
+            if (_text.compare(_position, length, literal) != 0) {
+                return false;
+            }
+            _position += length;
+            return true;
+        }
+
+        bool parseHex4(uint32_t& codePoint) {
+            if (_position + 4 > _text.size()) {
+                return fail("truncated \\u escape");
+            }
+
+            codePoint = 0;
+            for (int i = 0; i < 4; ++i) {
+                const char c = _text[_position++];
+                codePoint <<= 4;
+                if (c >= '0' && c <= '9') {
+                    codePoint |= static_cast<uint32_t>(c - '0');
+                } else if (c >= 'a' && c <= 'f') {
+                    codePoint |= static_cast<uint32_t>(c - 'a' + 10);
+                } else if (c >= 'A' && c <= 'F') {
+                    codePoint |= static_cast<uint32_t>(c - 'A' + 10);
+                } else {
+                    return fail("invalid \\u escape");
+                }
+            }
+            return true;
+        }
+
+        static void appendUtf8(std::string& out, uint32_t codePoint) {
+            if (codePoint < 0x80) {
+                out += static_cast<char>(codePoint);
+            } else if (codePoint < 0x800) {
+                out += static_cast<char>(0xc0 | (codePoint >> 6));
+                out += static_cast<char>(0x80 | (codePoint & 0x3f));
+            } else if (codePoint < 0x10000) {
+                out += static_cast<char>(0xe0 | (codePoint >> 12));
+                out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f));
+                out += static_cast<char>(0x80 | (codePoint & 0x3f));
+            } else {
+                out += static_cast<char>(0xf0 | (codePoint >> 18));
+                out += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3f));
+                out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f));
+                out += static_cast<char>(0x80 | (codePoint & 0x3f));
+            }
+        }
+
+        bool parseString(std::string& out) {
+            // the opening quote has been checked by the caller
+            ++_position;
+
+            while (_position < _text.size()) {
+                const char c = _text[_position++];
+
+                if (c == '"') {
+                    return true;
+                }
+
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    return fail("control character in string");
+                }
+
+                if (c != '\\') {
+                    out += c;
+                    continue;
+                }
+
+                if (_position >= _text.size()) {
+                    break;
+                }
+
+                const char escape = _text[_position++];
+                switch (escape) {
+                    case '"':
+                    case '\\':
+                    case '/':
+                        out += escape;
+                        break;
+                    case 'b':
+                        out += '\b';
+                        break;
+                    case 'f':
+                        out += '\f';
+                        break;
+                    case 'n':
+                        out += '\n';
+                        break;
+                    case 'r':
+                        out += '\r';
+                        break;
+                    case 't':
+                        out += '\t';
+                        break;
+                    case 'u': {
+                        uint32_t codePoint;
+                        if (!parseHex4(codePoint)) {
+                            return false;
+                        }
+
+                        // characters outside of the basic multilingual plane are encoded as surrogate pairs
+                        if (codePoint >= 0xd800 && codePoint < 0xdc00) {
+                            uint32_t low;
+                            if (!consume("\\u") || !parseHex4(low) || low < 0xdc00 || low >= 0xe000) {
+                                return fail("invalid surrogate pair");
+                            }
+                            codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+                        } else if (codePoint >= 0xdc00 && codePoint < 0xe000) {
+                            return fail("invalid surrogate pair");
+                        }
+
+                        appendUtf8(out, codePoint);
+                        break;
+                    }
+                    default:
+                        return fail(std::string("invalid escape \\") + escape);
+                }
+            }
+
+            return fail("unterminated string");
+        }
+
+        bool parseNumber(double& out) {
+            const size_t start = _position;
+
+            if (_position < _text.size() && _text[_position] == '-') {
+                ++_position;
+            }
+            while (_position < _text.size() && strchr("0123456789.eE+-", _text[_position]) != nullptr) {
+                ++_position;
+            }
+
+            const std::string number = _text.substr(start, _position - start);
+            char* end = nullptr;
+            errno = 0;
+            out = strtod(number.c_str(), &end);
+
+            if (number.empty() || end != number.c_str() + number.size() || errno != 0) {
+                _position = start;
+                return fail("invalid number");
+            }
+            return true;
+        }
+
+        bool parseValue(JsonValue& value, int depth) {
+            if (depth > maximumDepth) {
+                return fail("too deeply nested");
+            }
+
+            skipWhitespace();
+
+            if (_position >= _text.size()) {
+                return fail("unexpected end of file");
+            }
+
+            const char c = _text[_position];
+
+            if (c == '{') {
+                value.type = JsonValue::Type::Object;
+                ++_position;
+                skipWhitespace();
+
+                if (consume("}")) {
+                    return true;
+                }
+
+                while (true) {
+                    skipWhitespace();
+                    if (_position >= _text.size() || _text[_position] != '"') {
+                        return fail("expected a key");
+                    }
+
+                    std::string key;
+                    if (!parseString(key)) {
+                        return false;
+                    }
+
+                    skipWhitespace();
+                    if (!consume(":")) {
+                        return fail("expected ':'");
+                    }
+
+                    JsonValue member;
+                    if (!parseValue(member, depth + 1)) {
+                        return false;
+                    }
+                    value.object.emplace_back(std::move(key), std::move(member));
+
+                    skipWhitespace();
+                    if (consume("}")) {
+                        return true;
+                    }
+                    if (!consume(",")) {
+                        return fail("expected ',' or '}'");
+                    }
+                }
+            }
+
+            if (c == '[') {
+                value.type = JsonValue::Type::Array;
+                ++_position;
+                skipWhitespace();
+
+                if (consume("]")) {
+                    return true;
+                }
+
+                while (true) {
+                    JsonValue element;
+                    if (!parseValue(element, depth + 1)) {
+                        return false;
+                    }
+                    value.array.push_back(std::move(element));
+
+                    skipWhitespace();
+                    if (consume("]")) {
+                        return true;
+                    }
+                    if (!consume(",")) {
+                        return fail("expected ',' or ']'");
+                    }
+                }
+            }
+
+            if (c == '"') {
+                value.type = JsonValue::Type::String;
+                return parseString(value.string);
+            }
+
+            if (consume("true")) {
+                value.type = JsonValue::Type::Boolean;
+                value.boolean = true;
+                return true;
+            }
+
+            if (consume("false")) {
+                value.type = JsonValue::Type::Boolean;
+                value.boolean = false;
+                return true;
+            }
+
+            if (consume("null")) {
+                value.type = JsonValue::Type::Null;
+                return true;
+            }
+
+            value.type = JsonValue::Type::Number;
+            return parseNumber(value.number);
+        }
+
+    public:
+        explicit JsonParser(const std::string& text) : _text(text) {}
+
+        bool parse(JsonValue& value) {
+            if (!parseValue(value, 0)) {
+                return false;
+            }
+
+            skipWhitespace();
+            if (_position != _text.size()) {
+                return fail("trailing data after the document");
+            }
+            return true;
+        }
+
+        const std::string& error() const {
+            return _error;
+        }
+
+        size_t position() const {
+            return _position;
+        }
+    };
+
+    // one entry of the manifest, owns the strings its options point to
+    class Artifact {
+    private:
+        std::map<std::string, std::string> _strings;
+        std::vector<std::string> _mksquashfsOptions;
+        std::map<std::string, std::string> _environment;
+
+        std::vector<const char*> _mksquashfsOptionPointers;
+        std::vector<std::string> _environmentStrings;
+        std::vector<const char*> _environmentPointers;
+
+        const char* string(const std::string& key) const {
+            const auto it = _strings.find(key);
+            return it == _strings.end() ? nullptr : it->second.c_str();
+        }
+
+    public:
+        size_t index = 0;
+        appimagetool_options_t options{};
+
+        std::string arch;
+        std::string runtimeFile;
+
+        // results
+        bool built = false;
+        std::string label;
+        std::string error;
+        long microseconds = -1;
+        std::map<std::string, long> stages;
+
+        bool parse(const JsonValue& entry, std::string& error) {
+            if (entry.type != JsonValue::Type::Object) {
+                error = "expected an object";
+                return false;
+            }
+
+            static const std::vector<std::pair<const char*, bool appimagetool_options_t::*>> booleanOptions = {
+                {"guess", &appimagetool_options_t::guess_update_information},
+                {"offline", &appimagetool_options_t::offline},
+                {"sign", &appimagetool_options_t::sign},
+                {"no-appstream", &appimagetool_options_t::no_appstream},
+                {"checksums", &appimagetool_options_t::write_checksums},
+                {"zsync-friendly", &appimagetool_options_t::zsync_friendly},
+                {"verbose", &appimagetool_options_t::verbose},
+            };
+
+            static const std::vector<const char*> stringOptions = {
+                "appdir", "arch", "destination", "updateinformation", "comp", "exclude-file", "runtime-file",
+                "sign-key", "file-url", "squashfs-backend",
+            };
+
+            for (const auto& [key, value] : entry.object) {
+                const auto expect = [&](JsonValue::Type type) {
+                    if (value.type != type) {
+                        error = "\"" + key + "\" must be " + JsonValue::typeName(type);
+                        return false;
+                    }
+                    return true;
+                };
+
+                const auto booleanOption = std::find_if(booleanOptions.begin(), booleanOptions.end(), [&](const auto& option) {
+                    return key == option.first;
+                });
+                if (booleanOption != booleanOptions.end()) {
+                    if (!expect(JsonValue::Type::Boolean)) {
+                        return false;
+                    }
+                    options.*(booleanOption->second) = value.boolean;
+                    continue;
+                }
+
+                const auto stringOption = std::find_if(stringOptions.begin(), stringOptions.end(), [&](const char* option) {
+                    return key == option;
+                });
+                if (stringOption != stringOptions.end()) {
+                    if (!expect(JsonValue::Type::String)) {
+                        return false;
+                    }
+                    _strings[key] = value.string;
+                    continue;
+                }
+
+                if (key == "mksquashfs-opt") {
+                    if (!expect(JsonValue::Type::Array)) {
+                        return false;
+                    }
+                    _mksquashfsOptions.clear();
+                    for (const auto& option : value.array) {
+                        if (option.type != JsonValue::Type::String) {
+                            error = "\"mksquashfs-opt\" must be an array of strings";
+                            return false;
+                        }
+                        _mksquashfsOptions.push_back(option.string);
+                    }
+                    continue;
+                }
+
+                if (key == "env") {
+                    if (!expect(JsonValue::Type::Object)) {
+                        return false;
+                    }
+                    for (const auto& [name, variable] : value.object) {
+                        if (variable.type != JsonValue::Type::String || name.empty() || name.find('=') != std::string::npos) {
+                            error = "\"env\" must map variable names to strings";
+                            return false;
+                        }
+                        _environment[name] = variable.string;
+                    }
+                    continue;
+                }
+
+                error = "unknown key \"" + key + "\"";
+                return false;
+            }
+
+            if (string("appdir") == nullptr) {
+                error = "\"appdir\" is missing";
+                return false;
+            }
+
+            if (const char* value = string("arch")) {
+                arch = value;
+            }
+
+            return true;
+        }
+
+        /* Point the options to the strings owned by the artifact, the manifest's values replace the defaults */
+        void prepare(const appimagetool_options_t& defaults, const std::string& workingDirectory) {
+            const auto override = [this](const char* key, const char*& option) {
+                if (const char* value = string(key)) {
+                    option = value;
+                }
+            };
+
+            options.source = string("appdir");
+            options.destination = string("destination");
+            options.working_directory = workingDirectory.c_str();
+            override("updateinformation", options.update_information);
+            override("comp", options.compression);
+            override("exclude-file", options.exclude_file);
+            override("runtime-file", options.runtime_file);
+            override("sign-key", options.sign_key);
+            override("file-url", options.file_url);
+            override("squashfs-backend", options.squashfs_backend);
+
+            if (!runtimeFile.empty() && string("runtime-file") == nullptr) {
+                options.runtime_file = runtimeFile.c_str();
+            }
+
+            if (!_mksquashfsOptions.empty()) {
+                _mksquashfsOptionPointers.clear();
+                for (const auto& option : _mksquashfsOptions) {
+                    _mksquashfsOptionPointers.push_back(option.c_str());
+                }
+                _mksquashfsOptionPointers.push_back(nullptr);
+                options.mksquashfs_options = _mksquashfsOptionPointers.data();
+            }
+
+            // the build's environment is the process' one, plus $ARCH and the manifest's variables
+            std::map<std::string, std::string> environment;
+            const char* const* base = defaults.environment != nullptr ? defaults.environment : environ;
+            for (const char* const* variable = base; *variable != nullptr; ++variable) {
+                const char* separator = strchr(*variable, '=');
+                if (separator != nullptr) {
+                    environment[std::string(*variable, separator)] = separator + 1;
+                }
+            }
+            if (!arch.empty()) {
+                environment["ARCH"] = arch;
+            }
+            for (const auto& [name, value] : _environment) {
+                environment[name] = value;
+            }
+
+            _environmentStrings.clear();
+            _environmentPointers.clear();
+            for (const auto& [name, value] : environment) {
+                _environmentStrings.push_back(name + "=" + value);
+            }
+            for (const auto& variable : _environmentStrings) {
+                _environmentPointers.push_back(variable.c_str());
+            }
+            _environmentPointers.push_back(nullptr);
+            options.environment = _environmentPointers.data();
+
+            if (const char* destination = string("destination")) {
+                label = destination;
+            } else {
+                label = std::string(string("appdir")) + (arch.empty() ? "" : " (" + arch + ")");
+            }
+        }
+    };
+
+    class Batch {
+    private:
+        std::string _manifestPath;
+        std::string _manifestDirectory;
+        appimagetool_options_t _defaults;
+        const appimage_budget_t* _budget;
+
+        // paths of the command line's options are relative to the working directory, not to the manifest
+        std::map<std::string, std::string> _defaultPaths;
+
+        std::vector<std::unique_ptr<Artifact>> _artifacts;
+        unsigned int _parallel = 0;
+
+        // runtimes downloaded by the batch, by architecture, shared by all builds for it
+        std::map<std::string, int> _runtimeFds;
+
+        std::mutex _stagesMutex;
+
+        static long microsecondsSince(std::chrono::steady_clock::time_point start) {
+            return static_cast<long>(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start
+            ).count());
+        }
+
+        const char* absoluteDefault(const char* path) {
+            if (path == nullptr || path[0] == '/') {
+                return path;
+            }
+            auto& absolute = _defaultPaths[path];
+            absolute = std::filesystem::absolute(path).string();
+            return absolute.c_str();
+        }
+
+        bool readManifest() {
+            std::ifstream stream(_manifestPath);
+            if (!stream) {
+                fprintf(stderr, "Could not open batch manifest %s: %s\n", _manifestPath.c_str(), strerror(errno));
+                return false;
+            }
+
+            std::stringstream buffer;
+            buffer << stream.rdbuf();
+            const std::string text = buffer.str();
+
+            JsonValue document;
+            JsonParser parser(text);
+            if (!parser.parse(document)) {
+                fprintf(stderr, "Failed to parse batch manifest %s at offset %zu: %s\n", _manifestPath.c_str(),
+                        parser.position(), parser.error().c_str());
+                return false;
+            }
+
+            const JsonValue* artifacts = &document;
+
+            if (document.type == JsonValue::Type::Object) {
+                for (const auto& [key, value] : document.object) {
+                    if (key != "artifacts" && key != "parallel") {
+                        fprintf(stderr, "Batch manifest %s: unknown key \"%s\"\n", _manifestPath.c_str(), key.c_str());
+                        return false;
+                    }
+                }
+
+                if (const JsonValue* parallel = document.find("parallel")) {
+                    if (parallel->type != JsonValue::Type::Number || parallel->number < 1) {
+                        fprintf(stderr, "Batch manifest %s: \"parallel\" must be a positive number\n", _manifestPath.c_str());
+                        return false;
+                    }
+                    _parallel = static_cast<unsigned int>(parallel->number);
+                }
+
+                artifacts = document.find("artifacts");
+            }
+
+            if (artifacts == nullptr || artifacts->type != JsonValue::Type::Array) {
+                fprintf(stderr, "Batch manifest %s: expected a list of artifacts\n", _manifestPath.c_str());
+                return false;
+            }
+
+            if (artifacts->array.empty()) {
+                fprintf(stderr, "Batch manifest %s: no artifacts\n", _manifestPath.c_str());
+                return false;
+            }
+
+            for (const auto& entry : artifacts->array) {
+                auto artifact = std::make_unique<Artifact>();
+                artifact->index = _artifacts.size();
+                artifact->options = _defaults;
+
+                std::string error;
+                if (!artifact->parse(entry, error)) {
+                    fprintf(stderr, "Batch manifest %s, artifact %zu: %s\n", _manifestPath.c_str(), artifact->index + 1,
+                            error.c_str());
+                    return false;
+                }
+
+                _artifacts.push_back(std::move(artifact));
+            }
+
+            return true;
+        }
+
+        /* Download the runtime of every architecture named in the manifest once, concurrently */
+        void fetchRuntimes() {
+            std::vector<std::string> archs;
+            for (const auto& artifact : _artifacts) {
+                if (!artifact->arch.empty() && _defaults.runtime_file == nullptr &&
+                    std::find(archs.begin(), archs.end(), artifact->arch) == archs.end()) {
+                    archs.push_back(artifact->arch);
+                }
+            }
+
+            if (archs.empty()) {
+                return;
+            }
+
+            fetch_runtime_init();
+
+            std::vector<int> fds(archs.size(), -1);
+            std::vector<long> durations(archs.size(), -1);
+            std::vector<std::thread> threads;
+
+            for (size_t i = 0; i < archs.size(); ++i) {
+                threads.emplace_back([this, &archs, &fds, &durations, i]() {
+                    const auto start = std::chrono::steady_clock::now();
+                    std::vector<char> arch(archs[i].begin(), archs[i].end());
+                    arch.push_back('\0');
+
+                    size_t size = 0;
+                    int fd = -1;
+                    if (fetch_runtime(arch.data(), _defaults.environment, &size, &fd, _defaults.offline, _defaults.verbose)) {
+                        fds[i] = fd;
+                    }
+                    durations[i] = microsecondsSince(start);
+                });
+            }
+
+            for (auto& thread : threads) {
+                thread.join();
+            }
+
+            for (size_t i = 0; i < archs.size(); ++i) {
+                if (fds[i] < 0) {
+                    // the builds for this architecture try again themselves, and report the error
+                    fprintf(stderr, "Warning: could not fetch the runtime for %s ahead of the builds\n", archs[i].c_str());
+                    continue;
+                }
+
+                fprintf(stderr, "Runtime for %s fetched in %.1f s\n", archs[i].c_str(), durations[i] / 1e6);
+                _runtimeFds[archs[i]] = fds[i];
+            }
+
+            // the descriptors may refer to unlinked or anonymous files, which only have a path in /proc
+            for (auto& artifact : _artifacts) {
+                const auto it = _runtimeFds.find(artifact->arch);
+                if (it != _runtimeFds.end()) {
+                    artifact->runtimeFile = "/proc/self/fd/" + std::to_string(it->second);
+                }
+            }
+        }
+
+        struct StageForwarding {
+            Batch* batch;
+            Artifact* artifact;
+        };
+
+        static void forwardStage(const char* stage, long microseconds, void* userData) {
+            auto* forwarding = static_cast<StageForwarding*>(userData);
+            const auto& defaults = forwarding->batch->_defaults;
+
+            // the command line's callback is shared by all builds
+            std::lock_guard<std::mutex> lock(forwarding->batch->_stagesMutex);
+            forwarding->artifact->stages[stage] = microseconds;
+            if (defaults.stage_callback != nullptr) {
+                defaults.stage_callback(stage, microseconds, defaults.stage_callback_data);
+            }
+        }
+
+        void build(Artifact& artifact, unsigned int jobs, uint64_t memory) {
+            artifact.prepare(_defaults, _manifestDirectory);
+            artifact.options.jobs = jobs;
+            artifact.options.memory = memory;
+
+            StageForwarding forwarding{this, &artifact};
+            artifact.options.stage_callback = forwardStage;
+            artifact.options.stage_callback_data = &forwarding;
+
+            fprintf(stderr, "Building %s\n", artifact.label.c_str());
+
+            const auto start = std::chrono::steady_clock::now();
+            appimagetool_context_t* context = appimagetool_context_new();
+
+            artifact.built = appimagetool_build(context, &artifact.options);
+            artifact.microseconds = microsecondsSince(start);
+
+            if (!artifact.built) {
+                const char* error = appimagetool_context_error(context);
+                artifact.error = error != nullptr ? error : "unknown error";
+            }
+            if (const char* destination = appimagetool_context_destination(context)) {
+                artifact.label = destination;
+            }
+
+            appimagetool_context_free(context);
+
+            fprintf(stderr, "%s %s\n", artifact.built ? "Built" : "Failed to build", artifact.label.c_str());
+        }
+
+        static std::string formatDuration(long microseconds) {
+            if (microseconds < 0) {
+                return "-";
+            }
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%.1f s", microseconds / 1e6);
+            return buffer;
+        }
+
+        long stageDuration(const Artifact& artifact, std::initializer_list<const char*> names) const {
+            // validations run concurrently, the longest one is what they cost
+            long duration = -1;
+            for (const char* name : names) {
+                const auto it = artifact.stages.find(name);
+                if (it != artifact.stages.end()) {
+                    duration = std::max(duration, it->second);
+                }
+            }
+            return duration;
+        }
+
+        void printSummary(long microseconds) const {
+            size_t failed = 0;
+            size_t labelWidth = strlen("Artifact");
+            for (const auto& artifact : _artifacts) {
+                failed += artifact->built ? 0 : 1;
+                labelWidth = std::max(labelWidth, artifact->label.size());
+            }
+
+            fprintf(stderr, "\nBatch summary: %zu built, %zu failed, %s in total\n", _artifacts.size() - failed, failed,
+                    formatDuration(microseconds).c_str());
+            fprintf(stderr, "  %-*s  %-6s  %9s  %9s  %9s  %9s\n", static_cast<int>(labelWidth), "Artifact", "Result",
+                    "Total", "Validate", "Squashfs", "Finalize");
+
+            for (const auto& artifact : _artifacts) {
+                fprintf(
+                    stderr, "  %-*s  %-6s  %9s  %9s  %9s  %9s\n", static_cast<int>(labelWidth), artifact->label.c_str(),
+                    artifact->built ? "ok" : "failed", formatDuration(artifact->microseconds).c_str(),
+                    formatDuration(stageDuration(*artifact, {"desktop-file-validate", "appstreamcli", "appstream-util"})).c_str(),
+                    formatDuration(stageDuration(*artifact, {"mksquashfs"})).c_str(),
+                    formatDuration(stageDuration(*artifact, {"finalize"})).c_str()
+                );
+                if (!artifact->built) {
+                    fprintf(stderr, "  %-*s  %s\n", static_cast<int>(labelWidth), "", artifact->error.c_str());
+                }
+            }
+        }
+
+    public:
+        Batch(const char* manifestPath, const appimagetool_options_t* defaults, const appimage_budget_t* budget)
+            : _manifestPath(manifestPath), _defaults(*defaults), _budget(budget) {
+            _manifestDirectory = std::filesystem::absolute(_manifestPath).parent_path().string();
+
+            // only the manifest says where an artifact comes from and goes to
+            _defaults.source = nullptr;
+            _defaults.destination = nullptr;
+            _defaults.exclude_file = absoluteDefault(_defaults.exclude_file);
+            _defaults.runtime_file = absoluteDefault(_defaults.runtime_file);
+            _defaults.cache_directory = absoluteDefault(_defaults.cache_directory);
+        }
+
+        ~Batch() {
+            for (const auto& [arch, fd] : _runtimeFds) {
+                close(fd);
+            }
+        }
+
+        int run() {
+            if (!readManifest()) {
+                return 1;
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+
+            // by default, every build gets two CPUs, one for mksquashfs and one for the stages alongside it
+            const auto artifactCount = static_cast<unsigned int>(_artifacts.size());
+            unsigned int parallel = _parallel != 0 ? _parallel : std::max(1u, _budget->jobs / 2);
+            parallel = std::min(parallel, artifactCount);
+
+            const unsigned int jobs = std::max(1u, _budget->jobs / parallel);
+            const uint64_t memory = _budget->memory / parallel;
+
+            fprintf(stderr, "Building %u artifacts, %u at a time, with %u CPUs each\n", artifactCount, parallel, jobs);
+
+            fetchRuntimes();
+
+            std::atomic<size_t> next{0};
+            std::vector<std::thread> workers;
+
+            for (unsigned int i = 0; i < parallel; ++i) {
+                workers.emplace_back([this, &next, jobs, memory]() {
+                    for (size_t index = next++; index < _artifacts.size(); index = next++) {
+                        build(*_artifacts[index], jobs, memory);
+                    }
+                });
+            }
+
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            printSummary(microsecondsSince(start));
+
+            const bool success = std::all_of(_artifacts.begin(), _artifacts.end(), [](const auto& artifact) {
+                return artifact->built;
+            });
+            return success ? 0 : 1;
+        }
+    };
+}
+
+int appimage_batch_run(const char* manifest_path, const appimagetool_options_t* defaults, const appimage_budget_t* budget) {
+    Batch batch(manifest_path, defaults, budget);
+    return batch.run();
+}
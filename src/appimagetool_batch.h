@@ -0,0 +1,40 @@
+#pragma once
+
+#include "appimagetool.h"
+#include "appimagetool_resources.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Build several AppImages, e.g., the same application for several architectures, as described by a JSON manifest:
+ *
+ *     {
+ *         "parallel": 2,
+ *         "artifacts": [
+ *             {"appdir": "MyApp.AppDir", "arch": "x86_64", "destination": "out/MyApp-x86_64.AppImage"},
+ *             {"appdir": "MyApp.AppDir", "arch": "aarch64", "sign": true, "env": {"VERSION": "1.2.3"}}
+ *         ]
+ *     }
+ *
+ * The manifest may also be just the list of artifacts. Only "appdir" is required. The other keys of an artifact are
+ * named like the long options of appimagetool (updateinformation, guess, comp, mksquashfs-opt, exclude-file,
+ * runtime-file, offline, sign, sign-key, file-url, no-appstream, checksums, zsync-friendly, squashfs-backend, verbose),
+ * plus "arch", which sets $ARCH, and "env", which sets further environment variables. Relative paths are resolved
+ * against the manifest's directory.
+ *
+ * The builds share one CPU and memory budget: "parallel" of them (by default, one per two CPUs) run at the same time,
+ * each with an equal share of the budget. The runtime is downloaded once per architecture before the builds start,
+ * and signing talks to gpg-agent one build at a time, so the passphrase is asked for once. A summary of the results and
+ * stage timings of every artifact is printed at the end.
+ *
+ * @param defaults options from the command line, which apply to all artifacts unless the manifest overrides them
+ * @param budget CPUs and memory shared by all builds
+ * @return exit code: 0 if all artifacts have been built, 1 otherwise
+ */
+int appimage_batch_run(const char* manifest_path, const appimagetool_options_t* defaults, const appimage_budget_t* budget);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,573 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <gcrypt.h>
+
+#include "appimagetool_block_cache.h"
+
+extern "C" {
+#include "appimagetool_sign.h"
+}
+
+namespace {
+    constexpr size_t sha256Size = 32;
+    using Digest = std::array<uint8_t, sha256Size>;
+
+    // bumped whenever the meaning of keys or entries changes, so that old entries are not used anymore
+    constexpr char cacheFormat[] = "appimagetool-block-cache-2";
+
+    // every entry starts with this, the size of the compressed block and a checksum of the key and the block
+    constexpr char entryMagic[8] = {'A', 'I', 'B', 'L', 'O', 'C', 'K', '2'};
+    constexpr size_t entryHeaderSize = sizeof(entryMagic) + 8 + sha256Size;
+
+    constexpr char temporaryPrefix[] = ".tmp-";
+
+    // temporary files of builds which have crashed are removed after this time
+    constexpr time_t staleTemporaryAge = 24 * 60 * 60;
+
+    // hits refresh the access time of an entry at most this often, rather than writing to the store for every block
+    constexpr time_t accessTimeGranularity = 60 * 60;
+
+    // size of the block compressed to tell versions of the compression libraries apart
+    constexpr size_t probeSize = 64 * 1024;
+
+    // hex digits of the configuration hash naming the subdirectory the entries of a configuration are kept in
+    constexpr size_t partitionNameLength = 16;
+
+    std::string toHex(const uint8_t* data, size_t size) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(size * 2);
+        for (size_t i = 0; i < size; ++i) {
+            hex += digits[data[i] >> 4];
+            hex += digits[data[i] & 0xf];
+        }
+        return hex;
+    }
+
+    int64_t toNs(const struct timespec& time) {
+        return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+    }
+
+    void encodeNumber(uint64_t value, uint8_t* bytes) {
+        for (int i = 0; i < 8; ++i) {
+            bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+    }
+
+    uint64_t decodeNumber(const uint8_t* bytes) {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; ++i) {
+            value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+        }
+        return value;
+    }
+
+    /**
+     * Incremental SHA-256 of length prefixed fields, so that concatenated fields cannot be confused.
+     */
+    class Hasher {
+    private:
+        gcry_md_hd_t _handle = nullptr;
+
+    public:
+        Hasher() {
+            gcry_md_open(&_handle, GCRY_MD_SHA256, 0);
+        }
+
+        ~Hasher() {
+            gcry_md_close(_handle);
+        }
+
+        Hasher(const Hasher&) = delete;
+        Hasher& operator=(const Hasher&) = delete;
+
+        void writeNumber(uint64_t value) {
+            uint8_t bytes[8];
+            encodeNumber(value, bytes);
+            gcry_md_write(_handle, bytes, sizeof(bytes));
+        }
+
+        void writeField(const void* data, size_t size) {
+            writeNumber(size);
+            gcry_md_write(_handle, data, size);
+        }
+
+        Digest finish() {
+            Digest digest;
+            memcpy(digest.data(), gcry_md_read(_handle, GCRY_MD_SHA256), sha256Size);
+            return digest;
+        }
+    };
+
+    bool readAll(int fd, void* buffer, size_t size, off_t offset) {
+        auto* position = static_cast<char*>(buffer);
+
+        while (size > 0) {
+            const ssize_t result = pread(fd, position, size, offset);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                return false;
+            }
+            position += result;
+            offset += result;
+            size -= static_cast<size_t>(result);
+        }
+
+        return true;
+    }
+
+    bool writeAll(int fd, const void* buffer, size_t size) {
+        const auto* position = static_cast<const char*>(buffer);
+
+        while (size > 0) {
+            const ssize_t result = write(fd, position, size);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result < 0) {
+                return false;
+            }
+            position += result;
+            size -= static_cast<size_t>(result);
+        }
+
+        return true;
+    }
+
+    /**
+     * The key covers the uncompressed block, so this detects both damaged entries and ones stored under the wrong name
+     */
+    Digest entryChecksum(const Digest& key, const sqfs_u8* data, size_t size) {
+        Hasher hasher;
+        hasher.writeField(key.data(), key.size());
+        hasher.writeField(data, size);
+        return hasher.finish();
+    }
+
+    /**
+     * Compressible, deterministic data resembling text, to probe the compressor's output with.
+     */
+    std::vector<uint8_t> probeData(size_t size) {
+        static const char* const words[] = {
+            "squashfs ", "AppImage ", "runtime ", "block ", "the ", "of ", "lib", ".so.", "/usr/", "\n", "0x", "ELF ",
+            "compress ", "data ", "{", "}", "\t", "= ", "and ", "desktop ",
+        };
+        constexpr size_t wordsCount = sizeof(words) / sizeof(words[0]);
+
+        std::vector<uint8_t> data;
+        data.reserve(size + 16);
+
+        uint32_t state = 0x2545f491;
+        while (data.size() < size) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            const char* word = words[state % wordsCount];
+            data.insert(data.end(), word, word + strlen(word));
+            // some noise, so that the probe does not compress to almost nothing
+            data.push_back(static_cast<uint8_t>(state >> 24));
+        }
+
+        data.resize(size);
+        return data;
+    }
+}
+
+/*
+ * Entries of one compressor configuration: <store>/<configuration hash>/<first two hex digits>/<remaining hex digits>
+ * An entry holds a header and the compressed block, or no block if the compressor has left the block uncompressed.
+ */
+struct BlockCachePartition {
+    appimage_block_cache* cache;
+    std::string directory;
+    Digest configuration;
+
+    Digest entryKey(const sqfs_u8* data, sqfs_u32 size, sqfs_u32 outputSize) const {
+        Hasher hasher;
+        hasher.writeField(configuration.data(), configuration.size());
+        // whether a block is left uncompressed depends on the space available for the compressed one
+        hasher.writeNumber(outputSize);
+        hasher.writeField(data, size);
+        return hasher.finish();
+    }
+
+    std::string entryPath(const Digest& key) const {
+        const std::string hex = toHex(key.data(), key.size());
+        return directory + "/" + hex.substr(0, 2) + "/" + hex.substr(2);
+    }
+};
+
+struct appimage_block_cache {
+    std::string directory;
+    uint64_t maxSize;
+    bool verbose;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<BlockCachePartition>> partitions;
+
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> storedBlocks{0};
+    std::atomic<uint64_t> storedBytes{0};
+    std::atomic<bool> warnedAboutStoring{false};
+
+    appimage_block_cache(std::string directory, uint64_t maxSize, bool verbose)
+        : directory(std::move(directory)), maxSize(maxSize), verbose(verbose) {}
+
+    /*
+     * Read the entry into the output buffer, result receives what the compressor would have returned.
+     * Entries which fail the checks (e.g., after a crash or a full disk) are removed and count as misses.
+     */
+    bool load(const Digest& key, const std::string& path, sqfs_u8* output, sqfs_u32 outputSize, sqfs_s32& result) {
+        ++lookups;
+
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+
+        uint8_t header[entryHeaderSize];
+        struct stat entryStat{};
+        bool success = fstat(fd, &entryStat) == 0 && readAll(fd, header, sizeof(header), 0);
+
+        const uint64_t payloadSize = success ? decodeNumber(header + sizeof(entryMagic)) : 0;
+        success = success && memcmp(header, entryMagic, sizeof(entryMagic)) == 0 &&
+            static_cast<uint64_t>(entryStat.st_size) == entryHeaderSize + payloadSize && payloadSize <= outputSize &&
+            readAll(fd, output, static_cast<size_t>(payloadSize), entryHeaderSize);
+
+        if (success) {
+            const Digest checksum = entryChecksum(key, output, static_cast<size_t>(payloadSize));
+            success = memcmp(header + sizeof(entryMagic) + 8, checksum.data(), checksum.size()) == 0;
+        }
+
+        if (success && time(nullptr) - entryStat.st_atime > accessTimeGranularity) {
+            const struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+            futimens(fd, times);
+        }
+        close(fd);
+
+        if (!success) {
+            unlink(path.c_str());
+            if (verbose) {
+                fprintf(stderr, "Removed damaged entry %s from the block cache\n", path.c_str());
+            }
+            return false;
+        }
+
+        ++hits;
+        result = static_cast<sqfs_s32>(payloadSize);
+        return true;
+    }
+
+    /* Add an entry, failures only cost the time to compress the block again next time */
+    void store(const Digest& key, const std::string& path, const sqfs_u8* data, sqfs_s32 size) {
+        const std::string shard = path.substr(0, path.rfind('/'));
+        std::string temporaryPath = shard + "/" + temporaryPrefix + "XXXXXX";
+
+        int fd = mkstemp(&temporaryPath[0]);
+        if (fd < 0 && errno == ENOENT) {
+            mkdir(shard.substr(0, shard.rfind('/')).c_str(), 0755);
+            mkdir(shard.c_str(), 0755);
+            temporaryPath = shard + "/" + temporaryPrefix + "XXXXXX";
+            fd = mkstemp(&temporaryPath[0]);
+        }
+
+        uint8_t header[entryHeaderSize];
+        memcpy(header, entryMagic, sizeof(entryMagic));
+        encodeNumber(static_cast<uint64_t>(size), header + sizeof(entryMagic));
+        const Digest checksum = entryChecksum(key, data, static_cast<size_t>(size));
+        memcpy(header + sizeof(entryMagic) + 8, checksum.data(), checksum.size());
+
+        // the data must be on disk before the name is, or a crash can leave an entry with the wrong contents
+        bool success = fd >= 0 && fchmod(fd, 0644) == 0 && writeAll(fd, header, sizeof(header)) &&
+            writeAll(fd, data, static_cast<size_t>(size)) && fsync(fd) == 0;
+        if (fd >= 0 && close(fd) != 0) {
+            success = false;
+        }
+
+        // concurrent builds storing the same block store the same data
+        if (success && rename(temporaryPath.c_str(), path.c_str()) != 0) {
+            success = false;
+        }
+
+        if (!success) {
+            const int error = errno;
+            if (fd >= 0) {
+                unlink(temporaryPath.c_str());
+            }
+            if (!warnedAboutStoring.exchange(true)) {
+                fprintf(stderr, "Warning: failed to add blocks to the block cache in %s: %s\n", directory.c_str(), strerror(error));
+            }
+            return;
+        }
+
+        ++storedBlocks;
+        storedBytes += static_cast<uint64_t>(size);
+    }
+
+    /* Remove the least recently used entries of all configurations until the store fits into its size */
+    void evict() const {
+        struct Entry {
+            std::string path;
+            uint64_t size;
+            int64_t lastUsedNs;
+        };
+
+        std::vector<Entry> entries;
+        uint64_t totalSize = 0;
+        const time_t now = time(nullptr);
+
+        const auto list = [](const std::string& path) {
+            std::vector<std::string> names;
+            if (DIR* dir = opendir(path.c_str())) {
+                while (const struct dirent* dirent = readdir(dir)) {
+                    if (strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0) {
+                        names.emplace_back(dirent->d_name);
+                    }
+                }
+                closedir(dir);
+            }
+            return names;
+        };
+
+        for (const auto& partition : list(directory)) {
+            for (const auto& shard : list(directory + "/" + partition)) {
+                const std::string shardPath = directory + "/" + partition + "/" + shard;
+
+                for (const auto& name : list(shardPath)) {
+                    const std::string path = shardPath + "/" + name;
+                    struct stat entryStat{};
+
+                    if (lstat(path.c_str(), &entryStat) != 0 || !S_ISREG(entryStat.st_mode)) {
+                        continue;
+                    }
+
+                    if (name.rfind(temporaryPrefix, 0) == 0) {
+                        if (now - entryStat.st_mtime > staleTemporaryAge) {
+                            unlink(path.c_str());
+                        }
+                        continue;
+                    }
+
+                    entries.push_back({path, static_cast<uint64_t>(entryStat.st_size), toNs(entryStat.st_atim)});
+                    totalSize += static_cast<uint64_t>(entryStat.st_size);
+                }
+            }
+        }
+
+        if (maxSize == 0 || totalSize <= maxSize) {
+            return;
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.lastUsedNs < b.lastUsedNs;
+        });
+
+        uint64_t evicted = 0;
+        for (const auto& entry : entries) {
+            if (totalSize <= maxSize) {
+                break;
+            }
+
+            // another process may have evicted it already
+            if (unlink(entry.path.c_str()) == 0 || errno == ENOENT) {
+                totalSize -= entry.size;
+                ++evicted;
+            }
+        }
+
+        if (verbose) {
+            fprintf(stderr, "Evicted %lu blocks from the block cache\n", static_cast<unsigned long>(evicted));
+        }
+    }
+};
+
+namespace {
+    /**
+     * sqfs_compressor_t which consults the store before passing blocks on to the compressor it wraps.
+     * The object header (including the reference count of newer libsquashfs versions) is copied from the wrapped
+     * compressor, so that the wrapper works with every version of the library's object model.
+     */
+    struct CachingCompressor {
+        sqfs_compressor_t base;
+        sqfs_compressor_t* compressor;
+        BlockCachePartition* partition;
+    };
+
+    CachingCompressor* self(sqfs_compressor_t* base) {
+        return reinterpret_cast<CachingCompressor*>(base);
+    }
+
+    const CachingCompressor* self(const sqfs_compressor_t* base) {
+        return reinterpret_cast<const CachingCompressor*>(base);
+    }
+
+    sqfs_compressor_t* newCachingCompressor(sqfs_compressor_t* compressor, BlockCachePartition* partition);
+
+    void destroyCachingCompressor(sqfs_object_t* object) {
+        auto* wrapper = self(reinterpret_cast<sqfs_compressor_t*>(object));
+        sqfs_destroy(wrapper->compressor);
+        delete wrapper;
+    }
+
+    sqfs_object_t* copyCachingCompressor(const sqfs_object_t* object) {
+        const auto* wrapper = self(reinterpret_cast<const sqfs_compressor_t*>(object));
+
+        auto* copy = static_cast<sqfs_compressor_t*>(sqfs_copy(wrapper->compressor));
+        if (copy == nullptr) {
+            return nullptr;
+        }
+
+        return reinterpret_cast<sqfs_object_t*>(newCachingCompressor(copy, wrapper->partition));
+    }
+
+    void getConfiguration(const sqfs_compressor_t* base, sqfs_compressor_config_t* configuration) {
+        const auto* compressor = self(base)->compressor;
+        compressor->get_configuration(compressor, configuration);
+    }
+
+    int writeOptions(sqfs_compressor_t* base, sqfs_file_t* file) {
+        auto* compressor = self(base)->compressor;
+        return compressor->write_options(compressor, file);
+    }
+
+    int readOptions(sqfs_compressor_t* base, sqfs_file_t* file) {
+        auto* compressor = self(base)->compressor;
+        return compressor->read_options(compressor, file);
+    }
+
+    sqfs_s32 doBlock(sqfs_compressor_t* base, const sqfs_u8* input, sqfs_u32 size, sqfs_u8* output, sqfs_u32 outputSize) {
+        auto* compressor = self(base)->compressor;
+        const BlockCachePartition& partition = *self(base)->partition;
+
+        const Digest key = partition.entryKey(input, size, outputSize);
+        const std::string path = partition.entryPath(key);
+
+        sqfs_s32 result;
+        if (partition.cache->load(key, path, output, outputSize, result)) {
+            return result;
+        }
+
+        result = compressor->do_block(compressor, input, size, output, outputSize);
+        if (result >= 0) {
+            partition.cache->store(key, path, output, result);
+        }
+        return result;
+    }
+
+    sqfs_compressor_t* newCachingCompressor(sqfs_compressor_t* compressor, BlockCachePartition* partition) {
+        auto* wrapper = new CachingCompressor;
+        wrapper->base = *compressor;
+        wrapper->base.base.destroy = destroyCachingCompressor;
+        wrapper->base.base.copy = copyCachingCompressor;
+        wrapper->base.get_configuration = getConfiguration;
+        wrapper->base.write_options = writeOptions;
+        wrapper->base.read_options = readOptions;
+        wrapper->base.do_block = doBlock;
+        wrapper->compressor = compressor;
+        wrapper->partition = partition;
+        return &wrapper->base;
+    }
+}
+
+appimage_block_cache_t* appimage_block_cache_open(const char* directory, uint64_t max_size, bool verbose) {
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create block cache %s: %s\n", directory, strerror(errno));
+        return nullptr;
+    }
+
+    struct stat directoryStat{};
+    if (stat(directory, &directoryStat) != 0 || !S_ISDIR(directoryStat.st_mode)) {
+        fprintf(stderr, "Block cache %s is not a directory\n", directory);
+        return nullptr;
+    }
+
+    init_gcrypt();
+    return new appimage_block_cache(directory, max_size, verbose);
+}
+
+void appimage_block_cache_free(appimage_block_cache_t* cache) {
+    if (cache == nullptr) {
+        return;
+    }
+
+    const uint64_t lookups = cache->lookups;
+    if (lookups > 0) {
+        fprintf(
+            stderr, "Reused %lu of %lu compressed blocks from the block cache, added %lu blocks (%lu bytes)\n",
+            static_cast<unsigned long>(cache->hits.load()), static_cast<unsigned long>(lookups),
+            static_cast<unsigned long>(cache->storedBlocks.load()), static_cast<unsigned long>(cache->storedBytes.load())
+        );
+    }
+
+    // the store can only have outgrown its size if something has been added
+    if (cache->storedBlocks > 0) {
+        cache->evict();
+    }
+
+    delete cache;
+}
+
+sqfs_compressor_t* appimage_block_cache_wrap(appimage_block_cache_t* cache, const sqfs_compressor_t* compressor) {
+    auto* copy = static_cast<sqfs_compressor_t*>(sqfs_copy(compressor));
+    if (copy == nullptr) {
+        fprintf(stderr, "Failed to copy the squashfs compressor\n");
+        return nullptr;
+    }
+
+    sqfs_compressor_config_t configuration;
+    memset(&configuration, 0, sizeof(configuration));
+    copy->get_configuration(copy, &configuration);
+
+    Hasher hasher;
+    hasher.writeField(cacheFormat, strlen(cacheFormat));
+    hasher.writeNumber(configuration.id);
+    hasher.writeNumber(configuration.flags);
+    hasher.writeNumber(configuration.block_size);
+    hasher.writeNumber(configuration.level);
+    hasher.writeField(&configuration.opt, sizeof(configuration.opt));
+
+    // the compression libraries do not promise stable output across versions, so their output is part of the key
+    const std::vector<uint8_t> probe = probeData(std::min<size_t>(probeSize, configuration.block_size));
+    std::vector<uint8_t> compressedProbe(probe.size());
+    const sqfs_s32 probeResult = copy->do_block(
+        copy, probe.data(), static_cast<sqfs_u32>(probe.size()), compressedProbe.data(), static_cast<sqfs_u32>(compressedProbe.size())
+    );
+    if (probeResult < 0) {
+        fprintf(stderr, "Failed to compress the block cache probe: error %d\n", static_cast<int>(probeResult));
+        sqfs_destroy(copy);
+        return nullptr;
+    }
+    hasher.writeField(compressedProbe.data(), static_cast<size_t>(probeResult));
+
+    auto partition = std::make_unique<BlockCachePartition>();
+    partition->cache = cache;
+    partition->configuration = hasher.finish();
+    partition->directory = cache->directory + "/" + toHex(partition->configuration.data(), sha256Size).substr(0, partitionNameLength);
+
+    if (cache->verbose) {
+        fprintf(stderr, "Using block cache %s\n", partition->directory.c_str());
+    }
+
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->partitions.push_back(std::move(partition));
+    return newCachingCompressor(copy, cache->partitions.back().get());
+}
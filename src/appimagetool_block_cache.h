@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sqfs/compressor.h>
+
+/**
+ * Store of compressed squashfs data blocks, so that rebuilding an AppDir in which only a few files have changed only
+ * compresses the data of those files.
+ *
+ * Blocks are keyed by a hash of their uncompressed contents and the compressor's configuration. Compressors are
+ * deterministic, so a block taken from the store is the same as the one the compressor would produce, and the image
+ * stays bit-identical to one built without the store. A probe block compressed when the store is opened is part of
+ * the configuration, so that entries are not reused once an update of the compression library changes its output.
+ *
+ * Like the cache of finished AppImages, the store is a plain directory which may be shared by several processes, with
+ * entries added by renaming complete, synced files into place and evicted by least recent use. Every entry carries a
+ * checksum which is verified when it is used, damaged entries are removed and the block is compressed again.
+ */
+
+typedef struct appimage_block_cache appimage_block_cache_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Open the store in the given directory, which is created if necessary.
+ * @param max_size size in bytes the entries may take up, 0 for no limit
+ * @return store, or NULL on errors
+ */
+appimage_block_cache_t* appimage_block_cache_open(const char* directory, uint64_t max_size, bool verbose);
+
+/**
+ * Evict the least recently used entries which exceed the store's size if any have been added, and free the store.
+ * All compressors wrapped with it must have been destroyed before.
+ */
+void appimage_block_cache_free(appimage_block_cache_t* cache);
+
+/**
+ * Create a compressor which looks up every block in the store before compressing it with (a copy of) the given
+ * compressor, and adds the blocks it compresses to the store. Copies of it, e.g., the block processor's per-thread
+ * ones, share the store.
+ * @return compressor, to be destroyed with sqfs_destroy; NULL on errors
+ */
+sqfs_compressor_t* appimage_block_cache_wrap(appimage_block_cache_t* cache, const sqfs_compressor_t* compressor);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,2380 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2004-24 Simon Peter
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#include <stdlib.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <errno.h>
+#include <libgen.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#include "appimagetool.h"
+
+#include "appimagetool_arch.h"
+#include "appimagetool_build.h"
+#include "appimagetool_cache.h"
+#include "appimagetool_elf.h"
+#include "appimagetool_fetch_runtime.h"
+#include "appimagetool_hash.h"
+#include "appimagetool_journal.h"
+#include "appimagetool_output.h"
+#include "appimagetool_process.h"
+#include "appimagetool_resources.h"
+#include "appimagetool_runtime.h"
+#include "appimagetool_scan.h"
+#include "appimagetool_sign.h"
+#include "appimagetool_stages.h"
+#include "appimagetool_zsync.h"
+#ifdef HAVE_LIBSQUASHFS
+#include "appimagetool_squashfs.h"
+#endif
+
+typedef enum {
+    fARCH_i686,
+    fARCH_x86_64,
+    fARCH_armhf,
+    fARCH_aarch64
+} fARCH;
+
+static gchar const APPIMAGEIGNORE[] = ".appimageignore";
+
+/* Everything a build needs to know, set up by appimagetool_build from the options and released when it returns */
+struct appimagetool_context {
+    const appimagetool_options_t* options;
+    gchar* working_directory;
+    gchar** environment;
+    // CPUs and memory the build may use, split between the squashfs stage and the stages running alongside
+    appimage_budget_t budget;
+    bool use_libsquashfs;
+    // version of mksquashfs as major * 100 + minor, determined by the preflight stage
+    int mksquashfs_version;
+    // the children run by this build, terminated when its pipeline is cancelled
+    appimage_process_group_t* processes;
+    // paths from the options, resolved against the working directory
+    gchar* exclude_file;
+    gchar* runtime_file;
+    // .appimageignore in the working directory, NULL if there is none
+    gchar* appimageignore;
+    // cache of finished AppImages, NULL if disabled
+    appimage_build_cache_t* cache;
+    // compressed squashfs blocks reused across builds, kept next to the cached AppImages, NULL if disabled
+    gchar* block_cache_directory;
+    // content hashes of the AppDir's files, kept next to the cached AppImages, NULL if disabled
+    gchar* file_hash_directory;
+    // keys of the validations which have passed in builds with this context, see validation_key
+    GHashTable* passed_validations;
+    // scan and hashes of the AppDir for the next build, see appimagetool_context_use_scan
+    appdir_scan_t* next_scan;
+    appimage_tree_hashes_t next_hashes;
+    // results of the last build
+    gchar* error;
+    gchar* destination;
+};
+
+#ifdef AUXILIARY_FILES_DESTINATION
+// mksquashfs bundled with appimagetool, set up once
+static gchar* bundled_mksquashfs = NULL;
+
+/* Find mksquashfs relative to the appimagetool binary */
+static void register_bundled_mksquashfs(void) {
+    char* executable = realpath("/proc/self/exe", NULL);
+    if (executable == NULL) {
+        g_print("Could not access /proc/self/exe\n");
+        return;
+    }
+
+    bundled_mksquashfs = g_build_filename(dirname(executable), "..", AUXILIARY_FILES_DESTINATION, "mksquashfs", NULL);
+    free(executable);
+
+    if (g_file_test(bundled_mksquashfs, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_EXECUTABLE)) {
+        appimage_register_tool("mksquashfs", bundled_mksquashfs);
+    }
+}
+#endif
+
+/* Set up what is shared by all builds in the process, before the first build starts its threads */
+static void init_library(void) {
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        fetch_runtime_init();
+#ifdef AUXILIARY_FILES_DESTINATION
+        register_bundled_mksquashfs();
+#endif
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+/* Record why the build failed, the first error is kept since the later ones are usually caused by it */
+static bool fail(appimagetool_context_t* context, const char* format, ...) {
+    if (context->error == NULL) {
+        va_list args;
+        va_start(args, format);
+        context->error = g_strdup_vprintf(format, args);
+        va_end(args);
+    }
+
+    return false;
+}
+
+static const char* context_getenv(const appimagetool_context_t* context, const char* name) {
+    return g_environ_getenv(context->environment, name);
+}
+
+/* Look up a tool in the build's PATH, which is where the children of the build look them up, too */
+static const char* context_find_tool(const appimagetool_context_t* context, const char* name) {
+    return appimage_find_tool(name, appimage_environment_search_path(context->environment));
+}
+
+/* Resolve a path from the options against the build's working directory, returns NULL for NULL */
+static gchar* resolve_path(const appimagetool_context_t* context, const char* path) {
+    if (path == NULL) {
+        return NULL;
+    }
+
+    if (g_path_is_absolute(path)) {
+        return g_strdup(path);
+    }
+
+    return g_build_filename(context->working_directory, path, NULL);
+}
+
+/* Cancel handler of the pipeline, terminates the children started by the other stages of the same build */
+static void terminate_children(void* user_data) {
+    appimage_process_group_terminate(user_data);
+}
+
+/* Run a tool whose output is captured and printed in one piece when it has finished, so that the output of tools
+ * running concurrently does not interleave */
+static int run_tool(const appimagetool_context_t* context, char* const argv[], char* const envp[]) {
+    static GMutex output_mutex;
+
+    const appimage_process_options_t options = {
+        .envp = envp != NULL ? envp : context->environment,
+        .stdout_mode = APPIMAGE_PROCESS_CAPTURE,
+        .stderr_mode = APPIMAGE_PROCESS_CAPTURE,
+        .capture_limit = 0,
+        .group = context->processes,
+    };
+
+    appimage_process_result_t result;
+    const int exit_code = appimage_process_run(NULL, argv, &options, &result);
+
+    g_mutex_lock(&output_mutex);
+    if (result.stdout_data != NULL) {
+        fwrite(result.stdout_data, 1, result.stdout_length, stdout);
+        if (result.stdout_truncated)
+            printf("[output of %s truncated]\n", argv[0]);
+        fflush(stdout);
+    }
+    if (result.stderr_data != NULL) {
+        fwrite(result.stderr_data, 1, result.stderr_length, stderr);
+        if (result.stderr_truncated)
+            fprintf(stderr, "[output of %s truncated]\n", argv[0]);
+    }
+    if (context->options->verbose)
+        appimage_process_print_usage(argv[0], &result);
+    g_mutex_unlock(&output_mutex);
+
+    appimage_process_result_clear(&result);
+    return exit_code;
+}
+
+// mksquashfs 4.6 has added the extended pseudo file definitions (with times) the overlay uses
+static const int mksquashfs_pseudo_files_version = 406;
+
+/* Generate a squashfs filesystem using mksquashfs on the $PATH, or the one bundled with appimagetool
+ * The overlay files are given as pseudo file definitions, along with an exclude file for the AppDir's files they
+ * replace, both may be NULL */
+static int sfs_mksquashfs(const appimagetool_context_t* context, char *source, char *destination, int offset, char* pseudo_file, char* overlay_exclude_file) {
+    const appimagetool_options_t* build_options = context->options;
+    const appimage_budget_t* budget = &context->budget;
+
+    gchar* offset_string;
+    offset_string = g_strdup_printf("%i", offset);
+
+    char* const* sqfs_opts = (char* const*) build_options->mksquashfs_options;
+    guint sqfs_opts_len = sqfs_opts ? g_strv_length((gchar**) sqfs_opts) : 0;
+
+    int max_num_args = sqfs_opts_len + 34;
+    char* args[max_num_args];
+
+    int i = 0;
+    args[i++] = "mksquashfs";
+    args[i++] = source;
+    args[i++] = destination;
+    args[i++] = "-offset";
+    args[i++] = offset_string;
+
+    const char* sqfs_comp = build_options->compression != NULL ? build_options->compression : "zstd";
+
+    args[i++] = "-comp";
+    args[i++] = (char*) sqfs_comp;
+
+    args[i++] = "-root-owned";
+    args[i++] = "-noappend";
+
+    // compression-specific optimization
+    if (strcmp(sqfs_comp, "xz") == 0) {
+        // https://jonathancarter.org/2015/04/06/squashfs-performance-testing/ says:
+        // improved performance by using a 16384 block size with a sacrifice of around 3% more squashfs image space
+        args[i++] = "-Xdict-size";
+        args[i++] = "100%";
+        args[i++] = "-b";
+        args[i++] = "16384";
+    } else if (strcmp(sqfs_comp, "zstd") == 0) {
+        /*
+         * > Build with default 128K block size
+         * > It used to be 1M but that actually causes much higher startup times.
+         * > Some testing might be needed to see if there is some other value that actually improves performance.
+         * -- https://github.com/AppImage/appimagetool/issues/64
+         */
+        args[i++] = "-b";
+        args[i++] = "128K";
+    }
+
+    // use the ignore file if it exists
+    if (context->appimageignore != NULL) {
+        printf("Including %s", APPIMAGEIGNORE);
+        args[i++] = "-wildcards";
+        args[i++] = "-ef";
+        args[i++] = context->appimageignore;
+    }
+
+    // if an exclude file has been passed on the command line, should be used, too (its existence has been checked by
+    // the preflight stage)
+    if (context->exclude_file != NULL) {
+        args[i++] = "-wildcards";
+        args[i++] = "-ef";
+        args[i++] = context->exclude_file;
+    }
+
+    // the files the build generates replace the AppDir's ones, mksquashfs only adds pseudo files which do not exist yet
+    if (pseudo_file != NULL) {
+        args[i++] = "-wildcards";
+        args[i++] = "-ef";
+        args[i++] = overlay_exclude_file;
+        args[i++] = "-pf";
+        args[i++] = pseudo_file;
+    }
+
+    // don't override time if user sets it
+    if (!context_getenv(context, "SOURCE_DATE_EPOCH")) {
+        args[i++] = "-mkfs-time";
+        args[i++] = "0";
+
+        // unchanged files keep their inodes, and hence the metadata blocks stay the same between builds
+        if (build_options->zsync_friendly) {
+            args[i++] = "-all-time";
+            args[i++] = "0";
+        }
+    }
+
+    // a change to a single file must not affect the fragment blocks shared with other files
+    // mksquashfs cannot align files, that is only done by the libsquashfs backend
+    if (build_options->zsync_friendly) {
+        args[i++] = "-no-fragments";
+    }
+
+    // otherwise, mksquashfs uses all of the host's CPUs and a quarter of its memory, regardless of cgroup limits
+    gchar* processors_string = g_strdup_printf("%u", budget->squashfs_jobs);
+    args[i++] = "-processors";
+    args[i++] = processors_string;
+
+    gchar* mem_string = NULL;
+    if (budget->memory_limited) {
+        mem_string = g_strdup_printf("%lluM", (unsigned long long) (budget->squashfs_memory / (1024 * 1024)));
+        args[i++] = "-mem";
+        args[i++] = mem_string;
+    }
+
+    for (guint sqfs_opts_idx = 0; sqfs_opts_idx < sqfs_opts_len; ++sqfs_opts_idx) {
+        args[i++] = sqfs_opts[sqfs_opts_idx];
+    }
+
+    args[i++] = 0;
+
+    if (build_options->verbose) {
+        printf("mksquashfs commandline: ");
+        for (char** t = args; *t != 0; t++) {
+            printf("%s ", *t);
+        }
+        printf("\n");
+    }
+
+    const appimage_process_options_t process_options = {
+        .envp = context->environment,
+        .stdout_mode = APPIMAGE_PROCESS_INHERIT,
+        .stderr_mode = APPIMAGE_PROCESS_INHERIT,
+        .capture_limit = 0,
+        .group = context->processes,
+    };
+
+    appimage_process_result_t result;
+    const int retcode = appimage_process_run(NULL, args, &process_options, &result);
+    g_free(offset_string);
+    g_free(processors_string);
+    g_free(mem_string);
+
+    if (build_options->verbose)
+        appimage_process_print_usage("mksquashfs", &result);
+    appimage_process_result_clear(&result);
+
+    if (retcode) {
+        fprintf(stderr, "mksquashfs exited with code %d\n", retcode);
+        return(-1);
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_LIBSQUASHFS
+/* Squashfs block size used for the given compressor, matches what sfs_mksquashfs passes to mksquashfs */
+static size_t squashfs_block_size(const char* compressor) {
+    if (strcmp(compressor, "xz") == 0) {
+        return 16384;
+    }
+    return 128 * 1024;
+}
+#endif
+
+/*
+ * Decide whether the squashfs image is built in-process with libsquashfs or by running mksquashfs.
+ * mksquashfs is the default, since the libsquashfs backend writes no extended attributes, no hardlinks and no export
+ * table; libsquashfs is only used when requested.
+ */
+static bool select_squashfs_backend(appimagetool_context_t* context) {
+    const appimagetool_options_t* options = context->options;
+    const char* backend = options->squashfs_backend != NULL ? options->squashfs_backend : "mksquashfs";
+
+    context->use_libsquashfs = false;
+
+    if (strcmp(backend, "mksquashfs") == 0) {
+        return true;
+    }
+
+    if (strcmp(backend, "auto") != 0 && strcmp(backend, "libsquashfs") != 0) {
+        return fail(context, "Unknown squashfs backend: %s", backend);
+    }
+
+    const bool required = strcmp(backend, "libsquashfs") == 0;
+
+#ifndef HAVE_LIBSQUASHFS
+    if (required) {
+        return fail(context, "This build of appimagetool does not support the libsquashfs backend");
+    }
+#else
+    // exclude files use mksquashfs' wildcard syntax, and arbitrary options can only be understood by mksquashfs
+    const char* reason = NULL;
+    if (options->mksquashfs_options != NULL) {
+        reason = "--mksquashfs-opt";
+    } else if (context->exclude_file != NULL) {
+        reason = "--exclude-file";
+    } else if (context->appimageignore != NULL) {
+        reason = APPIMAGEIGNORE;
+    } else if (!squashfs_compressor_supported(options->compression != NULL ? options->compression : "zstd")) {
+        reason = "the selected compressor";
+    }
+
+    if (reason != NULL) {
+        if (required) {
+            return fail(context, "The libsquashfs backend cannot be used with %s", reason);
+        }
+        if (options->verbose) {
+            fprintf(stderr, "Using mksquashfs because of %s\n", reason);
+        }
+        return true;
+    }
+
+    context->use_libsquashfs = true;
+#endif
+
+    return true;
+}
+
+/* Check for dependencies before the build starts. Better fail early if they are not present. */
+static bool check_tools(appimagetool_context_t* context) {
+    if(! context_find_tool(context, "file"))
+        return fail(context, "file command is missing but required, please install it");
+#ifndef AUXILIARY_FILES_DESTINATION
+    if(! context->use_libsquashfs && ! context_find_tool(context, "mksquashfs"))
+        return fail(context, "mksquashfs command is missing but required, please install it");
+#else
+    if (! context->use_libsquashfs && (bundled_mksquashfs == NULL ||
+            !g_file_test(bundled_mksquashfs, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_EXECUTABLE)))
+        return fail(context, "No such file or directory: %s", bundled_mksquashfs != NULL ? bundled_mksquashfs : "mksquashfs");
+#endif
+    if(! context_find_tool(context, "desktop-file-validate"))
+        return fail(context, "desktop-file-validate command is missing, please install it");
+    if(! context->options->no_appstream)
+        if(! context_find_tool(context, "appstreamcli"))
+            g_print("WARNING: appstreamcli command is missing, please install it if you want to use AppStream metadata\n");
+    if(! context_find_tool(context, "gpg2") && ! context_find_tool(context, "gpg"))
+        g_print("WARNING: gpg2 or gpg command is missing, please install it if you want to create digital signatures\n");
+    if(! context_find_tool(context, "sha256sum") && ! context_find_tool(context, "shasum"))
+        g_print("WARNING: sha256sum or shasum command is missing, please install it if you want to create digital signatures\n");
+
+    return true;
+}
+
+/* Validate desktop file using desktop-file-validate on the $PATH */
+static int validate_desktop_file(const appimagetool_context_t* context, char *file) {
+    char* args[] = {"desktop-file-validate", file, NULL};
+    return run_tool(context, args, NULL);
+}
+
+/* in-place modification of the string, and assuming the buffer pointed to by
+* line is large enough to hold the resulting string*/
+static void replacestr(char *line, const char *search, const char *replace)
+{
+    char *sp = NULL;
+
+    if ((sp = strstr(line, search)) == NULL) {
+        return;
+    }
+    int search_len = strlen(search);
+    int replace_len = strlen(replace);
+    int tail_len = strlen(sp+search_len);
+
+    memmove(sp+replace_len,sp+search_len,tail_len+1);
+    memcpy(sp, replace, replace_len);
+
+    /* Do it recursively again until no more work to do */
+
+    if ((sp = strstr(line, search))) {
+        replacestr(line, search, replace);
+    }
+}
+
+static int count_archs(bool* archs) {
+    int countArchs = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        countArchs += archs[i];
+    }
+    return countArchs;
+}
+
+static gchar* archToName(fARCH arch) {
+    switch (arch) {
+        case fARCH_aarch64:
+            return "aarch64";
+        case fARCH_armhf:
+            return "armhf";
+        case fARCH_i686:
+            return "i686";
+        case fARCH_x86_64:
+            return "x86_64";
+    }
+    return "all";
+}
+
+static gchar* getArchName(bool* archs) {
+    if (archs[fARCH_i686])
+        return archToName(fARCH_i686);
+    else if (archs[fARCH_x86_64])
+        return archToName(fARCH_x86_64);
+    else if (archs[fARCH_armhf])
+        return archToName(fARCH_armhf);
+    else if (archs[fARCH_aarch64])
+        return archToName(fARCH_aarch64);
+    else
+        return "all";
+}
+
+static void extract_arch_from_e_machine_field(int16_t e_machine, const gchar* sourcename, bool* archs, bool verbose) {
+    if (e_machine == 3) {
+        archs[fARCH_i686] = 1;
+        if(verbose)
+            fprintf(stderr, "%s used for determining architecture %s\n", sourcename, archToName(fARCH_i686));
+    }
+
+    if (e_machine == 62) {
+        archs[fARCH_x86_64] = 1;
+        if(verbose)
+            fprintf(stderr, "%s used for determining architecture %s\n", sourcename, archToName(fARCH_x86_64));
+    }
+
+    if (e_machine == 40) {
+        archs[fARCH_armhf] = 1;
+        if(verbose)
+            fprintf(stderr, "%s used for determining architecture %s\n", sourcename, archToName(fARCH_armhf));
+    }
+
+    if (e_machine == 183) {
+        archs[fARCH_aarch64] = 1;
+        if(verbose)
+            fprintf(stderr, "%s used for determining architecture %s\n", sourcename, archToName(fARCH_aarch64));
+    }
+}
+
+/* The name is modified in place */
+static void extract_arch_from_text(gchar *archname, const gchar* sourcename, bool* archs, bool verbose) {
+    if (archname) {
+        archname = g_strstrip(archname);
+        if (archname) {
+            replacestr(archname, "-", "_");
+            replacestr(archname, " ", "_");
+            if (g_ascii_strncasecmp("i386", archname, 5) == 0
+                    || g_ascii_strncasecmp("i486", archname, 5) == 0
+                    || g_ascii_strncasecmp("i586", archname, 5) == 0
+                    || g_ascii_strncasecmp("i686", archname, 5) == 0
+                    || g_ascii_strncasecmp("intel_80386", archname, 12) == 0
+                    || g_ascii_strncasecmp("intel_80486", archname, 12) == 0
+                    || g_ascii_strncasecmp("intel_80586", archname, 12) == 0
+                    || g_ascii_strncasecmp("intel_80686", archname, 12) == 0
+                    ) {
+                archs[fARCH_i686] = 1;
+                if (verbose)
+                    fprintf(stderr, "%s used for determining architecture i386\n", sourcename);
+            } else if (g_ascii_strncasecmp("x86_64", archname, 7) == 0) {
+                archs[fARCH_x86_64] = 1;
+                if (verbose)
+                    fprintf(stderr, "%s used for determining architecture x86_64\n", sourcename);
+            } else if (g_ascii_strncasecmp("arm", archname, 4) == 0 ||
+                       g_ascii_strncasecmp("armhf", archname, 6) == 0) {
+                archs[fARCH_armhf] = 1;
+                if (verbose)
+                    fprintf(stderr, "%s used for determining architecture ARM\n", sourcename);
+            } else if (g_ascii_strncasecmp("arm_aarch64", archname, 12) == 0 ||
+                       g_ascii_strncasecmp("aarch64", archname, 8) == 0) {
+                archs[fARCH_aarch64] = 1;
+                if (verbose)
+                    fprintf(stderr, "%s used for determining architecture ARM aarch64\n", sourcename);
+            }
+        }
+    }
+}
+
+/* Determine the architecture from the main executable, falling back to all of the AppDir's ELF files */
+static void find_arch(const gchar* real_path, const appdir_scan_t* scan, const gchar* exec, bool* archs, bool verbose) {
+    // Exec= follows shell-like quoting rules, and we only need the program
+    gchar* exec_program = NULL;
+    gchar** exec_argv = NULL;
+    if (exec != NULL && g_shell_parse_argv(exec, NULL, &exec_argv, NULL)) {
+        exec_program = exec_argv[0];
+    }
+
+    uint16_t machines[8];
+    size_t machines_count = appimage_detect_elf_machines(real_path, scan, exec_program, machines, 8, verbose);
+
+    for (size_t i = 0; i < machines_count; ++i) {
+        extract_arch_from_e_machine_field((int16_t) machines[i], "ELF header", archs, verbose);
+    }
+
+    g_strfreev(exec_argv);
+}
+
+/* Find the first entry of the given kind (see appdir_entry_flags), returns its absolute path */
+static gchar* find_first_matching_entry(const appdir_scan_t* scan, const gchar *real_path, uint32_t flag) {
+    for (size_t i = 0; i < appdir_scan_entries_count(scan); ++i) {
+        const appdir_entry_t* entry = appdir_scan_entry(scan, i);
+        if ((entry->flags & flag) != 0) {
+            return g_build_filename(real_path, entry->path, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Check whether the scan found a file of the given kind (or any regular file) at the given path relative to the AppDir */
+static bool scan_has_entry(const appdir_scan_t* scan, const gchar* relative_path, uint32_t flag) {
+    const appdir_entry_t* entry = appdir_scan_find(scan, relative_path);
+    return entry != NULL && ((entry->flags & flag) != 0 || S_ISREG(entry->mode));
+}
+
+static gchar* get_desktop_entry(GKeyFile *kf, char *key) {
+    gchar *value = g_key_file_get_string (kf, "Desktop Entry", key, NULL);
+    if (! value){
+        fprintf(stderr, "%s entry not found in desktop file\n", key);
+    }
+    return value;
+}
+
+/* run a command outside the current appimage, block environs like LD_LIBRARY_PATH
+ * argv[0] is looked up on the $PATH */
+static int run_external(const appimagetool_context_t* context, char *const argv []) {
+    // blocks env defined in resources/AppRun
+    static const char* const blocked_variables[] = {
+        "LD_LIBRARY_PATH",
+        "PYTHONPATH",
+        "XDG_DATA_DIRS",
+        "PERLLIB",
+        "GSETTINGS_SCHEMA_DIR",
+        "QT_PLUGIN_PATH",
+        NULL
+    };
+
+    gchar** envp = g_strdupv(context->environment);
+    for (const char* const* variable = blocked_variables; *variable != NULL; ++variable) {
+        envp = g_environ_unsetenv(envp, *variable);
+    }
+
+    int exit_code = run_tool(context, argv, envp);
+    g_strfreev(envp);
+
+    if (exit_code == 0) {
+        return 0;
+    } else {
+        g_print("run_external: subprocess exited with status %d", exit_code);
+        return 1;
+    }
+}
+
+/* A file of the AppImage which differs from the AppDir's, added when the squashfs image is generated */
+typedef struct {
+    // relative to the AppDir
+    gchar* path;
+    // generated file in the overlay directory, NULL for a symlink
+    gchar* contents_path;
+    gchar* link_target;
+} overlay_entry_t;
+
+static void clear_overlay_entry(gpointer entry) {
+    overlay_entry_t* overlay_entry = entry;
+
+    if (overlay_entry->contents_path != NULL) {
+        g_unlink(overlay_entry->contents_path);
+        gchar* directory = g_path_get_dirname(overlay_entry->contents_path);
+        g_rmdir(directory);
+        g_free(directory);
+    }
+
+    g_free(overlay_entry->path);
+    g_free(overlay_entry->contents_path);
+    g_free(overlay_entry->link_target);
+}
+
+/* State shared by the stages of the packaging pipeline */
+typedef struct {
+    appimagetool_context_t* context;
+    char source[PATH_MAX];
+    // result of the one walk over the AppDir, shared by all stages
+    appdir_scan_t* scan;
+    gchar* desktop_file;
+    gchar* desktop_exec;
+    gchar* appdata_path;
+    gchar* version;
+    char app_name_for_filename[PATH_MAX];
+    // set by the architecture stage
+    gchar* arch;
+    // as given, or derived by the architecture stage
+    gchar* destination;
+    // as given, or guessed by the architecture stage, NULL if none is embedded
+    gchar* update_information;
+    // Merkle hashes of the AppDir, calculated by the hash stage unless they have been handed over with the scan
+    appimage_tree_hashes_t appdir_hashes;
+    bool appdir_hashed;
+    // the one of the hashes the AppImage depends on, and key of the build in the cache, empty if the build is not cached
+    char appdir_hash[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    char cache_key[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    // the cached AppImage, if the cache has one for the key
+    int cached_fd;
+    // checkpoint journal next to the destination, NULL unless resuming is enabled
+    appimage_journal_t* journal;
+    appimage_checkpoint_keys_t checkpoint_keys;
+    // checkpoint the build continues after, and the last one it has reached
+    appimage_checkpoint_t resume_point;
+    appimage_checkpoint_t checkpoint;
+    // temporary file the AppImage is built in, set by the squashfs stage
+    appimage_output_t* output;
+    // set by the runtime stage
+    int runtime_fd;
+    size_t runtime_size;
+    // parsed once from the runtime, valid for the AppImage as well since the runtime is embedded at offset 0
+    appimage_elf_sections_t* runtime_sections;
+    // set up while the AppImage is hashed, if update information is embedded
+    appimage_zsync_t* zsync;
+    // files added to the AppImage or replacing the AppDir's ones, e.g., the desktop file with the version; the AppDir
+    // itself is never modified, so that it may be read-only and shared by concurrent builds
+    GArray* overlay;
+    // private temporary directory the overlay's files are generated in, NULL until the first one is
+    gchar* overlay_directory;
+} pipeline_t;
+
+static void pipeline_clear(pipeline_t* pipeline) {
+    appdir_scan_free(pipeline->scan);
+    g_free(pipeline->desktop_file);
+    g_free(pipeline->desktop_exec);
+    g_free(pipeline->appdata_path);
+    g_free(pipeline->version);
+    g_free(pipeline->destination);
+    g_free(pipeline->update_information);
+    if (pipeline->cached_fd >= 0)
+        close(pipeline->cached_fd);
+    appimage_journal_free(pipeline->journal);
+    // removes the temporary file unless the AppImage has been published
+    appimage_output_free(pipeline->output);
+    if (pipeline->runtime_fd >= 0)
+        close(pipeline->runtime_fd);
+    if (pipeline->runtime_sections != NULL)
+        appimage_elf_sections_free(pipeline->runtime_sections);
+    if (pipeline->zsync != NULL)
+        appimage_zsync_free(pipeline->zsync);
+    if (pipeline->overlay != NULL)
+        g_array_free(pipeline->overlay, TRUE);
+    if (pipeline->overlay_directory != NULL) {
+        gchar* pseudo_file = g_build_filename(pipeline->overlay_directory, "pseudo-files", NULL);
+        gchar* exclude_file = g_build_filename(pipeline->overlay_directory, "excludes", NULL);
+        g_unlink(pseudo_file);
+        g_unlink(exclude_file);
+        g_rmdir(pipeline->overlay_directory);
+        g_free(pseudo_file);
+        g_free(exclude_file);
+        g_free(pipeline->overlay_directory);
+    }
+}
+
+/* The overlay's entry for the given path relative to the AppDir, NULL if the AppDir's file is used */
+static const overlay_entry_t* find_overlay_entry(const pipeline_t* pipeline, const char* relative_path) {
+    for (guint i = 0; pipeline->overlay != NULL && i < pipeline->overlay->len; ++i) {
+        const overlay_entry_t* entry = &g_array_index(pipeline->overlay, overlay_entry_t, i);
+        if (strcmp(entry->path, relative_path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void add_overlay_entry(pipeline_t* pipeline, const overlay_entry_t* entry) {
+    if (pipeline->overlay == NULL) {
+        pipeline->overlay = g_array_new(FALSE, TRUE, sizeof(overlay_entry_t));
+        g_array_set_clear_func(pipeline->overlay, clear_overlay_entry);
+    }
+    g_array_append_val(pipeline->overlay, *entry);
+}
+
+/* Generate a file of the overlay, it keeps its name, so that tools reading it (e.g., desktop-file-validate) see the
+ * same name as in the AppImage */
+static bool add_overlay_file(pipeline_t* pipeline, const char* relative_path, const gchar* contents, gsize length, mode_t mode) {
+    if (pipeline->overlay_directory == NULL) {
+        pipeline->overlay_directory = g_dir_make_tmp("appimagetool-XXXXXX", NULL);
+        if (pipeline->overlay_directory == NULL) {
+            return false;
+        }
+    }
+
+    // one directory per entry, so that files with the same name in different directories do not collide
+    gchar* index = g_strdup_printf("%u", pipeline->overlay != NULL ? pipeline->overlay->len : 0);
+    gchar* directory = g_build_filename(pipeline->overlay_directory, index, NULL);
+    gchar* name = g_path_get_basename(relative_path);
+    g_free(index);
+
+    overlay_entry_t entry = {
+        .path = g_strdup(relative_path),
+        .contents_path = g_build_filename(directory, name, NULL),
+        .link_target = NULL,
+    };
+    g_free(name);
+
+    const bool success = g_mkdir(directory, 0700) == 0 &&
+        g_file_set_contents(entry.contents_path, contents, (gssize) length, NULL) &&
+        chmod(entry.contents_path, mode & 07777) == 0;
+    g_free(directory);
+
+    // cleared along with the others, even if it could not be written
+    add_overlay_entry(pipeline, &entry);
+    return success;
+}
+
+static void add_overlay_symlink(pipeline_t* pipeline, const char* relative_path, const char* target) {
+    const overlay_entry_t entry = {
+        .path = g_strdup(relative_path),
+        .contents_path = NULL,
+        .link_target = g_strdup(target),
+    };
+    add_overlay_entry(pipeline, &entry);
+}
+
+/* Path of the desktop file as it ends up in the AppImage */
+static const char* appimage_desktop_file(const pipeline_t* pipeline) {
+    const overlay_entry_t* entry = find_overlay_entry(pipeline, pipeline->desktop_file + strlen(pipeline->source) + 1);
+    return entry != NULL ? entry->contents_path : pipeline->desktop_file;
+}
+
+// the stages mostly wait for subprocesses or the network, mksquashfs uses all cores on its own anyway
+static const unsigned int max_parallel_stages = 4;
+
+static bool validate_desktop_file_stage(stage_scheduler_t* scheduler, void* user_data) {
+    pipeline_t* pipeline = user_data;
+
+    if(validate_desktop_file(pipeline->context, (char*) appimage_desktop_file(pipeline)) != 0){
+        if (!stage_scheduler_cancelled(scheduler)) {
+            fprintf(stderr, "ERROR: Desktop file contains errors. Please fix them. Please see\n");
+            fprintf(stderr, "       https://specifications.freedesktop.org/desktop-entry-spec/latest/index.html\n");
+            fprintf(stderr, "       for more information.\n");
+            fail(pipeline->context, "Desktop file contains errors");
+        }
+        return false;
+    }
+
+    return true;
+}
+
+static bool validate_appstream_stage(stage_scheduler_t* scheduler, void* user_data) {
+    pipeline_t* pipeline = user_data;
+
+    char *args[] = {
+        "appstreamcli",
+        "validate-tree",
+        pipeline->source,
+        NULL
+    };
+    g_print("Trying to validate AppStream information with the appstreamcli tool\n");
+    g_print("In case of issues, please refer to https://github.com/ximion/appstream\n");
+    int ret = run_external(pipeline->context, args);
+    if (ret != 0) {
+        if (!stage_scheduler_cancelled(scheduler))
+            fail(pipeline->context, "Failed to validate AppStream information with appstreamcli");
+        return false;
+    }
+
+    return true;
+}
+
+static bool validate_appstream_util_stage(stage_scheduler_t* scheduler, void* user_data) {
+    pipeline_t* pipeline = user_data;
+
+    char *args[] = {
+        "appstream-util",
+        "validate-relax",
+        pipeline->appdata_path,
+        NULL
+    };
+    g_print("Trying to validate AppStream information with the appstream-util tool\n");
+    g_print("In case of issues, please refer to https://github.com/hughsie/appstream-glib\n");
+    int ret = run_external(pipeline->context, args);
+    if (ret != 0) {
+        if (!stage_scheduler_cancelled(scheduler))
+            fail(pipeline->context, "Failed to validate AppStream information with appstream-util");
+        return false;
+    }
+
+    return true;
+}
+
+static gchar* guess_update_information(const appimagetool_context_t* context, const pipeline_t* pipeline);
+static bool find_update_information_section(appimagetool_context_t* context, const pipeline_t* pipeline, unsigned long* offset);
+static bool find_digest_section(appimagetool_context_t* context, const pipeline_t* pipeline, unsigned long* offset);
+
+static bool determine_architecture_stage(stage_scheduler_t* scheduler, void* user_data) {
+    (void) scheduler;
+    pipeline_t* pipeline = user_data;
+    appimagetool_context_t* context = pipeline->context;
+    const bool verbose = context->options->verbose;
+
+    /* Determine the architecture */
+    bool archs[4] = {0, 0, 0, 0};
+    gchar* arch_env = g_strdup(context_getenv(context, "ARCH"));
+    extract_arch_from_text(arch_env, "Environmental variable ARCH", archs, verbose);
+    g_free(arch_env);
+    if (count_archs(archs) != 1) {
+        /* If no $ARCH variable is set check the files */
+        /* The main executable usually tells, otherwise we look at all executables and .so files */
+        find_arch(pipeline->source, pipeline->scan, pipeline->desktop_exec, archs, verbose);
+        int countArchs = count_archs(archs);
+        if (countArchs != 1) {
+            if (countArchs < 1)
+                fprintf(stderr, "Unable to guess the architecture of the AppDir source directory \"%s\"\n", context->options->source);
+            else
+                fprintf(stderr, "More than one architectures were found of the AppDir source directory \"%s\"\n", context->options->source);
+            fprintf(stderr, "A valid architecture with the ARCH environmental variable should be provided\ne.g. ARCH=x86_64 appimagetool ...\n");
+            return fail(context, "Could not determine the architecture of the AppDir");
+        }
+    }
+    pipeline->arch = getArchName(archs);
+    fprintf(stderr, "Using architecture %s\n", pipeline->arch);
+
+    if (pipeline->destination == NULL) {
+        /* No destination has been specified, to let's construct one
+        * TODO: Find out the architecture and use a $VERSION that might be around in the env */
+
+        // if $VERSION is specified, we embed it into the filename
+        if (pipeline->version != NULL) {
+            pipeline->destination = g_strdup_printf("%s-%s-%s.AppImage", pipeline->app_name_for_filename, pipeline->version, pipeline->arch);
+        } else {
+            pipeline->destination = g_strdup_printf("%s-%s.AppImage", pipeline->app_name_for_filename, pipeline->arch);
+        }
+
+        replacestr(pipeline->destination, " ", "_");
+    }
+
+    fprintf (stdout, "%s should be packaged as %s\n", pipeline->source, pipeline->destination);
+
+    // guessing it needs the architecture, and the cache needs it ahead of the squashfs stage
+    pipeline->update_information = g_strdup(context->options->update_information);
+    if (pipeline->update_information == NULL && context->options->guess_update_information) {
+        pipeline->update_information = guess_update_information(context, pipeline);
+    }
+
+    return true;
+}
+
+static bool provide_runtime_stage(stage_scheduler_t* scheduler, void* user_data) {
+    (void) scheduler;
+    pipeline_t* pipeline = user_data;
+    appimagetool_context_t* context = pipeline->context;
+
+    if (context->runtime_file != NULL) {
+        struct stat runtime_stat;
+        pipeline->runtime_fd = open(context->runtime_file, O_RDONLY | O_CLOEXEC);
+        if (pipeline->runtime_fd < 0 || fstat(pipeline->runtime_fd, &runtime_stat) != 0) {
+            return fail(context, "Unable to load provided runtime file");
+        }
+        pipeline->runtime_size = (size_t) runtime_stat.st_size;
+    } else {
+        if (!fetch_runtime(pipeline->arch, (const char* const*) context->environment, &pipeline->runtime_size, &pipeline->runtime_fd, context->options->offline, context->options->verbose)) {
+            fprintf(
+                stderr,
+                "Failed to download runtime file, please download the runtime manually from "
+                "https://github.com/AppImage/type2-runtime/releases and pass it to appimagetool with "
+                "--runtime-file\n"
+            );
+            return fail(context, "Failed to download runtime file");
+        }
+    }
+
+    if (context->options->verbose)
+        printf("Size of the embedded runtime: %zu bytes\n", pipeline->runtime_size);
+
+    pipeline->runtime_sections = appimage_elf_sections_read(pipeline->runtime_fd);
+    if (pipeline->runtime_sections == NULL) {
+        return fail(context, "Runtime is not a valid ELF file");
+    }
+
+    return true;
+}
+
+/* Check that the AppImage will fit next to the destination
+ * The squashfs image is at most about as large as the AppDir's files, plus the metadata, and compresses them by a
+ * factor of 2 to 3 in typical cases; the build fails if it could only fit with a much better ratio than that, and
+ * warns if it might not fit */
+static bool check_free_space(appimagetool_context_t* context, const pipeline_t* pipeline) {
+    static const uint64_t best_compression_ratio = 4;
+
+    gchar* destination = resolve_path(context, pipeline->destination);
+    gchar* directory = g_path_get_dirname(destination);
+    g_free(destination);
+
+    struct statvfs directory_stat;
+    if (statvfs(directory, &directory_stat) != 0) {
+        // the build fails with a more helpful message when it creates the temporary file there
+        fprintf(stderr, "Warning: could not determine the free space in %s: %s\n", directory, strerror(errno));
+        g_free(directory);
+        return true;
+    }
+
+    const uint64_t available = (uint64_t) directory_stat.f_bavail * directory_stat.f_frsize;
+    const uint64_t files_size = appdir_scan_total_size(pipeline->scan);
+    const uint64_t metadata_size = files_size / 64 + 1024 * 1024;
+    const uint64_t maximum_size = pipeline->runtime_size + files_size + metadata_size;
+    const uint64_t minimum_size = pipeline->runtime_size + files_size / best_compression_ratio + metadata_size;
+
+    bool success = true;
+    if (available < minimum_size) {
+        success = fail(
+            context, "Not enough free space in %s: %llu MiB available, the AppImage needs about %llu to %llu MiB",
+            directory, (unsigned long long) (available >> 20), (unsigned long long) (minimum_size >> 20),
+            (unsigned long long) (maximum_size >> 20)
+        );
+    } else if (available < maximum_size) {
+        fprintf(
+            stderr, "Warning: %llu MiB available in %s, the AppImage may need up to %llu MiB\n",
+            (unsigned long long) (available >> 20), directory, (unsigned long long) (maximum_size >> 20)
+        );
+    }
+
+    g_free(directory);
+    return success;
+}
+
+/* Check everything the stages after the squashfs image need, so that misconfigured builds fail before it is
+ * generated rather than after */
+/* Determine the version of mksquashfs, and whether it supports everything the build asks of it */
+static bool check_mksquashfs_version(appimagetool_context_t* context, const pipeline_t* pipeline) {
+    char* args[] = {"mksquashfs", "-version", NULL};
+    const appimage_process_options_t options = {
+        .envp = context->environment,
+        .stdout_mode = APPIMAGE_PROCESS_CAPTURE,
+        .stderr_mode = APPIMAGE_PROCESS_CAPTURE,
+        .capture_limit = 0,
+        .group = context->processes,
+    };
+
+    appimage_process_result_t result;
+    appimage_process_run(NULL, args, &options, &result);
+
+    // e.g., "mksquashfs version 4.6.1 (2023/03/25)"
+    int major, minor;
+    const bool known = result.stdout_data != NULL &&
+        sscanf(result.stdout_data, "mksquashfs version %d.%d", &major, &minor) == 2;
+    appimage_process_result_clear(&result);
+
+    if (!known) {
+        fprintf(stderr, "Warning: could not determine the version of mksquashfs, assuming it is 4.6 or newer\n");
+        context->mksquashfs_version = mksquashfs_pseudo_files_version;
+        return true;
+    }
+
+    context->mksquashfs_version = major * 100 + minor;
+    if (context->options->verbose) {
+        fprintf(stderr, "Using mksquashfs %d.%d\n", major, minor);
+    }
+
+    if (pipeline->overlay != NULL && pipeline->overlay->len > 0 && context->mksquashfs_version < mksquashfs_pseudo_files_version) {
+        return fail(
+            context,
+            "mksquashfs %d.%d is too old: the generated desktop file and .DirIcon are added as pseudo files, which "
+            "requires mksquashfs 4.6 or newer (like the one bundled with appimagetool); please update mksquashfs",
+            major, minor
+        );
+    }
+
+    return true;
+}
+
+static bool preflight_stage(stage_scheduler_t* scheduler, void* user_data) {
+    (void) scheduler;
+    pipeline_t* pipeline = user_data;
+    appimagetool_context_t* context = pipeline->context;
+    const appimagetool_options_t* options = context->options;
+    unsigned long offset;
+
+    if (context->exclude_file != NULL && access(context->exclude_file, F_OK) < 0) {
+        return fail(context, "Exclude file %s not found", context->exclude_file);
+    }
+
+    if (pipeline->update_information != NULL && !find_update_information_section(context, pipeline, &offset)) {
+        return false;
+    }
+
+    if (!find_digest_section(context, pipeline, &offset)) {
+        return false;
+    }
+
+    if (options->sign && !check_signing_preconditions(options->sign_key, pipeline->runtime_sections, options->verbose)) {
+        return fail(context, "Signing would fail, aborting");
+    }
+
+    if (!context->use_libsquashfs && !check_mksquashfs_version(context, pipeline)) {
+        return false;
+    }
+
+    return check_free_space(context, pipeline);
+}
+
+/* Whether the files' modification times end up in the squashfs image, otherwise they are all set to a fixed time */
+static bool squashfs_keeps_times(const appimagetool_context_t* context) {
+    return context_getenv(context, "SOURCE_DATE_EPOCH") == NULL && !context->options->zsync_friendly;
+}
+
+static bool hash_appdir_stage(stage_scheduler_t* scheduler, void* user_data) {
+    (void) scheduler;
+    pipeline_t* pipeline = user_data;
+    appimagetool_context_t* context = pipeline->context;
+
+    if (!pipeline->appdir_hashed && !appimage_tree_hash(
+            pipeline->source, pipeline->scan, context->budget.jobs, context->file_hash_directory, &pipeline->appdir_hashes,
+            context->options->verbose
+        )) {
+        return fail(context, "Failed to hash the AppDir");
+    }
+
+    const appimage_tree_hashes_t* hashes = &pipeline->appdir_hashes;
+    memcpy(pipeline->appdir_hash, squashfs_keeps_times(context) ? hashes->with_times : hashes->without_times, sizeof(pipeline->appdir_hash));
+    return true;
+}
+
+/* Add the AppDir, the overlay and the options the squashfs image depends on, besides the exclude files
+ * Returns false if a file of the overlay cannot be read */
+static bool add_squashfs_inputs(appimage_cache_key_t* key, const appimagetool_context_t* context, const pipeline_t* pipeline) {
+    const appimagetool_options_t* options = context->options;
+    bool success = true;
+
+    appimage_cache_key_add_string(key, "appdir", pipeline->appdir_hash);
+    for (guint i = 0; pipeline->overlay != NULL && i < pipeline->overlay->len; ++i) {
+        const overlay_entry_t* entry = &g_array_index(pipeline->overlay, overlay_entry_t, i);
+        appimage_cache_key_add_string(key, "overlay-path", entry->path);
+        appimage_cache_key_add_string(key, "overlay-link", entry->link_target);
+        success = success && appimage_cache_key_add_file(key, "overlay-contents", entry->contents_path);
+    }
+    appimage_cache_key_add_string(key, "backend", context->use_libsquashfs ? "libsquashfs" : "mksquashfs");
+    appimage_cache_key_add_string(key, "compression", options->compression != NULL ? options->compression : "zstd");
+    for (const char* const* option = options->mksquashfs_options; option != NULL && *option != NULL; ++option) {
+        appimage_cache_key_add_string(key, "mksquashfs-option", *option);
+    }
+    appimage_cache_key_add_string(key, "zsync-friendly", options->zsync_friendly ? "yes" : "no");
+    appimage_cache_key_add_string(key, "source-date-epoch", context_getenv(context, "SOURCE_DATE_EPOCH"));
+
+    return success;
+}
+
+/* Everything the AppImage's bytes depend on, except for the signature's timestamp, goes into the key */
+static bool lookup_cache_stage(stage_scheduler_t* scheduler, void* user_data) {
+    (void) scheduler;
+    pipeline_t* pipeline = user_data;
+    appimagetool_context_t* context = pipeline->context;
+    const appimagetool_options_t* options = context->options;
+
+    // without a key ID, gpg signs with whatever secret key comes first, which differs between machines
+    if (options->sign && options->sign_key == NULL) {
+        fprintf(stderr, "Not using the build cache, signing requires --sign-key to be cached\n");
+        return true;
+    }
+
+    appimage_cache_key_t* key = appimage_cache_key_new();
+    bool success = add_squashfs_inputs(key, context, pipeline);
+    appimage_cache_key_add_string(key, "update-information", pipeline->update_information);
+    appimage_cache_key_add_string(key, "version", pipeline->version);
+    appimage_cache_key_add_string(key, "sign-key", options->sign ? options->sign_key : NULL);
+
+    success = success && appimage_cache_key_add_fd(key, "runtime", pipeline->runtime_fd) &&
+        appimage_cache_key_add_file(key, "exclude-file", context->exclude_file) &&
+        appimage_cache_key_add_file(key, "appimageignore", context->appimageignore);
+
+    char cache_key[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    appimage_cache_key_finish(key, cache_key);
+
+    if (!success) {
+        return fail(context, "Failed to calculate the build cache key");
+    }
+
+    g_strlcpy(pipeline->cache_key, cache_key, sizeof(pipeline->cache_key));
+    pipeline->cached_fd = appimage_build_cache_lookup(context->cache, pipeline->cache_key);
+
+    fprintf(stderr, "Build cache %s for key %s\n", pipeline->cached_fd >= 0 ? "hit" : "miss", pipeline->cache_key);
+    return true;
+}
+
+/* Calculate the keys of the checkpoints, each covers the one before it and the inputs of its own stage
+ * Signing is not checkpointed, it is what usually fails, and takes little time compared to the other stages */
+static bool calculate_checkpoint_keys(const appimagetool_context_t* context, const pipeline_t* pipeline, appimage_checkpoint_keys_t keys) {
+    gchar* runtime_size = g_strdup_printf("%zu", pipeline->runtime_size);
+    bool success = true;
+
+    for (int checkpoint = APPIMAGE_CHECKPOINT_SQUASHFS; checkpoint < APPIMAGE_CHECKPOINT_COUNT; ++checkpoint) {
+        appimage_cache_key_t* key = appimage_cache_key_new();
+        appimage_cache_key_add_string(key, "checkpoint", appimage_checkpoint_name((appimage_checkpoint_t) checkpoint));
+
+        switch (checkpoint) {
+            case APPIMAGE_CHECKPOINT_SQUASHFS:
+                // the image is written at the runtime's size
+                success = success && add_squashfs_inputs(key, context, pipeline);
+                appimage_cache_key_add_string(key, "offset", runtime_size);
+                success = success && appimage_cache_key_add_file(key, "exclude-file", context->exclude_file) &&
+                    appimage_cache_key_add_file(key, "appimageignore", context->appimageignore);
+                break;
+            case APPIMAGE_CHECKPOINT_RUNTIME:
+                appimage_cache_key_add_string(key, "squashfs", keys[APPIMAGE_CHECKPOINT_SQUASHFS]);
+                success = success && appimage_cache_key_add_fd(key, "runtime", pipeline->runtime_fd);
+                break;
+            case APPIMAGE_CHECKPOINT_SECTIONS:
+                appimage_cache_key_add_string(key, "runtime", keys[APPIMAGE_CHECKPOINT_RUNTIME]);
+                appimage_cache_key_add_string(key, "update-information", pipeline->update_information);
+                break;
+            default:
+                // the digest only depends on the bytes written before
+                appimage_cache_key_add_string(key, "previous", keys[checkpoint - 1]);
+                break;
+        }
+
+        appimage_cache_key_finish(key, keys[checkpoint]);
+    }
+
+    g_free(runtime_size);
+    return success;
+}
+
+/* Find the checkpoint a failed build with the same inputs has reached, and continue with its partial AppImage */
+static bool lookup_checkpoint_stage(stage_scheduler_t* scheduler, void* user_data) {
+    (void) scheduler;
+    pipeline_t* pipeline = user_data;
+    appimagetool_context_t* context = pipeline->context;
+
+    // the AppImage in the cache is used as is
+    if (pipeline->cached_fd >= 0) {
+        return true;
+    }
+
+    if (!calculate_checkpoint_keys(context, pipeline, pipeline->checkpoint_keys)) {
+        return fail(context, "Failed to calculate the checkpoint keys");
+    }
+
+    gchar* destination = resolve_path(context, pipeline->destination);
+    pipeline->journal = appimage_journal_open(destination);
+
+    const char* partial_path = NULL;
+    pipeline->resume_point = appimage_journal_resume_point(pipeline->journal, pipeline->checkpoint_keys, &partial_path);
+
+    if (pipeline->resume_point != APPIMAGE_CHECKPOINT_NONE) {
+        fprintf(
+            stderr, "Resuming the build of %s after the %s checkpoint\n", pipeline->destination,
+            appimage_checkpoint_name(pipeline->resume_point)
+        );
+        pipeline->output = appimage_output_adopt(destination, partial_path);
+        pipeline->checkpoint = pipeline->resume_point;
+    }
+
+    g_free(destination);
+    return true;
+}
+
+/* Record a checkpoint, if resuming is enabled; failing to do so only costs a later build the time to redo the stage */
+static void record_checkpoint(pipeline_t* pipeline, appimage_checkpoint_t checkpoint, int fd) {
+    if (pipeline->journal == NULL) {
+        return;
+    }
+
+    if (appimage_journal_record(pipeline->journal, checkpoint, pipeline->checkpoint_keys[checkpoint], fd)) {
+        pipeline->checkpoint = checkpoint;
+        if (pipeline->context->options->verbose)
+            fprintf(stderr, "Recorded the %s checkpoint\n", appimage_checkpoint_name(checkpoint));
+    }
+}
+
+#ifdef HAVE_LIBSQUASHFS
+static bool squashfs_build_cancelled(void* user_data) {
+    return stage_scheduler_cancelled(user_data);
+}
+#endif
+
+/* Escape the given characters of a path with backslashes, as mksquashfs' wildcards and pseudo file names expect */
+static void append_escaped_path(GString* string, const char* path, const char* special) {
+    for (const char* c = path; *c != '\0'; ++c) {
+        if (strchr(special, *c) != NULL)
+            g_string_append_c(string, '\\');
+        g_string_append_c(string, *c);
+    }
+}
+
+/* Write the pseudo file definitions adding the overlay's files, and an exclude file for the AppDir's files they
+ * replace, since mksquashfs does not let pseudo files replace existing ones */
+static bool write_mksquashfs_overlay(const pipeline_t* pipeline, gchar** pseudo_file, gchar** exclude_file) {
+    // the files are generated by the build, so they get a fixed time like the libsquashfs backend gives them
+    // (mksquashfs' -all-time and SOURCE_DATE_EPOCH take precedence)
+    const char* source_date_epoch = context_getenv(pipeline->context, "SOURCE_DATE_EPOCH");
+    const long long overlay_time = source_date_epoch != NULL ? strtoll(source_date_epoch, NULL, 10) : 0;
+
+    GString* definitions = g_string_new(NULL);
+    GString* excludes = g_string_new(NULL);
+
+    for (guint i = 0; i < pipeline->overlay->len; ++i) {
+        const overlay_entry_t* entry = &g_array_index(pipeline->overlay, overlay_entry_t, i);
+
+        append_escaped_path(excludes, entry->path, "\\*?[]!+@()");
+        g_string_append_c(excludes, '\n');
+
+        g_string_append_c(definitions, '"');
+        append_escaped_path(definitions, entry->path, "\\\"");
+        g_string_append_c(definitions, '"');
+
+        if (entry->contents_path != NULL) {
+            struct stat contents_stat;
+            if (stat(entry->contents_path, &contents_stat) != 0) {
+                g_string_free(definitions, TRUE);
+                g_string_free(excludes, TRUE);
+                return false;
+            }
+
+            gchar* quoted_path = g_shell_quote(entry->contents_path);
+            g_string_append_printf(
+                definitions, " F %lld %o 0 0 cat %s\n", overlay_time, (unsigned int) (contents_stat.st_mode & 07777), quoted_path
+            );
+            g_free(quoted_path);
+        } else {
+            g_string_append_printf(definitions, " S %lld 777 0 0 %s\n", overlay_time, entry->link_target);
+        }
+    }
+
+    *pseudo_file = g_build_filename(pipeline->overlay_directory, "pseudo-files", NULL);
+    *exclude_file = g_build_filename(pipeline->overlay_directory, "excludes", NULL);
+
+    const bool success = g_file_set_contents(*pseudo_file, definitions->str, (gssize) definitions->len, NULL) &&
+        g_file_set_contents(*exclude_file, excludes->str, (gssize) excludes->len, NULL);
+
+    g_string_free(definitions, TRUE);
+    g_string_free(excludes, TRUE);
+    return success;
+}
+
+/* Record the squashfs image as the first checkpoint of the new partial AppImage, which replaces the previous one */
+static bool start_checkpoints(pipeline_t* pipeline) {
+    if (pipeline->journal == NULL) {
+        return true;
+    }
+
+    // mksquashfs has written the file by its path, it is opened once it is done
+    const int fd = appimage_output_open(pipeline->output);
+    if (fd < 0) {
+        return fail(pipeline->context, "Failed to open the squashfs image");
+    }
+
+    if (appimage_journal_start(pipeline->journal, appimage_output_path(pipeline->output))) {
+        record_checkpoint(pipeline, APPIMAGE_CHECKPOINT_SQUASHFS, fd);
+    }
+
+    // from now on, the file survives an interruption, too, for --resume to continue with
+    if (pipeline->checkpoint != APPIMAGE_CHECKPOINT_NONE) {
+        appimage_output_keep(pipeline->output);
+    }
+
+    return true;
+}
+
+static bool mksquashfs_stage_function(stage_scheduler_t* scheduler, void* user_data) {
+    pipeline_t* pipeline = user_data;
+    appimagetool_context_t* context = pipeline->context;
+    const appimagetool_options_t* options = context->options;
+
+    if (pipeline->cached_fd >= 0) {
+        fprintf(stderr, "Using the cached AppImage instead of generating squashfs\n");
+        return true;
+    }
+
+    if (pipeline->resume_point >= APPIMAGE_CHECKPOINT_SQUASHFS) {
+        fprintf(stderr, "Using the squashfs image of the previous build\n");
+        return true;
+    }
+
+    gchar* destination = resolve_path(context, pipeline->destination);
+    pipeline->output = appimage_output_new(destination);
+    g_free(destination);
+
+    if (pipeline->output == NULL) {
+        return fail(context, "Failed to create the AppImage next to %s", pipeline->destination);
+    }
+
+    const char* output_path = appimage_output_path(pipeline->output);
+
+#ifdef HAVE_LIBSQUASHFS
+    if (context->use_libsquashfs) {
+        fprintf (stderr, "Generating squashfs with libsquashfs...\n");
+
+        const char* compressor = options->compression != NULL ? options->compression : "zstd";
+        const char* source_date_epoch = context_getenv(context, "SOURCE_DATE_EPOCH");
+
+        const guint overlay_count = pipeline->overlay != NULL ? pipeline->overlay->len : 0;
+        squashfs_overlay_entry_t overlay[MAX(overlay_count, 1)];
+        for (guint i = 0; i < overlay_count; ++i) {
+            const overlay_entry_t* entry = &g_array_index(pipeline->overlay, overlay_entry_t, i);
+            overlay[i] = (squashfs_overlay_entry_t) {
+                .path = entry->path,
+                .contents_path = entry->contents_path,
+                .link_target = entry->link_target,
+            };
+        }
+
+        squashfs_writer_options_t squashfs_options = {
+            .compressor = compressor,
+            .block_size = squashfs_block_size(compressor),
+            .workers = context->budget.squashfs_jobs,
+            .memory_limit = context->budget.memory_limited ? context->budget.squashfs_memory : 0,
+            // like mksquashfs, SOURCE_DATE_EPOCH applies to all files, otherwise only the image's time is zeroed
+            // unless the layout should be kept stable
+            .fixed_time = source_date_epoch != NULL ? strtoll(source_date_epoch, NULL, 10) : (options->zsync_friendly ? 0 : -1),
+            .no_fragments = options->zsync_friendly,
+            .align_large_files = options->zsync_friendly,
+            .block_cache_directory = context->block_cache_directory,
+            .block_cache_size = options->cache_size,
+            .overlay = overlay,
+            .overlay_count = overlay_count,
+            .cancel_callback = squashfs_build_cancelled,
+            .cancel_callback_data = scheduler,
+        };
+
+        if (!write_squashfs(pipeline->source, pipeline->scan, output_path, pipeline->runtime_size, &squashfs_options, options->verbose)) {
+            if (!stage_scheduler_cancelled(scheduler))
+                fail(context, "Failed to generate squashfs with libsquashfs");
+            return false;
+        }
+
+        return start_checkpoints(pipeline);
+    }
+#else
+    (void) scheduler;
+    (void) options;
+#endif
+
+    /* Upstream mksquashfs can currently not start writing at an offset,
+    * so we need a patched one. https://github.com/plougher/squashfs-tools/pull/13
+    * should hopefully change that. */
+    fprintf (stderr, "Generating squashfs...\n");
+
+    gchar* pseudo_file = NULL;
+    gchar* overlay_exclude_file = NULL;
+    if (pipeline->overlay != NULL && !write_mksquashfs_overlay(pipeline, &pseudo_file, &overlay_exclude_file)) {
+        g_free(pseudo_file);
+        g_free(overlay_exclude_file);
+        return fail(context, "Failed to write the pseudo file definitions for mksquashfs");
+    }
+
+    int result = sfs_mksquashfs(context, pipeline->source, (char*) output_path, pipeline->runtime_size, pseudo_file, overlay_exclude_file);
+    g_free(pseudo_file);
+    g_free(overlay_exclude_file);
+    if(result != 0) {
+        return fail(context, "sfs_mksquashfs error");
+    }
+
+    return start_checkpoints(pipeline);
+}
+
+/* In zsync friendly mode, the zsync blocks line up with the files the libsquashfs backend aligns
+ * Otherwise, the block size is picked like zsyncmake does (0) */
+static size_t zsync_block_size(const appimagetool_context_t* context) {
+    return context->options->zsync_friendly ? APPIMAGE_ZSYNC_FRIENDLY_BLOCK_SIZE : 0;
+}
+
+/* Write the zsync file for the finished AppImage
+ * The block checksums have been calculated before the digest and the signature were embedded, therefore the blocks
+ * covering these sections are calculated again, all other blocks are up to date already */
+static bool write_zsync_file(
+    appimage_zsync_t* zsync,
+    const char* appimage_path,
+    const appimage_elf_sections_t* sections,
+    const char* zsync_path,
+    const char* url,
+    const char* sha1
+) {
+    static const char* const patched_sections[] = {".digest_md5", ".sha256_sig", ".sig_key"};
+
+    int fd = open(appimage_path, O_RDONLY | O_CLOEXEC);
+    struct stat appimage_stat;
+
+    if (fd < 0 || fstat(fd, &appimage_stat) != 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", appimage_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(patched_sections) / sizeof(patched_sections[0]); ++i) {
+        unsigned long offset = 0;
+        unsigned long length = 0;
+
+        appimage_elf_sections_find(sections, patched_sections[i], &offset, &length);
+
+        if (!appimage_zsync_rehash_range(zsync, fd, offset, length)) {
+            close(fd);
+            return false;
+        }
+    }
+
+    close(fd);
+
+    // like zsyncmake, use the file name only, clients save the file under this name
+    gchar* filename = g_path_get_basename(appimage_path);
+    const bool success = appimage_zsync_write(zsync, zsync_path, filename, url, (long) appimage_stat.st_mtime, sha1);
+    g_free(filename);
+
+    return success;
+}
+
+/* Parse VERSION environment variable.
+ * Also, if VERSION is not set and -g is called and if git is on the path, use
+ * git rev-parse --short HEAD
+ * TODO: Might also want to somehow make use of
+ * git rev-parse --abbrev-ref HEAD
+ * git log -1 --format=%ci */
+static gchar* determine_version(const appimagetool_context_t* context) {
+    const char* version_env = context_getenv(context, "VERSION");
+
+    if (version_env != NULL) {
+        return g_strdup(version_env);
+    }
+
+    if (!context->options->guess_update_information || context_find_tool(context, "git") == NULL) {
+        return NULL;
+    }
+
+    // git runs in the build's working directory
+    char* args[] = {"git", "-C", context->working_directory, "rev-parse", "--short", "HEAD", NULL};
+    const appimage_process_options_t options = {
+        .envp = context->environment,
+        .stdout_mode = APPIMAGE_PROCESS_CAPTURE,
+        .stderr_mode = APPIMAGE_PROCESS_INHERIT,
+        .capture_limit = 0,
+        .group = context->processes,
+    };
+
+    appimage_process_result_t result;
+    const int exit_code = appimage_process_run(NULL, args, &options, &result);
+    gchar* version = NULL;
+
+    if (exit_code != 0) {
+        g_printerr("Failed to run 'git rev-parse --short HEAD' (code %d)\n", exit_code);
+    } else {
+        version = g_strstrip(g_strdup(result.stdout_data));
+
+        if (version != NULL) {
+            g_printerr("NOTE: Using the output of 'git rev-parse --short HEAD' as the version:\n");
+            g_printerr("      %s\n", version);
+            g_printerr("      Please set the $VERSION environment variable if this is not intended\n");
+        }
+    }
+
+    appimage_process_result_clear(&result);
+    return version;
+}
+
+/* Read everything the pipeline needs from the AppDir, and add what it must contain
+ * The AppDir is walked once, everything we need to know about its contents is collected on the way */
+static bool prepare_appdir(appimagetool_context_t* context, pipeline_t* pipeline) {
+    const appimagetool_options_t* options = context->options;
+    const bool verbose = options->verbose;
+    const char* source = pipeline->source;
+
+    // the AppDir's hash and the in-process squashfs image are made from the scan's metadata rather than by walking
+    // the AppDir again
+    const bool metadata = context->cache != NULL || options->resume || context->use_libsquashfs;
+
+    // the architecture is determined from the ELF headers the scan reads, unless $ARCH tells it
+    bool archs[4] = {0, 0, 0, 0};
+    gchar* arch_env = g_strdup(context_getenv(context, "ARCH"));
+    extract_arch_from_text(arch_env, "Environmental variable ARCH", archs, false);
+    g_free(arch_env);
+    const bool probe_elf = count_archs(archs) != 1;
+
+    if (context->next_scan != NULL) {
+        pipeline->scan = context->next_scan;
+        pipeline->appdir_hashes = context->next_hashes;
+        pipeline->appdir_hashed = true;
+        context->next_scan = NULL;
+    } else {
+        pipeline->scan = appdir_scan(source, 0, (metadata ? APPDIR_SCAN_METADATA : 0) | (probe_elf ? APPDIR_SCAN_PROBE_ELF : 0), verbose);
+    }
+    if (pipeline->scan == NULL) {
+        return fail(context, "Failed to scan AppDir, aborting");
+    }
+
+    /* Check if *.desktop file is present in source AppDir */
+    pipeline->desktop_file = find_first_matching_entry(pipeline->scan, source, APPDIR_ENTRY_DESKTOP_FILE);
+    if(pipeline->desktop_file == NULL){
+        return fail(context, "Desktop file not found, aborting");
+    }
+    if(verbose)
+        fprintf (stdout, "Desktop file: %s\n", pipeline->desktop_file);
+
+    /* Read information from .desktop file */
+    GKeyFile *kf = g_key_file_new ();
+    if (!g_key_file_load_from_file (kf, pipeline->desktop_file, G_KEY_FILE_KEEP_TRANSLATIONS | G_KEY_FILE_KEEP_COMMENTS, NULL)) {
+        g_key_file_free(kf);
+        return fail(context, ".desktop file cannot be parsed");
+    }
+    if (!get_desktop_entry(kf, "Categories")) {
+        g_key_file_free(kf);
+        return fail(context, ".desktop file is missing a Categories= key");
+    }
+
+    if(verbose){
+        fprintf (stderr,"Name: %s\n", get_desktop_entry(kf, "Name"));
+        fprintf (stderr,"Icon: %s\n", get_desktop_entry(kf, "Icon"));
+        fprintf (stderr,"Exec: %s\n", get_desktop_entry(kf, "Exec"));
+        fprintf (stderr,"Comment: %s\n", get_desktop_entry(kf, "Comment"));
+        fprintf (stderr,"Type: %s\n", get_desktop_entry(kf, "Type"));
+        fprintf (stderr,"Categories: %s\n", get_desktop_entry(kf, "Categories"));
+    }
+
+    {
+        const char* const env_app_name = context_getenv(context, "APPIMAGETOOL_APP_NAME");
+        if (env_app_name != NULL) {
+            fprintf(stderr, "Using user-specified app name: %s\n", env_app_name);
+            g_strlcpy(pipeline->app_name_for_filename, env_app_name, PATH_MAX);
+        } else {
+            gchar* desktop_file_app_name = get_desktop_entry(kf, "Name");
+            snprintf(pipeline->app_name_for_filename, PATH_MAX, "%s", desktop_file_app_name);
+            g_free(desktop_file_app_name);
+            replacestr(pipeline->app_name_for_filename, " ", "_");
+
+            if (verbose) {
+                fprintf(stderr, "Using app name extracted from desktop file: %s\n", pipeline->app_name_for_filename);
+            }
+        }
+    }
+
+    // if $VERSION is specified, we embed its value into the desktop file of the AppImage, the AppDir's one is left as
+    // it is; this must happen before the validation stage reads the file
+    pipeline->version = determine_version(context);
+    if (pipeline->version != NULL) {
+        g_key_file_set_string(kf, G_KEY_FILE_DESKTOP_GROUP, "X-AppImage-Version", pipeline->version);
+
+        gsize length = 0;
+        gchar* contents = g_key_file_to_data(kf, &length, NULL);
+        const appdir_entry_t* entry = appdir_scan_find(pipeline->scan, pipeline->desktop_file + strlen(source) + 1);
+        const bool saved = contents != NULL && entry != NULL &&
+            add_overlay_file(pipeline, entry->path, contents, length, entry->mode);
+        g_free(contents);
+
+        if (!saved) {
+            g_key_file_free(kf);
+            return fail(context, "Could not save modified desktop file");
+        }
+    }
+
+    pipeline->desktop_exec = g_key_file_get_string(kf, G_KEY_FILE_DESKTOP_GROUP, "Exec", NULL);
+
+    /* Check if the Icon file is how it is expected */
+    gchar* icon_name = get_desktop_entry(kf, "Icon");
+    g_key_file_free(kf);
+
+    gchar* icon_file_path = NULL;
+    gchar* icon_file_png;
+    gchar* icon_file_svg;
+    gchar* icon_file_xpm;
+    icon_file_png = g_strdup_printf("%s/%s.png", source, icon_name);
+    icon_file_svg = g_strdup_printf("%s/%s.svg", source, icon_name);
+    icon_file_xpm = g_strdup_printf("%s/%s.xpm", source, icon_name);
+    const size_t source_prefix_length = strlen(source) + 1;
+    if (scan_has_entry(pipeline->scan, icon_file_png + source_prefix_length, APPDIR_ENTRY_ICON)) {
+        icon_file_path = icon_file_png;
+    } else if(scan_has_entry(pipeline->scan, icon_file_svg + source_prefix_length, APPDIR_ENTRY_ICON)) {
+        icon_file_path = icon_file_svg;
+    } else if(scan_has_entry(pipeline->scan, icon_file_xpm + source_prefix_length, APPDIR_ENTRY_ICON)) {
+        icon_file_path = icon_file_xpm;
+    } else {
+        fprintf (stderr, "%s{.png,.svg,.xpm} defined in desktop file but not found\n", icon_name);
+        fprintf (stderr, "For example, you could put a 256x256 pixel png into\n");
+        gchar *icon_name_with_png = g_strconcat(icon_name, ".png", NULL);
+        gchar *example_path = g_build_filename(source, "/", icon_name_with_png, NULL);
+        fprintf (stderr, "%s\n", example_path);
+        fail(context, "Icon %s defined in desktop file but not found", icon_name);
+        g_free(example_path);
+        g_free(icon_name_with_png);
+    }
+
+    /* Check if .DirIcon is present in source AppDir, otherwise (or if it is a dangling symlink) the AppImage gets one */
+    gchar *diricon_path = g_build_filename(source, ".DirIcon", NULL);
+    const bool success = icon_file_path != NULL;
+
+    if (success && ! g_file_test(diricon_path, G_FILE_TEST_IS_REGULAR)){
+        fprintf (stderr, "Adding .DirIcon symlink based on information from desktop file\n");
+        gchar* icon_file_name = g_path_get_basename(icon_file_path);
+        add_overlay_symlink(pipeline, ".DirIcon", icon_file_name);
+        g_free(icon_file_name);
+    }
+
+    g_free(diricon_path);
+    g_free(icon_file_png);
+    g_free(icon_file_svg);
+    g_free(icon_file_xpm);
+    g_free(icon_name);
+
+    if (!success) {
+        return false;
+    }
+
+    /* Check if AppStream upstream metadata is present in source AppDir */
+    if(! options->no_appstream){
+        char application_id[PATH_MAX];
+        gchar* desktop_file_name = g_path_get_basename(pipeline->desktop_file);
+        snprintf (application_id, sizeof(application_id), "%s", desktop_file_name);
+        g_free(desktop_file_name);
+        replacestr(application_id, ".desktop", ".appdata.xml");
+        gchar *appdata_path = g_build_filename(source, "/usr/share/metainfo/", application_id, NULL);
+        gchar *appdata_relative_path = g_build_filename("usr/share/metainfo", application_id, NULL);
+        const bool appdata_found = scan_has_entry(pipeline->scan, appdata_relative_path, APPDIR_ENTRY_APPSTREAM);
+        g_free(appdata_relative_path);
+        if (! appdata_found){
+            fprintf (stderr, "WARNING: AppStream upstream metadata is missing, please consider creating it\n");
+            fprintf (stderr, "         in usr/share/metainfo/%s\n", application_id);
+            fprintf (stderr, "         Please see https://www.freedesktop.org/software/appstream/docs/chap-Quickstart.html#sect-Quickstart-DesktopApps\n");
+            fprintf (stderr, "         for more information or use the generator at\n");
+            fprintf (stderr, "         https://docs.appimage.org/packaging-guide/optional/appstream.html#using-the-appstream-generator\n");
+            g_free(appdata_path);
+        } else {
+            fprintf (stderr, "AppStream upstream metadata found in usr/share/metainfo/%s\n", application_id);
+            pipeline->appdata_path = appdata_path;
+        }
+    }
+
+    return true;
+}
+
+/* Key of a validation: the tool, the given file and the AppDir's entries with any of the flags or below the directory
+ * The validators only look at these files, so a validation which has passed before needs not run again as long as
+ * they are unchanged, e.g., when the same AppDir is rebuilt after every change with --watch
+ * Returns NULL if a file cannot be read, the validation runs then */
+static gchar* validation_key(const pipeline_t* pipeline, const char* tool, const char* file, uint32_t entry_flags, const char* directory) {
+    appimage_cache_key_t* key = appimage_cache_key_new();
+    appimage_cache_key_add_string(key, "tool", context_find_tool(pipeline->context, tool));
+    bool success = appimage_cache_key_add_file(key, "file", file);
+
+    for (size_t i = 0; success && (entry_flags != 0 || directory != NULL) && i < appdir_scan_entries_count(pipeline->scan); ++i) {
+        const appdir_entry_t* entry = appdir_scan_entry(pipeline->scan, i);
+        if (S_ISDIR(entry->mode) ||
+            ((entry->flags & entry_flags) == 0 && (directory == NULL || !g_str_has_prefix(entry->path, directory))))
+            continue;
+
+        gchar* path = g_build_filename(pipeline->source, entry->path, NULL);
+        appimage_cache_key_add_string(key, "path", entry->path);
+        success = appimage_cache_key_add_file(key, "contents", path);
+        g_free(path);
+    }
+
+    char hex[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    appimage_cache_key_finish(key, hex);
+
+    return success ? g_strdup_printf("%s:%s", tool, hex) : NULL;
+}
+
+/* Add a validation stage, unless the same validation has passed in an earlier build with this context
+ * The key is added to the pending ones, which are remembered once the build has succeeded */
+static void add_validation_stage(
+    stage_scheduler_t* scheduler, pipeline_t* pipeline, const char* name, stage_function_t function, gchar* key,
+    GPtrArray* pending_validations
+) {
+    appimagetool_context_t* context = pipeline->context;
+
+    if (key != NULL && g_hash_table_contains(context->passed_validations, key)) {
+        fprintf(stderr, "Skipping %s, the files it checks have not changed since they passed\n", name);
+        g_free(key);
+        return;
+    }
+
+    stage_scheduler_add(scheduler, name, function, pipeline, NULL, 0);
+    if (key != NULL)
+        g_ptr_array_add(pending_validations, key);
+}
+
+static void report_stage(const appimagetool_context_t* context, const char* name, long microseconds) {
+    if (context->options->stage_callback != NULL && microseconds >= 0) {
+        context->options->stage_callback(name, microseconds, context->options->stage_callback_data);
+    }
+}
+
+/* The stages below are independent of each other to a large extent, so they run concurrently
+ * Validation, architecture detection and fetching the runtime overlap, and mksquashfs starts as soon as the
+ * runtime's size is known, and the preflight checks have passed
+ * If any of the stages fails, the others are cancelled and no AppImage is produced */
+static bool run_pipeline(appimagetool_context_t* context, pipeline_t* pipeline) {
+    stage_scheduler_t* scheduler = stage_scheduler_new(max_parallel_stages, context->options->verbose);
+    stage_scheduler_set_cancel_handler(scheduler, terminate_children, context->processes);
+
+    if (context->passed_validations == NULL)
+        context->passed_validations = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GPtrArray* pending_validations = g_ptr_array_new_with_free_func(g_free);
+
+    if (context_find_tool(context, "desktop-file-validate")) {
+        add_validation_stage(
+            scheduler, pipeline, "desktop-file-validate", validate_desktop_file_stage,
+            validation_key(pipeline, "desktop-file-validate", appimage_desktop_file(pipeline), 0, NULL), pending_validations
+        );
+    }
+
+    if (pipeline->appdata_path != NULL) {
+        /* Use ximion's appstreamcli to make sure that desktop file and appdata match together */
+        if (context_find_tool(context, "appstreamcli")) {
+            // validate-tree checks all metainfo and desktop files in the AppDir
+            add_validation_stage(
+                scheduler, pipeline, "appstreamcli", validate_appstream_stage,
+                validation_key(pipeline, "appstreamcli", NULL, APPDIR_ENTRY_DESKTOP_FILE | APPDIR_ENTRY_APPSTREAM, "usr/share/applications/"),
+                pending_validations
+            );
+        }
+        /* It seems that hughsie's appstream-util does additional validations */
+        if (context_find_tool(context, "appstream-util")) {
+            add_validation_stage(
+                scheduler, pipeline, "appstream-util", validate_appstream_util_stage,
+                validation_key(pipeline, "appstream-util", pipeline->appdata_path, 0, NULL), pending_validations
+            );
+        }
+    }
+
+    const int arch_stage = stage_scheduler_add(scheduler, "architecture", determine_architecture_stage, pipeline, NULL, 0);
+    const int runtime_stage = stage_scheduler_add(scheduler, "runtime", provide_runtime_stage, pipeline, &arch_stage, 1);
+
+    /* The AppDir is hashed alongside the validation, the squashfs image is only generated if the cache misses, and
+     * no failed build with the same inputs has left one behind */
+    int squashfs_dependency = runtime_stage;
+    if (context->cache != NULL || context->options->resume) {
+        const int lookup_dependencies[] = {
+            stage_scheduler_add(scheduler, "appdir-hash", hash_appdir_stage, pipeline, NULL, 0),
+            runtime_stage,
+        };
+        if (context->cache != NULL)
+            squashfs_dependency = stage_scheduler_add(scheduler, "cache-lookup", lookup_cache_stage, pipeline, lookup_dependencies, 2);
+        if (context->options->resume) {
+            const int checkpoint_dependencies[] = {lookup_dependencies[0], squashfs_dependency};
+            squashfs_dependency = stage_scheduler_add(scheduler, "checkpoint-lookup", lookup_checkpoint_stage, pipeline, checkpoint_dependencies, 2);
+        }
+    }
+
+    const int squashfs_dependencies[] = {
+        stage_scheduler_add(scheduler, "preflight", preflight_stage, pipeline, &runtime_stage, 1),
+        squashfs_dependency,
+    };
+    stage_scheduler_add(scheduler, "mksquashfs", mksquashfs_stage_function, pipeline, squashfs_dependencies, 2);
+
+    const bool pipeline_succeeded = stage_scheduler_run(scheduler);
+    for (size_t stage_id = 0; stage_id < stage_scheduler_count(scheduler); ++stage_id) {
+        report_stage(
+            context, stage_scheduler_name(scheduler, (int) stage_id), stage_scheduler_duration(scheduler, (int) stage_id)
+        );
+    }
+    stage_scheduler_free(scheduler);
+
+    if (pipeline_succeeded) {
+        for (guint i = 0; i < pending_validations->len; ++i) {
+            g_hash_table_add(context->passed_validations, g_strdup(g_ptr_array_index(pending_validations, i)));
+        }
+    }
+    g_ptr_array_free(pending_validations, TRUE);
+
+    // stages which are cancelled do not report an error themselves
+    if (!pipeline_succeeded) {
+        return fail(context, "Failed to generate AppImage, aborting");
+    }
+
+    return true;
+}
+
+/* If the user has not provided update information but we know this is a CI build,
+ * then fill in update information based on well-known CI environment variables
+ * https://github.com/AppImage/AppImageSpec/blob/master/draft.md#github-releases */
+static gchar* guess_update_information(const appimagetool_context_t* context, const pipeline_t* pipeline) {
+    /* Parse Travis CI environment variables.
+     * https://docs.travis-ci.com/user/environment-variables/#Default-Environment-Variables
+     * TRAVIS_REPO_SLUG: The slug (in form: owner_name/repo_name) of the repository currently being built.
+     * TRAVIS_TAG: If the current build is for a git tag, this variable is set to the tag’s name. */
+    const char* travis_repo_slug = context_getenv(context, "TRAVIS_REPO_SLUG");
+    const char* travis_tag = context_getenv(context, "TRAVIS_TAG");
+    const char* travis_pull_request = context_getenv(context, "TRAVIS_PULL_REQUEST");
+
+    /* https://github.com/probonopd/uploadtool */
+    const char* github_token = context_getenv(context, "GITHUB_TOKEN");
+
+    /* Parse GitHub Actions environment variables.
+     * https://docs.github.com/en/actions/learn-github-actions/variables
+     * GITHUB_REPOSITORY: The owner and repository name. For example, octocat/Hello-World.
+     * GITHUB_REPOSITORY_OWNER: The repository owner's name. For example, octocat.
+     * The repository name is GITHUB_REPOSITORY without the owner at the beginning, and the slash that follows it */
+    const char* github_repository = context_getenv(context, "GITHUB_REPOSITORY");
+    const char* github_repository_owner = context_getenv(context, "GITHUB_REPOSITORY_OWNER");
+    const char* github_repository_name = NULL;
+    if (github_repository_owner != NULL && github_repository != NULL) {
+        const char* owner_start = strstr(github_repository, github_repository_owner);
+        if (owner_start != NULL) {
+            owner_start += strlen(github_repository_owner);
+            // Skip the '/'
+            if (*owner_start == '/')
+                owner_start++;
+            github_repository_name = owner_start;
+        }
+    }
+
+    /* Parse GitLab CI environment variables.
+     * https://docs.gitlab.com/ee/ci/variables/#predefined-variables-environment-variables
+     * echo "${CI_PROJECT_URL}/-/jobs/artifacts/${CI_COMMIT_REF_NAME}/raw/QtQuickApp-x86_64.AppImage?job=${CI_JOB_NAME}"
+     */
+    const char* CI_PROJECT_URL = context_getenv(context, "CI_PROJECT_URL");
+    const char* CI_COMMIT_REF_NAME = context_getenv(context, "CI_COMMIT_REF_NAME"); // The branch or tag name for which project is built
+    const char* CI_JOB_NAME = context_getenv(context, "CI_JOB_NAME"); // The name of the job as defined in .gitlab-ci.yml
+
+    gchar* update_information = NULL;
+
+    if(github_repository_name){
+        if(!github_token) {
+            printf("Will not guess update information since $GITHUB_TOKEN is missing\n");
+        } else {
+            // gh-releases-zsync|probono|AppImages|latest|Subsurface-*x86_64.AppImage.zsync
+            update_information = g_strdup_printf("gh-releases-zsync|%s|%s|latest|%s*-%s.AppImage.zsync", github_repository_owner, github_repository_name, pipeline->app_name_for_filename, pipeline->arch);
+            printf("Guessing update information based on $GITHUB_REPOSITORY=%s\n", github_repository);
+            printf("%s\n", update_information);
+        }
+    } else if(travis_repo_slug){
+        if(!github_token) {
+            printf("Will not guess update information since $GITHUB_TOKEN is missing,\n");
+            if(travis_pull_request == NULL || 0 != strcmp(travis_pull_request, "false")){
+                printf("please set it in the Travis CI Repository Settings for this project.\n");
+                printf("You can get one from https://github.com/settings/tokens\n");
+            } else {
+                printf("which is expected since this is a pull request\n");
+            }
+        } else {
+            gchar **parts = g_strsplit (travis_repo_slug, "/", 2);
+            /* gh-releases-zsync|probono|AppImages|latest|Subsurface*-x86_64.AppImage.zsync */
+            gchar *channel = "continuous";
+                if(travis_tag != NULL){
+                    if((strcmp(travis_tag, "") != 0) && (strcmp(travis_tag, "continuous") != 0)) {
+                        channel = "latest";
+                    }
+                }
+            update_information = g_strdup_printf("gh-releases-zsync|%s|%s|%s|%s*-%s.AppImage.zsync", parts[0], parts[1], channel, pipeline->app_name_for_filename, pipeline->arch);
+            g_strfreev(parts);
+            printf("Guessing update information based on $TRAVIS_TAG=%s and $TRAVIS_REPO_SLUG=%s\n", travis_tag, travis_repo_slug);
+            printf("%s\n", update_information);
+        }
+    } else if(CI_COMMIT_REF_NAME){
+        // ${CI_PROJECT_URL}/-/jobs/artifacts/${CI_COMMIT_REF_NAME}/raw/QtQuickApp-x86_64.AppImage?job=${CI_JOB_NAME}
+        update_information = g_strdup_printf("zsync|%s/-/jobs/artifacts/%s/raw/%s-%s.AppImage.zsync?job=%s", CI_PROJECT_URL, CI_COMMIT_REF_NAME, pipeline->app_name_for_filename, pipeline->arch, CI_JOB_NAME);
+        printf("Guessing update information based on $CI_COMMIT_REF_NAME=%s and $CI_JOB_NAME=%s\n", CI_COMMIT_REF_NAME, CI_JOB_NAME);
+        printf("%s\n", update_information);
+    }
+
+    return update_information;
+}
+
+/* Check the update information, and find the offset of the section it is embedded in */
+static bool find_update_information_section(appimagetool_context_t* context, const pipeline_t* pipeline, unsigned long* offset) {
+    const char* update_information = pipeline->update_information;
+
+    if(!g_str_has_prefix(update_information,"zsync|"))
+        if(!g_str_has_prefix(update_information,"gh-releases-zsync|"))
+            if(!g_str_has_prefix(update_information,"pling-v1-zsync|"))
+                return fail(context, "The provided updateinformation is not in a recognized format");
+
+    /* TODO: Further checking of the updateinformation */
+
+    unsigned long ui_offset = 0;
+    unsigned long ui_length = 0;
+
+    appimage_elf_sections_find(pipeline->runtime_sections, ".upd_info", &ui_offset, &ui_length);
+
+    if (ui_offset == 0 || ui_length == 0) {
+        return fail(context, "Could not find section .upd_info in runtime");
+    }
+
+    if(context->options->verbose) {
+        printf("ui_offset: %lu\n", ui_offset);
+        printf("ui_length: %lu\n", ui_length);
+    }
+
+    if(strlen(update_information)>ui_length)
+        return fail(context, "updateinformation does not fit into segment, aborting");
+
+    *offset = ui_offset;
+    return true;
+}
+
+/* Check the update information and add it to the patch plan */
+static bool embed_update_information(appimagetool_context_t* context, pipeline_t* pipeline, const char* update_information) {
+    unsigned long ui_offset = 0;
+
+    if (!find_update_information_section(context, pipeline, &ui_offset)) {
+        return false;
+    }
+
+    if(context->options->verbose) {
+        gchar **ui_type = g_strsplit_set(update_information, "|", -1);
+        printf("updateinformation type: %s\n", ui_type[0]);
+        g_strfreev(ui_type);
+    }
+
+    appimage_output_patch(pipeline->output, ui_offset, update_information, strlen(update_information));
+    return true;
+}
+
+// bytes of the MD5 digest embedded in .digest_md5
+static const unsigned long digest_md5_size = 16;
+
+/* Find the offset of the section the MD5 digest is embedded in */
+static bool find_digest_section(appimagetool_context_t* context, const pipeline_t* pipeline, unsigned long* offset) {
+    unsigned long digest_md5_offset = 0;
+    unsigned long digest_md5_length = 0;
+
+    appimage_elf_sections_find(pipeline->runtime_sections, ".digest_md5", &digest_md5_offset, &digest_md5_length);
+
+    if (digest_md5_offset == 0 || digest_md5_length == 0) {
+        return fail(context, "Could not find section .digest_md5 in runtime");
+    }
+
+    if (digest_md5_length < digest_md5_size) {
+        return fail(
+            context,
+            ".digest_md5 section in runtime's ELF header is too small"
+            "(found %lu bytes, minimum required: %lu bytes)",
+            digest_md5_length, digest_md5_size
+        );
+    }
+
+    *offset = digest_md5_offset;
+    return true;
+}
+
+/* Calculate and embed the MD5 digest
+ * The block checksums of the zsync file are calculated while the AppImage is read for it */
+static bool embed_digest(appimagetool_context_t* context, pipeline_t* pipeline) {
+    fprintf(stderr, "Embedding MD5 digest\n");
+
+    unsigned long digest_md5_offset = 0;
+
+    if (!find_digest_section(context, pipeline, &digest_md5_offset)) {
+        return false;
+    }
+
+    appimage_hashes_t hashes;
+
+    // the digest covers the update information
+    if (!appimage_output_flush(pipeline->output)) {
+        return fail(context, "Failed to embed update information");
+    }
+
+    if (!appimage_hash_file_observed(
+            appimage_output_path(pipeline->output), APPIMAGE_HASH_TYPE2_MD5, pipeline->runtime_sections,
+            pipeline->zsync != NULL ? appimage_zsync_update : NULL, pipeline->zsync, &hashes, context->options->verbose
+        )) {
+        return fail(context, "Failed to calculate MD5 digest");
+    }
+
+    appimage_output_patch(pipeline->output, digest_md5_offset, hashes.type2_md5, digest_md5_size);
+    return true;
+}
+
+/* Write the checksum files and the zsync file of the published AppImage
+ * They must describe the final file, hence their digests are calculated after signing, all from the same read of the
+ * file. The zsync block checksums of a cached AppImage are calculated during this read as well */
+static bool write_companion_files(appimagetool_context_t* context, pipeline_t* pipeline, const char* destination) {
+    const appimagetool_options_t* options = context->options;
+    bool observe_zsync = false;
+
+    if (pipeline->update_information != NULL && pipeline->zsync == NULL) {
+        struct stat destination_stat;
+
+        if (stat(destination, &destination_stat) != 0 ||
+            (pipeline->zsync = appimage_zsync_new((unsigned long) destination_stat.st_size, zsync_block_size(context), context->budget.jobs)) == NULL) {
+            return fail(context, "Failed to prepare zsync file generation");
+        }
+        observe_zsync = true;
+    }
+
+    int final_hash_types = 0;
+
+    if (options->write_checksums)
+        final_hash_types |= APPIMAGE_HASH_SHA256 | APPIMAGE_HASH_MD5;
+    if (pipeline->zsync != NULL)
+        final_hash_types |= APPIMAGE_HASH_SHA1;
+
+    appimage_hashes_t hashes;
+
+    if (final_hash_types != 0 && !appimage_hash_file_observed(
+            destination, final_hash_types, NULL, observe_zsync ? appimage_zsync_update : NULL, pipeline->zsync, &hashes,
+            options->verbose
+        )) {
+        return fail(context, "Failed to calculate checksums");
+    }
+
+    if (options->write_checksums) {
+        fprintf(stderr, "Writing SHA256SUMS and MD5SUMS\n");
+
+        if (!appimage_write_checksum_files(destination, &hashes)) {
+            return fail(context, "Failed to write checksum files");
+        }
+    }
+
+    if (pipeline->zsync != NULL) {
+        // like before, the zsync file is written to the working directory
+        gchar* filename = g_path_get_basename(destination);
+        gchar* zsync_name = g_strdup_printf("%s.zsync", filename);
+        gchar* zsync_path = g_build_filename(context->working_directory, zsync_name, NULL);
+        const gchar* zsync_url = options->file_url ? options->file_url : filename;
+
+        fprintf(stderr, "Writing zsync file %s\n", zsync_name);
+
+        const bool success = write_zsync_file(pipeline->zsync, destination, pipeline->runtime_sections, zsync_path, zsync_url, hashes.sha1);
+
+        g_free(zsync_path);
+        g_free(zsync_name);
+        g_free(filename);
+
+        if (!success) {
+            return fail(context, "Failed to generate zsync file");
+        }
+    }
+
+    return true;
+}
+
+/* Turn the squashfs image written by the pipeline into the final AppImage, and publish it at its destination */
+static bool finish_appimage(appimagetool_context_t* context, pipeline_t* pipeline) {
+    const appimagetool_options_t* options = context->options;
+    appimage_output_t* output = pipeline->output;
+
+    // everything up to the publication works on the temporary file
+    const int output_fd = appimage_output_open(output);
+    if (output_fd < 0) {
+        return fail(context, "Not able to open the AppImage for writing, aborting");
+    }
+
+    // embedding the runtime resets the sections, hence they are written again unless the checkpoint after them matches
+    if (pipeline->resume_point < APPIMAGE_CHECKPOINT_RUNTIME) {
+        fprintf (stderr, "Embedding ELF...\n");
+        if (!embed_runtime(pipeline->runtime_fd, pipeline->runtime_size, output_fd, options->verbose)) {
+            return fail(context, "Not able to embed the runtime in the AppImage, aborting");
+        }
+        record_checkpoint(pipeline, APPIMAGE_CHECKPOINT_RUNTIME, output_fd);
+    }
+    close(pipeline->runtime_fd);
+    pipeline->runtime_fd = -1;
+
+    /* If updateinformation was provided, then we check and embed it, and a zsync file is generated as well */
+    if (pipeline->update_information != NULL && pipeline->resume_point < APPIMAGE_CHECKPOINT_SECTIONS) {
+        if (!embed_update_information(context, pipeline, pipeline->update_information)) {
+            return false;
+        }
+    }
+
+    if (pipeline->journal != NULL && pipeline->resume_point < APPIMAGE_CHECKPOINT_SECTIONS) {
+        if (!appimage_output_flush(output)) {
+            return fail(context, "Failed to embed update information");
+        }
+        record_checkpoint(pipeline, APPIMAGE_CHECKPOINT_SECTIONS, output_fd);
+    }
+
+    // when resuming after the digest, the zsync file is generated from the published AppImage instead
+    if (pipeline->resume_point < APPIMAGE_CHECKPOINT_DIGEST) {
+        if (pipeline->update_information != NULL) {
+            struct stat destination_stat;
+
+            if (fstat(output_fd, &destination_stat) != 0 ||
+                (pipeline->zsync = appimage_zsync_new((unsigned long) destination_stat.st_size, zsync_block_size(context), context->budget.jobs)) == NULL) {
+                return fail(context, "Failed to prepare zsync file generation");
+            }
+        }
+
+        if (!embed_digest(context, pipeline)) {
+            return false;
+        }
+
+        if (pipeline->journal != NULL) {
+            if (!appimage_output_flush(output)) {
+                return fail(context, "Failed to embed the MD5 digest");
+            }
+            record_checkpoint(pipeline, APPIMAGE_CHECKPOINT_DIGEST, output_fd);
+        }
+    } else {
+        fprintf(stderr, "Using the MD5 digest embedded by the previous build\n");
+    }
+
+    if (options->sign) {
+        const char* passphrase = context_getenv(context, "APPIMAGETOOL_SIGN_PASSPHRASE");
+        if (!sign_appimage(output, options->sign_key, passphrase, pipeline->runtime_sections, options->verbose)) {
+            return fail(context, "Signing failed, aborting");
+        }
+    }
+
+    /* The remaining patches are written, and the complete AppImage replaces the destination at once */
+    fprintf (stderr, "Marking the AppImage as executable...\n");
+    if (!appimage_output_publish(output)) {
+        return fail(context, "Failed to write the AppImage, aborting");
+    }
+
+    context->destination = g_strdup(appimage_output_destination(output));
+
+    if (pipeline->journal != NULL) {
+        appimage_journal_remove(pipeline->journal);
+        pipeline->checkpoint = APPIMAGE_CHECKPOINT_NONE;
+    }
+
+    if (!write_companion_files(context, pipeline, context->destination)) {
+        return false;
+    }
+
+    // a failure to store the AppImage only costs the next build the time to build it again
+    if (context->cache != NULL && pipeline->cache_key[0] != '\0') {
+        appimage_build_cache_store(context->cache, pipeline->cache_key, context->destination);
+    }
+
+    return true;
+}
+
+/* Publish the AppImage found in the build cache at the destination instead of building it */
+static bool publish_cached_appimage(appimagetool_context_t* context, pipeline_t* pipeline) {
+    gchar* destination = resolve_path(context, pipeline->destination);
+
+    if (!appimage_build_cache_publish(pipeline->cached_fd, destination)) {
+        g_free(destination);
+        return fail(context, "Failed to publish the cached AppImage, aborting");
+    }
+
+    context->destination = destination;
+    return write_companion_files(context, pipeline, destination);
+}
+
+
+static bool build_appimage(appimagetool_context_t* context, pipeline_t* pipeline) {
+    const char* source = context->options->source;
+
+    if (source == NULL) {
+        return fail(context, "SOURCE is missing");
+    }
+
+    gchar* source_path = resolve_path(context, source);
+    const bool is_directory = g_file_test(source_path, G_FILE_TEST_IS_DIR) && realpath(source_path, pipeline->source) != NULL;
+    g_free(source_path);
+
+    if (!is_directory) {
+        return fail(context, "Error: no such directory: %s", source);
+    }
+
+    if (!prepare_appdir(context, pipeline) || !run_pipeline(context, pipeline)) {
+        return false;
+    }
+
+    // the pipeline is done with the scan
+    appdir_scan_free(pipeline->scan);
+    pipeline->scan = NULL;
+
+    const gint64 finalize_start_time = g_get_monotonic_time();
+
+    if (!(pipeline->cached_fd >= 0 ? publish_cached_appimage(context, pipeline) : finish_appimage(context, pipeline))) {
+        return false;
+    }
+
+    report_stage(context, "finalize", (long) (g_get_monotonic_time() - finalize_start_time));
+    return true;
+}
+
+void appimagetool_options_init(appimagetool_options_t* options) {
+    memset(options, 0, sizeof(*options));
+}
+
+appimagetool_context_t* appimagetool_context_new(void) {
+    return g_new0(appimagetool_context_t, 1);
+}
+
+void appimagetool_context_free(appimagetool_context_t* context) {
+    if (context == NULL) {
+        return;
+    }
+
+    g_free(context->error);
+    g_free(context->destination);
+    if (context->passed_validations != NULL)
+        g_hash_table_destroy(context->passed_validations);
+    appdir_scan_free(context->next_scan);
+    g_free(context);
+}
+
+void appimagetool_context_use_scan(appimagetool_context_t* context, appdir_scan_t* scan, const appimage_tree_hashes_t* hashes) {
+    appdir_scan_free(context->next_scan);
+    context->next_scan = scan;
+    context->next_hashes = *hashes;
+}
+
+const char* appimagetool_context_error(const appimagetool_context_t* context) {
+    return context->error;
+}
+
+const char* appimagetool_context_destination(const appimagetool_context_t* context) {
+    return context->destination;
+}
+
+bool appimagetool_build(appimagetool_context_t* context, const appimagetool_options_t* options) {
+    init_library();
+
+    g_free(context->error);
+    g_free(context->destination);
+    context->error = NULL;
+    context->destination = NULL;
+
+    context->options = options;
+    context->working_directory = options->working_directory != NULL ? g_strdup(options->working_directory) : g_get_current_dir();
+    context->environment = options->environment != NULL ? g_strdupv((gchar**) options->environment) : g_get_environ();
+    context->processes = appimage_process_group_new();
+    appimage_budget_init(&context->budget, options->jobs, options->memory);
+
+    // an empty exclude file is the same as none
+    if (options->exclude_file != NULL && strlen(options->exclude_file) > 0)
+        context->exclude_file = resolve_path(context, options->exclude_file);
+    context->runtime_file = resolve_path(context, options->runtime_file);
+    context->appimageignore = g_build_filename(context->working_directory, APPIMAGEIGNORE, NULL);
+    if (access(context->appimageignore, F_OK) < 0) {
+        g_free(context->appimageignore);
+        context->appimageignore = NULL;
+    }
+
+    // the build works just the same without the cache
+    if (options->cache_directory != NULL) {
+        gchar* cache_directory = resolve_path(context, options->cache_directory);
+        context->cache = appimage_build_cache_open(cache_directory, options->cache_size, options->verbose);
+        if (context->cache == NULL)
+            fprintf(stderr, "Warning: not using the build cache in %s\n", cache_directory);
+        else {
+            context->block_cache_directory = g_build_filename(cache_directory, "blocks", NULL);
+            context->file_hash_directory = g_build_filename(cache_directory, "file-hashes", NULL);
+        }
+        g_free(cache_directory);
+    }
+
+    pipeline_t pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.context = context;
+    pipeline.destination = g_strdup(options->destination);
+    pipeline.runtime_fd = -1;
+    pipeline.cached_fd = -1;
+
+    const bool success = select_squashfs_backend(context) && check_tools(context) &&
+        build_appimage(context, &pipeline);
+
+    // the partial AppImage stays next to the destination, for the next build to continue with
+    if (!success && pipeline.checkpoint != APPIMAGE_CHECKPOINT_NONE && pipeline.output != NULL) {
+        appimage_output_keep(pipeline.output);
+        fprintf(
+            stderr, "The build has reached the %s checkpoint, run it again with --resume to continue from there\n",
+            appimage_checkpoint_name(pipeline.checkpoint)
+        );
+    }
+
+    pipeline_clear(&pipeline);
+
+    appimage_process_group_free(context->processes);
+    appimage_build_cache_free(context->cache);
+    g_free(context->block_cache_directory);
+    g_free(context->file_hash_directory);
+    g_strfreev(context->environment);
+    g_free(context->working_directory);
+    g_free(context->exclude_file);
+    g_free(context->runtime_file);
+    g_free(context->appimageignore);
+    // only meant for this build
+    appdir_scan_free(context->next_scan);
+    context->processes = NULL;
+    context->environment = NULL;
+    context->working_directory = NULL;
+    context->exclude_file = NULL;
+    context->runtime_file = NULL;
+    context->appimageignore = NULL;
+    context->cache = NULL;
+    context->block_cache_directory = NULL;
+    context->file_hash_directory = NULL;
+    context->next_scan = NULL;
+    context->options = NULL;
+
+    return success;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "appimagetool.h"
+#include "appimagetool_cache.h"
+#include "appimagetool_scan.h"
+
+/**
+ * Let the next build with this context use the given scan of its AppDir and the hashes calculated from it, instead of
+ * scanning and hashing the AppDir itself, e.g., because the caller has just done so to find out whether it has changed.
+ * The context takes ownership of the scan, which is freed after the next build even if that fails before using it.
+ * @param scan scan of the next build's source, made with APPDIR_SCAN_METADATA and APPDIR_SCAN_PROBE_ELF
+ * @param hashes result of appimage_tree_hash for the scan, using the context's cache
+ */
+void appimagetool_context_use_scan(appimagetool_context_t* context, appdir_scan_t* scan, const appimage_tree_hashes_t* hashes);
@@ -0,0 +1,886 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <gcrypt.h>
+
+#include "appimagetool_cache.h"
+
+extern "C" {
+#include "appimagetool_sign.h"
+}
+
+namespace {
+    constexpr size_t sha256Size = 32;
+    using Digest = std::array<uint8_t, sha256Size>;
+
+    // bumped whenever the meaning of keys or tree hashes changes, so that old entries are not used anymore
+    constexpr char cacheFormat[] = "appimagetool-build-cache-1";
+
+    constexpr char entrySuffix[] = ".AppImage";
+    constexpr char temporaryPrefix[] = ".tmp-";
+
+    // temporary files of builds which have crashed are removed after this time
+    constexpr time_t staleTemporaryAge = 24 * 60 * 60;
+
+    // file systems take timestamps from a clock which may lag behind the one we read by up to a tick
+    constexpr int64_t changeTimeMarginNs = 10 * 1000 * 1000;
+
+    constexpr size_t readBufferSize = 256 * 1024;
+
+    std::string toHex(const uint8_t* data, size_t size) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(size * 2);
+        for (size_t i = 0; i < size; ++i) {
+            hex += digits[data[i] >> 4];
+            hex += digits[data[i] & 0xf];
+        }
+        return hex;
+    }
+
+    int64_t toNs(const struct timespec& time) {
+        return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+    }
+
+    /**
+     * Incremental SHA-256, also used to serialize the inputs of tree and cache keys unambiguously.
+     */
+    class Hasher {
+    private:
+        gcry_md_hd_t _handle = nullptr;
+
+    public:
+        Hasher() {
+            init_gcrypt();
+            gcry_md_open(&_handle, GCRY_MD_SHA256, 0);
+        }
+
+        ~Hasher() {
+            gcry_md_close(_handle);
+        }
+
+        Hasher(const Hasher&) = delete;
+        Hasher& operator=(const Hasher&) = delete;
+
+        void write(const void* data, size_t size) {
+            gcry_md_write(_handle, data, size);
+        }
+
+        void writeNumber(uint64_t value) {
+            uint8_t bytes[8];
+            for (int i = 0; i < 8; ++i) {
+                bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+            }
+            write(bytes, sizeof(bytes));
+        }
+
+        // length prefixed, so that concatenated fields cannot be confused
+        void writeField(const void* data, size_t size) {
+            writeNumber(size);
+            write(data, size);
+        }
+
+        void writeField(const std::string& value) {
+            writeField(value.data(), value.size());
+        }
+
+        Digest finish() {
+            Digest digest;
+            memcpy(digest.data(), gcry_md_read(_handle, GCRY_MD_SHA256), sha256Size);
+            return digest;
+        }
+    };
+
+    bool hashFd(int fd, Hasher& hasher, bool positional) {
+        std::vector<char> buffer(readBufferSize);
+        off_t offset = 0;
+
+        while (true) {
+            const ssize_t result = positional ? pread(fd, buffer.data(), buffer.size(), offset)
+                                              : read(fd, buffer.data(), buffer.size());
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result < 0) {
+                return false;
+            }
+            if (result == 0) {
+                return true;
+            }
+            hasher.write(buffer.data(), static_cast<size_t>(result));
+            offset += result;
+        }
+    }
+
+    /* What tells whether a file has changed since its contents have been hashed */
+    struct FileState {
+        uint64_t device;
+        uint64_t inode;
+        uint64_t size;
+        int64_t modificationTimeNs;
+        int64_t changeTimeNs;
+
+        static FileState of(const appdir_entry_t& entry) {
+            return {entry.device, entry.inode, entry.size, entry.mtime_ns, entry.ctime_ns};
+        }
+
+        static FileState of(const struct stat& fileStat) {
+            return {
+                static_cast<uint64_t>(fileStat.st_dev), static_cast<uint64_t>(fileStat.st_ino),
+                static_cast<uint64_t>(fileStat.st_size), toNs(fileStat.st_mtim), toNs(fileStat.st_ctim),
+            };
+        }
+    };
+
+    /**
+     * Content hashes of the files of one AppDir, kept in the cache directory rather than in the AppDir, which builds
+     * never modify. A file's hash is reused while its device, inode, size, modification and change time are the ones
+     * it has been hashed with. The index is named after the host and the AppDir's path, since device and inode numbers
+     * only identify files on one machine.
+     */
+    class FileHashIndex {
+    private:
+        struct Entry {
+            uint64_t size;
+            int64_t modificationTimeNs;
+            int64_t changeTimeNs;
+            Digest sha256;
+        };
+
+        using FileId = std::pair<uint64_t, uint64_t>;
+
+        static constexpr char header[] = "appimagetool-file-hashes 1";
+
+        std::string _path;
+        int64_t _startNs;
+        // loaded before the files are hashed, read-only afterwards
+        std::map<FileId, Entry> _previous;
+        std::mutex _mutex;
+        std::map<FileId, Entry> _current;
+
+        static FileId idOf(const FileState& state) {
+            return {state.device, state.inode};
+        }
+
+        static bool fromHex(const char* hex, Digest& digest) {
+            for (size_t i = 0; i < sha256Size; ++i) {
+                unsigned int byte;
+                if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+                    return false;
+                }
+                digest[i] = static_cast<uint8_t>(byte);
+            }
+            return true;
+        }
+
+        /* Lines which do not parse end the index, e.g., after a crash while it was written */
+        void load() {
+            FILE* file = fopen(_path.c_str(), "r");
+            if (file == nullptr) {
+                return;
+            }
+
+            char line[256];
+            if (fgets(line, sizeof(line), file) != nullptr && strncmp(line, header, strlen(header)) == 0 && line[strlen(header)] == '\n') {
+                while (fgets(line, sizeof(line), file) != nullptr) {
+                    unsigned long long device, inode, size;
+                    long long modificationTimeNs, changeTimeNs;
+                    char hex[2 * sha256Size + 1];
+
+                    Entry entry{};
+                    if (sscanf(line, "%llu %llu %llu %lld %lld %64s", &device, &inode, &size, &modificationTimeNs, &changeTimeNs, hex) != 6 ||
+                        strlen(hex) != 2 * sha256Size || !fromHex(hex, entry.sha256)) {
+                        break;
+                    }
+
+                    entry.size = size;
+                    entry.modificationTimeNs = modificationTimeNs;
+                    entry.changeTimeNs = changeTimeNs;
+                    _previous[{device, inode}] = entry;
+                }
+            }
+
+            fclose(file);
+        }
+
+    public:
+        FileHashIndex(const char* directory, const char* root) {
+            struct timespec now{};
+            clock_gettime(CLOCK_REALTIME, &now);
+            _startNs = toNs(now);
+
+            char host[HOST_NAME_MAX + 1] = {};
+            gethostname(host, sizeof(host) - 1);
+            char* absoluteRoot = realpath(root, nullptr);
+
+            Hasher hasher;
+            hasher.writeField(std::string(host));
+            hasher.writeField(std::string(absoluteRoot != nullptr ? absoluteRoot : root));
+            free(absoluteRoot);
+
+            const Digest name = hasher.finish();
+            _path = std::string(directory) + "/" + toHex(name.data(), name.size()).substr(0, 32);
+
+            load();
+        }
+
+        /* Called from the threads hashing the files, entries which are used are kept in the index */
+        bool lookup(const FileState& state, Digest& digest) {
+            const auto entry = _previous.find(idOf(state));
+            if (entry == _previous.end() || entry->second.size != state.size ||
+                entry->second.modificationTimeNs != state.modificationTimeNs || entry->second.changeTimeNs != state.changeTimeNs) {
+                return false;
+            }
+
+            digest = entry->second.sha256;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            _current.insert(*entry);
+            return true;
+        }
+
+        /* Called from the threads hashing the files, with the file's state from before and after it has been read */
+        void add(const FileState& before, const FileState& after, const Digest& digest) {
+            // a file which has been written to while it was read, or might have been written to unnoticed right before,
+            // is hashed again next time
+            if (after.modificationTimeNs != before.modificationTimeNs || after.changeTimeNs != before.changeTimeNs ||
+                after.size != before.size || after.changeTimeNs > _startNs - changeTimeMarginNs) {
+                return;
+            }
+
+            const Entry entry{after.size, after.modificationTimeNs, after.changeTimeNs, digest};
+            std::lock_guard<std::mutex> lock(_mutex);
+            _current[idOf(after)] = entry;
+        }
+
+        /* Replace the index with the entries of the files seen by this run, failures only cost hashing them again */
+        void save() {
+            const auto slash = _path.rfind('/');
+            mkdir(_path.substr(0, slash).c_str(), 0755);
+
+            std::string contents = std::string(header) + "\n";
+            for (const auto& [id, entry] : _current) {
+                contents += std::to_string(id.first) + " " + std::to_string(id.second) + " " + std::to_string(entry.size) + " " +
+                    std::to_string(entry.modificationTimeNs) + " " + std::to_string(entry.changeTimeNs) + " " +
+                    toHex(entry.sha256.data(), entry.sha256.size()) + "\n";
+            }
+
+            std::vector<char> temporaryPath(_path.begin(), _path.end());
+            const char suffix[] = ".XXXXXX";
+            temporaryPath.insert(temporaryPath.end(), suffix, suffix + sizeof(suffix));
+
+            const int fd = mkstemp(temporaryPath.data());
+            if (fd < 0) {
+                return;
+            }
+
+            bool success = true;
+            for (size_t written = 0; success && written < contents.size();) {
+                const ssize_t result = write(fd, contents.data() + written, contents.size() - written);
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+                success = result > 0;
+                written += success ? static_cast<size_t>(result) : 0;
+            }
+
+            // a damaged index would report wrong hashes, so it must be complete before it replaces the previous one
+            success = success && fchmod(fd, 0644) == 0 && fsync(fd) == 0;
+            success = close(fd) == 0 && success;
+
+            if (!success || rename(temporaryPath.data(), _path.c_str()) != 0) {
+                unlink(temporaryPath.data());
+            }
+        }
+    };
+
+    bool hashFileContents(const char* path, const FileState& state, FileHashIndex* index, Digest& digest) {
+        if (index != nullptr && index->lookup(state, digest)) {
+            return true;
+        }
+
+        const int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+            return false;
+        }
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        Hasher hasher;
+        struct stat after{};
+        const bool success = hashFd(fd, hasher, false) && fstat(fd, &after) == 0;
+        close(fd);
+
+        if (!success) {
+            fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+            return false;
+        }
+
+        digest = hasher.finish();
+
+        if (index != nullptr) {
+            index->add(state, FileState::of(after), digest);
+        }
+
+        return true;
+    }
+
+    /* Extended attributes, sorted by name, since mksquashfs stores them in the image */
+    bool readAttributes(const char* path, std::string& serialized) {
+        ssize_t size = llistxattr(path, nullptr, 0);
+        if (size < 0) {
+            // not supported by the file system, hence there are none
+            return errno == ENOTSUP;
+        }
+        if (size == 0) {
+            return true;
+        }
+
+        std::vector<char> names(static_cast<size_t>(size));
+        size = llistxattr(path, names.data(), names.size());
+        if (size < 0) {
+            return false;
+        }
+
+        std::vector<std::string> sorted;
+        for (size_t position = 0; position < static_cast<size_t>(size); position += strlen(names.data() + position) + 1) {
+            sorted.emplace_back(names.data() + position);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        for (const auto& name : sorted) {
+            const ssize_t valueSize = lgetxattr(path, name.c_str(), nullptr, 0);
+            if (valueSize < 0) {
+                return false;
+            }
+            std::string value(static_cast<size_t>(valueSize), '\0');
+            if (lgetxattr(path, name.c_str(), value.data(), value.size()) != valueSize) {
+                return false;
+            }
+
+            serialized += std::to_string(name.size()) + ":" + name + std::to_string(value.size()) + ":" + value;
+        }
+
+        return true;
+    }
+
+    /**
+     * Hashes a directory tree bottom up: a file's hash covers its metadata and contents, a directory's hash covers its
+     * metadata and the names and hashes of its entries, in the order of their names.
+     * The tree is the one recorded by appdir_scan, which is not walked again; the files are read by several threads,
+     * then the directories are hashed.
+     */
+    class TreeHasher {
+    private:
+        // the digests are calculated with and without the modification times at once, indexed by these
+        static constexpr size_t withoutTimes = 0;
+        static constexpr size_t withTimes = 1;
+
+        struct Node {
+            const appdir_entry_t* entry;
+            std::vector<size_t> children;
+            Digest digests[2];
+        };
+
+        std::string _root;
+        FileHashIndex* _index;
+        std::vector<Node> _nodes;
+        std::vector<size_t> _files;
+
+        std::string pathOf(const Node& node) const {
+            return node.entry->path[0] == '\0' ? _root : _root + "/" + node.entry->path;
+        }
+
+        /* Node i + 1 is entry i, node 0 is the root; the entries are sorted by path, so every directory comes before
+         * its entries, which are in the order of their names */
+        void build(const appdir_scan_t* scan) {
+            _nodes.push_back({appdir_scan_root(scan), {}, {}});
+
+            for (size_t i = 0; i < appdir_scan_entries_count(scan); ++i) {
+                const appdir_entry_t* entry = appdir_scan_entry(scan, i);
+                const size_t parent = entry->parent == APPDIR_SCAN_ROOT ? 0 : entry->parent + 1;
+
+                _nodes.push_back({entry, {}, {}});
+                _nodes[parent].children.push_back(i + 1);
+
+                if (S_ISREG(entry->mode)) {
+                    _files.push_back(i + 1);
+                }
+            }
+        }
+
+        /* Both digests are made of the same fields, apart from the time, so every entry is only read once */
+        bool hashNode(Node& node, const Digest* contents) {
+            const std::string path = pathOf(node);
+            const uint32_t mode = node.entry->mode;
+
+            Hasher hashers[2];
+            for (auto& hasher : hashers) {
+                hasher.writeNumber(mode);
+            }
+            hashers[withTimes].writeNumber(static_cast<uint64_t>(node.entry->mtime_ns));
+
+            std::string attributes;
+            if (!readAttributes(path.c_str(), attributes)) {
+                fprintf(stderr, "Failed to read the extended attributes of %s: %s\n", path.c_str(), strerror(errno));
+                return false;
+            }
+            for (auto& hasher : hashers) {
+                hasher.writeField(attributes);
+            }
+
+            if (S_ISREG(mode)) {
+                for (auto& hasher : hashers) {
+                    hasher.writeField(contents->data(), contents->size());
+                }
+            } else if (S_ISLNK(mode)) {
+                char target[PATH_MAX];
+                const ssize_t length = readlink(path.c_str(), target, sizeof(target));
+                if (length < 0) {
+                    fprintf(stderr, "Failed to read symlink %s: %s\n", path.c_str(), strerror(errno));
+                    return false;
+                }
+                for (auto& hasher : hashers) {
+                    hasher.writeField(target, static_cast<size_t>(length));
+                }
+            } else if (S_ISDIR(mode)) {
+                for (size_t times = 0; times < 2; ++times) {
+                    for (const size_t child : node.children) {
+                        hashers[times].writeField(std::string(_nodes[child].entry->name));
+                        hashers[times].write(_nodes[child].digests[times].data(), sha256Size);
+                    }
+                }
+            } else {
+                for (auto& hasher : hashers) {
+                    hasher.writeNumber(node.entry->rdev);
+                }
+            }
+
+            for (size_t times = 0; times < 2; ++times) {
+                node.digests[times] = hashers[times].finish();
+            }
+            return true;
+        }
+
+    public:
+        TreeHasher(const char* root, FileHashIndex* index)
+            : _root(root), _index(index) {}
+
+        bool hash(const appdir_scan_t* scan, unsigned int threads, Digest& digest, Digest& digestWithTimes) {
+            build(scan);
+
+            std::vector<Digest> contents(_files.size());
+            std::atomic<size_t> next{0};
+            std::atomic<bool> failed{false};
+            std::vector<std::thread> workers;
+
+            threads = std::max(1u, std::min<unsigned int>(threads, static_cast<unsigned int>(_files.size())));
+            for (unsigned int i = 0; i < threads; ++i) {
+                workers.emplace_back([&]() {
+                    for (size_t file = next++; file < _files.size() && !failed; file = next++) {
+                        const Node& node = _nodes[_files[file]];
+                        if (!hashFileContents(pathOf(node).c_str(), FileState::of(*node.entry), _index, contents[file])) {
+                            failed = true;
+                        }
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            if (failed) {
+                return false;
+            }
+
+            // children come after their parents, so going backwards hashes every directory after its entries
+            size_t file = _files.size();
+            for (size_t index = _nodes.size(); index-- > 0;) {
+                const Digest* fileContents = nullptr;
+                if (S_ISREG(_nodes[index].entry->mode)) {
+                    fileContents = &contents[--file];
+                }
+                if (!hashNode(_nodes[index], fileContents)) {
+                    return false;
+                }
+            }
+
+            digest = _nodes[0].digests[withoutTimes];
+            digestWithTimes = _nodes[0].digests[withTimes];
+            return true;
+        }
+    };
+
+    /* Create a file next to the given path under a temporary name, only renamed to the path once complete */
+    std::string temporaryPathNextTo(const std::string& path, const std::string& prefix) {
+        const auto slash = path.rfind('/');
+        const std::string directory = slash == std::string::npos ? "." : path.substr(0, slash);
+        const std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        return directory + "/" + prefix + name + ".XXXXXX";
+    }
+
+    /**
+     * Copy the file open as fd to a new file named after the given mkstemp pattern, sharing the data if possible.
+     * A reflink shares the blocks but not the inode, so either file can be replaced without affecting the other, an
+     * actual copy is the fallback. Never a hardlink: the cache entry and the published AppImage must stay separate
+     * files, since users may modify the AppImage in place (e.g., appimageupdate or a re-signing step) and eviction
+     * must not affect it.
+     * @param path mkstemp pattern, receives the path of the copy
+     * @param method receives how the copy has been made
+     */
+    bool cloneFile(int fd, std::string& path, const char*& method) {
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+
+        int targetFd = mkstemp(name.data());
+        if (targetFd < 0) {
+            fprintf(stderr, "Failed to create %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        path = name.data();
+
+        const auto finish = [&](const char* how) {
+            const bool success = fchmod(targetFd, 0755) == 0 && fsync(targetFd) == 0;
+            close(targetFd);
+            if (!success) {
+                fprintf(stderr, "Failed to write %s: %s\n", path.c_str(), strerror(errno));
+                unlink(path.c_str());
+                return false;
+            }
+            method = how;
+            return true;
+        };
+
+#ifdef FICLONE
+        if (ioctl(targetFd, FICLONE, fd) == 0) {
+            return finish("reflinked");
+        }
+#endif
+
+        struct stat sourceStat{};
+        off_t offset = 0;
+        bool success = fstat(fd, &sourceStat) == 0;
+
+        bool copyFileRange = true;
+        std::vector<char> buffer;
+
+        while (success && offset < sourceStat.st_size) {
+            ssize_t copied;
+
+            if (copyFileRange) {
+                copied = copy_file_range(fd, &offset, targetFd, nullptr, static_cast<size_t>(sourceStat.st_size - offset), 0);
+
+                // not supported between these file systems (or at all), copied through user space then
+                if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    copyFileRange = false;
+                    buffer.resize(readBufferSize);
+                    continue;
+                }
+            } else {
+                copied = pread(fd, buffer.data(), buffer.size(), offset);
+                if (copied > 0 && write(targetFd, buffer.data(), static_cast<size_t>(copied)) != copied) {
+                    copied = -1;
+                }
+                if (copied > 0) {
+                    offset += copied;
+                }
+            }
+
+            if (copied < 0 && errno == EINTR) {
+                continue;
+            }
+            success = copied > 0;
+        }
+
+        if (!success) {
+            fprintf(stderr, "Failed to copy to %s: %s\n", path.c_str(), strerror(errno));
+            close(targetFd);
+            unlink(path.c_str());
+            return false;
+        }
+
+        return finish("copied");
+    }
+}
+
+struct appimage_cache_key {
+    Hasher hasher;
+};
+
+struct appimage_build_cache {
+    std::string directory;
+    uint64_t maxSize;
+    bool verbose;
+
+    std::string entryPath(const char* key) const {
+        return directory + "/" + key + entrySuffix;
+    }
+
+    /* Remove the least recently used entries until the cache fits into its size */
+    void evict() const {
+        DIR* dir = opendir(directory.c_str());
+        if (dir == nullptr) {
+            return;
+        }
+
+        struct Entry {
+            std::string path;
+            uint64_t size;
+            int64_t lastUsedNs;
+        };
+
+        std::vector<Entry> entries;
+        uint64_t totalSize = 0;
+        const time_t now = time(nullptr);
+
+        while (const struct dirent* dirent = readdir(dir)) {
+            const std::string name = dirent->d_name;
+            const std::string path = directory + "/" + name;
+            struct stat entryStat{};
+
+            if (lstat(path.c_str(), &entryStat) != 0 || !S_ISREG(entryStat.st_mode)) {
+                continue;
+            }
+
+            if (name.rfind(temporaryPrefix, 0) == 0) {
+                if (now - entryStat.st_mtime > staleTemporaryAge) {
+                    unlink(path.c_str());
+                }
+                continue;
+            }
+
+            if (name.size() <= strlen(entrySuffix) || name.compare(name.size() - strlen(entrySuffix), std::string::npos, entrySuffix) != 0) {
+                continue;
+            }
+
+            // lookups set the access time explicitly, which works with noatime and relatime mounts as well
+            entries.push_back({path, static_cast<uint64_t>(entryStat.st_size), toNs(entryStat.st_atim)});
+            totalSize += static_cast<uint64_t>(entryStat.st_size);
+        }
+        closedir(dir);
+
+        if (maxSize == 0 || totalSize <= maxSize) {
+            return;
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.lastUsedNs < b.lastUsedNs;
+        });
+
+        for (const auto& entry : entries) {
+            if (totalSize <= maxSize) {
+                break;
+            }
+
+            // another process may have evicted it already
+            if (unlink(entry.path.c_str()) == 0 || errno == ENOENT) {
+                totalSize -= entry.size;
+
+                if (verbose) {
+                    fprintf(stderr, "Evicted %s from the build cache\n", entry.path.c_str());
+                }
+            }
+        }
+    }
+};
+
+bool appimage_tree_hash(
+    const char* root, const appdir_scan_t* scan, unsigned int threads, const char* index_directory,
+    appimage_tree_hashes_t* hashes, bool verbose
+) {
+    const auto start = std::chrono::steady_clock::now();
+
+    std::unique_ptr<FileHashIndex> index;
+    if (index_directory != nullptr) {
+        index = std::make_unique<FileHashIndex>(index_directory, root);
+    }
+
+    TreeHasher treeHasher(root, index.get());
+    Digest digest;
+    Digest digestWithTimes;
+    if (!treeHasher.hash(scan, threads, digest, digestWithTimes)) {
+        return false;
+    }
+
+    if (index != nullptr) {
+        index->save();
+    }
+
+    memcpy(hashes->without_times, toHex(digest.data(), digest.size()).c_str(), APPIMAGE_CACHE_KEY_LENGTH + 1);
+    memcpy(hashes->with_times, toHex(digestWithTimes.data(), digestWithTimes.size()).c_str(), APPIMAGE_CACHE_KEY_LENGTH + 1);
+
+    if (verbose) {
+        const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "Hashed %s in %lld ms: %s\n", root, static_cast<long long>(milliseconds), hashes->with_times);
+    }
+
+    return true;
+}
+
+appimage_cache_key_t* appimage_cache_key_new(void) {
+    auto* key = new appimage_cache_key;
+    key->hasher.writeField(std::string(cacheFormat));
+    return key;
+}
+
+void appimage_cache_key_add_string(appimage_cache_key_t* key, const char* name, const char* value) {
+    key->hasher.writeField(std::string(name));
+    key->hasher.writeNumber(value != nullptr ? 1 : 0);
+    if (value != nullptr) {
+        key->hasher.writeField(std::string(value));
+    }
+}
+
+bool appimage_cache_key_add_file(appimage_cache_key_t* key, const char* name, const char* path) {
+    const int fd = path != nullptr ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+
+    if (fd < 0) {
+        if (path != nullptr && errno != ENOENT) {
+            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        key->hasher.writeField(std::string(name));
+        key->hasher.writeNumber(0);
+        return true;
+    }
+
+    const bool success = appimage_cache_key_add_fd(key, name, fd);
+    close(fd);
+    return success;
+}
+
+bool appimage_cache_key_add_fd(appimage_cache_key_t* key, const char* name, int fd) {
+    Hasher contents;
+    if (!hashFd(fd, contents, true)) {
+        return false;
+    }
+
+    const Digest digest = contents.finish();
+    key->hasher.writeField(std::string(name));
+    key->hasher.writeNumber(1);
+    key->hasher.writeField(digest.data(), digest.size());
+    return true;
+}
+
+void appimage_cache_key_finish(appimage_cache_key_t* key, char hex[APPIMAGE_CACHE_KEY_LENGTH + 1]) {
+    const Digest digest = key->hasher.finish();
+    const std::string result = toHex(digest.data(), digest.size());
+    memcpy(hex, result.c_str(), APPIMAGE_CACHE_KEY_LENGTH + 1);
+    delete key;
+}
+
+appimage_build_cache_t* appimage_build_cache_open(const char* directory, uint64_t max_size, bool verbose) {
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create build cache %s: %s\n", directory, strerror(errno));
+        return nullptr;
+    }
+
+    struct stat directoryStat{};
+    if (stat(directory, &directoryStat) != 0 || !S_ISDIR(directoryStat.st_mode)) {
+        fprintf(stderr, "Build cache %s is not a directory\n", directory);
+        return nullptr;
+    }
+
+    return new appimage_build_cache{directory, max_size, verbose};
+}
+
+void appimage_build_cache_free(appimage_build_cache_t* cache) {
+    delete cache;
+}
+
+int appimage_build_cache_lookup(appimage_build_cache_t* cache, const char* key) {
+    const std::string path = cache->entryPath(key);
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to open %s: %s\n", path.c_str(), strerror(errno));
+        }
+        return -1;
+    }
+
+    const struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+    futimens(fd, times);
+
+    return fd;
+}
+
+bool appimage_build_cache_publish(int fd, const char* destination) {
+    std::string temporaryPath = temporaryPathNextTo(destination, ".");
+    const char* method;
+
+    // works from the descriptor, even if the entry has been evicted since
+    if (!cloneFile(fd, temporaryPath, method)) {
+        return false;
+    }
+
+    if (rename(temporaryPath.c_str(), destination) != 0) {
+        fprintf(stderr, "Failed to rename %s to %s: %s\n", temporaryPath.c_str(), destination, strerror(errno));
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+
+    fprintf(stderr, "Published the cached AppImage at %s (%s)\n", destination, method);
+    return true;
+}
+
+bool appimage_build_cache_store(appimage_build_cache_t* cache, const char* key, const char* path) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const std::string entryPath = cache->entryPath(key);
+    std::string temporaryPath = temporaryPathNextTo(entryPath, temporaryPrefix);
+    const char* method;
+
+    const bool cloned = cloneFile(fd, temporaryPath, method);
+    close(fd);
+
+    if (!cloned) {
+        return false;
+    }
+
+    // rename is atomic on local file systems and NFS alike, concurrent builds of the same key store equivalent files
+    if (rename(temporaryPath.c_str(), entryPath.c_str()) != 0) {
+        fprintf(stderr, "Failed to rename %s to %s: %s\n", temporaryPath.c_str(), entryPath.c_str(), strerror(errno));
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+
+    // a reflinked entry keeps the access time of its source, but has just been used
+    const struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+    utimensat(AT_FDCWD, entryPath.c_str(), times, 0);
+
+    if (cache->verbose) {
+        fprintf(stderr, "Stored %s in the build cache (%s)\n", path, method);
+    }
+
+    cache->evict();
+    return true;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "appimagetool_scan.h"
+
+/**
+ * Content-addressed cache of finished AppImages, for CI setups which repackage identical AppDirs again and again.
+ *
+ * A build's key covers everything its result depends on: a Merkle hash of the AppDir, the runtime, the squashfs
+ * options, the update information, the version and the signing key. On a hit, the cached AppImage is published at the
+ * destination by reflinking or copying it, instead of building the squashfs image again.
+ *
+ * The cache is a plain directory, which may be shared by several processes and machines (e.g., on NFS). Entries are
+ * added by renaming complete files into place, and evicted by least recent use once the cache exceeds its size.
+ */
+
+// length of keys and hashes in hex, without the terminating null byte
+#define APPIMAGE_CACHE_KEY_LENGTH 64
+
+typedef struct appimage_build_cache appimage_build_cache_t;
+
+typedef struct appimage_cache_key appimage_cache_key_t;
+
+typedef struct {
+    // for AppImages which keep the files' modification times
+    char with_times[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    // for AppImages whose files all get the same time, and for noticing changes other than touched files
+    char without_times[APPIMAGE_CACHE_KEY_LENGTH + 1];
+} appimage_tree_hashes_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Calculate a Merkle hash of a directory tree: the names, types, modes and contents of all entries, symlink targets,
+ * and extended attributes. Symlinks are not followed. The tree is only read, never modified.
+ * The hash is calculated with and without the modification times in the same pass.
+ * The entries are taken from a scan of the tree, the files are read, but the tree is not walked again.
+ * The content hashes of regular files are kept in an index in index_directory, one per host and tree, and reused as
+ * long as the file's device, inode, size, modification and change time show it has not been touched since.
+ * @param scan result of appdir_scan for root with APPDIR_SCAN_METADATA
+ * @param threads number of threads reading files
+ * @param index_directory directory of the indexes, created if necessary; NULL reads all files
+ * @param hashes receives both hashes in hex
+ * @return true on success, false otherwise
+ */
+bool appimage_tree_hash(
+    const char* root, const appdir_scan_t* scan, unsigned int threads, const char* index_directory,
+    appimage_tree_hashes_t* hashes, bool verbose
+);
+
+/**
+ * Start a new key. Every input is added with a name, so that values cannot be mistaken for each other.
+ */
+appimage_cache_key_t* appimage_cache_key_new(void);
+
+/**
+ * Add a string to the key, NULL is distinct from the empty string.
+ */
+void appimage_cache_key_add_string(appimage_cache_key_t* key, const char* name, const char* value);
+
+/**
+ * Add the contents of a file to the key, a file that does not exist is distinct from an empty one.
+ * @param path may be NULL, which counts as a file that does not exist
+ * @return true on success, false if the file exists but cannot be read
+ */
+bool appimage_cache_key_add_file(appimage_cache_key_t* key, const char* name, const char* path);
+
+/**
+ * Add the contents of an open file to the key, read from the start without changing the file offset.
+ * @return true on success, false otherwise
+ */
+bool appimage_cache_key_add_fd(appimage_cache_key_t* key, const char* name, int fd);
+
+/**
+ * Finish and free the key.
+ * @param hex receives the key in hex
+ */
+void appimage_cache_key_finish(appimage_cache_key_t* key, char hex[APPIMAGE_CACHE_KEY_LENGTH + 1]);
+
+/**
+ * Open the cache in the given directory, which is created if necessary.
+ * @param max_size size in bytes the entries may take up, 0 for no limit
+ * @return cache, or NULL on errors
+ */
+appimage_build_cache_t* appimage_build_cache_open(const char* directory, uint64_t max_size, bool verbose);
+
+void appimage_build_cache_free(appimage_build_cache_t* cache);
+
+/**
+ * Look up an entry and mark it as used. The returned descriptor keeps the entry's data available even if it is
+ * evicted by someone else in the meantime.
+ * @return read-only file descriptor of the cached AppImage, or -1 if there is no entry for the key
+ */
+int appimage_build_cache_lookup(appimage_build_cache_t* cache, const char* key);
+
+/**
+ * Publish a cached AppImage at the destination: reflinked if the file system supports it, copied otherwise, but
+ * never hardlinked, so that the AppImage and the cache entry stay independent. The destination is replaced at once.
+ * @param fd descriptor returned by appimage_build_cache_lookup
+ * @return true on success, false otherwise
+ */
+bool appimage_build_cache_publish(int fd, const char* destination);
+
+/**
+ * Add a finished AppImage to the cache, then evict the least recently used entries which exceed the cache's size.
+ * @return true on success, false otherwise; the build itself is not affected either way
+ */
+bool appimage_build_cache_store(appimage_build_cache_t* cache, const char* key, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
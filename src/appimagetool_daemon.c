@@ -0,0 +1,1075 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "appimagetool_daemon.h"
+
+extern char** environ;
+
+/* Every message starts with a header, followed by length bytes of payload
+ * A job request carries the client's standard input, output and error along with its header */
+#define MESSAGE_MAGIC 0x4a494141
+#define MAX_REQUEST_SIZE (16 * 1024 * 1024)
+#define CLIENT_FDS_COUNT 3
+
+// a client which does not send its request in time is disconnected, so that it does not hold on to the connection
+#define REQUEST_TIMEOUT_SECONDS 5
+
+enum {
+    // client to daemon, payload: working directory, number of arguments, arguments, environment, NUL separated
+    MESSAGE_JOB = 1,
+    // client to daemon, no payload
+    MESSAGE_METRICS = 2,
+    // daemon to client, payload: exit code of the job as int32_t
+    MESSAGE_EXIT = 3,
+    // daemon to client, payload: metrics text
+    MESSAGE_TEXT = 4,
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t length;
+} message_header_t;
+
+typedef struct {
+    int client_fd;
+    // standard input, output and error of the client, closed in the daemon once the worker has been started
+    int fds[CLIENT_FDS_COUNT];
+    gchar* cwd;
+    gchar** argv;
+    gchar** envp;
+    gint64 queued_time;
+    gint64 start_time;
+    pid_t pid;
+    // the worker reports the durations of the stages through this pipe, which is closed when the worker exits
+    int report_fd;
+    GString* report;
+} job_t;
+
+/* A client whose request has not been received completely yet, read whenever its socket becomes readable */
+typedef struct {
+    int fd;
+    // the header followed by the payload, as far as they have been received
+    GByteArray* request;
+    // file descriptors passed along with the header
+    int fds[CLIENT_FDS_COUNT];
+    size_t fds_count;
+    gint64 accepted_time;
+} connection_t;
+
+typedef struct {
+    double sum;
+    guint64 count;
+} summary_t;
+
+typedef struct {
+    int listen_fd;
+    int signal_fd;
+    unsigned int workers;
+    appimage_daemon_job_function_t job_function;
+    GQueue* queue;
+    GPtrArray* running;
+    GPtrArray* connections;
+    // metrics
+    guint64 succeeded;
+    guint64 failed;
+    summary_t queue_wait;
+    summary_t job_duration;
+    GHashTable* stages;
+} daemon_t;
+
+/* Write end of the report pipe in workers, -1 otherwise */
+static int report_fd = -1;
+
+static bool send_all(int fd, const void* data, size_t length) {
+    const char* position = data;
+
+    while (length > 0) {
+        const ssize_t sent = send(fd, position, length, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+
+        position += sent;
+        length -= (size_t) sent;
+    }
+
+    return true;
+}
+
+static bool receive_all(int fd, void* data, size_t length) {
+    char* position = data;
+
+    while (length > 0) {
+        const ssize_t received = recv(fd, position, length, 0);
+
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+
+        position += received;
+        length -= (size_t) received;
+    }
+
+    return true;
+}
+
+static bool send_message(int fd, uint32_t type, const void* payload, size_t length, const int* fds, size_t fds_count) {
+    message_header_t header = {.magic = MESSAGE_MAGIC, .type = type, .length = (uint32_t) length};
+
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * CLIENT_FDS_COUNT)];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (fds_count > 0) {
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * fds_count);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fds_count);
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0) {
+        return false;
+    }
+
+    // the file descriptors have been passed along with the first byte already
+    return send_all(fd, (const char*) &header + sent, sizeof(header) - (size_t) sent) && send_all(fd, payload, length);
+}
+
+/* Take the file descriptors passed along with a received message, the ones beyond CLIENT_FDS_COUNT are closed */
+static void take_fds(struct msghdr* message, int* fds, size_t* count) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(message); cmsg != NULL; cmsg = CMSG_NXTHDR(message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        const size_t cmsg_fds_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (size_t i = 0; i < cmsg_fds_count; ++i) {
+            int received_fd;
+            memcpy(&received_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+            if (fds != NULL && *count < CLIENT_FDS_COUNT) {
+                fds[(*count)++] = received_fd;
+            } else {
+                close(received_fd);
+            }
+        }
+    }
+}
+
+/* Receive a header and the file descriptors passed along with it, returns false on errors and invalid headers */
+static bool receive_header(int fd, message_header_t* header, int* fds, size_t* fds_count) {
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * CLIENT_FDS_COUNT)];
+    } control;
+
+    struct iovec iov = {.iov_base = header, .iov_len = sizeof(*header)};
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+
+    ssize_t received;
+    do {
+        received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    size_t count = 0;
+
+    if (received > 0) {
+        take_fds(&message, fds, &count);
+    }
+
+    const bool success = received > 0 &&
+                         receive_all(fd, (char*) header + received, sizeof(*header) - (size_t) received) &&
+                         header->magic == MESSAGE_MAGIC;
+
+    if (!success) {
+        for (size_t i = 0; i < count; ++i) {
+            close(fds[i]);
+        }
+        count = 0;
+    }
+
+    if (fds_count != NULL) {
+        *fds_count = count;
+    }
+
+    return success;
+}
+
+static void summary_add(summary_t* summary, double value) {
+    summary->sum += value;
+    summary->count++;
+}
+
+static void free_job(job_t* job) {
+    if (job->client_fd >= 0) {
+        close(job->client_fd);
+    }
+    for (int i = 0; i < CLIENT_FDS_COUNT; ++i) {
+        if (job->fds[i] >= 0) {
+            close(job->fds[i]);
+        }
+    }
+    if (job->report_fd >= 0) {
+        close(job->report_fd);
+    }
+
+    g_free(job->cwd);
+    g_strfreev(job->argv);
+    g_strfreev(job->envp);
+    g_string_free(job->report, TRUE);
+    g_free(job);
+}
+
+static void free_connection(connection_t* connection) {
+    if (connection->fd >= 0) {
+        close(connection->fd);
+    }
+    for (size_t i = 0; i < connection->fds_count; ++i) {
+        close(connection->fds[i]);
+    }
+
+    g_byte_array_free(connection->request, TRUE);
+    g_free(connection);
+}
+
+static job_t* parse_job(const char* payload, size_t length) {
+    if (length == 0 || payload[length - 1] != '\0') {
+        return NULL;
+    }
+
+    GPtrArray* strings = g_ptr_array_new();
+    for (const char* string = payload; string < payload + length; string += strlen(string) + 1) {
+        g_ptr_array_add(strings, (gpointer) string);
+    }
+
+    job_t* job = NULL;
+    const unsigned long argc = strings->len >= 2 ? strtoul(g_ptr_array_index(strings, 1), NULL, 10) : 0;
+
+    if (argc > 0 && argc <= strings->len - 2) {
+        job = g_new0(job_t, 1);
+        job->cwd = g_strdup(g_ptr_array_index(strings, 0));
+        job->argv = g_new0(gchar*, argc + 1);
+        job->envp = g_new0(gchar*, strings->len - 2 - argc + 1);
+
+        for (guint i = 0; i < argc; ++i) {
+            job->argv[i] = g_strdup(g_ptr_array_index(strings, 2 + i));
+        }
+        for (guint i = 2 + argc; i < strings->len; ++i) {
+            job->envp[i - 2 - argc] = g_strdup(g_ptr_array_index(strings, i));
+        }
+    }
+
+    g_ptr_array_free(strings, TRUE);
+    return job;
+}
+
+/* Label values may not contain unescaped quotes, backslashes or line breaks */
+static void append_label_value(GString* text, const char* value) {
+    for (const char* c = value; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            g_string_append_c(text, '\\');
+            g_string_append_c(text, *c);
+        } else if (*c == '\n') {
+            g_string_append(text, "\\n");
+        } else {
+            g_string_append_c(text, *c);
+        }
+    }
+}
+
+static void append_metric_header(GString* text, const char* name, const char* type, const char* help) {
+    g_string_append_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static gchar* format_metrics(const daemon_t* daemon) {
+    GString* text = g_string_new(NULL);
+
+    append_metric_header(text, "appimagetool_daemon_workers", "gauge", "Maximum number of jobs running at the same time.");
+    g_string_append_printf(text, "appimagetool_daemon_workers %u\n", daemon->workers);
+
+    append_metric_header(text, "appimagetool_daemon_queue_depth", "gauge", "Jobs waiting for a free worker.");
+    g_string_append_printf(text, "appimagetool_daemon_queue_depth %u\n", g_queue_get_length(daemon->queue));
+
+    append_metric_header(text, "appimagetool_daemon_jobs_running", "gauge", "Jobs being built.");
+    g_string_append_printf(text, "appimagetool_daemon_jobs_running %u\n", daemon->running->len);
+
+    append_metric_header(text, "appimagetool_daemon_jobs_total", "counter", "Finished jobs.");
+    g_string_append_printf(text, "appimagetool_daemon_jobs_total{result=\"succeeded\"} %" G_GUINT64_FORMAT "\n", daemon->succeeded);
+    g_string_append_printf(text, "appimagetool_daemon_jobs_total{result=\"failed\"} %" G_GUINT64_FORMAT "\n", daemon->failed);
+
+    append_metric_header(text, "appimagetool_daemon_queue_wait_seconds", "summary", "Time jobs waited for a free worker.");
+    g_string_append_printf(text, "appimagetool_daemon_queue_wait_seconds_sum %.6f\n", daemon->queue_wait.sum);
+    g_string_append_printf(text, "appimagetool_daemon_queue_wait_seconds_count %" G_GUINT64_FORMAT "\n", daemon->queue_wait.count);
+
+    append_metric_header(text, "appimagetool_daemon_job_duration_seconds", "summary", "Time from the start of a job to its end.");
+    g_string_append_printf(text, "appimagetool_daemon_job_duration_seconds_sum %.6f\n", daemon->job_duration.sum);
+    g_string_append_printf(text, "appimagetool_daemon_job_duration_seconds_count %" G_GUINT64_FORMAT "\n", daemon->job_duration.count);
+
+    append_metric_header(text, "appimagetool_daemon_stage_duration_seconds", "summary", "Time spent in the stages of the packaging pipeline.");
+
+    GList* names = g_list_sort(g_hash_table_get_keys(daemon->stages), (GCompareFunc) strcmp);
+
+    for (GList* name = names; name != NULL; name = name->next) {
+        const summary_t* summary = g_hash_table_lookup(daemon->stages, name->data);
+
+        g_string_append(text, "appimagetool_daemon_stage_duration_seconds_sum{stage=\"");
+        append_label_value(text, name->data);
+        g_string_append_printf(text, "\"} %.6f\n", summary->sum);
+        g_string_append(text, "appimagetool_daemon_stage_duration_seconds_count{stage=\"");
+        append_label_value(text, name->data);
+        g_string_append_printf(text, "\"} %" G_GUINT64_FORMAT "\n", summary->count);
+    }
+
+    g_list_free(names);
+
+    return g_string_free(text, FALSE);
+}
+
+/* Reports are lines of the form "stage MICROSECONDS NAME" */
+static void record_report(daemon_t* daemon, const GString* report) {
+    gchar** lines = g_strsplit(report->str, "\n", -1);
+
+    for (gchar** line = lines; *line != NULL; ++line) {
+        long microseconds;
+        int name_offset = 0;
+
+        if (sscanf(*line, "stage %ld %n", &microseconds, &name_offset) != 1 || name_offset == 0 || (*line)[name_offset] == '\0') {
+            continue;
+        }
+
+        const char* name = *line + name_offset;
+        summary_t* summary = g_hash_table_lookup(daemon->stages, name);
+
+        if (summary == NULL) {
+            summary = g_new0(summary_t, 1);
+            g_hash_table_insert(daemon->stages, g_strdup(name), summary);
+        }
+
+        summary_add(summary, (double) microseconds / G_USEC_PER_SEC);
+    }
+
+    g_strfreev(lines);
+}
+
+/* Close everything of the daemon and the other jobs a worker has inherited */
+static void close_inherited_fds(daemon_t* daemon, const job_t* own_job) {
+    close(daemon->listen_fd);
+    close(daemon->signal_fd);
+
+    for (guint i = 0; i < daemon->connections->len; ++i) {
+        const connection_t* connection = g_ptr_array_index(daemon->connections, i);
+
+        close(connection->fd);
+        for (size_t j = 0; j < connection->fds_count; ++j) {
+            close(connection->fds[j]);
+        }
+    }
+
+    for (GList* entry = daemon->queue->head; entry != NULL; entry = entry->next) {
+        const job_t* job = entry->data;
+
+        if (job == own_job) {
+            continue;
+        }
+
+        close(job->client_fd);
+        for (int i = 0; i < CLIENT_FDS_COUNT; ++i) {
+            close(job->fds[i]);
+        }
+    }
+
+    for (guint i = 0; i < daemon->running->len; ++i) {
+        const job_t* job = g_ptr_array_index(daemon->running, i);
+
+        if (job->client_fd >= 0) {
+            close(job->client_fd);
+        }
+        close(job->report_fd);
+    }
+}
+
+static void run_worker(daemon_t* daemon, job_t* job, int report_write_fd) {
+    // a process group of its own, so that the worker and the tools it runs can be terminated at once
+    setpgid(0, 0);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigprocmask(SIG_SETMASK, &signals, NULL);
+    signal(SIGPIPE, SIG_DFL);
+
+    close_inherited_fds(daemon, job);
+    close(job->client_fd);
+
+    for (int i = 0; i < CLIENT_FDS_COUNT; ++i) {
+        if (dup2(job->fds[i], i) < 0) {
+            _exit(1);
+        }
+        if (job->fds[i] != i) {
+            close(job->fds[i]);
+        }
+    }
+
+    report_fd = report_write_fd;
+
+    if (chdir(job->cwd) != 0) {
+        fprintf(stderr, "Failed to change into %s: %s\n", job->cwd, strerror(errno));
+        _exit(1);
+    }
+
+    clearenv();
+    for (gchar** variable = job->envp; *variable != NULL; ++variable) {
+        putenv(*variable);
+    }
+
+    exit(daemon->job_function((int) g_strv_length(job->argv), job->argv));
+}
+
+static bool start_job(daemon_t* daemon, job_t* job) {
+    int pipe_fds[2];
+
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+        return false;
+    }
+
+    // buffered output would otherwise be written by both processes
+    fflush(stdout);
+    fflush(stderr);
+
+    const pid_t pid = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "Failed to start worker: %s\n", strerror(errno));
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        run_worker(daemon, job, pipe_fds[1]);
+    }
+
+    close(pipe_fds[1]);
+
+    job->pid = pid;
+    job->report_fd = pipe_fds[0];
+    job->start_time = g_get_monotonic_time();
+
+    for (int i = 0; i < CLIENT_FDS_COUNT; ++i) {
+        close(job->fds[i]);
+        job->fds[i] = -1;
+    }
+
+    summary_add(&daemon->queue_wait, (double) (job->start_time - job->queued_time) / G_USEC_PER_SEC);
+    return true;
+}
+
+static void send_exit_code(job_t* job, int exit_code) {
+    const int32_t payload = exit_code;
+
+    if (job->client_fd >= 0) {
+        send_message(job->client_fd, MESSAGE_EXIT, &payload, sizeof(payload), NULL, 0);
+    }
+}
+
+static void start_queued_jobs(daemon_t* daemon) {
+    while (daemon->running->len < daemon->workers && !g_queue_is_empty(daemon->queue)) {
+        job_t* job = g_queue_pop_head(daemon->queue);
+
+        if (start_job(daemon, job)) {
+            g_ptr_array_add(daemon->running, job);
+        } else {
+            daemon->failed++;
+            send_exit_code(job, 1);
+            free_job(job);
+        }
+    }
+}
+
+static void finish_job(daemon_t* daemon, job_t* job) {
+    int status = 0;
+    pid_t waited;
+
+    do {
+        waited = waitpid(job->pid, &status, 0);
+    } while (waited < 0 && errno == EINTR);
+
+    int exit_code = 1;
+    if (waited >= 0 && WIFEXITED(status)) {
+        exit_code = WEXITSTATUS(status);
+    } else if (waited >= 0 && WIFSIGNALED(status)) {
+        exit_code = 128 + WTERMSIG(status);
+    }
+
+    if (exit_code == 0) {
+        daemon->succeeded++;
+    } else {
+        daemon->failed++;
+    }
+
+    summary_add(&daemon->job_duration, (double) (g_get_monotonic_time() - job->start_time) / G_USEC_PER_SEC);
+    record_report(daemon, job->report);
+
+    send_exit_code(job, exit_code);
+
+    g_ptr_array_remove_fast(daemon->running, job);
+    free_job(job);
+}
+
+/* Read what the worker has reported, returns false once the worker has exited */
+static bool read_report(job_t* job) {
+    char buffer[4096];
+    ssize_t bytes_read;
+
+    do {
+        bytes_read = read(job->report_fd, buffer, sizeof(buffer));
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read <= 0) {
+        return false;
+    }
+
+    g_string_append_len(job->report, buffer, bytes_read);
+    return true;
+}
+
+/* A client which goes away cancels its job, returns true if it is gone */
+static bool client_gone(job_t* job) {
+    char buffer[256];
+    const ssize_t received = recv(job->client_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    return received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+static void cancel_job(daemon_t* daemon, job_t* job) {
+    close(job->client_fd);
+    job->client_fd = -1;
+
+    if (job->pid > 0) {
+        // the worker is reaped once it has exited, like any other
+        kill(-job->pid, SIGTERM);
+    } else {
+        g_queue_remove(daemon->queue, job);
+        daemon->failed++;
+        free_job(job);
+    }
+}
+
+static void send_metrics(const daemon_t* daemon, int client_fd) {
+    gchar* metrics = format_metrics(daemon);
+    send_message(client_fd, MESSAGE_TEXT, metrics, strlen(metrics), NULL, 0);
+    g_free(metrics);
+}
+
+/* Clients are accepted right away, their requests are received as they arrive, see receive_request */
+static void accept_client(daemon_t* daemon) {
+    const int client_fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client_fd < 0) {
+        return;
+    }
+
+    // jobs run as the daemon's user, so only the same user may submit them
+    struct ucred credentials;
+    socklen_t credentials_size = sizeof(credentials);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) != 0 ||
+        credentials.uid != getuid()) {
+        close(client_fd);
+        return;
+    }
+
+    connection_t* connection = g_new0(connection_t, 1);
+    connection->fd = client_fd;
+    connection->request = g_byte_array_new();
+    connection->accepted_time = g_get_monotonic_time();
+
+    g_ptr_array_add(daemon->connections, connection);
+}
+
+/* Handle a request which has been received completely, the connection is taken over by a job, or closed afterwards */
+static void handle_request(daemon_t* daemon, connection_t* connection, const message_header_t* header) {
+    // the responses are written like to any other client, the worker's output does not go through the socket anyway
+    fcntl(connection->fd, F_SETFL, fcntl(connection->fd, F_GETFL) & ~O_NONBLOCK);
+
+    if (header->type == MESSAGE_METRICS) {
+        send_metrics(daemon, connection->fd);
+        return;
+    }
+
+    if (header->type != MESSAGE_JOB || connection->fds_count != CLIENT_FDS_COUNT) {
+        return;
+    }
+
+    job_t* job = parse_job((const char*) connection->request->data + sizeof(*header), header->length);
+    if (job == NULL) {
+        return;
+    }
+
+    job->client_fd = connection->fd;
+    connection->fd = -1;
+    memcpy(job->fds, connection->fds, sizeof(job->fds));
+    connection->fds_count = 0;
+    job->pid = -1;
+    job->report_fd = -1;
+    job->report = g_string_new(NULL);
+    job->queued_time = g_get_monotonic_time();
+
+    if (daemon->running->len >= daemon->workers) {
+        dprintf(job->fds[2], "Waiting for a free worker, %u jobs ahead\n", g_queue_get_length(daemon->queue));
+    }
+
+    g_queue_push_tail(daemon->queue, job);
+}
+
+/* Receive what the client has sent so far, without blocking, and handle its request once it is complete
+ * Returns false once the connection is done with, i.e., the request has been handled, or is invalid */
+static bool receive_request(daemon_t* daemon, connection_t* connection) {
+    message_header_t header;
+    size_t expected = sizeof(header);
+
+    if (connection->request->len >= sizeof(header)) {
+        memcpy(&header, connection->request->data, sizeof(header));
+        expected += header.length;
+    }
+
+    char buffer[65536];
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * CLIENT_FDS_COUNT)];
+    } control;
+
+    // nothing beyond the request is read, like with blocking reads
+    struct iovec iov = {.iov_base = buffer, .iov_len = MIN(sizeof(buffer), expected - connection->request->len)};
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+
+    ssize_t received;
+    do {
+        received = recvmsg(connection->fd, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    if (received < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    take_fds(&message, connection->fds, &connection->fds_count);
+
+    if (received == 0) {
+        return false;
+    }
+
+    const bool header_complete = connection->request->len >= sizeof(header);
+    g_byte_array_append(connection->request, (const guint8*) buffer, (guint) received);
+
+    if (!header_complete && connection->request->len == sizeof(header)) {
+        memcpy(&header, connection->request->data, sizeof(header));
+
+        if (header.magic != MESSAGE_MAGIC || header.length > MAX_REQUEST_SIZE) {
+            return false;
+        }
+
+        expected += header.length;
+    }
+
+    if (connection->request->len < expected) {
+        return true;
+    }
+
+    handle_request(daemon, connection, &header);
+    return false;
+}
+
+/* Milliseconds until the oldest incomplete request times out, -1 if there is none */
+static int request_timeout(const daemon_t* daemon) {
+    if (daemon->connections->len == 0) {
+        return -1;
+    }
+
+    gint64 oldest = G_MAXINT64;
+    for (guint i = 0; i < daemon->connections->len; ++i) {
+        const connection_t* connection = g_ptr_array_index(daemon->connections, i);
+        oldest = MIN(oldest, connection->accepted_time);
+    }
+
+    const gint64 remaining = oldest + REQUEST_TIMEOUT_SECONDS * G_USEC_PER_SEC - g_get_monotonic_time();
+    return remaining > 0 ? (int) ((remaining + 999) / 1000) : 0;
+}
+
+static void close_timed_out_connections(daemon_t* daemon) {
+    const gint64 now = g_get_monotonic_time();
+
+    for (guint i = 0; i < daemon->connections->len;) {
+        connection_t* connection = g_ptr_array_index(daemon->connections, i);
+
+        if (now - connection->accepted_time >= REQUEST_TIMEOUT_SECONDS * G_USEC_PER_SEC) {
+            g_ptr_array_remove_index_fast(daemon->connections, i);
+            free_connection(connection);
+        } else {
+            ++i;
+        }
+    }
+}
+
+/* A socket left behind by a daemon which has been killed is replaced, one which is still served is not */
+static int listen_on(const char* socket_path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", socket_path);
+            return -1;
+        }
+
+        const int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const bool served = probe_fd >= 0 && connect(probe_fd, (struct sockaddr*) &address, sizeof(address)) == 0;
+        if (probe_fd >= 0) {
+            close(probe_fd);
+        }
+
+        if (served) {
+            fprintf(stderr, "Another daemon is listening on %s\n", socket_path);
+            return -1;
+        }
+
+        unlink(socket_path);
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // accessible to the daemon's user only
+    const mode_t previous_umask = umask(0077);
+    const bool bound = bind(fd, (struct sockaddr*) &address, sizeof(address)) == 0;
+    umask(previous_umask);
+
+    if (!bound || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void serve(daemon_t* daemon) {
+    GArray* poll_fds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+    GPtrArray* poll_jobs = g_ptr_array_new();
+    GPtrArray* poll_connections = g_ptr_array_new();
+
+    for (;;) {
+        g_array_set_size(poll_fds, 0);
+        g_ptr_array_set_size(poll_jobs, 0);
+        g_ptr_array_set_size(poll_connections, 0);
+
+        struct pollfd entry = {.fd = daemon->listen_fd, .events = POLLIN};
+        g_array_append_val(poll_fds, entry);
+        entry.fd = daemon->signal_fd;
+        g_array_append_val(poll_fds, entry);
+
+        // clients whose requests are incomplete come first, followed by the jobs
+        for (guint i = 0; i < daemon->connections->len; ++i) {
+            connection_t* connection = g_ptr_array_index(daemon->connections, i);
+            entry.fd = connection->fd;
+            g_array_append_val(poll_fds, entry);
+            g_ptr_array_add(poll_connections, connection);
+        }
+
+        // a job's client comes before its report, so that a job finished by the latter is not used afterwards
+        for (guint i = 0; i < daemon->running->len; ++i) {
+            job_t* job = g_ptr_array_index(daemon->running, i);
+
+            if (job->client_fd >= 0) {
+                entry.fd = job->client_fd;
+                g_array_append_val(poll_fds, entry);
+                g_ptr_array_add(poll_jobs, job);
+            }
+
+            entry.fd = job->report_fd;
+            g_array_append_val(poll_fds, entry);
+            g_ptr_array_add(poll_jobs, job);
+        }
+
+        for (GList* queued = daemon->queue->head; queued != NULL; queued = queued->next) {
+            job_t* job = queued->data;
+            entry.fd = job->client_fd;
+            g_array_append_val(poll_fds, entry);
+            g_ptr_array_add(poll_jobs, job);
+        }
+
+        if (poll((struct pollfd*) poll_fds->data, poll_fds->len, request_timeout(daemon)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        const struct pollfd* polled = (const struct pollfd*) poll_fds->data;
+
+        if (polled[1].revents != 0) {
+            break;
+        }
+
+        const guint jobs_start = 2 + poll_connections->len;
+
+        for (guint i = 2; i < jobs_start; ++i) {
+            connection_t* connection = g_ptr_array_index(poll_connections, i - 2);
+
+            if (polled[i].revents != 0 && !receive_request(daemon, connection)) {
+                g_ptr_array_remove_fast(daemon->connections, connection);
+                free_connection(connection);
+            }
+        }
+
+        close_timed_out_connections(daemon);
+
+        for (guint i = jobs_start; i < poll_fds->len; ++i) {
+            job_t* job = g_ptr_array_index(poll_jobs, i - jobs_start);
+
+            if (polled[i].revents == 0) {
+                continue;
+            }
+
+            if (polled[i].fd == job->report_fd) {
+                if (!read_report(job)) {
+                    finish_job(daemon, job);
+                }
+            } else if (client_gone(job)) {
+                cancel_job(daemon, job);
+            }
+        }
+
+        if (polled[0].revents != 0) {
+            accept_client(daemon);
+        }
+
+        start_queued_jobs(daemon);
+    }
+
+    g_array_free(poll_fds, TRUE);
+    g_ptr_array_free(poll_jobs, TRUE);
+    g_ptr_array_free(poll_connections, TRUE);
+}
+
+int appimage_daemon_run(const char* socket_path, unsigned int workers, appimage_daemon_job_function_t job_function) {
+    daemon_t daemon = {
+        .listen_fd = -1,
+        .signal_fd = -1,
+        .workers = workers > 0 ? workers : 1,
+        .job_function = job_function,
+        .queue = g_queue_new(),
+        .running = g_ptr_array_new(),
+        .connections = g_ptr_array_new(),
+        .stages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free),
+    };
+
+    // SIGINT and SIGTERM are handled in the main loop, so that the workers can be stopped
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    daemon.signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    // clients may go away at any time
+    signal(SIGPIPE, SIG_IGN);
+
+    if (daemon.signal_fd < 0 || (daemon.listen_fd = listen_on(socket_path)) < 0) {
+        return 1;
+    }
+
+    fprintf(stderr, "Listening on %s, running up to %u jobs at the same time\n", socket_path, daemon.workers);
+
+    serve(&daemon);
+
+    fprintf(stderr, "Shutting down\n");
+
+    for (guint i = 0; i < daemon.running->len; ++i) {
+        const job_t* job = g_ptr_array_index(daemon.running, i);
+        kill(-job->pid, SIGTERM);
+    }
+    while (daemon.running->len > 0) {
+        finish_job(&daemon, g_ptr_array_index(daemon.running, 0));
+    }
+    while (!g_queue_is_empty(daemon.queue)) {
+        job_t* job = g_queue_pop_head(daemon.queue);
+        send_exit_code(job, 1);
+        free_job(job);
+    }
+    for (guint i = 0; i < daemon.connections->len; ++i) {
+        free_connection(g_ptr_array_index(daemon.connections, i));
+    }
+
+    unlink(socket_path);
+    close(daemon.listen_fd);
+    close(daemon.signal_fd);
+
+    g_queue_free(daemon.queue);
+    g_ptr_array_free(daemon.running, TRUE);
+    g_ptr_array_free(daemon.connections, TRUE);
+    g_hash_table_destroy(daemon.stages);
+
+    return 0;
+}
+
+static int connect_to_daemon(const char* socket_path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        fprintf(stderr, "Failed to connect to the daemon at %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+int appimage_daemon_submit(const char* socket_path, char* const argv[]) {
+    const int fd = connect_to_daemon(socket_path);
+    if (fd < 0) {
+        return 1;
+    }
+
+    // the job runs in the same directory and with the same environment as if it was run here
+    gchar* cwd = g_get_current_dir();
+    GString* payload = g_string_new(NULL);
+
+    g_string_append_len(payload, cwd, (gssize) strlen(cwd) + 1);
+    g_string_append_printf(payload, "%u", g_strv_length((gchar**) argv));
+    g_string_append_c(payload, '\0');
+    for (char* const* arg = argv; *arg != NULL; ++arg) {
+        g_string_append_len(payload, *arg, (gssize) strlen(*arg) + 1);
+    }
+    for (char** variable = environ; *variable != NULL; ++variable) {
+        g_string_append_len(payload, *variable, (gssize) strlen(*variable) + 1);
+    }
+
+    g_free(cwd);
+
+    // the job's output is written to this process' streams directly, while it is running
+    static const int fds[CLIENT_FDS_COUNT] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    const bool sent = send_message(fd, MESSAGE_JOB, payload->str, payload->len, fds, CLIENT_FDS_COUNT);
+    g_string_free(payload, TRUE);
+
+    message_header_t header;
+    int32_t exit_code = 1;
+
+    if (!sent || !receive_header(fd, &header, NULL, NULL) || header.type != MESSAGE_EXIT ||
+        header.length != sizeof(exit_code) || !receive_all(fd, &exit_code, sizeof(exit_code))) {
+        fprintf(stderr, "Lost connection to the daemon\n");
+        exit_code = 1;
+    }
+
+    close(fd);
+    return exit_code;
+}
+
+int appimage_daemon_print_metrics(const char* socket_path) {
+    const int fd = connect_to_daemon(socket_path);
+    if (fd < 0) {
+        return 1;
+    }
+
+    message_header_t header;
+    gchar* text = NULL;
+
+    if (send_message(fd, MESSAGE_METRICS, NULL, 0, NULL, 0) && receive_header(fd, &header, NULL, NULL) &&
+        header.type == MESSAGE_TEXT && header.length <= MAX_REQUEST_SIZE) {
+        text = g_malloc(header.length);
+
+        if (receive_all(fd, text, header.length)) {
+            fwrite(text, 1, header.length, stdout);
+        } else {
+            g_free(text);
+            text = NULL;
+        }
+    }
+
+    close(fd);
+
+    if (text == NULL) {
+        fprintf(stderr, "Failed to get metrics from the daemon\n");
+        return 1;
+    }
+
+    g_free(text);
+    return 0;
+}
+
+bool appimage_daemon_is_worker(void) {
+    return report_fd >= 0;
+}
+
+void appimage_daemon_report_stage(const char* name, long microseconds) {
+    if (report_fd >= 0 && microseconds >= 0) {
+        dprintf(report_fd, "stage %ld %s\n", microseconds, name);
+    }
+}
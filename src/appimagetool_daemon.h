@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Build daemon for build farms which run appimagetool many times a day.
+ *
+ * The daemon initializes what is expensive to set up once (libraries, ...) and listens on a Unix socket.
+ * Every job runs in a worker forked from the daemon, which inherits this state, so that a failing job, which exits
+ * like appimagetool does, cannot take the daemon down. At most a given number of workers run at the same time, further
+ * jobs are queued.
+ *
+ * A client sends its working directory, environment and arguments, along with its standard input, output and error,
+ * which the worker uses as its own, so the build's output reaches the client as it happens. The client exits with
+ * the worker's exit code. Only clients of the same user as the daemon are accepted. Requests are received without
+ * blocking, so a slow client does not hold up the other clients and the running jobs.
+ */
+
+/**
+ * Runs a job in a worker. Its working directory and environment have been set up already.
+ * @return exit code of the job
+ */
+typedef int (*appimage_daemon_job_function_t)(int argc, char** argv);
+
+/**
+ * Serve jobs on the given socket until SIGINT or SIGTERM is received.
+ * @param workers maximum number of jobs running at the same time
+ * @return exit code for appimagetool
+ */
+int appimage_daemon_run(const char* socket_path, unsigned int workers, appimage_daemon_job_function_t job_function);
+
+/**
+ * Run a job on a daemon and wait for it to finish.
+ * @param argv arguments of the job, NULL terminated, argv[0] is the program name
+ * @return exit code of the job, or 1 if the daemon could not be reached
+ */
+int appimage_daemon_submit(const char* socket_path, char* const argv[]);
+
+/**
+ * Print the daemon's metrics in the Prometheus text exposition format: queue depth, running jobs, job counts and
+ * latencies of the jobs and of the individual stages of the pipeline.
+ * @return 0 on success, 1 otherwise
+ */
+int appimage_daemon_print_metrics(const char* socket_path);
+
+/**
+ * Whether this process is a worker of a daemon.
+ */
+bool appimage_daemon_is_worker(void);
+
+/**
+ * Report the duration of a stage of the job to the daemon, for its metrics. Does nothing outside of workers.
+ * @param microseconds duration, negative values (stages which have not run) are ignored
+ */
+void appimage_daemon_report_stage(const char* name, long microseconds);
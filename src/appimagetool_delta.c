@@ -0,0 +1,195 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "appimagetool_delta.h"
+#include "appimagetool_zsync.h"
+#include "util.h"
+
+#define SQUASHFS_MAGIC 0x73717368
+#define SQUASHFS_SUPERBLOCK_SIZE 96
+#define SQUASHFS_INVALID_TABLE UINT64_MAX
+
+enum {
+    REGION_RUNTIME,
+    REGION_SUPERBLOCK,
+    REGION_DATA,
+    REGION_INODE_TABLE,
+    REGION_DIRECTORY_TABLE,
+    REGION_LOOKUP_TABLES,
+    REGION_PADDING,
+    REGIONS_COUNT
+};
+
+static const char* const region_names[REGIONS_COUNT] = {
+    "Runtime",
+    "Superblock",
+    "Data blocks",
+    "Inode table",
+    "Directory table",
+    "Lookup tables",
+    "Padding",
+};
+
+/* Table locations from the superblock, relative to the beginning of the squashfs image */
+typedef struct {
+    uint64_t bytes_used;
+    uint64_t id_table;
+    uint64_t xattr_table;
+    uint64_t inode_table;
+    uint64_t directory_table;
+    uint64_t fragment_table;
+    uint64_t export_table;
+} squashfs_tables_t;
+
+static uint64_t read_le64(const unsigned char* data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return le64toh(value);
+}
+
+static bool read_squashfs_tables(const char* path, off_t offset, squashfs_tables_t* tables) {
+    unsigned char superblock[SQUASHFS_SUPERBLOCK_SIZE];
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const ssize_t bytes_read = pread(fd, superblock, sizeof(superblock), offset);
+    close(fd);
+
+    uint32_t magic;
+    memcpy(&magic, superblock, sizeof(magic));
+
+    if (bytes_read != (ssize_t) sizeof(superblock) || le32toh(magic) != SQUASHFS_MAGIC) {
+        return false;
+    }
+
+    tables->bytes_used = read_le64(superblock + 40);
+    tables->id_table = read_le64(superblock + 48);
+    tables->xattr_table = read_le64(superblock + 56);
+    tables->inode_table = read_le64(superblock + 64);
+    tables->directory_table = read_le64(superblock + 72);
+    tables->fragment_table = read_le64(superblock + 80);
+    tables->export_table = read_le64(superblock + 88);
+
+    return true;
+}
+
+/* Divide the new AppImage into its regions
+ * Both mksquashfs and libsquashfs write the data blocks first, followed by the inode table, the directory table and
+ * the lookup tables, in this order */
+static bool find_regions(const char* path, appimage_zsync_delta_region_t* regions) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const ssize_t runtime_size = appimage_get_elf_size(path);
+    if (runtime_size <= 0) {
+        return false;
+    }
+
+    squashfs_tables_t tables;
+    if (!read_squashfs_tables(path, runtime_size, &tables)) {
+        fprintf(stderr, "No squashfs image found at offset %zd of %s\n", runtime_size, path);
+        return false;
+    }
+
+    if (tables.inode_table < SQUASHFS_SUPERBLOCK_SIZE || tables.inode_table > tables.directory_table ||
+        tables.directory_table > tables.bytes_used || (uint64_t) runtime_size + tables.bytes_used > (uint64_t) st.st_size) {
+        fprintf(stderr, "Unexpected squashfs layout in %s\n", path);
+        return false;
+    }
+
+    // the directory table ends where the first of the lookup tables begins
+    uint64_t lookup_tables = tables.bytes_used;
+    const uint64_t table_offsets[] = {tables.fragment_table, tables.export_table, tables.id_table, tables.xattr_table};
+
+    for (size_t i = 0; i < sizeof(table_offsets) / sizeof(table_offsets[0]); ++i) {
+        if (table_offsets[i] != SQUASHFS_INVALID_TABLE && table_offsets[i] >= tables.directory_table &&
+            table_offsets[i] < lookup_tables) {
+            lookup_tables = table_offsets[i];
+        }
+    }
+
+    const uint64_t bounds[REGIONS_COUNT + 1] = {
+        0,
+        runtime_size,
+        runtime_size + SQUASHFS_SUPERBLOCK_SIZE,
+        runtime_size + tables.inode_table,
+        runtime_size + tables.directory_table,
+        runtime_size + lookup_tables,
+        runtime_size + tables.bytes_used,
+        st.st_size,
+    };
+
+    for (int i = 0; i < REGIONS_COUNT; ++i) {
+        regions[i].offset = bounds[i];
+        regions[i].length = bounds[i + 1] - bounds[i];
+        regions[i].download_size = 0;
+    }
+
+    return true;
+}
+
+static double percentage(unsigned long part, unsigned long total) {
+    return total > 0 ? 100.0 * (double) part / (double) total : 0.0;
+}
+
+int appimage_print_delta_report(
+    const char* old_path,
+    const char* new_path,
+    size_t block_size,
+    unsigned int threads,
+    double max_download_percentage
+) {
+    appimage_zsync_delta_region_t regions[REGIONS_COUNT];
+    appimage_zsync_delta_t delta;
+
+    // without a breakdown, the totals are still useful, e.g., for type 1 AppImages
+    const bool have_regions = find_regions(new_path, regions);
+
+    if (!appimage_zsync_estimate_delta(old_path, new_path, block_size, threads, have_regions ? regions : NULL,
+                                       have_regions ? REGIONS_COUNT : 0, &delta)) {
+        fprintf(stderr, "Failed to compare %s and %s\n", old_path, new_path);
+        return 1;
+    }
+
+    const double download_percentage = percentage(delta.download_size, delta.new_length);
+
+    printf("Block size: %zu bytes\n", delta.block_size);
+    printf("Reused blocks: %zu of %zu (%.1f%%)\n",
+           delta.reused_blocks_count, delta.blocks_count,
+           delta.blocks_count > 0 ? percentage(delta.reused_blocks_count, delta.blocks_count) : 100.0);
+    printf("Expected download: %lu of %lu bytes (%.1f%%)\n", delta.download_size, delta.new_length, download_percentage);
+
+    if (have_regions) {
+        printf("\n%-16s %14s %14s\n", "Region", "Size", "Download");
+
+        for (int i = 0; i < REGIONS_COUNT; ++i) {
+            if (regions[i].length == 0)
+                continue;
+
+            printf("%-16s %14lu %14lu %8.1f%%\n", region_names[i], regions[i].length, regions[i].download_size,
+                   percentage(regions[i].download_size, regions[i].length));
+        }
+    }
+
+    if (max_download_percentage >= 0 && download_percentage > max_download_percentage) {
+        fprintf(stderr, "Expected download of %.1f%% exceeds the limit of %.1f%%\n", download_percentage,
+                max_download_percentage);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Report how much of a new AppImage a zsync client which has the old one downloads when updating, in total and
+ * broken down by region of the new file: the runtime, the squashfs superblock, the data blocks, the inode and
+ * directory tables, the remaining lookup tables (fragments, export, ids, xattrs) and the padding after the image.
+ *
+ * @param block_size zsync block size, 0 picks the block size like zsyncmake does
+ * @param threads number of threads used for hashing, 0 uses all CPUs
+ * @param max_download_percentage if not negative, the report fails if the expected download exceeds this percentage
+ *                                of the new file, so that regressions can be gated in CI
+ * @return 0 on success, 1 on errors or if the expected download exceeds the limit
+ */
+int appimage_print_delta_report(
+    const char* old_path,
+    const char* new_path,
+    size_t block_size,
+    unsigned int threads,
+    double max_download_percentage
+);
@@ -0,0 +1,240 @@
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "light_elf.h"
+#include "appimagetool_elf.h"
+
+namespace {
+    // extended numbering, see elf(5)
+    constexpr uint16_t sectionIndexExtended = 0xffff;
+
+    // sanity limits, no real-world runtime comes anywhere near these
+    constexpr uint64_t maxSectionCount = 65536;
+    constexpr uint64_t maxStringTableSize = 16 * 1024 * 1024;
+
+    struct Section {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    template<typename T>
+    T byteSwap(T value) {
+        if constexpr (sizeof(T) == 2) {
+            return static_cast<T>(__builtin_bswap16(value));
+        } else if constexpr (sizeof(T) == 4) {
+            return static_cast<T>(__builtin_bswap32(value));
+        } else {
+            static_assert(sizeof(T) == 8);
+            return static_cast<T>(__builtin_bswap64(value));
+        }
+    }
+
+    /**
+     * Convert a value read from the file to host byte order. The check is resolved at compile time.
+     */
+    template<bool FileIsBigEndian, typename T>
+    T toHost(T value) {
+        if constexpr (FileIsBigEndian != (std::endian::native == std::endian::big)) {
+            return byteSwap(value);
+        } else {
+            return value;
+        }
+    }
+
+    struct Elf32Types {
+        using Ehdr = Elf32_Ehdr;
+        using Shdr = Elf32_Shdr;
+    };
+
+    struct Elf64Types {
+        using Ehdr = Elf64_Ehdr;
+        using Shdr = Elf64_Shdr;
+    };
+
+    bool readExactly(int fd, void* buffer, size_t size, uint64_t offset) {
+        auto* position = static_cast<char*>(buffer);
+
+        while (size > 0) {
+            const auto bytesRead = pread(fd, position, size, static_cast<off_t>(offset));
+
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytesRead <= 0) {
+                return false;
+            }
+
+            position += bytesRead;
+            offset += bytesRead;
+            size -= bytesRead;
+        }
+
+        return true;
+    }
+
+    /**
+     * Parse the section table for one specific ELF class and byte order.
+     * There are four instantiations, each with all layout and byte order decisions made at compile time.
+     */
+    template<typename Types, bool BigEndian>
+    bool parseSectionTable(int fd, std::unordered_map<std::string, Section>& sections) {
+        typename Types::Ehdr ehdr{};
+        if (!readExactly(fd, &ehdr, sizeof(ehdr), 0)) {
+            return false;
+        }
+
+        const uint64_t sectionHeadersOffset = toHost<BigEndian>(ehdr.e_shoff);
+        const uint16_t sectionHeaderSize = toHost<BigEndian>(ehdr.e_shentsize);
+        uint64_t sectionCount = toHost<BigEndian>(ehdr.e_shnum);
+        uint64_t stringTableIndex = toHost<BigEndian>(ehdr.e_shstrndx);
+
+        if (sectionHeadersOffset == 0) {
+            // no section table at all
+            return true;
+        }
+
+        if (sectionHeaderSize < sizeof(typename Types::Shdr)) {
+            return false;
+        }
+
+        // with extended numbering, the real values are stored in the first section header
+        if (sectionCount == 0 || stringTableIndex == sectionIndexExtended) {
+            typename Types::Shdr first{};
+            if (!readExactly(fd, &first, sizeof(first), sectionHeadersOffset)) {
+                return false;
+            }
+            if (sectionCount == 0) {
+                sectionCount = toHost<BigEndian>(first.sh_size);
+            }
+            if (stringTableIndex == sectionIndexExtended) {
+                stringTableIndex = toHost<BigEndian>(first.sh_link);
+            }
+        }
+
+        if (sectionCount == 0 || sectionCount > maxSectionCount || stringTableIndex >= sectionCount) {
+            return false;
+        }
+
+        // the entire section header table in one read
+        std::vector<char> rawHeaders(sectionCount * sectionHeaderSize);
+        if (!readExactly(fd, rawHeaders.data(), rawHeaders.size(), sectionHeadersOffset)) {
+            return false;
+        }
+
+        const auto header = [&rawHeaders, sectionHeaderSize](uint64_t index) {
+            typename Types::Shdr shdr{};
+            std::memcpy(&shdr, rawHeaders.data() + index * sectionHeaderSize, sizeof(shdr));
+            return shdr;
+        };
+
+        const auto stringTableHeader = header(stringTableIndex);
+        const uint64_t stringTableOffset = toHost<BigEndian>(stringTableHeader.sh_offset);
+        const uint64_t stringTableSize = toHost<BigEndian>(stringTableHeader.sh_size);
+
+        if (stringTableSize == 0 || stringTableSize > maxStringTableSize) {
+            return false;
+        }
+
+        std::vector<char> stringTable(stringTableSize + 1, '\0');
+        if (!readExactly(fd, stringTable.data(), stringTableSize, stringTableOffset)) {
+            return false;
+        }
+
+        sections.reserve(sectionCount);
+
+        for (uint64_t i = 0; i < sectionCount; ++i) {
+            const auto shdr = header(i);
+            const uint64_t nameOffset = toHost<BigEndian>(shdr.sh_name);
+
+            if (nameOffset >= stringTableSize) {
+                continue;
+            }
+
+            // later sections take precedence, like they did with the previous implementation
+            sections.insert_or_assign(
+                std::string(stringTable.data() + nameOffset),
+                Section{toHost<BigEndian>(shdr.sh_offset), toHost<BigEndian>(shdr.sh_size)}
+            );
+        }
+
+        return true;
+    }
+}
+
+struct appimage_elf_sections {
+    std::unordered_map<std::string, Section> sections;
+};
+
+appimage_elf_sections_t* appimage_elf_sections_read(int fd) {
+    unsigned char ident[EI_NIDENT];
+
+    if (!readExactly(fd, ident, sizeof(ident), 0) || std::memcmp(ident, "\x7f" "ELF", 4) != 0) {
+        return nullptr;
+    }
+
+    auto* result = new appimage_elf_sections{};
+
+    const auto elfClass = ident[EI_CLASS];
+    const auto elfData = ident[EI_DATA];
+
+    bool success = false;
+
+    if (elfClass == ELFCLASS32 && elfData == ELFDATA2LSB) {
+        success = parseSectionTable<Elf32Types, false>(fd, result->sections);
+    } else if (elfClass == ELFCLASS32 && elfData == ELFDATA2MSB) {
+        success = parseSectionTable<Elf32Types, true>(fd, result->sections);
+    } else if (elfClass == ELFCLASS64 && elfData == ELFDATA2LSB) {
+        success = parseSectionTable<Elf64Types, false>(fd, result->sections);
+    } else if (elfClass == ELFCLASS64 && elfData == ELFDATA2MSB) {
+        success = parseSectionTable<Elf64Types, true>(fd, result->sections);
+    } else {
+        std::cerr << "Platforms other than 32-bit/64-bit are currently not supported!" << std::endl;
+    }
+
+    if (!success) {
+        delete result;
+        return nullptr;
+    }
+
+    return result;
+}
+
+appimage_elf_sections_t* appimage_elf_sections_open(const char* path) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+
+    auto* result = appimage_elf_sections_read(fd);
+    close(fd);
+
+    return result;
+}
+
+void appimage_elf_sections_free(appimage_elf_sections_t* sections) {
+    delete sections;
+}
+
+bool appimage_elf_sections_find(const appimage_elf_sections_t* sections, const char* name, unsigned long* offset, unsigned long* length) {
+    const auto it = sections->sections.find(name);
+
+    if (it == sections->sections.end()) {
+        return false;
+    }
+
+    *offset = it->second.offset;
+    *length = it->second.size;
+    return true;
+}
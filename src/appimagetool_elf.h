@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Section table of an ELF file, i.e., the name, offset and size of each section.
+ * Only the ELF header, the section header table and the section name string table are read, using bounded preads.
+ * 32-bit and 64-bit files of either byte order are supported.
+ * Since the runtime is placed at the beginning of an AppImage as is, a table parsed from the runtime is valid for
+ * the AppImage, too.
+ */
+typedef struct appimage_elf_sections appimage_elf_sections_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Parse the section table from an open file descriptor. The file descriptor is neither moved nor closed.
+ * @return section table, or NULL if the file is not a valid ELF file. Must be freed with appimage_elf_sections_free.
+ */
+appimage_elf_sections_t* appimage_elf_sections_read(int fd);
+
+/**
+ * Parse the section table of the file at the given path.
+ * @return section table, or NULL on errors. Must be freed with appimage_elf_sections_free.
+ */
+appimage_elf_sections_t* appimage_elf_sections_open(const char* path);
+
+void appimage_elf_sections_free(appimage_elf_sections_t* sections);
+
+/**
+ * Look up a section by name in constant time. If multiple sections share a name, the last one is returned.
+ * @return true if the section exists, false otherwise (offset and length are not modified then)
+ */
+bool appimage_elf_sections_find(const appimage_elf_sections_t* sections, const char* name, unsigned long* offset, unsigned long* length);
+
+#ifdef __cplusplus
+}
+#endif
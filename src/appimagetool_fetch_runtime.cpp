@@ -7,9 +7,70 @@
 #include <filesystem>
 #include <algorithm>
 
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <optional>
+#include <tuple>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
 #include <curl/curl.h>
+#include <gcrypt.h>
 
 #include "appimagetool_fetch_runtime.h"
+#include "appimagetool_runtime.h"
+
+/**
+ * Environment of the build a runtime is fetched for, which is not necessarily the environment of the process, e.g., in
+ * the daemon. Without variables, the process' environment is used.
+ */
+class Environment {
+private:
+    const char* const* _variables;
+
+public:
+    explicit Environment(const char* const* variables) : _variables(variables) {}
+
+    [[nodiscard]] bool isProcessEnvironment() const {
+        return _variables == nullptr;
+    }
+
+    [[nodiscard]] const char* get(const std::string& name) const {
+        if (_variables == nullptr) {
+            return getenv(name.c_str());
+        }
+
+        for (auto variable = _variables; *variable != nullptr; ++variable) {
+            if (strncmp(*variable, name.c_str(), name.size()) == 0 && (*variable)[name.size()] == '=') {
+                return *variable + name.size() + 1;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Look up the first of the given variables which is set to a non-empty value.
+     * @return value, or an empty string
+     */
+    [[nodiscard]] std::string first(std::initializer_list<const char*> names) const {
+        for (const auto* name : names) {
+            const char* value = get(name);
+            if (value != nullptr && value[0] != '\0') {
+                return value;
+            }
+        }
+
+        return {};
+    }
+};
 
 class CurlResponse {
 private:
@@ -17,14 +78,16 @@ private:
     long _statusCode;
     std::string _effectiveUrl;
     curl_off_t _contentLength;
-    std::vector<char> _data;
+    size_t _bytesWritten;
+    std::map<std::string, std::string> _headers;
 
 public:
-    CurlResponse(bool success, long statusCode, curl_off_t contentLength, std::vector<char> data)
+    CurlResponse(bool success, long statusCode, curl_off_t contentLength, size_t bytesWritten, std::map<std::string, std::string> headers)
             : _success(success)
             , _statusCode(statusCode)
             , _contentLength(contentLength)
-            , _data(std::move(data)) {}
+            , _bytesWritten(bytesWritten)
+            , _headers(std::move(headers)) {}
 
     [[nodiscard]] bool success() const {
         return _success;
@@ -38,8 +101,21 @@ public:
         return _contentLength;
     }
 
-    [[nodiscard]] const std::vector<char>& data() const {
-        return _data;
+    [[nodiscard]] size_t bytesWritten() const {
+        return _bytesWritten;
+    }
+
+    /**
+     * Look up a header of the final response (i.e., after following redirects).
+     * @param name header name in lower case
+     * @return header value, or an empty string if the header was not sent
+     */
+    [[nodiscard]] std::string header(const std::string& name) const {
+        const auto it = _headers.find(name);
+        if (it == _headers.end()) {
+            return {};
+        }
+        return it->second;
     }
 };
 
@@ -99,12 +175,69 @@ public:
 class GetRequest {
 private:
     CURL* _handle;
-    std::vector<char> _buffer;
+    curl_slist* _requestHeaders;
+    int _outputFd;
+    size_t _bytesWritten;
+    std::function<void(const char*, size_t)> _bodyObserver;
+    std::map<std::string, std::string> _responseHeaders;
     std::vector<char> _errorBuffer;
 
+    // the response body is written straight to the output file descriptor, no need to keep it in memory
     static size_t writeStuff(char* data, size_t size, size_t nmemb, void* this_ptr) {
+        auto* request = static_cast<GetRequest*>(this_ptr);
         const auto bytes = size * nmemb;
-        std::copy(data, data + bytes, std::back_inserter(static_cast<GetRequest*>(this_ptr)->_buffer));
+
+        size_t written = 0;
+        while (written < bytes) {
+            const auto result = write(request->_outputFd, data + written, bytes - written);
+
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                // returning a value other than bytes makes libcurl abort the transfer
+                return 0;
+            }
+
+            written += result;
+        }
+
+        request->_bytesWritten += bytes;
+
+        if (request->_bodyObserver) {
+            request->_bodyObserver(data, bytes);
+        }
+
+        return bytes;
+    }
+
+    static size_t headerStuff(char* data, size_t size, size_t nmemb, void* this_ptr) {
+        auto* request = static_cast<GetRequest*>(this_ptr);
+        const auto bytes = size * nmemb;
+
+        std::string line(data, bytes);
+
+        // a new status line means we're following a redirect, only the final response's headers are of interest
+        if (line.rfind("HTTP/", 0) == 0) {
+            request->_responseHeaders.clear();
+            return bytes;
+        }
+
+        const auto colon = line.find(':');
+        if (colon == std::string::npos) {
+            return bytes;
+        }
+
+        auto name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+
+        auto value = line.substr(colon + 1);
+        const auto first = value.find_first_not_of(" \t");
+        const auto last = value.find_last_not_of(" \t\r\n");
+        value = (first == std::string::npos) ? std::string() : value.substr(first, last - first + 1);
+
+        request->_responseHeaders[name] = value;
         return bytes;
     }
 
@@ -209,7 +342,11 @@ private:
     }
 
 public:
-    explicit GetRequest(const std::string& url, bool verbose = false) : _errorBuffer(CURL_ERROR_SIZE) {
+    GetRequest(const std::string& url, int outputFd, bool verbose = false)
+        : _requestHeaders(nullptr)
+        , _outputFd(outputFd)
+        , _bytesWritten(0)
+        , _errorBuffer(CURL_ERROR_SIZE) {
         // not the cleanest approach to globally init curl here, but this method shouldn't be called more than once anyway
         curl_global_init(CURL_GLOBAL_ALL);
 
@@ -234,15 +371,49 @@ public:
         // needed to handle request internally
         setOption(CURLOPT_WRITEFUNCTION, GetRequest::writeStuff);
         setOption(CURLOPT_WRITEDATA, static_cast<void*>(this));
+        setOption(CURLOPT_HEADERFUNCTION, GetRequest::headerStuff);
+        setOption(CURLOPT_HEADERDATA, static_cast<void*>(this));
         setOption(CURLOPT_ERRORBUFFER, _errorBuffer.data());
     }
 
+    /**
+     * libcurl reads the proxy variables from the process' environment. Make it use the ones of the given environment
+     * instead, like curl(1) would, if it is not the process' one.
+     */
+    void setUpProxy(const Environment& environment, const std::string& url) {
+        if (environment.isProcessEnvironment()) {
+            return;
+        }
+
+        // like libcurl, only the lowercase http_proxy is used, as HTTP_PROXY might be set by CGI-style callers
+        const auto proxy = url.rfind("https://", 0) == 0
+            ? environment.first({"https_proxy", "HTTPS_PROXY", "all_proxy", "ALL_PROXY"})
+            : environment.first({"http_proxy", "all_proxy", "ALL_PROXY"});
+
+        // empty strings disable the proxy, and exclude no hosts from it, regardless of the process' environment
+        setOption(CURLOPT_PROXY, proxy.c_str());
+        setOption(CURLOPT_NOPROXY, environment.first({"no_proxy", "NO_PROXY"}).c_str());
+    }
+
     GetRequest(const GetRequest&) = delete;
     GetRequest(GetRequest&&) = delete;
 
     ~GetRequest() {
-        curl_global_cleanup();
+        curl_slist_free_all(_requestHeaders);
         curl_easy_cleanup(this->_handle);
+        curl_global_cleanup();
+    }
+
+    void addHeader(const std::string& header) {
+        _requestHeaders = curl_slist_append(_requestHeaders, header.c_str());
+        setOption(CURLOPT_HTTPHEADER, _requestHeaders);
+    }
+
+    /**
+     * Register a callback which gets to see every chunk of the response body after it has been written.
+     */
+    void setBodyObserver(std::function<void(const char*, size_t)> observer) {
+        _bodyObserver = std::move(observer);
     }
 
     CurlResponse perform() {
@@ -251,56 +422,380 @@ public:
             result == CURLE_OK,
             getOption<long>(CURLINFO_RESPONSE_CODE),
             getOption<curl_off_t>(CURLINFO_CONTENT_LENGTH_DOWNLOAD_T),
-            _buffer
+            _bytesWritten,
+            _responseHeaders
         };
     }
 };
 
-bool fetch_runtime(char *arch, size_t *size, char **buffer, bool verbose) {
+/**
+ * On-disk cache of downloaded runtimes, shared by all appimagetool processes of a user.
+ *
+ * The runtimes are stored content-addressed as runtime-<arch>-<sha256>. Those files are never modified once published.
+ * For every architecture, runtime-<arch>.entry names the current file along with the validators needed to revalidate
+ * it with the server. All files are published by renaming them into place, so readers never need to lock anything.
+ * Only writers serialize on runtime-<arch>.lock to avoid downloading the same file in parallel.
+ */
+class RuntimeCache {
+public:
+    struct Entry {
+        std::string sha256;
+        std::string etag;
+        std::string lastModified;
+    };
+
+private:
+    std::filesystem::path _directory;
+    std::string _arch;
+    int _lockFd;
+
+    [[nodiscard]] std::filesystem::path entryPath() const {
+        return _directory / ("runtime-" + _arch + ".entry");
+    }
+
+    [[nodiscard]] std::filesystem::path blobPath(const std::string& sha256) const {
+        return _directory / ("runtime-" + _arch + "-" + sha256);
+    }
+
+public:
+    RuntimeCache(std::filesystem::path directory, std::string arch)
+        : _directory(std::move(directory))
+        , _arch(std::move(arch))
+        , _lockFd(-1) {}
+
+    RuntimeCache(const RuntimeCache&) = delete;
+
+    ~RuntimeCache() {
+        if (_lockFd >= 0) {
+            close(_lockFd);
+        }
+    }
+
+    static std::filesystem::path defaultDirectory(const Environment& environment) {
+        const auto xdgCacheHome = environment.first({"XDG_CACHE_HOME"});
+        if (!xdgCacheHome.empty()) {
+            return std::filesystem::path(xdgCacheHome) / "appimagetool" / "runtimes";
+        }
+
+        const auto home = environment.first({"HOME"});
+        if (!home.empty()) {
+            return std::filesystem::path(home) / ".cache" / "appimagetool" / "runtimes";
+        }
+
+        return {};
+    }
+
+    /**
+     * Make sure the cache directory exists.
+     * @return true if the cache can be written to, false otherwise
+     */
+    bool prepare() {
+        if (_directory.empty()) {
+            return false;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(_directory, ec);
+        return !ec && access(_directory.c_str(), W_OK) == 0;
+    }
+
+    /**
+     * Look up the current entry for the architecture, and open the file it refers to.
+     * @return entry and read-only file descriptor, or no value if the cache has no usable entry
+     */
+    std::optional<std::pair<Entry, int>> lookup() const {
+        std::ifstream ifs(entryPath());
+        if (!ifs) {
+            return std::nullopt;
+        }
+
+        Entry entry;
+        std::string line;
+        while (std::getline(ifs, line)) {
+            const auto space = line.find(' ');
+            if (space == std::string::npos) {
+                continue;
+            }
+
+            const auto key = line.substr(0, space);
+            const auto value = line.substr(space + 1);
+
+            if (key == "sha256") {
+                entry.sha256 = value;
+            } else if (key == "etag") {
+                entry.etag = value;
+            } else if (key == "last-modified") {
+                entry.lastModified = value;
+            }
+        }
+
+        // a concurrent writer might have replaced the file in the meantime, in that case this is just a miss
+        if (entry.sha256.empty()) {
+            return std::nullopt;
+        }
+
+        const int fd = open(blobPath(entry.sha256).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return std::nullopt;
+        }
+
+        return std::make_pair(entry, fd);
+    }
+
+    /**
+     * Take the writer lock. Blocks until concurrent writers for the same architecture are done.
+     */
+    void lock() {
+        _lockFd = open((_directory / ("runtime-" + _arch + ".lock")).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (_lockFd >= 0) {
+            while (flock(_lockFd, LOCK_EX) != 0 && errno == EINTR) {}
+        }
+    }
+
+    /**
+     * Create a file in the cache directory a new download can be written to.
+     * @return path and file descriptor, the descriptor is negative on failure
+     */
+    std::pair<std::filesystem::path, int> createDownloadFile() const {
+        auto pattern = (_directory / ".download-XXXXXX").string();
+        const int fd = mkostemp(pattern.data(), O_CLOEXEC);
+        return {pattern, fd};
+    }
+
+    /**
+     * Move a finished download into place and point the architecture's entry to it.
+     * @return true on success, false otherwise
+     */
+    bool publish(const std::filesystem::path& downloadPath, int fd, const Entry& entry) const {
+        const auto target = blobPath(entry.sha256);
+
+        fchmod(fd, 0644);
+
+        if (rename(downloadPath.c_str(), target.c_str()) != 0) {
+            return false;
+        }
+
+        auto tempEntryPath = entryPath();
+        tempEntryPath += ".tmp-" + std::to_string(getpid());
+
+        {
+            std::ofstream ofs(tempEntryPath);
+            ofs << "sha256 " << entry.sha256 << std::endl;
+            if (!entry.etag.empty()) {
+                ofs << "etag " << entry.etag << std::endl;
+            }
+            if (!entry.lastModified.empty()) {
+                ofs << "last-modified " << entry.lastModified << std::endl;
+            }
+
+            if (!ofs) {
+                std::filesystem::remove(tempEntryPath);
+                return false;
+            }
+        }
+
+        if (rename(tempEntryPath.c_str(), entryPath().c_str()) != 0) {
+            std::filesystem::remove(tempEntryPath);
+            return false;
+        }
+
+        // older runtimes for this architecture are no longer referenced
+        // readers which still have them open are not affected, and readers which fail to open them treat it as a miss
+        const auto prefix = "runtime-" + _arch + "-";
+        std::error_code ec;
+        for (const auto& file : std::filesystem::directory_iterator(_directory, ec)) {
+            const auto name = file.path().filename().string();
+            if (name.rfind(prefix, 0) == 0 && file.path() != target) {
+                std::filesystem::remove(file.path(), ec);
+            }
+        }
+
+        return true;
+    }
+};
+
+std::string runtimeUrl(const Environment& environment, const std::string& arch) {
+    // allows for testing against a local server, or using a mirror
+    const auto baseUrl = environment.first({"APPIMAGETOOL_RUNTIME_BASE_URL"});
+
     std::ostringstream urlstream;
-    urlstream << "https://github.com/AppImage/type2-runtime/releases/download/continuous/runtime-" << arch;
-    auto url = urlstream.str();
+    if (!baseUrl.empty()) {
+        urlstream << baseUrl;
+        if (urlstream.str().back() != '/') {
+            urlstream << '/';
+        }
+    } else {
+        urlstream << "https://github.com/AppImage/type2-runtime/releases/download/continuous/";
+    }
+    urlstream << "runtime-" << arch;
+    return urlstream.str();
+}
+
+bool fileSize(int fd, size_t* size) {
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    *size = st.st_size;
+    return true;
+}
+
+bool fetch_runtime(char *arch, const char* const* environment, size_t *size, int *fd, bool offline, bool verbose) {
+    const Environment buildEnvironment(environment);
+
+    RuntimeCache cache(RuntimeCache::defaultDirectory(buildEnvironment), arch);
+
+    const bool cacheUsable = cache.prepare();
+
+    if (offline) {
+        auto cached = cacheUsable ? cache.lookup() : std::nullopt;
+        if (!cached.has_value()) {
+            std::cerr << "No cached runtime for architecture " << arch << " available in offline mode" << std::endl;
+            return false;
+        }
+
+        std::cerr << "Using cached runtime " << cached->first.sha256 << " (offline mode)" << std::endl;
+        *fd = cached->second;
+        return fileSize(*fd, size);
+    }
+
+    // serialize downloads among parallel jobs, whoever comes second will most likely get a 304 response
+    if (cacheUsable) {
+        cache.lock();
+    }
+
+    auto cached = cacheUsable ? cache.lookup() : std::nullopt;
+
+    // use the cached runtime if it is still current, or if the server cannot be reached
+    auto useCached = [&](const std::string& reason) {
+        std::cerr << "Using cached runtime " << cached->first.sha256 << " (" << reason << ")" << std::endl;
+        *fd = cached->second;
+        return fileSize(*fd, size);
+    };
+
+    std::filesystem::path downloadPath;
+    int downloadFd = -1;
+
+    if (cacheUsable) {
+        std::tie(downloadPath, downloadFd) = cache.createDownloadFile();
+    }
+
+    if (downloadFd < 0) {
+        downloadPath.clear();
+        downloadFd = create_runtime_file_descriptor();
+
+        if (downloadFd < 0) {
+            std::cerr << "Failed to create file to download runtime to" << std::endl;
+            return false;
+        }
+    }
+
+    auto discardDownload = [&]() {
+        close(downloadFd);
+        if (!downloadPath.empty()) {
+            unlink(downloadPath.c_str());
+        }
+    };
+
+    const auto url = runtimeUrl(buildEnvironment, arch);
 
     std::cerr << "Downloading runtime file from " << url << std::endl;
 
+    gcry_md_hd_t sha256Handle = nullptr;
+    if (gcry_check_version(nullptr) == nullptr || gcry_md_open(&sha256Handle, GCRY_MD_SHA256, 0) != GPG_ERR_NO_ERROR) {
+        std::cerr << "Failed to initialize SHA-256 context" << std::endl;
+        discardDownload();
+        return false;
+    }
+
     try {
-        GetRequest request(url, verbose);
+        GetRequest request(url, downloadFd, verbose);
+        request.setUpProxy(buildEnvironment, url);
+
+        // revalidate the cached copy, the server will respond with 304 Not Modified if it's still current
+        if (cached.has_value()) {
+            if (!cached->first.etag.empty()) {
+                request.addHeader("If-None-Match: " + cached->first.etag);
+            } else if (!cached->first.lastModified.empty()) {
+                request.addHeader("If-Modified-Since: " + cached->first.lastModified);
+            }
+        }
+
+        request.setBodyObserver([sha256Handle](const char* data, size_t bytes) {
+            gcry_md_write(sha256Handle, data, bytes);
+        });
 
         auto response = request.perform();
 
+        if (cached.has_value() && response.statusCode() == 304) {
+            gcry_md_close(sha256Handle);
+            discardDownload();
+            return useCached("not modified on server");
+        }
+
         if (response.statusCode() != 200) {
             std::cerr << "Failed to download runtime: server returned status code " << response.statusCode() << std::endl;
+            gcry_md_close(sha256Handle);
+            discardDownload();
+            if (cached.has_value()) {
+                return useCached("download failed");
+            }
             return false;
         }
 
         std::cerr << "Downloaded runtime binary of size " << response.contentLength() << std::endl;
 
-        if (!response.success()) {
+        if (!response.success() || response.bytesWritten() != static_cast<size_t>(response.contentLength())) {
+            std::cerr << "Error: downloaded data size of " << response.bytesWritten()
+                      << " does not match content-length of " << response.contentLength() << std::endl;
+            gcry_md_close(sha256Handle);
+            discardDownload();
+            if (cached.has_value()) {
+                return useCached("download incomplete");
+            }
             return false;
         }
 
-        auto runtimeData = response.data();
+        *size = response.bytesWritten();
 
-        if (runtimeData.size() != response.contentLength()) {
-            std::cerr << "Error: downloaded data size of " << runtimeData.size()
-                      << " does not match content-length of " << response.contentLength() << std::endl;
-            return false;
+        std::ostringstream sha256Hex;
+        const auto* digest = gcry_md_read(sha256Handle, GCRY_MD_SHA256);
+        for (unsigned int i = 0; i < gcry_md_get_algo_dlen(GCRY_MD_SHA256); ++i) {
+            sha256Hex << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(digest[i]);
         }
+        gcry_md_close(sha256Handle);
 
-        *size = response.contentLength();
+        if (cached.has_value()) {
+            close(cached->second);
+        }
 
-        *buffer = (char *) calloc(response.contentLength() + 1, 1);
+        if (!downloadPath.empty()) {
+            const RuntimeCache::Entry entry{sha256Hex.str(), response.header("etag"), response.header("last-modified")};
 
-        if (*buffer == nullptr) {
-            std::cerr << "Failed to allocate buffer" << std::endl;
-            return false;
+            if (cache.publish(downloadPath, downloadFd, entry)) {
+                if (verbose) {
+                    std::cerr << "Stored runtime " << entry.sha256 << " in cache" << std::endl;
+                }
+            } else {
+                std::cerr << "Warning: failed to store runtime in cache" << std::endl;
+                unlink(downloadPath.c_str());
+            }
         }
 
-        std::copy(runtimeData.begin(), runtimeData.end(), *buffer);
-
+        *fd = downloadFd;
         return true;
     } catch (const CurlException& e) {
         std::cerr << "libcurl error: " << e.what() << std::endl;
+        gcry_md_close(sha256Handle);
+        discardDownload();
+        if (cached.has_value()) {
+            return useCached("server unreachable");
+        }
         return false;
     }
 }
+
+void fetch_runtime_init() {
+    // libcurl counts its initializations, GetRequest's init and cleanup only change the count from now on
+    curl_global_init(CURL_GLOBAL_ALL);
+}
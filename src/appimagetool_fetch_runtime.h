@@ -1,13 +1,23 @@
 #pragma once
 
 /**
- * Download runtime from GitHub into a buffer.
- * This function allocates a buffer of the right size internally, which needs to be cleaned up by the caller.
+ * Provide the runtime for the given architecture as a readable file descriptor.
+ * Runtimes are cached in $XDG_CACHE_HOME/appimagetool/runtimes and revalidated with the server, so they are downloaded
+ * from GitHub only if they have changed. In offline mode, the network is not accessed at all.
+ * The data is never held in memory as a whole. The caller must close the returned file descriptor.
+ * @param environment NULL terminated environment of the build, which provides the cache directory, the server
+ *        (APPIMAGETOOL_RUNTIME_BASE_URL) and the proxy settings; NULL uses the process' environment
  */
 #ifdef __cplusplus
 extern "C" {
 #endif
-bool fetch_runtime(char *arch, size_t *size, char **buffer, bool verbose);
+bool fetch_runtime(char *arch, const char* const* environment, size_t *size, int *fd, bool offline, bool verbose);
+
+/**
+ * Initialize libcurl ahead of fetching runtimes. It stays initialized, so that fetching runtimes later on does not
+ * initialize and clean it up every time, e.g., in the jobs of the daemon.
+ */
+void fetch_runtime_init(void);
 #ifdef __cplusplus
 }
 #endif
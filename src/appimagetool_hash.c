@@ -0,0 +1,740 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <gcrypt.h>
+
+#include "appimagetool_hash.h"
+#include "appimagetool_sign.h"
+#include "md5.h"
+#include "util.h"
+
+// large reads keep the number of syscalls low and the device busy
+// the buffers are page aligned, and since the file is read from the start in full buffers, so is every read
+static const size_t read_buffer_size = 4 * 1024 * 1024;
+static const size_t read_buffer_alignment = 4096;
+
+// a reader thread fills the buffers while the previous ones are being hashed
+// with three buffers, one can be hashed while one is being read and one is already waiting
+#define READ_PIPELINE_DEPTH 3
+
+/*
+ * The type 2 digest has to agree with the one the reference implementation calculates, i.e., the chunked
+ * appimage_type2_digest_md5 of libappimage and earlier versions of appimagetool, which validators use. It hashes the
+ * file in 4 KiB chunks read into the same buffer, and its results depend on details of how it skips the sections:
+ * - bytes it skips keep the value they had in the previous chunk, and so does the rest of the last chunk
+ * - the bytes before a section are always read to the start of the buffer, even after other bytes were skipped
+ * - the rest of a section spanning several chunks is skipped at the start of the following chunks, starting with its
+ *   remainder modulo the chunk size
+ * - a section which starts exactly at the start of a chunk is not skipped at all
+ * - if two sections start in the same chunk, all following chunks are shifted
+ * None of this depends on the data, so the reads it makes are planned chunk by chunk and served from the buffers of
+ * the single pass. Chunks which are read in full are hashed directly from those buffers.
+ */
+#define TYPE2_MD5_CHUNK_SIZE 4096
+
+// a read of the reference implementation: length bytes from the file at offset into the chunk at chunk_offset
+typedef struct {
+    unsigned long offset;
+    size_t chunk_offset;
+    size_t length;
+} type2_md5_read_t;
+
+typedef struct {
+    const appimage_byte_range_t* sections;
+    size_t sections_count;
+    // position of the reference implementation after the current chunk, and what it has to skip in the next ones
+    unsigned long position;
+    unsigned long skip;
+    unsigned long chunks_hashed;
+    // reads of the current chunk, one before each section at most and one for the rest of the chunk
+    type2_md5_read_t* reads;
+    size_t reads_count;
+    size_t next_read;
+    // the buffer of the reference implementation, which is uninitialized before the first chunk, zeroes are used then
+    char chunk[TYPE2_MD5_CHUNK_SIZE];
+    // consecutive chunks hashed directly from a read buffer, the last of which has not been copied to chunk yet
+    const char* direct_run;
+    size_t direct_run_length;
+    Md5Context context;
+} type2_md5_t;
+
+static void type2_md5_add_read(type2_md5_t* type2_md5, size_t chunk_offset, size_t length) {
+    if (length > 0) {
+        type2_md5_read_t* read = &type2_md5->reads[type2_md5->reads_count++];
+        read->offset = type2_md5->position;
+        read->chunk_offset = chunk_offset;
+        read->length = length;
+    }
+    type2_md5->position += length;
+}
+
+// plan the reads of the next chunk, leaving position where the reference implementation is after it
+static void type2_md5_plan_chunk(type2_md5_t* type2_md5) {
+    const unsigned long chunk_position = type2_md5->position;
+    long left_this_chunk = TYPE2_MD5_CHUNK_SIZE;
+
+    type2_md5->reads_count = 0;
+    type2_md5->next_read = 0;
+
+    if (type2_md5->skip > 0) {
+        const unsigned long skip_this_chunk = type2_md5->skip % TYPE2_MD5_CHUNK_SIZE == 0 ?
+            TYPE2_MD5_CHUNK_SIZE : type2_md5->skip % TYPE2_MD5_CHUNK_SIZE;
+        left_this_chunk -= (long) skip_this_chunk;
+        type2_md5->skip -= skip_this_chunk;
+        type2_md5->position += skip_this_chunk;
+    }
+
+    // the sections are checked in the order given
+    for (size_t i = 0; i < type2_md5->sections_count; ++i) {
+        const unsigned long offset = type2_md5->sections[i].offset;
+        const unsigned long length = type2_md5->sections[i].length;
+
+        if (length == 0 || offset <= chunk_position || offset - chunk_position >= TYPE2_MD5_CHUNK_SIZE) {
+            continue;
+        }
+
+        const unsigned long begin_of_section = offset - chunk_position;
+        type2_md5_add_read(type2_md5, 0, begin_of_section);
+
+        left_this_chunk -= (long) (begin_of_section + length);
+        if (left_this_chunk < 0) {
+            type2_md5->skip = (unsigned long) -left_this_chunk;
+            left_this_chunk = 0;
+        }
+
+        type2_md5->position += TYPE2_MD5_CHUNK_SIZE - (unsigned long) left_this_chunk - begin_of_section;
+    }
+
+    if (left_this_chunk > 0) {
+        type2_md5_add_read(type2_md5, TYPE2_MD5_CHUNK_SIZE - (size_t) left_this_chunk, (size_t) left_this_chunk);
+    }
+}
+
+static bool type2_md5_init(type2_md5_t* type2_md5, const appimage_byte_range_t* sections, size_t sections_count) {
+    memset(type2_md5, 0, sizeof(*type2_md5));
+
+    type2_md5->reads = malloc((sections_count + 1) * sizeof(type2_md5_read_t));
+    if (type2_md5->reads == NULL) {
+        return false;
+    }
+
+    type2_md5->sections = sections;
+    type2_md5->sections_count = sections_count;
+    Md5Initialise(&type2_md5->context);
+    type2_md5_plan_chunk(type2_md5);
+    return true;
+}
+
+static void type2_md5_flush_direct_run(type2_md5_t* type2_md5) {
+    if (type2_md5->direct_run_length == 0) {
+        return;
+    }
+
+    Md5Update(&type2_md5->context, type2_md5->direct_run, (uint32_t) type2_md5->direct_run_length);
+    memcpy(type2_md5->chunk, type2_md5->direct_run + type2_md5->direct_run_length - TYPE2_MD5_CHUNK_SIZE, TYPE2_MD5_CHUNK_SIZE);
+    type2_md5->direct_run_length = 0;
+}
+
+// serve the planned reads from a buffer of the pass, hashing every chunk that is complete
+static void type2_md5_update(type2_md5_t* type2_md5, const char* buffer, size_t size, unsigned long position) {
+    const unsigned long end = position + size;
+
+    for (;;) {
+        const type2_md5_read_t* first = &type2_md5->reads[0];
+
+        if (type2_md5->reads_count == 1 && first->chunk_offset == 0 && first->length == TYPE2_MD5_CHUNK_SIZE &&
+            first->offset + TYPE2_MD5_CHUNK_SIZE <= end) {
+            const char* data = buffer + (first->offset - position);
+
+            if (type2_md5->direct_run_length > 0 && type2_md5->direct_run + type2_md5->direct_run_length != data) {
+                type2_md5_flush_direct_run(type2_md5);
+            }
+            if (type2_md5->direct_run_length == 0) {
+                type2_md5->direct_run = data;
+            }
+            type2_md5->direct_run_length += TYPE2_MD5_CHUNK_SIZE;
+
+            type2_md5->chunks_hashed++;
+            type2_md5_plan_chunk(type2_md5);
+            continue;
+        }
+
+        // the chunk keeps bytes of the previous one, and the buffer the run is in may not be there anymore next time
+        type2_md5_flush_direct_run(type2_md5);
+
+        while (type2_md5->next_read < type2_md5->reads_count) {
+            type2_md5_read_t* read = &type2_md5->reads[type2_md5->next_read];
+
+            if (read->offset >= end) {
+                return;
+            }
+
+            const size_t available = read->length < end - read->offset ? read->length : end - read->offset;
+            memcpy(type2_md5->chunk + read->chunk_offset, buffer + (read->offset - position), available);
+            read->offset += available;
+            read->chunk_offset += available;
+            read->length -= available;
+
+            if (read->length > 0) {
+                return;
+            }
+
+            type2_md5->next_read++;
+        }
+
+        // until the file is known to reach past the chunk, the chunk might be one after the last one
+        if (type2_md5->position > end) {
+            return;
+        }
+
+        Md5Update(&type2_md5->context, type2_md5->chunk, TYPE2_MD5_CHUNK_SIZE);
+        type2_md5->chunks_hashed++;
+        type2_md5_plan_chunk(type2_md5);
+    }
+}
+
+// hash the remaining chunks of a file of the given size, reads past its end leave the chunk as it is
+static void type2_md5_final(type2_md5_t* type2_md5, unsigned long size, char* digest) {
+    type2_md5_flush_direct_run(type2_md5);
+
+    const unsigned long chunks = (size + TYPE2_MD5_CHUNK_SIZE - 1) / TYPE2_MD5_CHUNK_SIZE;
+
+    while (type2_md5->chunks_hashed < chunks) {
+        Md5Update(&type2_md5->context, type2_md5->chunk, TYPE2_MD5_CHUNK_SIZE);
+        type2_md5->chunks_hashed++;
+        type2_md5_plan_chunk(type2_md5);
+    }
+
+    MD5_HASH checksum;
+    Md5Finalise(&type2_md5->context, &checksum);
+    memcpy(digest, checksum.bytes, APPIMAGE_MD5_DIGEST_SIZE);
+}
+
+// in the order the reference implementation checks them in
+static size_t collect_type2_md5_skipped_ranges(const appimage_elf_sections_t* sections, appimage_byte_range_t* ranges) {
+    static const char* const section_names[] = {".digest_md5", ".sha256_sig", ".sig_key"};
+
+    size_t count = 0;
+
+    for (size_t i = 0; i < sizeof(section_names) / sizeof(section_names[0]); ++i) {
+        unsigned long offset = 0;
+        unsigned long length = 0;
+
+        appimage_elf_sections_find(sections, section_names[i], &offset, &length);
+
+        if (offset == 0 || length == 0) {
+            continue;
+        }
+
+        ranges[count].offset = offset;
+        ranges[count].length = length;
+        count++;
+    }
+
+    return count;
+}
+
+// fill the entire buffer unless the end of the file is reached, so that every read starts at an aligned offset
+static ssize_t read_full(int fd, char* buffer, size_t size) {
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t bytes_read = read(fd, buffer + total, size - total);
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (bytes_read == 0) {
+            break;
+        }
+
+        total += (size_t) bytes_read;
+    }
+
+    return (ssize_t) total;
+}
+
+typedef struct {
+    int types;
+    unsigned long position;
+    type2_md5_t type2_md5;
+    Md5Context md5_context;
+    gcry_md_hd_t sha256_handle;
+    gcry_md_hd_t sha1_handle;
+    appimage_hash_observer_t observer;
+    void* observer_data;
+} hash_state_t;
+
+static void hash_state_update(hash_state_t* state, char* buffer, size_t size) {
+    if (state->observer != NULL) {
+        state->observer(buffer, size, state->position, state->observer_data);
+    }
+
+    // the plain digests see the data as is
+    if ((state->types & APPIMAGE_HASH_SHA256) != 0) {
+        gcry_md_write(state->sha256_handle, buffer, size);
+    }
+
+    if ((state->types & APPIMAGE_HASH_SHA1) != 0) {
+        gcry_md_write(state->sha1_handle, buffer, size);
+    }
+
+    if ((state->types & APPIMAGE_HASH_MD5) != 0) {
+        Md5Update(&state->md5_context, buffer, (uint32_t) size);
+    }
+
+    if ((state->types & APPIMAGE_HASH_TYPE2_MD5) != 0) {
+        type2_md5_update(&state->type2_md5, buffer, size, state->position);
+    }
+
+    state->position += (unsigned long) size;
+}
+
+// ring of buffers shared by the reader thread and the hashing thread
+// produced and consumed only ever increase, buffer i is stored at index i % READ_PIPELINE_DEPTH
+typedef struct {
+    int fd;
+    char* buffers[READ_PIPELINE_DEPTH];
+    ssize_t sizes[READ_PIPELINE_DEPTH];
+    int read_error;
+    size_t produced;
+    size_t consumed;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} read_pipeline_t;
+
+static void* read_pipeline_reader(void* data) {
+    read_pipeline_t* pipeline = data;
+
+    for (;;) {
+        pthread_mutex_lock(&pipeline->mutex);
+        while (pipeline->produced - pipeline->consumed == READ_PIPELINE_DEPTH) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+        }
+        const size_t index = pipeline->produced % READ_PIPELINE_DEPTH;
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        // the buffer is owned by the reader until produced is incremented
+        const ssize_t bytes_read = read_full(pipeline->fd, pipeline->buffers[index], read_buffer_size);
+        const int read_error = errno;
+
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->sizes[index] = bytes_read;
+        if (bytes_read < 0) {
+            pipeline->read_error = read_error;
+        }
+        pipeline->produced++;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        // a short read means the end of the file has been reached
+        if (bytes_read < 0 || (size_t) bytes_read < read_buffer_size) {
+            return NULL;
+        }
+    }
+}
+
+// read the entire file with a reader thread and feed every buffer into the hashes on the calling thread
+static bool hash_pipelined(read_pipeline_t* pipeline, hash_state_t* state) {
+    pthread_t reader;
+
+    if (pthread_create(&reader, NULL, read_pipeline_reader, pipeline) != 0) {
+        // reading and hashing alternately on this thread is slower, but works just as well
+        for (;;) {
+            ssize_t bytes_read = read_full(pipeline->fd, pipeline->buffers[0], read_buffer_size);
+
+            if (bytes_read < 0) {
+                pipeline->read_error = errno;
+                return false;
+            }
+
+            hash_state_update(state, pipeline->buffers[0], (size_t) bytes_read);
+
+            if ((size_t) bytes_read < read_buffer_size) {
+                return true;
+            }
+        }
+    }
+
+    bool success = true;
+
+    for (;;) {
+        pthread_mutex_lock(&pipeline->mutex);
+        while (pipeline->consumed == pipeline->produced) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+        }
+        const size_t index = pipeline->consumed % READ_PIPELINE_DEPTH;
+        const ssize_t bytes_read = pipeline->sizes[index];
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        if (bytes_read < 0) {
+            success = false;
+            break;
+        }
+
+        hash_state_update(state, pipeline->buffers[index], (size_t) bytes_read);
+
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->consumed++;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        if ((size_t) bytes_read < read_buffer_size) {
+            break;
+        }
+    }
+
+    // the reader has stopped after the last buffer it produced, which was the last one consumed
+    pthread_join(reader, NULL);
+
+    return success;
+}
+
+// name the SHA-256 implementation libgcrypt picks on this machine, based on the hardware features it detected
+static const char* sha256_backend_name() {
+    char* hardware_features = gcry_get_config(0, "hwflist");
+
+    if (hardware_features == NULL) {
+        return "generic";
+    }
+
+    const char* name = "generic";
+
+    if (strstr(hardware_features, "intel-shaext") != NULL) {
+        name = "SHA-NI";
+    } else if (strstr(hardware_features, "arm-sha2") != NULL) {
+        name = "ARMv8 Crypto Extensions";
+    } else if (strstr(hardware_features, "intel-avx2") != NULL && strstr(hardware_features, "intel-bmi2") != NULL) {
+        name = "AVX2";
+    } else if (strstr(hardware_features, "intel-avx") != NULL) {
+        name = "AVX";
+    } else if (strstr(hardware_features, "intel-ssse3") != NULL) {
+        name = "SSSE3";
+    } else if (strstr(hardware_features, "arm-neon") != NULL) {
+        name = "NEON";
+    }
+
+    gcry_free(hardware_features);
+    return name;
+}
+
+static double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+bool appimage_hash_fd(
+    int fd,
+    int types,
+    const appimage_byte_range_t* skipped_ranges,
+    size_t skipped_ranges_count,
+    appimage_hash_observer_t observer,
+    void* observer_data,
+    appimage_hashes_t* hashes,
+    bool verbose
+) {
+    hash_state_t state = {
+        .types = types,
+        .position = 0,
+        .sha256_handle = NULL,
+        .sha1_handle = NULL,
+        .observer = observer,
+        .observer_data = observer_data,
+    };
+
+    if ((types & (APPIMAGE_HASH_SHA256 | APPIMAGE_HASH_SHA1)) != 0) {
+        if (!init_gcrypt()) {
+            return false;
+        }
+    }
+
+    if ((types & APPIMAGE_HASH_TYPE2_MD5) != 0 && !type2_md5_init(&state.type2_md5, skipped_ranges, skipped_ranges_count)) {
+        fprintf(stderr, "Failed to allocate the type 2 digest's state\n");
+        return false;
+    }
+
+    if ((types & APPIMAGE_HASH_SHA256) != 0) {
+        gpg_error_t error = gcry_md_open(&state.sha256_handle, GCRY_MD_SHA256, 0);
+        if (error != GPG_ERR_NO_ERROR) {
+            fprintf(stderr, "gcry_md_open failed: %s\n", gcry_strerror(error));
+            free(state.type2_md5.reads);
+            return false;
+        }
+
+        if (verbose) {
+            fprintf(stderr, "Using %s implementation of SHA-256\n", sha256_backend_name());
+        }
+    }
+
+    if ((types & APPIMAGE_HASH_SHA1) != 0) {
+        gpg_error_t error = gcry_md_open(&state.sha1_handle, GCRY_MD_SHA1, 0);
+        if (error != GPG_ERR_NO_ERROR) {
+            fprintf(stderr, "gcry_md_open failed: %s\n", gcry_strerror(error));
+            gcry_md_close(state.sha256_handle);
+            free(state.type2_md5.reads);
+            return false;
+        }
+    }
+
+    Md5Initialise(&state.md5_context);
+
+    read_pipeline_t pipeline = {
+        .fd = fd,
+        .read_error = 0,
+        .produced = 0,
+        .consumed = 0,
+    };
+
+    bool success = true;
+
+    for (int i = 0; i < READ_PIPELINE_DEPTH; ++i) {
+        void* buffer = NULL;
+        if (posix_memalign(&buffer, read_buffer_alignment, read_buffer_size) != 0) {
+            fprintf(stderr, "Failed to allocate read buffers for hashing\n");
+            success = false;
+        }
+        pipeline.buffers[i] = buffer;
+    }
+
+    if (success) {
+        pthread_mutex_init(&pipeline.mutex, NULL);
+        pthread_cond_init(&pipeline.changed, NULL);
+
+        // the file is read once from start to end, let the kernel read ahead aggressively
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        const double start = monotonic_seconds();
+        success = hash_pipelined(&pipeline, &state);
+        const double elapsed = monotonic_seconds() - start;
+
+        pthread_cond_destroy(&pipeline.changed);
+        pthread_mutex_destroy(&pipeline.mutex);
+
+        if (!success) {
+            fprintf(stderr, "Failed to read file for hashing: %s\n", strerror(pipeline.read_error));
+        } else if (verbose) {
+            fprintf(
+                stderr, "Hashed %lu bytes in a single pass in %.3f s (%.2f GB/s)\n",
+                state.position, elapsed, elapsed > 0 ? (double) state.position / elapsed / 1e9 : 0.0
+            );
+        }
+    }
+
+    for (int i = 0; i < READ_PIPELINE_DEPTH; ++i) {
+        free(pipeline.buffers[i]);
+    }
+
+    if (success && (types & APPIMAGE_HASH_TYPE2_MD5) != 0) {
+        type2_md5_final(&state.type2_md5, state.position, hashes->type2_md5);
+    }
+    free(state.type2_md5.reads);
+
+    if (!success) {
+        gcry_md_close(state.sha256_handle);
+        gcry_md_close(state.sha1_handle);
+        return false;
+    }
+
+    if ((types & APPIMAGE_HASH_MD5) != 0) {
+        MD5_HASH checksum;
+        Md5Finalise(&state.md5_context, &checksum);
+        memcpy(hashes->md5, checksum.bytes, APPIMAGE_MD5_DIGEST_SIZE);
+    }
+
+    if ((types & APPIMAGE_HASH_SHA256) != 0) {
+        gcry_md_final(state.sha256_handle);
+        memcpy(hashes->sha256, gcry_md_read(state.sha256_handle, GCRY_MD_SHA256), APPIMAGE_SHA256_DIGEST_SIZE);
+        gcry_md_close(state.sha256_handle);
+    }
+
+    if ((types & APPIMAGE_HASH_SHA1) != 0) {
+        gcry_md_final(state.sha1_handle);
+        memcpy(hashes->sha1, gcry_md_read(state.sha1_handle, GCRY_MD_SHA1), APPIMAGE_SHA1_DIGEST_SIZE);
+        gcry_md_close(state.sha1_handle);
+    }
+
+    return true;
+}
+
+bool appimage_hash_file(const char* path, int types, const appimage_elf_sections_t* sections, appimage_hashes_t* hashes, bool verbose) {
+    return appimage_hash_file_observed(path, types, sections, NULL, NULL, hashes, verbose);
+}
+
+bool appimage_hash_file_observed(
+    const char* path,
+    int types,
+    const appimage_elf_sections_t* sections,
+    appimage_hash_observer_t observer,
+    void* observer_data,
+    appimage_hashes_t* hashes,
+    bool verbose
+) {
+    appimage_byte_range_t skipped_ranges[3];
+    size_t skipped_ranges_count = 0;
+
+    if ((types & APPIMAGE_HASH_TYPE2_MD5) != 0) {
+        appimage_elf_sections_t* parsed_sections = NULL;
+
+        if (sections == NULL) {
+            sections = parsed_sections = appimage_elf_sections_open(path);
+        }
+
+        if (sections == NULL) {
+            fprintf(stderr, "Failed to look up ELF sections excluded from the MD5 digest in %s\n", path);
+            return false;
+        }
+
+        skipped_ranges_count = collect_type2_md5_skipped_ranges(sections, skipped_ranges);
+        appimage_elf_sections_free(parsed_sections);
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s for hashing: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const bool success = appimage_hash_fd(
+        fd, types, skipped_ranges, skipped_ranges_count, observer, observer_data, hashes, verbose
+    );
+    close(fd);
+
+    if (!success) {
+        fprintf(stderr, "Failed to hash %s\n", path);
+    }
+
+    return success;
+}
+
+// rewrite a checksum list, replacing an existing line for the given filename, and publish it atomically
+static bool rewrite_checksum_file(const char* list_path, char* temp_path, const char* list_name, const char* filename, const char* hex_digest) {
+    int temp_fd = mkstemp(temp_path);
+    if (temp_fd < 0) {
+        fprintf(stderr, "Failed to create temporary file for %s: %s\n", list_name, strerror(errno));
+        return false;
+    }
+
+    FILE* out = fdopen(temp_fd, "w");
+    if (out == NULL) {
+        close(temp_fd);
+        unlink(temp_path);
+        return false;
+    }
+
+    // keep all entries for other files
+    FILE* in = fopen(list_path, "r");
+    if (in != NULL) {
+        char* line = NULL;
+        size_t line_size = 0;
+
+        while (getline(&line, &line_size, in) >= 0) {
+            // format: <hex digest><space><space or asterisk><filename>
+            const char* separator = strchr(line, ' ');
+            if (separator != NULL && separator[1] != '\0') {
+                const char* name = separator + 2;
+                size_t name_length = strcspn(name, "\n");
+                if (name_length == strlen(filename) && strncmp(name, filename, name_length) == 0) {
+                    continue;
+                }
+            }
+            fputs(line, out);
+        }
+
+        free(line);
+        fclose(in);
+    }
+
+    fprintf(out, "%s  %s\n", hex_digest, filename);
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", list_name, strerror(errno));
+        unlink(temp_path);
+        return false;
+    }
+
+    chmod(temp_path, 0644);
+
+    if (rename(temp_path, list_path) != 0) {
+        fprintf(stderr, "Failed to update %s: %s\n", list_path, strerror(errno));
+        unlink(temp_path);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Several builds (batch threads, daemon workers) may publish into the same directory, so the read-modify-write
+ * of a list happens under an exclusive lock on a sidecar file; the list itself is replaced by rename, hence
+ * cannot carry the lock
+ */
+static bool update_checksum_file(const char* directory, const char* list_name, const char* filename, const char* hex_digest) {
+    char list_path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    char lock_path[PATH_MAX];
+
+    if (snprintf(list_path, sizeof(list_path), "%s/%s", directory, list_name) >= (int) sizeof(list_path) ||
+        snprintf(temp_path, sizeof(temp_path), "%s/.%s.XXXXXX", directory, list_name) >= (int) sizeof(temp_path) ||
+        snprintf(lock_path, sizeof(lock_path), "%s/.%s.lock", directory, list_name) >= (int) sizeof(lock_path)) {
+        fprintf(stderr, "Path to %s is too long\n", list_name);
+        return false;
+    }
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0) {
+        fprintf(stderr, "Failed to open lock file %s: %s\n", lock_path, strerror(errno));
+        return false;
+    }
+
+    int result;
+    while ((result = flock(lock_fd, LOCK_EX)) != 0 && errno == EINTR) {}
+    if (result != 0) {
+        fprintf(stderr, "Failed to lock %s: %s\n", lock_path, strerror(errno));
+        close(lock_fd);
+        return false;
+    }
+
+    bool success = rewrite_checksum_file(list_path, temp_path, list_name, filename, hex_digest);
+
+    // closing releases the lock; the lock file stays, removing it would race with builds waiting for it
+    close(lock_fd);
+    return success;
+}
+
+bool appimage_write_checksum_files(const char* path, const appimage_hashes_t* hashes) {
+    // dirname and basename may modify their arguments
+    char* path_for_dirname = strdup(path);
+    char* path_for_basename = strdup(path);
+
+    const char* directory = dirname(path_for_dirname);
+    const char* filename = basename(path_for_basename);
+
+    char* sha256_hex = appimage_hexlify(hashes->sha256, APPIMAGE_SHA256_DIGEST_SIZE);
+    char* md5_hex = appimage_hexlify(hashes->md5, APPIMAGE_MD5_DIGEST_SIZE);
+
+    bool success = update_checksum_file(directory, "SHA256SUMS", filename, sha256_hex) &&
+        update_checksum_file(directory, "MD5SUMS", filename, md5_hex);
+
+    free(sha256_hex);
+    free(md5_hex);
+    free(path_for_dirname);
+    free(path_for_basename);
+
+    return success;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "appimagetool_elf.h"
+
+/**
+ * Hashes that can be calculated during a single pass over an AppImage.
+ * Multiple values can be combined with a bitwise or, the file is then read only once.
+ */
+enum appimage_hash_type {
+    // type 2 MD5 digest skipping .digest_md5, .sha256_sig and .sig_key, identical to libappimage's appimage_type2_digest_md5
+    APPIMAGE_HASH_TYPE2_MD5 = 1 << 0,
+    // plain SHA-256 digest of the entire file (what gets signed, and what sha256sum would report)
+    APPIMAGE_HASH_SHA256 = 1 << 1,
+    // plain MD5 digest of the entire file (what md5sum would report)
+    APPIMAGE_HASH_MD5 = 1 << 2,
+    // plain SHA-1 digest of the entire file (required for zsync control files)
+    APPIMAGE_HASH_SHA1 = 1 << 3,
+};
+
+#define APPIMAGE_MD5_DIGEST_SIZE 16
+#define APPIMAGE_SHA256_DIGEST_SIZE 32
+#define APPIMAGE_SHA1_DIGEST_SIZE 20
+
+typedef struct {
+    char type2_md5[APPIMAGE_MD5_DIGEST_SIZE];
+    char sha256[APPIMAGE_SHA256_DIGEST_SIZE];
+    char md5[APPIMAGE_MD5_DIGEST_SIZE];
+    char sha1[APPIMAGE_SHA1_DIGEST_SIZE];
+} appimage_hashes_t;
+
+/**
+ * Called with every buffer read during a hashing pass, in order.
+ * Allows further consumers (e.g., the zsync generator) to use the data without reading the file again.
+ * @param position offset of the buffer in the file
+ */
+typedef void (*appimage_hash_observer_t)(const char* buffer, size_t size, unsigned long position, void* user_data);
+
+typedef struct {
+    unsigned long offset;
+    unsigned long length;
+} appimage_byte_range_t;
+
+/**
+ * Read a file descriptor from its current position to the end once and feed all requested hashes from the same
+ * buffers. For APPIMAGE_HASH_TYPE2_MD5 only, skipped_ranges are left out in 4 KiB chunks exactly like the reference
+ * implementation does, see appimagetool_hash.c.
+ * Offsets are relative to the current position, which should be the start of the file for the type 2 digest.
+ * @param skipped_ranges byte ranges to skip, in the order the reference implementation checks the sections in
+ * @param observer optional callback which is passed every buffer read, may be NULL
+ * @return true on success, false otherwise
+ */
+bool appimage_hash_fd(
+    int fd,
+    int types,
+    const appimage_byte_range_t* skipped_ranges,
+    size_t skipped_ranges_count,
+    appimage_hash_observer_t observer,
+    void* observer_data,
+    appimage_hashes_t* hashes,
+    bool verbose
+);
+
+/**
+ * Read the given file once and feed all requested hashes from the same buffers.
+ * @param path file to hash
+ * @param types bitwise or of appimage_hash_type values
+ * @param sections section table of the file (or its runtime), used for APPIMAGE_HASH_TYPE2_MD5; if NULL, it is
+ *        parsed from the file
+ * @param hashes receives the raw (not hexlified) digests of the requested types
+ * @return true on success, false otherwise
+ */
+bool appimage_hash_file(const char* path, int types, const appimage_elf_sections_t* sections, appimage_hashes_t* hashes, bool verbose);
+
+/**
+ * Like appimage_hash_file, additionally passing every buffer read to the given observer.
+ */
+bool appimage_hash_file_observed(
+    const char* path,
+    int types,
+    const appimage_elf_sections_t* sections,
+    appimage_hash_observer_t observer,
+    void* observer_data,
+    appimage_hashes_t* hashes,
+    bool verbose
+);
+
+/**
+ * Add or replace the entries for the given file in SHA256SUMS and MD5SUMS in the file's directory.
+ * The format is compatible with sha256sum -c and md5sum -c.
+ * @param hashes must contain the APPIMAGE_HASH_SHA256 and APPIMAGE_HASH_MD5 digests of the file
+ * @return true on success, false otherwise
+ */
+bool appimage_write_checksum_files(const char* path, const appimage_hashes_t* hashes);
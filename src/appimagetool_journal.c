@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "appimagetool_journal.h"
+
+// first line of every journal, bumped whenever the format or the meaning of the keys changes
+static const char journal_header[] = "appimagetool-journal 1";
+
+static const char* const checkpoint_names[APPIMAGE_CHECKPOINT_COUNT] = {
+    "none", "squashfs", "runtime", "sections", "digest",
+};
+
+typedef struct {
+    appimage_checkpoint_t checkpoint;
+    char key[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    // state of the partial file right after the checkpoint
+    guint64 size;
+    gint64 mtime_ns;
+    guint64 inode;
+} entry_t;
+
+struct appimage_journal {
+    gchar* path;
+    gchar* directory;
+    // path of the partially built AppImage, NULL if none has been recorded
+    gchar* partial_path;
+    // in the order of the stages
+    GArray* entries;
+};
+
+static gint64 mtime_ns(const struct stat* file_stat) {
+    return (gint64) file_stat->st_mtim.tv_sec * 1000000000 + file_stat->st_mtim.tv_nsec;
+}
+
+static appimage_checkpoint_t checkpoint_from_name(const char* name) {
+    for (int checkpoint = APPIMAGE_CHECKPOINT_SQUASHFS; checkpoint < APPIMAGE_CHECKPOINT_COUNT; ++checkpoint) {
+        if (strcmp(name, checkpoint_names[checkpoint]) == 0) {
+            return (appimage_checkpoint_t) checkpoint;
+        }
+    }
+    return APPIMAGE_CHECKPOINT_NONE;
+}
+
+const char* appimage_checkpoint_name(appimage_checkpoint_t checkpoint) {
+    return checkpoint < APPIMAGE_CHECKPOINT_COUNT ? checkpoint_names[checkpoint] : "unknown";
+}
+
+/* Entries which do not parse, or are out of order, end the journal, the ones before them remain usable */
+static void load(appimage_journal_t* journal) {
+    gchar* contents = NULL;
+    if (!g_file_get_contents(journal->path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    gchar** lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    if (lines[0] == NULL || strcmp(lines[0], journal_header) != 0) {
+        g_strfreev(lines);
+        return;
+    }
+
+    for (gchar** line = lines + 1; *line != NULL && **line != '\0'; ++line) {
+        if (g_str_has_prefix(*line, "partial ")) {
+            g_free(journal->partial_path);
+            journal->partial_path = g_build_filename(journal->directory, *line + strlen("partial "), NULL);
+            continue;
+        }
+
+        char name[16];
+        char key[APPIMAGE_CACHE_KEY_LENGTH + 1];
+        unsigned long long size, inode;
+        long long modified;
+
+        if (sscanf(*line, "%15s %64s %llu %lld %llu", name, key, &size, &modified, &inode) != 5) {
+            break;
+        }
+
+        entry_t entry = {
+            .checkpoint = checkpoint_from_name(name),
+            .size = size,
+            .mtime_ns = modified,
+            .inode = inode,
+        };
+        g_strlcpy(entry.key, key, sizeof(entry.key));
+
+        const appimage_checkpoint_t expected = (appimage_checkpoint_t) (journal->entries->len + 1);
+        if (entry.checkpoint != expected || strlen(entry.key) != APPIMAGE_CACHE_KEY_LENGTH) {
+            break;
+        }
+
+        g_array_append_val(journal->entries, entry);
+    }
+
+    g_strfreev(lines);
+}
+
+/* Replace the journal at once, so that a crash leaves either the old or the new one */
+static bool save(const appimage_journal_t* journal) {
+    GString* contents = g_string_new(journal_header);
+    g_string_append_c(contents, '\n');
+
+    if (journal->partial_path != NULL) {
+        gchar* partial_name = g_path_get_basename(journal->partial_path);
+        g_string_append_printf(contents, "partial %s\n", partial_name);
+        g_free(partial_name);
+    }
+
+    for (guint i = 0; i < journal->entries->len; ++i) {
+        const entry_t* entry = &g_array_index(journal->entries, entry_t, i);
+        g_string_append_printf(
+            contents, "%s %s %llu %lld %llu\n", checkpoint_names[entry->checkpoint], entry->key,
+            (unsigned long long) entry->size, (long long) entry->mtime_ns, (unsigned long long) entry->inode
+        );
+    }
+
+    gchar* temporary_path = g_strdup_printf("%s.XXXXXX", journal->path);
+    const int fd = mkstemp(temporary_path);
+    bool success = fd >= 0;
+
+    for (gsize written = 0; success && written < contents->len;) {
+        const ssize_t result = write(fd, contents->str + written, contents->len - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        success = result > 0;
+        written += success ? (gsize) result : 0;
+    }
+
+    success = success && fsync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0) {
+        success = false;
+    }
+    success = success && rename(temporary_path, journal->path) == 0;
+
+    if (!success) {
+        fprintf(stderr, "Warning: failed to write checkpoint journal %s: %s\n", journal->path, strerror(errno));
+        if (fd >= 0) {
+            unlink(temporary_path);
+        }
+    }
+
+    g_free(temporary_path);
+    g_string_free(contents, TRUE);
+    return success;
+}
+
+appimage_journal_t* appimage_journal_open(const char* destination) {
+    gchar* directory = g_path_get_dirname(destination);
+    gchar* filename = g_path_get_basename(destination);
+
+    appimage_journal_t* journal = g_new0(appimage_journal_t, 1);
+    journal->path = g_strdup_printf("%s/.%s.journal", directory, filename);
+    journal->directory = directory;
+    journal->entries = g_array_new(FALSE, FALSE, sizeof(entry_t));
+    g_free(filename);
+
+    load(journal);
+    return journal;
+}
+
+void appimage_journal_free(appimage_journal_t* journal) {
+    if (journal == NULL) {
+        return;
+    }
+
+    g_array_free(journal->entries, TRUE);
+    g_free(journal->partial_path);
+    g_free(journal->directory);
+    g_free(journal->path);
+    g_free(journal);
+}
+
+appimage_checkpoint_t appimage_journal_resume_point(const appimage_journal_t* journal, const appimage_checkpoint_keys_t keys, const char** partial_path) {
+    if (journal->partial_path == NULL || journal->entries->len == 0) {
+        return APPIMAGE_CHECKPOINT_NONE;
+    }
+
+    // every stage modifies the partial file, so it must still be in the state the last one has left it in
+    const entry_t* last = &g_array_index(journal->entries, entry_t, journal->entries->len - 1);
+    struct stat partial_stat;
+    if (stat(journal->partial_path, &partial_stat) != 0 || (guint64) partial_stat.st_size != last->size ||
+        mtime_ns(&partial_stat) != last->mtime_ns || (guint64) partial_stat.st_ino != last->inode) {
+        fprintf(stderr, "Not resuming, %s has changed since the last checkpoint\n", journal->partial_path);
+        return APPIMAGE_CHECKPOINT_NONE;
+    }
+
+    guint matching = 0;
+    while (matching < journal->entries->len) {
+        const entry_t* entry = &g_array_index(journal->entries, entry_t, matching);
+        if (strcmp(entry->key, keys[entry->checkpoint]) != 0) {
+            break;
+        }
+        ++matching;
+    }
+
+    *partial_path = journal->partial_path;
+
+    if (matching == journal->entries->len) {
+        return last->checkpoint;
+    }
+
+    // the runtime is embedded again, which resets the sections written after it
+    return matching > 0 ? APPIMAGE_CHECKPOINT_SQUASHFS : APPIMAGE_CHECKPOINT_NONE;
+}
+
+bool appimage_journal_start(appimage_journal_t* journal, const char* partial_path) {
+    if (journal->partial_path != NULL && strcmp(journal->partial_path, partial_path) != 0) {
+        unlink(journal->partial_path);
+    }
+
+    g_free(journal->partial_path);
+    journal->partial_path = g_strdup(partial_path);
+    g_array_set_size(journal->entries, 0);
+
+    return save(journal);
+}
+
+bool appimage_journal_record(appimage_journal_t* journal, appimage_checkpoint_t checkpoint, const char* key, int fd) {
+    struct stat partial_stat;
+
+    // the checkpoint must not survive a crash which the data it describes does not
+    if (fsync(fd) != 0 || fstat(fd, &partial_stat) != 0) {
+        fprintf(stderr, "Warning: failed to sync %s for the checkpoint journal: %s\n", journal->partial_path, strerror(errno));
+        return false;
+    }
+
+    entry_t entry = {
+        .checkpoint = checkpoint,
+        .size = (guint64) partial_stat.st_size,
+        .mtime_ns = mtime_ns(&partial_stat),
+        .inode = (guint64) partial_stat.st_ino,
+    };
+    g_strlcpy(entry.key, key, sizeof(entry.key));
+
+    g_array_set_size(journal->entries, MIN(journal->entries->len, (guint) checkpoint - 1));
+    g_array_append_val(journal->entries, entry);
+
+    return save(journal);
+}
+
+void appimage_journal_remove(appimage_journal_t* journal) {
+    if (unlink(journal->path) != 0 && errno != ENOENT) {
+        fprintf(stderr, "Warning: failed to remove checkpoint journal %s: %s\n", journal->path, strerror(errno));
+    }
+
+    g_free(journal->partial_path);
+    journal->partial_path = NULL;
+    g_array_set_size(journal->entries, 0);
+}
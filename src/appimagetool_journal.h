@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "appimagetool_cache.h"
+
+/**
+ * Checkpoint journal of a build, so that a build which has failed after the squashfs image has been written (e.g.,
+ * because gpg-agent has timed out while signing) can be continued by the next one instead of starting over.
+ *
+ * The journal is kept next to the destination, as .NAME.journal, along with the partially built AppImage, which is the
+ * build's temporary output file. After every expensive stage, the partial file is synced and a checkpoint is recorded:
+ * the key of the stage's inputs, and the size, modification time and inode of the partial file afterwards. The keys
+ * are chained, every one covers the inputs of the stages before it as well.
+ *
+ * A later build continues after the last checkpoint if the keys it calculates for its own inputs match all recorded
+ * ones and the partial file has not been touched since. If only the squashfs image's key matches, it continues after
+ * the squashfs image, since embedding the runtime again resets everything written afterwards.
+ */
+
+typedef enum {
+    APPIMAGE_CHECKPOINT_NONE = 0,
+    // the squashfs image has been written at the runtime's offset
+    APPIMAGE_CHECKPOINT_SQUASHFS,
+    // the runtime has been embedded
+    APPIMAGE_CHECKPOINT_RUNTIME,
+    // the update information has been written to its section
+    APPIMAGE_CHECKPOINT_SECTIONS,
+    // the MD5 digest has been calculated and written to its section
+    APPIMAGE_CHECKPOINT_DIGEST,
+    APPIMAGE_CHECKPOINT_COUNT,
+} appimage_checkpoint_t;
+
+typedef struct appimage_journal appimage_journal_t;
+
+typedef char appimage_checkpoint_keys_t[APPIMAGE_CHECKPOINT_COUNT][APPIMAGE_CACHE_KEY_LENGTH + 1];
+
+/**
+ * Name of a checkpoint, as used in the journal and in messages.
+ */
+const char* appimage_checkpoint_name(appimage_checkpoint_t checkpoint);
+
+/**
+ * Load the journal of the given destination. A missing or unreadable journal is an empty one.
+ */
+appimage_journal_t* appimage_journal_open(const char* destination);
+
+void appimage_journal_free(appimage_journal_t* journal);
+
+/**
+ * Find the checkpoint a build with the given keys can continue after.
+ * @param keys the build's key of every checkpoint, indexed by appimage_checkpoint_t
+ * @param partial_path receives the path of the partially built AppImage, owned by the journal, unless NONE is returned
+ */
+appimage_checkpoint_t appimage_journal_resume_point(const appimage_journal_t* journal, const appimage_checkpoint_keys_t keys, const char** partial_path);
+
+/**
+ * Start recording checkpoints of a new partially built AppImage. The partial file of an earlier build, if any, is
+ * removed.
+ * @return true on success, false otherwise
+ */
+bool appimage_journal_start(appimage_journal_t* journal, const char* partial_path);
+
+/**
+ * Sync the partial file and record a checkpoint. Checkpoints recorded before for the same or later stages are dropped.
+ * @param fd descriptor of the partial file
+ * @return true on success, false otherwise; the build itself is not affected either way
+ */
+bool appimage_journal_record(appimage_journal_t* journal, appimage_checkpoint_t checkpoint, const char* key, int fd);
+
+/**
+ * Remove the journal, once the AppImage has been published.
+ */
+void appimage_journal_remove(appimage_journal_t* journal);
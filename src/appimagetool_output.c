@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "appimagetool.h"
+#include "appimagetool_output.h"
+
+// unpublished temporary files may have to be removed from a signal handler, which can neither lock nor follow
+// pointers to memory that may be freed, so they are registered in slots with a copy of their path
+#define UNPUBLISHED_SLOTS 64
+
+enum {
+    SLOT_FREE,
+    SLOT_CLAIMED,
+    SLOT_USED,
+};
+
+typedef struct {
+    gint state;
+    char path[PATH_MAX];
+} unpublished_slot_t;
+
+static unpublished_slot_t unpublished_slots[UNPUBLISHED_SLOTS];
+
+typedef struct {
+    unsigned long offset;
+    size_t length;
+    guint8* data;
+} patch_t;
+
+struct appimage_output {
+    gchar* destination;
+    gchar* path;
+    int fd;
+    bool published;
+    // left in place when discarded, to be continued by the next build
+    bool kept;
+    // index in unpublished_slots, -1 if the file is not registered there
+    int slot;
+    // patches which have not been written yet
+    GArray* patches;
+};
+
+static void clear_patch(gpointer patch) {
+    g_free(((patch_t*) patch)->data);
+}
+
+static appimage_output_t* new_output(const char* destination, gchar* path) {
+    appimage_output_t* output = g_new0(appimage_output_t, 1);
+    output->destination = g_strdup(destination);
+    output->path = path;
+    output->fd = -1;
+    output->slot = -1;
+    output->patches = g_array_new(FALSE, FALSE, sizeof(patch_t));
+    g_array_set_clear_func(output->patches, clear_patch);
+
+    return output;
+}
+
+/* If all slots are taken, the file is only removed when the build fails, not when the process is interrupted */
+static void register_unpublished(appimage_output_t* output) {
+    if (strlen(output->path) >= PATH_MAX) {
+        return;
+    }
+
+    for (int i = 0; i < UNPUBLISHED_SLOTS; ++i) {
+        unpublished_slot_t* slot = &unpublished_slots[i];
+
+        if (g_atomic_int_compare_and_exchange(&slot->state, SLOT_FREE, SLOT_CLAIMED)) {
+            strcpy(slot->path, output->path);
+            g_atomic_int_set(&slot->state, SLOT_USED);
+            output->slot = i;
+            return;
+        }
+    }
+}
+
+static void unregister_unpublished(appimage_output_t* output) {
+    if (output->slot >= 0) {
+        g_atomic_int_set(&unpublished_slots[output->slot].state, SLOT_FREE);
+        output->slot = -1;
+    }
+}
+
+void appimagetool_discard_unpublished(void) {
+    for (int i = 0; i < UNPUBLISHED_SLOTS; ++i) {
+        if (g_atomic_int_get(&unpublished_slots[i].state) == SLOT_USED) {
+            unlink(unpublished_slots[i].path);
+        }
+    }
+}
+
+appimage_output_t* appimage_output_new(const char* destination) {
+    gchar* directory = g_path_get_dirname(destination);
+    gchar* filename = g_path_get_basename(destination);
+
+    // hidden, so that it is not picked up by globs like *.AppImage in the meantime
+    gchar* path = g_strdup_printf("%s/.%s.XXXXXX", directory, filename);
+    g_free(directory);
+    g_free(filename);
+
+    // mksquashfs and the squashfs writer open the file by its path, so it must have one
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create temporary file next to %s: %s\n", destination, strerror(errno));
+        g_free(path);
+        return NULL;
+    }
+    close(fd);
+
+    appimage_output_t* output = new_output(destination, path);
+    register_unpublished(output);
+    return output;
+}
+
+appimage_output_t* appimage_output_adopt(const char* destination, const char* path) {
+    return new_output(destination, g_strdup(path));
+}
+
+const char* appimage_output_path(const appimage_output_t* output) {
+    return output->path;
+}
+
+const char* appimage_output_destination(const appimage_output_t* output) {
+    return output->destination;
+}
+
+int appimage_output_open(appimage_output_t* output) {
+    if (output->fd < 0) {
+        output->fd = open(output->path, O_RDWR | O_CLOEXEC);
+
+        if (output->fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", output->path, strerror(errno));
+        }
+    }
+
+    return output->fd;
+}
+
+void appimage_output_patch(appimage_output_t* output, unsigned long offset, const void* data, size_t length) {
+    patch_t patch = {
+        .offset = offset,
+        .length = length,
+        .data = g_malloc(length),
+    };
+
+    memcpy(patch.data, data, length);
+    g_array_append_val(output->patches, patch);
+}
+
+bool appimage_output_flush(appimage_output_t* output) {
+    if (output->patches->len == 0) {
+        return true;
+    }
+
+    if (appimage_output_open(output) < 0) {
+        return false;
+    }
+
+    for (guint i = 0; i < output->patches->len; ++i) {
+        const patch_t* patch = &g_array_index(output->patches, patch_t, i);
+        size_t written = 0;
+
+        while (written < patch->length) {
+            const ssize_t result = pwrite(output->fd, patch->data + written, patch->length - written,
+                                          (off_t) (patch->offset + written));
+
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (result <= 0) {
+                fprintf(stderr, "Failed to write %zu bytes at offset %lu of %s: %s\n", patch->length, patch->offset,
+                        output->path, result < 0 ? strerror(errno) : "no space written");
+                return false;
+            }
+
+            written += (size_t) result;
+        }
+    }
+
+    g_array_set_size(output->patches, 0);
+    return true;
+}
+
+/* The rename is only durable once the directory entry has been written, too */
+static bool sync_directory(const char* path) {
+    gchar* directory = g_path_get_dirname(path);
+    const int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    g_free(directory);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    const bool success = fsync(fd) == 0;
+    close(fd);
+
+    return success;
+}
+
+bool appimage_output_publish(appimage_output_t* output) {
+    if (!appimage_output_flush(output) || appimage_output_open(output) < 0) {
+        return false;
+    }
+
+    if (fchmod(output->fd, 0755) != 0) {
+        fprintf(stderr, "Could not set executable bit on %s: %s\n", output->path, strerror(errno));
+        return false;
+    }
+
+    if (fsync(output->fd) != 0) {
+        fprintf(stderr, "Failed to sync %s: %s\n", output->path, strerror(errno));
+        return false;
+    }
+
+    // errors on close are reported by some file systems (e.g., NFS) only
+    const int fd = output->fd;
+    output->fd = -1;
+    if (close(fd) != 0) {
+        fprintf(stderr, "Failed to close %s: %s\n", output->path, strerror(errno));
+        return false;
+    }
+
+    if (rename(output->path, output->destination) != 0) {
+        fprintf(stderr, "Failed to rename %s to %s: %s\n", output->path, output->destination, strerror(errno));
+        return false;
+    }
+
+    output->published = true;
+    unregister_unpublished(output);
+
+    // the AppImage is complete either way, a crash right now would at worst leave the previous one in place
+    if (!sync_directory(output->destination)) {
+        fprintf(stderr, "Warning: failed to sync the directory of %s: %s\n", output->destination, strerror(errno));
+    }
+
+    return true;
+}
+
+void appimage_output_keep(appimage_output_t* output) {
+    output->kept = true;
+    unregister_unpublished(output);
+}
+
+void appimage_output_discard(appimage_output_t* output) {
+    if (output == NULL) {
+        return;
+    }
+
+    if (output->fd >= 0) {
+        close(output->fd);
+        output->fd = -1;
+    }
+
+    if (!output->published && !output->kept && output->path != NULL) {
+        unregister_unpublished(output);
+        unlink(output->path);
+        g_free(output->path);
+        output->path = NULL;
+    }
+
+    g_array_set_size(output->patches, 0);
+}
+
+void appimage_output_free(appimage_output_t* output) {
+    if (output == NULL) {
+        return;
+    }
+
+    appimage_output_discard(output);
+
+    g_array_free(output->patches, TRUE);
+    g_free(output->path);
+    g_free(output->destination);
+    g_free(output);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The AppImage being built. It is written to a temporary file next to the destination, and only renamed to the
+ * destination once it is complete, so that a crash or a cancelled build never leaves a half-written AppImage at the
+ * destination, and consumers watching the destination never see one.
+ *
+ * The sections patched after the squashfs image has been written (update information, digest, signature and key)
+ * are collected in a patch plan and written with pwrite on a single file descriptor. The file is synced once, right
+ * before it is published.
+ */
+typedef struct appimage_output appimage_output_t;
+
+/**
+ * Create the temporary file in the destination's directory, so that it can be renamed atomically. Until it is
+ * published or kept, appimagetool_discard_unpublished removes it.
+ * @return output, or NULL on errors
+ */
+appimage_output_t* appimage_output_new(const char* destination);
+
+/**
+ * Continue with the temporary file of an earlier build, which has been left in place by appimage_output_keep.
+ * @return output, never NULL; opening the file reports whether it still exists
+ */
+appimage_output_t* appimage_output_adopt(const char* destination, const char* path);
+
+/**
+ * Path of the temporary file, to be written by mksquashfs or the squashfs writer, and read for hashing.
+ */
+const char* appimage_output_path(const appimage_output_t* output);
+
+const char* appimage_output_destination(const appimage_output_t* output);
+
+/**
+ * Open the file descriptor the runtime and all patches are written through. Must be called once the squashfs image
+ * has been written, since mksquashfs truncates the file.
+ * @return file descriptor, owned by the output, or -1 on errors
+ */
+int appimage_output_open(appimage_output_t* output);
+
+/**
+ * Add a write to the patch plan. The data is copied, nothing is written until the plan is flushed.
+ */
+void appimage_output_patch(appimage_output_t* output, unsigned long offset, const void* data, size_t length);
+
+/**
+ * Apply the pending patches, in the order they were added. Needed before the file is read again, e.g., because the
+ * digest covers the update information.
+ * @return true on success, false otherwise
+ */
+bool appimage_output_flush(appimage_output_t* output);
+
+/**
+ * Apply the pending patches, make the file executable, sync it and rename it to the destination.
+ * @return true on success, false otherwise
+ */
+bool appimage_output_publish(appimage_output_t* output);
+
+/**
+ * Leave the temporary file in place when the output is discarded, or the process is interrupted, so that a later
+ * build can adopt it.
+ */
+void appimage_output_keep(appimage_output_t* output);
+
+/**
+ * Remove the temporary file unless the output has been published or kept. Safe to call several times, and with NULL.
+ */
+void appimage_output_discard(appimage_output_t* output);
+
+/**
+ * Discard the output and release its resources.
+ */
+void appimage_output_free(appimage_output_t* output);
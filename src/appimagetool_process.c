@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "appimagetool_process.h"
+
+extern char** environ;
+
+#define DEFAULT_CAPTURE_LIMIT (64 * 1024)
+
+struct appimage_process {
+    pid_t pid;
+    gchar* name;
+    gint64 start_time;
+    size_t capture_limit;
+    // read ends of the pipes of captured streams, -1 otherwise
+    int fds[2];
+    GByteArray* data[2];
+    bool truncated[2];
+};
+
+/*
+ * Cache of appimage_find_tool, maps search paths to tables which map names to paths, NULL if the tool does not exist.
+ * Tools registered with appimage_register_tool are found regardless of the search path.
+ */
+static GMutex tools_mutex;
+static GHashTable* tools = NULL;
+static GHashTable* registered_tools = NULL;
+
+// what execvp searches if PATH is not set, see confstr(3)
+#define DEFAULT_SEARCH_PATH "/bin:/usr/bin"
+
+struct appimage_process_group {
+    // set once the group has been terminated, children started afterwards are terminated right away
+    bool terminated;
+};
+
+typedef struct {
+    pid_t pid;
+    appimage_process_group_t* group;
+} child_t;
+
+/* Running children of all groups, so they can be terminated when the pipeline they belong to is cancelled */
+static GMutex children_mutex;
+static GArray* children = NULL;
+static appimage_process_group_t default_group = {false};
+
+/* Search the absolute directories in search_path, relative ones would depend on the working directory */
+static gchar* search_tool(const char* name, const char* search_path) {
+    // like with execvp, names containing a slash are not searched for
+    if (strchr(name, '/') != NULL) {
+        return g_path_is_absolute(name) && g_file_test(name, G_FILE_TEST_IS_EXECUTABLE) ? g_strdup(name) : NULL;
+    }
+
+    gchar** directories = g_strsplit(search_path, ":", -1);
+    gchar* path = NULL;
+
+    for (gchar** directory = directories; *directory != NULL && path == NULL; ++directory) {
+        if (!g_path_is_absolute(*directory)) {
+            continue;
+        }
+
+        gchar* candidate = g_build_filename(*directory, name, NULL);
+        if (g_file_test(candidate, G_FILE_TEST_IS_EXECUTABLE) && !g_file_test(candidate, G_FILE_TEST_IS_DIR)) {
+            path = candidate;
+        } else {
+            g_free(candidate);
+        }
+    }
+
+    g_strfreev(directories);
+    return path;
+}
+
+const char* appimage_find_tool(const char* name, const char* search_path) {
+    if (search_path == NULL && (search_path = g_getenv("PATH")) == NULL) {
+        search_path = DEFAULT_SEARCH_PATH;
+    }
+
+    g_mutex_lock(&tools_mutex);
+
+    gpointer path = NULL;
+    if (registered_tools != NULL && g_hash_table_lookup_extended(registered_tools, name, NULL, &path)) {
+        g_mutex_unlock(&tools_mutex);
+        return path;
+    }
+
+    if (tools == NULL) {
+        tools = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_hash_table_destroy);
+    }
+
+    GHashTable* found = g_hash_table_lookup(tools, search_path);
+    if (found == NULL) {
+        found = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        g_hash_table_insert(tools, g_strdup(search_path), found);
+    }
+
+    if (!g_hash_table_lookup_extended(found, name, NULL, &path)) {
+        path = search_tool(name, search_path);
+        g_hash_table_insert(found, g_strdup(name), path);
+    }
+
+    g_mutex_unlock(&tools_mutex);
+
+    return path;
+}
+
+const char* appimage_environment_search_path(char* const* envp) {
+    if (envp == NULL) {
+        return NULL;
+    }
+
+    const char* search_path = g_environ_getenv((gchar**) envp, "PATH");
+    return search_path != NULL ? search_path : DEFAULT_SEARCH_PATH;
+}
+
+void appimage_register_tool(const char* name, const char* path) {
+    g_mutex_lock(&tools_mutex);
+    if (registered_tools == NULL) {
+        registered_tools = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    g_hash_table_insert(registered_tools, g_strdup(name), g_strdup(path));
+    g_mutex_unlock(&tools_mutex);
+}
+
+static void register_child(pid_t pid, appimage_process_group_t* group) {
+    g_mutex_lock(&children_mutex);
+    // the pipeline might have been cancelled while this child was being started
+    if (group->terminated) {
+        kill(pid, SIGTERM);
+    }
+    if (children == NULL) {
+        children = g_array_new(FALSE, FALSE, sizeof(child_t));
+    }
+    const child_t child = {pid, group};
+    g_array_append_val(children, child);
+    g_mutex_unlock(&children_mutex);
+}
+
+static void unregister_child(pid_t pid) {
+    g_mutex_lock(&children_mutex);
+    for (guint i = 0; children != NULL && i < children->len; ++i) {
+        if (g_array_index(children, child_t, i).pid == pid) {
+            g_array_remove_index_fast(children, i);
+            break;
+        }
+    }
+    g_mutex_unlock(&children_mutex);
+}
+
+appimage_process_group_t* appimage_process_group_new(void) {
+    return g_new0(appimage_process_group_t, 1);
+}
+
+void appimage_process_group_free(appimage_process_group_t* group) {
+    g_free(group);
+}
+
+void appimage_process_group_terminate(appimage_process_group_t* group) {
+    if (group == NULL) {
+        group = &default_group;
+    }
+
+    g_mutex_lock(&children_mutex);
+    group->terminated = true;
+    for (guint i = 0; children != NULL && i < children->len; ++i) {
+        const child_t* child = &g_array_index(children, child_t, i);
+        if (child->group == group) {
+            kill(child->pid, SIGTERM);
+        }
+    }
+    g_mutex_unlock(&children_mutex);
+}
+
+appimage_process_t* appimage_process_start(const char* path, char* const argv[], const appimage_process_options_t* options) {
+    static const appimage_process_options_t default_options = {
+        .envp = NULL,
+        .stdout_mode = APPIMAGE_PROCESS_INHERIT,
+        .stderr_mode = APPIMAGE_PROCESS_INHERIT,
+        .capture_limit = 0,
+        .group = NULL,
+    };
+
+    if (options == NULL) {
+        options = &default_options;
+    }
+
+    if (path == NULL && (path = appimage_find_tool(argv[0], appimage_environment_search_path(options->envp))) == NULL) {
+        fprintf(stderr, "%s command is missing\n", argv[0]);
+        return NULL;
+    }
+
+    appimage_process_t* process = g_new0(appimage_process_t, 1);
+    process->name = g_strdup(argv[0]);
+    process->capture_limit = options->capture_limit != 0 ? options->capture_limit : DEFAULT_CAPTURE_LIMIT;
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+
+    const appimage_process_output_t modes[2] = {options->stdout_mode, options->stderr_mode};
+    int write_fds[2] = {-1, -1};
+    bool failed = false;
+
+    process->fds[0] = -1;
+    process->fds[1] = -1;
+
+    for (int i = 0; i < 2; ++i) {
+        if (modes[i] != APPIMAGE_PROCESS_CAPTURE) {
+            continue;
+        }
+
+        // both ends are closed on exec, so that concurrently started children do not keep each other's pipes open
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+            fprintf(stderr, "Failed to create pipe for %s: %s\n", argv[0], strerror(errno));
+            failed = true;
+            break;
+        }
+
+        process->fds[i] = pipe_fds[0];
+        write_fds[i] = pipe_fds[1];
+        process->data[i] = g_byte_array_new();
+
+        // dup2 clears the close on exec flag of the child's stdout or stderr
+        posix_spawn_file_actions_adddup2(&file_actions, pipe_fds[1], STDOUT_FILENO + i);
+    }
+
+    // signals blocked by the calling thread must not be blocked in the child
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    posix_spawnattr_setsigmask(&attributes, &empty_mask);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+    if (!failed) {
+        // the output of inherited streams should appear after everything printed so far
+        fflush(stdout);
+
+        process->start_time = g_get_monotonic_time();
+
+        const int error = posix_spawn(&process->pid, path, &file_actions, &attributes, argv,
+                                      options->envp != NULL ? options->envp : environ);
+        if (error != 0) {
+            fprintf(stderr, "Failed to run %s: %s\n", path, strerror(error));
+            failed = true;
+        }
+    }
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&file_actions);
+
+    for (int i = 0; i < 2; ++i) {
+        if (write_fds[i] >= 0) {
+            close(write_fds[i]);
+        }
+    }
+
+    if (failed) {
+        for (int i = 0; i < 2; ++i) {
+            if (process->fds[i] >= 0) {
+                close(process->fds[i]);
+            }
+            if (process->data[i] != NULL) {
+                g_byte_array_free(process->data[i], TRUE);
+            }
+        }
+        g_free(process->name);
+        g_free(process);
+        return NULL;
+    }
+
+    register_child(process->pid, options->group != NULL ? options->group : &default_group);
+
+    return process;
+}
+
+/* Read what is available from one of the pipes, returns false once the pipe is closed */
+static bool read_output(appimage_process_t* process, int stream) {
+    char buffer[16384];
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(process->fds[stream], buffer, sizeof(buffer));
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read <= 0) {
+        return false;
+    }
+
+    // the child must not block on a full pipe, so everything is read, but only the beginning is kept
+    const size_t kept = process->data[stream]->len;
+    const size_t space = kept < process->capture_limit ? process->capture_limit - kept : 0;
+
+    if ((size_t) bytes_read > space) {
+        process->truncated[stream] = true;
+    }
+
+    g_byte_array_append(process->data[stream], (const guint8*) buffer, (guint) MIN((size_t) bytes_read, space));
+    return true;
+}
+
+static double timeval_seconds(struct timeval tv) {
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+}
+
+static void finish_process(appimage_process_t* process, appimage_process_result_t* result) {
+    memset(result, 0, sizeof(*result));
+
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+
+    // wait without reaping first: the zombie keeps the PID from being reused until the child is no longer registered,
+    // so appimage_process_group_terminate can never signal an unrelated process
+    siginfo_t info;
+    int waited_id;
+    do {
+        waited_id = waitid(P_PID, (id_t) process->pid, &info, WEXITED | WNOWAIT);
+    } while (waited_id == -1 && errno == EINTR);
+
+    unregister_child(process->pid);
+
+    // reap it, wait4 also reports the resource usage
+    pid_t waited;
+    do {
+        waited = wait4(process->pid, &status, 0, &usage);
+    } while (waited == -1 && errno == EINTR);
+
+    result->wall_seconds = (double) (g_get_monotonic_time() - process->start_time) / G_USEC_PER_SEC;
+
+    if (waited == -1) {
+        fprintf(stderr, "Failed to wait for %s: %s\n", process->name, strerror(errno));
+        result->exit_code = -1;
+    } else if (WIFEXITED(status)) {
+        result->exit_code = WEXITSTATUS(status);
+    } else {
+        result->exit_code = -1;
+        result->term_signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    }
+
+    result->user_seconds = timeval_seconds(usage.ru_utime);
+    result->system_seconds = timeval_seconds(usage.ru_stime);
+    result->max_rss_kib = usage.ru_maxrss;
+    result->input_blocks = usage.ru_inblock;
+    result->output_blocks = usage.ru_oublock;
+
+    char** data[2] = {&result->stdout_data, &result->stderr_data};
+    size_t* lengths[2] = {&result->stdout_length, &result->stderr_length};
+    bool* truncated[2] = {&result->stdout_truncated, &result->stderr_truncated};
+
+    for (int i = 0; i < 2; ++i) {
+        if (process->data[i] == NULL) {
+            continue;
+        }
+
+        *lengths[i] = process->data[i]->len;
+        *truncated[i] = process->truncated[i];
+        g_byte_array_append(process->data[i], (const guint8*) "", 1);
+        *data[i] = (char*) g_byte_array_free(process->data[i], FALSE);
+    }
+
+    g_free(process->name);
+    g_free(process);
+}
+
+void appimage_process_wait_all(appimage_process_t* const* processes, size_t count, appimage_process_result_t* results) {
+    struct pollfd* poll_fds = g_new(struct pollfd, count * 2);
+
+    // collect the output of all children until all of them have closed their streams
+    for (;;) {
+        nfds_t poll_count = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            for (int stream = 0; stream < 2; ++stream) {
+                if (processes[i]->fds[stream] >= 0) {
+                    poll_fds[poll_count].fd = processes[i]->fds[stream];
+                    poll_fds[poll_count].events = POLLIN;
+                    poll_fds[poll_count].revents = 0;
+                    ++poll_count;
+                }
+            }
+        }
+
+        if (poll_count == 0) {
+            break;
+        }
+
+        if (poll(poll_fds, poll_count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to read the output of subprocesses: %s\n", strerror(errno));
+            break;
+        }
+
+        nfds_t polled = 0;
+        for (size_t i = 0; i < count; ++i) {
+            for (int stream = 0; stream < 2; ++stream) {
+                if (processes[i]->fds[stream] < 0) {
+                    continue;
+                }
+
+                const short revents = poll_fds[polled++].revents;
+
+                if (revents != 0 && !read_output(processes[i], stream)) {
+                    close(processes[i]->fds[stream]);
+                    processes[i]->fds[stream] = -1;
+                }
+            }
+        }
+    }
+
+    g_free(poll_fds);
+
+    for (size_t i = 0; i < count; ++i) {
+        for (int stream = 0; stream < 2; ++stream) {
+            if (processes[i]->fds[stream] >= 0) {
+                close(processes[i]->fds[stream]);
+            }
+        }
+        finish_process(processes[i], &results[i]);
+    }
+}
+
+void appimage_process_wait(appimage_process_t* process, appimage_process_result_t* result) {
+    appimage_process_wait_all(&process, 1, result);
+}
+
+int appimage_process_run(
+    const char* path,
+    char* const argv[],
+    const appimage_process_options_t* options,
+    appimage_process_result_t* result
+) {
+    memset(result, 0, sizeof(*result));
+
+    appimage_process_t* process = appimage_process_start(path, argv, options);
+
+    if (process == NULL) {
+        result->exit_code = -1;
+        return -1;
+    }
+
+    appimage_process_wait(process, result);
+    return result->exit_code;
+}
+
+void appimage_process_result_clear(appimage_process_result_t* result) {
+    g_free(result->stdout_data);
+    g_free(result->stderr_data);
+    result->stdout_data = NULL;
+    result->stderr_data = NULL;
+}
+
+void appimage_process_print_usage(const char* name, const appimage_process_result_t* result) {
+    fprintf(
+        stderr,
+        "%s: exit code %d, %.2f s (user %.2f s, system %.2f s), max. RSS %.1f MiB, %ld blocks read, %ld blocks written\n",
+        name, result->exit_code, result->wall_seconds, result->user_seconds, result->system_seconds,
+        (double) result->max_rss_kib / 1024, result->input_blocks, result->output_blocks
+    );
+}
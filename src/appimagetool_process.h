@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Runs external tools with posix_spawn, which does not copy the page tables of the (multi-threaded) parent like fork
+ * does, and does not run any code in the child which could deadlock on locks held by other threads.
+ *
+ * All children are registered in a group, so that the children of a pipeline can be terminated at once when it is
+ * cancelled, without affecting the children of other pipelines running in the same process.
+ * Several children may run concurrently; appimage_process_wait_all collects the output of all of them at once.
+ */
+typedef struct appimage_process appimage_process_t;
+
+typedef struct appimage_process_group appimage_process_group_t;
+
+/**
+ * What happens to the standard output and error streams of a child.
+ */
+typedef enum {
+    // the child writes to appimagetool's stream
+    APPIMAGE_PROCESS_INHERIT,
+    // the output is collected into a bounded buffer, see appimage_process_result_t
+    APPIMAGE_PROCESS_CAPTURE,
+} appimage_process_output_t;
+
+typedef struct {
+    // environment of the child, NULL inherits appimagetool's environment
+    char* const* envp;
+    appimage_process_output_t stdout_mode;
+    appimage_process_output_t stderr_mode;
+    // maximum number of bytes captured per stream, the rest is read and discarded, 0 uses a default of 64 KiB
+    size_t capture_limit;
+    // group the child belongs to, NULL uses a default group shared by all children started without one
+    appimage_process_group_t* group;
+} appimage_process_options_t;
+
+typedef struct {
+    // exit code, or -1 if the child was killed by a signal
+    int exit_code;
+    // signal which terminated the child, 0 if it exited normally
+    int term_signal;
+    double wall_seconds;
+    double user_seconds;
+    double system_seconds;
+    long max_rss_kib;
+    // blocks read from and written to the file system, as counted by the kernel (see getrusage(2))
+    long input_blocks;
+    long output_blocks;
+    // captured output, NUL terminated, NULL unless the stream was captured
+    char* stdout_data;
+    size_t stdout_length;
+    bool stdout_truncated;
+    char* stderr_data;
+    size_t stderr_length;
+    bool stderr_truncated;
+} appimage_process_result_t;
+
+/**
+ * Look up a tool in the given search path. Every tool is looked up only once per search path, later calls return the
+ * cached result. Relative directories are skipped, as the result is shared by builds with different working
+ * directories.
+ * Thread safe.
+ * @param search_path value of $PATH to search, e.g., the one of a build's environment; NULL searches appimagetool's
+ * @return absolute path, owned by the cache, or NULL if the tool cannot be found
+ */
+const char* appimage_find_tool(const char* name, const char* search_path);
+
+/**
+ * Search path of an environment as used by appimage_find_tool, which is what execvp would search.
+ * @param envp NULL terminated environment, or NULL for appimagetool's environment
+ * @return $PATH of the environment, a default if it is not set, or NULL if envp is NULL
+ */
+const char* appimage_environment_search_path(char* const* envp);
+
+/**
+ * Make appimage_find_tool return the given path for a tool in every search path, e.g., for tools bundled with
+ * appimagetool.
+ */
+void appimage_register_tool(const char* name, const char* path);
+
+/**
+ * Start a child. argv[0] is passed to the child as is, the executable is path, or, if path is NULL, argv[0] looked up
+ * with appimage_find_tool in the search path of options->envp.
+ * @param options may be NULL, which inherits the environment and both output streams
+ * @return process, or NULL if the child could not be started. Must be passed to appimage_process_wait(_all).
+ */
+appimage_process_t* appimage_process_start(const char* path, char* const argv[], const appimage_process_options_t* options);
+
+/**
+ * Wait for the children to exit, collecting the output of all of them while they are running.
+ * The processes are freed.
+ * @param results receives one result per process, must be released with appimage_process_result_clear
+ */
+void appimage_process_wait_all(appimage_process_t* const* processes, size_t count, appimage_process_result_t* results);
+
+/**
+ * Wait for one child, see appimage_process_wait_all.
+ */
+void appimage_process_wait(appimage_process_t* process, appimage_process_result_t* result);
+
+/**
+ * Start a child and wait for it.
+ * @return exit code of the child, or -1 if it could not be started or did not exit normally
+ */
+int appimage_process_run(
+    const char* path,
+    char* const argv[],
+    const appimage_process_options_t* options,
+    appimage_process_result_t* result
+);
+
+void appimage_process_result_clear(appimage_process_result_t* result);
+
+/**
+ * Print the resource usage of a child, for verbose output.
+ */
+void appimage_process_print_usage(const char* name, const appimage_process_result_t* result);
+
+appimage_process_group_t* appimage_process_group_new(void);
+
+/**
+ * Must only be called once no children of the group are running anymore.
+ */
+void appimage_process_group_free(appimage_process_group_t* group);
+
+/**
+ * Send SIGTERM to all running children of the group, or of the default group if NULL. Children started in the group
+ * afterwards are terminated right away, since the pipeline has been cancelled.
+ */
+void appimage_process_group_terminate(appimage_process_group_t* group);
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "appimagetool_resources.h"
+
+#define MIB (1024ULL * 1024ULL)
+
+// see ioprio_set(2), there is no glibc wrapper
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+// cgroup v1 reports "no limit" as a huge number close to the maximum of a signed 64-bit value
+#define CGROUP_V1_UNLIMITED (1ULL << 62)
+
+/* Reads the limit a cgroup imposes from the interface files in its directory, returns false if there is none */
+typedef bool (*cgroup_limit_reader_t)(const char* directory, double* limit);
+
+static bool read_first_line(const char* path, char* buffer, size_t size) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    const bool success = fgets(buffer, (int) size, file) != NULL;
+    fclose(file);
+
+    return success;
+}
+
+/* Path of this process' cgroup from /proc/self/cgroup
+ * cgroup v2 is listed as "0::/path", cgroup v1 hierarchies as "ID:controller,controller:/path" */
+static bool find_cgroup_path(const char* controller, char* path, size_t size) {
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool found = false;
+    char line[PATH_MAX + 64];
+
+    while (!found && fgets(line, sizeof(line), file) != NULL) {
+        char* controllers = strchr(line, ':');
+        char* cgroup = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+        if (cgroup == NULL) {
+            continue;
+        }
+
+        *controllers++ = '\0';
+        *cgroup++ = '\0';
+        cgroup[strcspn(cgroup, "\n")] = '\0';
+
+        if (controller == NULL) {
+            found = strcmp(line, "0") == 0 && *controllers == '\0';
+        } else {
+            char* saveptr = NULL;
+            for (char* token = strtok_r(controllers, ",", &saveptr); token != NULL && !found; token = strtok_r(NULL, ",", &saveptr)) {
+                found = strcmp(token, controller) == 0;
+            }
+        }
+
+        if (found) {
+            snprintf(path, size, "%s", cgroup);
+        }
+    }
+
+    fclose(file);
+    return found;
+}
+
+/* The tightest limit set on the cgroup or any of its parents, or 0 if there is none
+ * Within a cgroup namespace, the cgroup is shown as the root, whose directory is the mount point itself */
+static double tightest_cgroup_limit(const char* mount_point, const char* cgroup_path, cgroup_limit_reader_t reader) {
+    char directory[PATH_MAX];
+    if (snprintf(directory, sizeof(directory), "%s%s", mount_point, cgroup_path) >= (int) sizeof(directory)) {
+        return 0;
+    }
+
+    const size_t mount_point_length = strlen(mount_point);
+    double tightest = 0;
+
+    for (;;) {
+        double limit;
+        if (reader(directory, &limit) && limit > 0 && (tightest == 0 || limit < tightest)) {
+            tightest = limit;
+        }
+
+        char* separator = strrchr(directory, '/');
+        if (separator == NULL || (size_t) (separator - directory) < mount_point_length) {
+            break;
+        }
+        *separator = '\0';
+    }
+
+    return tightest;
+}
+
+static bool read_cgroup_v2_cpu_limit(const char* directory, double* limit) {
+    char path[PATH_MAX];
+    char line[128];
+    snprintf(path, sizeof(path), "%s/cpu.max", directory);
+
+    unsigned long long quota;
+    unsigned long long period;
+
+    // "max 100000" means there is no quota
+    if (!read_first_line(path, line, sizeof(line)) || sscanf(line, "%llu %llu", &quota, &period) != 2 || period == 0) {
+        return false;
+    }
+
+    *limit = (double) quota / (double) period;
+    return true;
+}
+
+static bool read_cgroup_v1_cpu_limit(const char* directory, double* limit) {
+    char path[PATH_MAX];
+    char line[128];
+    long long quota;
+    long long period;
+
+    snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", directory);
+    if (!read_first_line(path, line, sizeof(line)) || sscanf(line, "%lld", &quota) != 1 || quota <= 0) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", directory);
+    if (!read_first_line(path, line, sizeof(line)) || sscanf(line, "%lld", &period) != 1 || period <= 0) {
+        return false;
+    }
+
+    *limit = (double) quota / (double) period;
+    return true;
+}
+
+static bool read_cgroup_v2_memory_limit(const char* directory, double* limit) {
+    static const char* const files[] = {"memory.max", "memory.high"};
+    bool found = false;
+
+    // memory.high is not a hard limit, but the kernel throttles the cgroup heavily above it
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+        char path[PATH_MAX];
+        char line[128];
+        unsigned long long bytes;
+        snprintf(path, sizeof(path), "%s/%s", directory, files[i]);
+
+        if (read_first_line(path, line, sizeof(line)) && sscanf(line, "%llu", &bytes) == 1 && bytes > 0 &&
+            (!found || (double) bytes < *limit)) {
+            *limit = (double) bytes;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+static bool read_cgroup_v1_memory_limit(const char* directory, double* limit) {
+    char path[PATH_MAX];
+    char line[128];
+    unsigned long long bytes;
+    snprintf(path, sizeof(path), "%s/memory.limit_in_bytes", directory);
+
+    if (!read_first_line(path, line, sizeof(line)) || sscanf(line, "%llu", &bytes) != 1 || bytes >= CGROUP_V1_UNLIMITED) {
+        return false;
+    }
+
+    *limit = (double) bytes;
+    return true;
+}
+
+static double cgroup_cpu_limit(void) {
+    char cgroup[PATH_MAX];
+
+    if (find_cgroup_path(NULL, cgroup, sizeof(cgroup))) {
+        const double limit = tightest_cgroup_limit("/sys/fs/cgroup", cgroup, read_cgroup_v2_cpu_limit);
+        if (limit > 0) {
+            return limit;
+        }
+    }
+
+    if (find_cgroup_path("cpu", cgroup, sizeof(cgroup))) {
+        static const char* const mount_points[] = {"/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu"};
+
+        for (size_t i = 0; i < sizeof(mount_points) / sizeof(mount_points[0]); ++i) {
+            const double limit = tightest_cgroup_limit(mount_points[i], cgroup, read_cgroup_v1_cpu_limit);
+            if (limit > 0) {
+                return limit;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static double cgroup_memory_limit(void) {
+    char cgroup[PATH_MAX];
+
+    if (find_cgroup_path(NULL, cgroup, sizeof(cgroup))) {
+        const double limit = tightest_cgroup_limit("/sys/fs/cgroup", cgroup, read_cgroup_v2_memory_limit);
+        if (limit > 0) {
+            return limit;
+        }
+    }
+
+    if (find_cgroup_path("memory", cgroup, sizeof(cgroup))) {
+        return tightest_cgroup_limit("/sys/fs/cgroup/memory", cgroup, read_cgroup_v1_memory_limit);
+    }
+
+    return 0;
+}
+
+static unsigned int available_cpus(void) {
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return (unsigned int) CPU_COUNT(&set);
+    }
+
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned int) cpus : 1;
+}
+
+static uint64_t physical_memory(void) {
+    const long pages = sysconf(_SC_PHYS_PAGES);
+    const long page_size = sysconf(_SC_PAGESIZE);
+
+    if (pages <= 0 || page_size <= 0) {
+        return 0;
+    }
+
+    return (uint64_t) pages * (uint64_t) page_size;
+}
+
+void appimage_budget_init(appimage_budget_t* budget, unsigned int jobs, uint64_t memory) {
+    memset(budget, 0, sizeof(*budget));
+
+    budget->jobs = available_cpus();
+
+    if (jobs > 0) {
+        budget->jobs = jobs;
+        budget->jobs_limited = true;
+    } else {
+        // a quota of 1.5 CPUs still allows two threads to make progress
+        const double quota = cgroup_cpu_limit();
+        const unsigned int quota_jobs = (unsigned int) quota + ((double) (unsigned int) quota < quota ? 1 : 0);
+        if (quota > 0 && quota_jobs < budget->jobs) {
+            budget->jobs = quota_jobs;
+            budget->jobs_limited = true;
+        }
+    }
+
+    budget->memory = physical_memory();
+
+    if (memory > 0) {
+        budget->memory = memory;
+        budget->memory_limited = true;
+    } else {
+        const double limit = cgroup_memory_limit();
+        if (limit > 0 && (budget->memory == 0 || limit < (double) budget->memory)) {
+            budget->memory = (uint64_t) limit;
+            budget->memory_limited = true;
+        }
+    }
+
+    // with enough CPUs, one is left for the validation stages, and for appimagetool reading the files when the
+    // in-process writer is used
+    budget->squashfs_jobs = budget->jobs >= 4 ? budget->jobs - 1 : budget->jobs;
+
+    // mksquashfs' -mem only bounds its caches and queues, the tables it builds and the other stages need memory, too
+    const uint64_t reserved = budget->memory / 4 < 256 * MIB ? budget->memory / 4 : 256 * MIB;
+    budget->squashfs_memory = (budget->memory - reserved) / 2;
+    if (budget->squashfs_memory < 64 * MIB) {
+        budget->squashfs_memory = 64 * MIB;
+    }
+}
+
+void appimage_budget_print(const appimage_budget_t* budget) {
+    fprintf(
+        stderr,
+        "Resource budget: %u CPUs (%s), %.0f MiB memory (%s), squashfs: %u CPUs, %.0f MiB\n",
+        budget->jobs, budget->jobs_limited ? "limited" : "all available",
+        (double) budget->memory / MIB, budget->memory_limited ? "limited" : "physical",
+        budget->squashfs_jobs, (double) budget->squashfs_memory / MIB
+    );
+}
+
+bool appimage_parse_memory_size(const char* text, uint64_t* bytes) {
+    char* end = NULL;
+
+    errno = 0;
+    const unsigned long long value = strtoull(text, &end, 10);
+
+    if (errno != 0 || end == text || text[0] == '-') {
+        return false;
+    }
+
+    unsigned int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; ++end; break;
+        case 'M': case 'm': shift = 20; ++end; break;
+        case 'G': case 'g': shift = 30; ++end; break;
+        case 'T': case 't': shift = 40; ++end; break;
+        default: break;
+    }
+
+    // 2G, 2GB and 2GiB all mean the same
+    if (shift > 0 && *end == 'i') {
+        ++end;
+    }
+    if (*end == 'B' || *end == 'b') {
+        ++end;
+    }
+
+    if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+        return false;
+    }
+
+    *bytes = (uint64_t) value << shift;
+    return true;
+}
+
+bool appimage_lower_priority(int nice_increment, const char* ionice_class) {
+    if (nice_increment != 0) {
+        errno = 0;
+        if (nice(nice_increment) == -1 && errno != 0) {
+            fprintf(stderr, "Failed to change the nice value: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    if (ionice_class == NULL) {
+        return true;
+    }
+
+    int priority;
+    unsigned int level = 4;
+
+    if (strcmp(ionice_class, "idle") == 0) {
+        priority = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    } else if (strcmp(ionice_class, "best-effort") == 0 ||
+               (sscanf(ionice_class, "best-effort:%u", &level) == 1 && level <= 7)) {
+        priority = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | (int) level;
+    } else {
+        fprintf(stderr, "Unknown I/O scheduling class: %s (use idle, best-effort or best-effort:0-7)\n", ionice_class);
+        return false;
+    }
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, priority) != 0) {
+        fprintf(stderr, "Failed to change the I/O priority: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * CPU and memory budget of a build, and its split between mksquashfs (or the in-process squashfs writer) and the
+ * stages which run at the same time.
+ *
+ * Without explicit limits, the budget is what the process may actually use: the CPUs in its affinity mask, further
+ * limited by the CPU quota of its cgroup (cpu.max for cgroup v2, cpu.cfs_quota_us for v1), and the physical memory,
+ * further limited by memory.max/memory.high (v2) or memory.limit_in_bytes (v1) of its cgroup and all its parents.
+ * This matters in CI containers, where the host's CPUs and memory are visible but most of them are not available.
+ */
+typedef struct {
+    unsigned int jobs;
+    uint64_t memory;
+    // whether the values are limited by a cgroup or the user, rather than the hardware
+    bool jobs_limited;
+    bool memory_limited;
+
+    // share of mksquashfs or the squashfs writer, the rest is left for the validation stages running alongside
+    unsigned int squashfs_jobs;
+    uint64_t squashfs_memory;
+} appimage_budget_t;
+
+/**
+ * Determine the budget.
+ * @param jobs explicit number of CPUs to use, 0 detects it
+ * @param memory explicit amount of memory to use in bytes, 0 detects it
+ */
+void appimage_budget_init(appimage_budget_t* budget, unsigned int jobs, uint64_t memory);
+
+void appimage_budget_print(const appimage_budget_t* budget);
+
+/**
+ * Parse a memory size like 512M, 2G or 1048576 (bytes). K, M, G and T are powers of 1024.
+ * @return true on success, false if the text is not a valid size
+ */
+bool appimage_parse_memory_size(const char* text, uint64_t* bytes);
+
+/**
+ * Lower the CPU and I/O priority of appimagetool and everything it starts, for shared build hosts.
+ * Must be called before any threads are started, since Linux applies both per thread, and new threads and children
+ * inherit them from the thread creating them.
+ * @param nice_increment added to the nice value, 0 keeps it
+ * @param ionice_class "idle", "best-effort" or "best-effort:LEVEL" (0-7, 0 is the highest priority), NULL keeps it
+ * @return true on success, false otherwise
+ */
+bool appimage_lower_priority(int nice_increment, const char* ionice_class);
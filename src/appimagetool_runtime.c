@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <linux/fs.h>
+
+#include "appimagetool_runtime.h"
+
+int create_runtime_file_descriptor(void) {
+    int fd = -1;
+
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("appimagetool-runtime", MFD_CLOEXEC);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL) {
+        tmpdir = "/tmp";
+    }
+
+#ifdef O_TMPFILE
+    fd = open(tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+
+    // last resort: a named temporary file which is unlinked right away
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/appimagetool-runtime-XXXXXX", tmpdir);
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+// try to share the runtime's blocks with the destination instead of copying them
+// the clone range must be aligned to the filesystem's block size, so an unaligned tail is left for the caller to copy
+static size_t clone_runtime(int runtime_fd, int destination_fd, size_t size, bool verbose) {
+#ifdef FICLONERANGE
+    struct stat st;
+    if (fstat(destination_fd, &st) != 0 || st.st_blksize <= 0) {
+        return 0;
+    }
+
+    const size_t aligned_size = size - (size % (size_t) st.st_blksize);
+    if (aligned_size == 0) {
+        return 0;
+    }
+
+    struct file_clone_range range = {
+        .src_fd = runtime_fd,
+        .src_offset = 0,
+        .src_length = aligned_size,
+        .dest_offset = 0,
+    };
+
+    if (ioctl(destination_fd, FICLONERANGE, &range) != 0) {
+        if (verbose) {
+            fprintf(stderr, "Cannot reflink runtime into AppImage (%s), copying instead\n", strerror(errno));
+        }
+        return 0;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Reflinked %zu bytes of the runtime into the AppImage\n", aligned_size);
+    }
+
+    return aligned_size;
+#else
+    (void) runtime_fd;
+    (void) destination_fd;
+    (void) size;
+    (void) verbose;
+    return 0;
+#endif
+}
+
+static bool copy_runtime_range(int runtime_fd, int destination_fd, off_t offset, size_t size) {
+    off_t in_offset = offset;
+    off_t out_offset = offset;
+    size_t left = size;
+
+    // copy_file_range works within a filesystem and, depending on the kernel, across some filesystems
+    while (left > 0) {
+        ssize_t copied = copy_file_range(runtime_fd, &in_offset, destination_fd, &out_offset, left, 0);
+
+        if (copied < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (copied == 0) {
+            // unexpected end of file
+            return false;
+        }
+
+        left -= (size_t) copied;
+    }
+
+    if (left == 0) {
+        return true;
+    }
+
+    // sendfile handles any combination of regular files and memory files, it writes to the current position
+    if (lseek(destination_fd, out_offset, SEEK_SET) == out_offset) {
+        while (left > 0) {
+            ssize_t copied = sendfile(destination_fd, runtime_fd, &in_offset, left);
+
+            if (copied < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            if (copied == 0) {
+                return false;
+            }
+
+            left -= (size_t) copied;
+        }
+    }
+
+    if (left == 0) {
+        return true;
+    }
+
+    // if the kernel can't help at all, fall back to a small bounce buffer
+    char buffer[64 * 1024];
+
+    while (left > 0) {
+        size_t chunk = left < sizeof(buffer) ? left : sizeof(buffer);
+        ssize_t bytes_read = pread(runtime_fd, buffer, chunk, in_offset);
+
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes_read <= 0) {
+            return false;
+        }
+
+        size_t written = 0;
+        while (written < (size_t) bytes_read) {
+            ssize_t result = pwrite(destination_fd, buffer + written, (size_t) bytes_read - written, out_offset + (off_t) written);
+
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+
+            written += (size_t) result;
+        }
+
+        in_offset += bytes_read;
+        out_offset += bytes_read;
+        left -= (size_t) bytes_read;
+    }
+
+    return true;
+}
+
+bool embed_runtime(int runtime_fd, size_t size, int destination_fd, bool verbose) {
+    size_t cloned = clone_runtime(runtime_fd, destination_fd, size, verbose);
+
+    // mksquashfs leaves a hole where the runtime goes, allocating it in one go avoids fragmenting the head of the file
+    if (cloned < size) {
+        if (fallocate(destination_fd, 0, (off_t) cloned, (off_t) (size - cloned)) != 0 && verbose) {
+            fprintf(stderr, "Could not preallocate space for the runtime: %s\n", strerror(errno));
+        }
+    }
+
+    if (!copy_runtime_range(runtime_fd, destination_fd, (off_t) cloned, size - cloned)) {
+        fprintf(stderr, "Failed to copy runtime into the AppImage: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
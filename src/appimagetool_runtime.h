@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create an unnamed file a downloaded runtime can be stored in until it is embedded.
+ * Uses a memory file descriptor if available, otherwise an unlinked temporary file.
+ * @return file descriptor, or -1 on failure
+ */
+int create_runtime_file_descriptor(void);
+
+/**
+ * Copy the first size bytes of runtime_fd to the beginning of the destination file.
+ * The data is cloned (reflinked) where the filesystems allow for it, and copied within the kernel otherwise.
+ * @param destination_fd file descriptor of the AppImage, opened for writing, remains open
+ * @return true on success, false otherwise
+ */
+bool embed_runtime(int runtime_fd, size_t size, int destination_fd, bool verbose);
+
+#ifdef __cplusplus
+}
+#endif
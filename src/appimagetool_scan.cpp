@@ -0,0 +1,572 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+
+#include "appimagetool_scan.h"
+
+namespace {
+    // getdents64 is not wrapped by all libcs we build with, so we use the raw syscall
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    constexpr size_t direntBufferSize = 64 * 1024;
+
+    // large enough for the fields of the ELF header we're interested in, for both 32-bit and 64-bit ELF files
+    constexpr size_t elfProbeSize = 20;
+
+    /**
+     * Bump allocator for path strings. Paths are never freed individually, only together with the scan result.
+     */
+    class PathArena {
+    private:
+        static constexpr size_t chunkSize = 256 * 1024;
+
+        std::vector<std::unique_ptr<char[]>> _chunks;
+        size_t _used = chunkSize;
+
+    public:
+        const char* store(std::string_view directory, std::string_view name) {
+            const auto length = directory.empty() ? name.size() : directory.size() + 1 + name.size();
+
+            char* target;
+
+            if (length + 1 > chunkSize) {
+                // unusually long path, give it a chunk of its own
+                _chunks.emplace_back(new char[length + 1]);
+                target = _chunks.back().get();
+            } else {
+                if (_used + length + 1 > chunkSize) {
+                    _chunks.emplace_back(new char[chunkSize]);
+                    _used = 0;
+                }
+                target = _chunks.back().get() + _used;
+                _used += length + 1;
+            }
+
+            char* position = target;
+            if (!directory.empty()) {
+                position = std::copy(directory.begin(), directory.end(), position);
+                *position++ = '/';
+            }
+            position = std::copy(name.begin(), name.end(), position);
+            *position = '\0';
+
+            return target;
+        }
+    };
+
+    struct EntryStat {
+        uint32_t mode;
+        uint64_t size;
+        // only set if the metadata has been asked for
+        int64_t mtimeNs;
+        int64_t ctimeNs;
+        uint64_t device;
+        uint64_t inode;
+        uint64_t rdev;
+    };
+
+    int64_t toNs(int64_t seconds, int64_t nanoseconds) {
+        return seconds * 1000000000 + nanoseconds;
+    }
+
+    EntryStat fromStat(const struct stat& st) {
+        return EntryStat{
+            static_cast<uint32_t>(st.st_mode), static_cast<uint64_t>(st.st_size),
+            toNs(st.st_mtim.tv_sec, st.st_mtim.tv_nsec), toNs(st.st_ctim.tv_sec, st.st_ctim.tv_nsec),
+            static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino), static_cast<uint64_t>(st.st_rdev),
+        };
+    }
+
+    std::optional<EntryStat> statEntry(int dirFd, const char* name, bool followSymlinks, bool metadata) {
+        const int flags = followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+
+#ifdef STATX_TYPE
+        struct statx buffer{};
+        // usually, we only need the type, mode and size, which lets network file systems skip revalidating everything
+        // else; the metadata is used to tell whether files have changed, so it must be as current as with stat
+        const unsigned int mask = STATX_TYPE | STATX_MODE | STATX_SIZE | (metadata ? STATX_MTIME | STATX_CTIME | STATX_INO : 0);
+        if (statx(dirFd, name, flags | (metadata ? AT_STATX_SYNC_AS_STAT : AT_STATX_DONT_SYNC), mask, &buffer) == 0) {
+            return EntryStat{
+                buffer.stx_mode, buffer.stx_size,
+                toNs(buffer.stx_mtime.tv_sec, buffer.stx_mtime.tv_nsec), toNs(buffer.stx_ctime.tv_sec, buffer.stx_ctime.tv_nsec),
+                makedev(buffer.stx_dev_major, buffer.stx_dev_minor), buffer.stx_ino,
+                makedev(buffer.stx_rdev_major, buffer.stx_rdev_minor),
+            };
+        }
+        if (errno != ENOSYS) {
+            return std::nullopt;
+        }
+#endif
+
+        struct stat fallback{};
+        if (fstatat(dirFd, name, &fallback, flags) != 0) {
+            return std::nullopt;
+        }
+        return fromStat(fallback);
+    }
+
+    void setMetadata(appdir_entry_t& entry, const EntryStat& stat) {
+        entry.mode = stat.mode;
+        entry.size = S_ISREG(stat.mode) ? stat.size : 0;
+        entry.mtime_ns = stat.mtimeNs;
+        entry.ctime_ns = stat.ctimeNs;
+        entry.device = stat.device;
+        entry.inode = stat.inode;
+        entry.rdev = stat.rdev;
+    }
+
+    bool endsWith(std::string_view value, std::string_view suffix) {
+        return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    uint16_t readElfHalf(const unsigned char* data, bool bigEndian) {
+        if (bigEndian) {
+            return static_cast<uint16_t>((data[0] << 8) | data[1]);
+        }
+        return static_cast<uint16_t>(data[0] | (data[1] << 8));
+    }
+
+    struct PendingProbe {
+        size_t entryIndex;
+        const char* name;
+    };
+
+    /**
+     * Directory walker which distributes directories across a fixed number of threads.
+     * Each thread works through its own queue of directories depth first, and steals from the other end of
+     * another thread's queue once its own queue is empty. This keeps all threads busy on deep as well as wide trees.
+     */
+    class AppDirScanner {
+    private:
+        struct Worker {
+            std::mutex mutex;
+            std::deque<const char*> directories;
+            PathArena arena;
+            std::vector<appdir_entry_t> entries;
+            uint64_t directoriesCount = 0;
+        };
+
+        int _rootFd;
+        bool _probeElf;
+        bool _metadata;
+        std::vector<std::unique_ptr<Worker>> _workers;
+        // number of directories which are queued or being processed
+        std::atomic<size_t> _pending{0};
+        std::atomic<bool> _failed{false};
+        std::mutex _errorMutex;
+
+        void fail(const std::string& message) {
+            std::lock_guard lock(_errorMutex);
+            if (!_failed.exchange(true)) {
+                std::cerr << message << std::endl;
+            }
+        }
+
+        void push(Worker& worker, const char* directory) {
+            _pending.fetch_add(1);
+            std::lock_guard lock(worker.mutex);
+            worker.directories.push_back(directory);
+        }
+
+        std::optional<const char*> pop(size_t self) {
+            {
+                auto& own = *_workers[self];
+                std::lock_guard lock(own.mutex);
+                if (!own.directories.empty()) {
+                    const auto* directory = own.directories.back();
+                    own.directories.pop_back();
+                    return directory;
+                }
+            }
+
+            // steal the oldest, i.e., usually the shallowest and therefore largest, piece of work
+            for (size_t i = 1; i < _workers.size(); ++i) {
+                auto& victim = *_workers[(self + i) % _workers.size()];
+                std::lock_guard lock(victim.mutex);
+                if (!victim.directories.empty()) {
+                    const auto* directory = victim.directories.front();
+                    victim.directories.pop_front();
+                    return directory;
+                }
+            }
+
+            return std::nullopt;
+        }
+
+        void probeElfHeaders(int dirFd, Worker& worker, const std::vector<PendingProbe>& probes) {
+            unsigned char header[elfProbeSize];
+
+            for (const auto& probe : probes) {
+                const int fd = openat(dirFd, probe.name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY);
+                if (fd < 0) {
+                    continue;
+                }
+
+                const auto bytesRead = pread(fd, header, sizeof(header), 0);
+                close(fd);
+
+                if (bytesRead != static_cast<ssize_t>(sizeof(header)) || memcmp(header, "\x7f" "ELF", 4) != 0) {
+                    continue;
+                }
+
+                auto& entry = worker.entries[probe.entryIndex];
+                const bool bigEndian = header[5] == 2;
+                entry.flags |= APPDIR_ENTRY_ELF;
+                entry.elf_class = header[4];
+                entry.elf_data = header[5];
+                entry.elf_type = readElfHalf(header + 16, bigEndian);
+                entry.elf_machine = readElfHalf(header + 18, bigEndian);
+            }
+        }
+
+        void scanDirectory(Worker& worker, const char* directory) {
+            const int dirFd = openat(_rootFd, *directory == '\0' ? "." : directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+            if (dirFd < 0) {
+                fail(std::string("Failed to open directory ") + directory + ": " + strerror(errno));
+                return;
+            }
+
+            worker.directoriesCount++;
+
+            const std::string_view directoryView(directory);
+            const bool isTopLevel = directoryView.empty();
+            const bool isMetainfo = directoryView == "usr/share/metainfo";
+
+            std::vector<PendingProbe> probes;
+            auto buffer = std::make_unique<char[]>(direntBufferSize);
+
+            for (;;) {
+                const auto bytesRead = syscall(SYS_getdents64, dirFd, buffer.get(), direntBufferSize);
+
+                if (bytesRead < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    fail(std::string("Failed to read directory ") + directory + ": " + strerror(errno));
+                    break;
+                }
+
+                if (bytesRead == 0) {
+                    break;
+                }
+
+                for (long offset = 0; offset < bytesRead;) {
+                    const auto* dirent = reinterpret_cast<const LinuxDirent64*>(buffer.get() + offset);
+                    offset += dirent->d_reclen;
+
+                    const std::string_view name(dirent->d_name);
+                    if (name == "." || name == "..") {
+                        continue;
+                    }
+
+                    const unsigned char type = dirent->d_type;
+
+                    appdir_entry_t entry{};
+                    entry.path = worker.arena.store(directoryView, name);
+
+                    if (type == DT_DIR && !_metadata) {
+                        entry.mode = S_IFDIR;
+                    } else if (type == DT_LNK && !_metadata) {
+                        // no need to stat, symlinks are not followed
+                        entry.mode = S_IFLNK | 0777;
+                    } else {
+                        // DT_UNKNOWN is common on network file systems
+                        const auto stat = statEntry(dirFd, dirent->d_name, false, _metadata);
+                        if (!stat.has_value()) {
+                            if (errno == ENOENT) {
+                                // removed while we were scanning
+                                continue;
+                            }
+                            fail(std::string("Failed to stat ") + entry.path + ": " + strerror(errno));
+                            continue;
+                        }
+
+                        setMetadata(entry, stat.value());
+                    }
+
+                    if (S_ISDIR(entry.mode)) {
+                        worker.entries.push_back(entry);
+                        push(worker, entry.path);
+                        continue;
+                    }
+
+                    const bool isDesktopFile = isTopLevel && endsWith(name, ".desktop");
+                    const bool isIcon = isTopLevel && (endsWith(name, ".png") || endsWith(name, ".svg") || endsWith(name, ".xpm"));
+                    const bool isAppStream = isMetainfo && endsWith(name, ".xml");
+
+                    if (isDesktopFile || isIcon || isAppStream) {
+                        bool isRegular = S_ISREG(entry.mode);
+
+                        // these are often symlinks into usr/share, which is fine as long as they point to a file
+                        if (S_ISLNK(entry.mode)) {
+                            const auto target = statEntry(dirFd, dirent->d_name, true, false);
+                            isRegular = target.has_value() && S_ISREG(target->mode);
+                        }
+
+                        if (isRegular) {
+                            entry.flags |= (isDesktopFile ? APPDIR_ENTRY_DESKTOP_FILE : 0) |
+                                (isIcon ? APPDIR_ENTRY_ICON : 0) |
+                                (isAppStream ? APPDIR_ENTRY_APPSTREAM : 0);
+                        }
+                    }
+
+                    worker.entries.push_back(entry);
+
+                    // ELF headers are read once the directory listing is complete, so directory reads and file reads
+                    // do not interleave
+                    if (_probeElf && S_ISREG(entry.mode) && ((entry.mode & 0111) != 0 || name.find(".so.") != std::string_view::npos)) {
+                        probes.push_back({worker.entries.size() - 1, entry.path + (isTopLevel ? 0 : directoryView.size() + 1)});
+                    }
+                }
+            }
+
+            probeElfHeaders(dirFd, worker, probes);
+
+            close(dirFd);
+        }
+
+        void run(size_t self) {
+            auto& worker = *_workers[self];
+            auto idleSince = std::chrono::steady_clock::time_point{};
+            bool idle = false;
+
+            while (!_failed.load()) {
+                const auto directory = pop(self);
+
+                if (directory.has_value()) {
+                    idle = false;
+                    scanDirectory(worker, directory.value());
+                    _pending.fetch_sub(1);
+                    continue;
+                }
+
+                if (_pending.load() == 0) {
+                    break;
+                }
+
+                // others are still working and might produce more work soon, back off gradually
+                const auto now = std::chrono::steady_clock::now();
+                if (!idle) {
+                    idle = true;
+                    idleSince = now;
+                }
+                if (now - idleSince < std::chrono::milliseconds(1)) {
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+        }
+
+    public:
+        AppDirScanner(int rootFd, unsigned int threads, bool probeElf, bool metadata)
+            : _rootFd(rootFd), _probeElf(probeElf), _metadata(metadata) {
+            for (unsigned int i = 0; i < threads; ++i) {
+                _workers.emplace_back(std::make_unique<Worker>());
+            }
+        }
+
+        [[nodiscard]] bool scan() {
+            push(*_workers.front(), "");
+
+            std::vector<std::thread> threads;
+            for (size_t i = 1; i < _workers.size(); ++i) {
+                threads.emplace_back(&AppDirScanner::run, this, i);
+            }
+
+            run(0);
+
+            for (auto& thread : threads) {
+                thread.join();
+            }
+
+            return !_failed.load();
+        }
+
+        [[nodiscard]] uint64_t directoriesCount() const {
+            uint64_t count = 0;
+            for (const auto& worker : _workers) {
+                count += worker->directoriesCount;
+            }
+            return count;
+        }
+
+        /**
+         * Move the collected entries and the memory backing their paths out of the scanner.
+         */
+        void collect(std::vector<appdir_entry_t>& entries, std::vector<PathArena>& arenas) {
+            for (auto& worker : _workers) {
+                entries.insert(entries.end(), worker->entries.begin(), worker->entries.end());
+                arenas.emplace_back(std::move(worker->arena));
+            }
+        }
+    };
+}
+
+struct appdir_scan {
+    std::vector<PathArena> arenas;
+    appdir_entry_t root{};
+    std::vector<appdir_entry_t> entries;
+    uint64_t totalSize = 0;
+    // indexes of the entries sorted by name, built on the first lookup by name
+    mutable std::once_flag nameIndexBuilt;
+    mutable std::vector<size_t> nameIndex;
+};
+
+appdir_scan_t* appdir_scan(const char* root, unsigned int threads, int options, bool verbose) {
+    if (threads == 0) {
+        // the walk is mostly bound by metadata latency rather than CPU, especially on NFS, so we use more
+        // threads than there are cores on small machines
+        threads = std::clamp(std::thread::hardware_concurrency(), 4u, 32u);
+    }
+
+    const int rootFd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        std::cerr << "Failed to open " << root << ": " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool metadata = (options & APPDIR_SCAN_METADATA) != 0;
+
+    auto result = std::make_unique<struct appdir_scan>();
+    result->root.path = "";
+    result->root.name = "";
+    result->root.parent = APPDIR_SCAN_ROOT;
+    result->root.mode = S_IFDIR;
+
+    struct stat rootStat{};
+    if (metadata) {
+        if (fstat(rootFd, &rootStat) != 0) {
+            std::cerr << "Failed to stat " << root << ": " << strerror(errno) << std::endl;
+            close(rootFd);
+            return nullptr;
+        }
+        setMetadata(result->root, fromStat(rootStat));
+    }
+
+    AppDirScanner scanner(rootFd, threads, (options & APPDIR_SCAN_PROBE_ELF) != 0, metadata);
+    const bool success = scanner.scan();
+    close(rootFd);
+
+    if (!success) {
+        return nullptr;
+    }
+
+    scanner.collect(result->entries, result->arenas);
+
+    // the threads finish in arbitrary order, sorting makes the results independent of that
+    std::sort(result->entries.begin(), result->entries.end(), [](const auto& a, const auto& b) {
+        return strcmp(a.path, b.path) < 0;
+    });
+
+    // directories come before their entries, so their indexes are known by then
+    std::unordered_map<std::string_view, size_t> directories;
+
+    for (size_t i = 0; i < result->entries.size(); ++i) {
+        auto& entry = result->entries[i];
+        const std::string_view path(entry.path);
+        const auto slash = path.rfind('/');
+
+        entry.name = slash == std::string_view::npos ? entry.path : entry.path + slash + 1;
+        entry.parent = slash == std::string_view::npos ? APPDIR_SCAN_ROOT : directories.at(path.substr(0, slash));
+
+        if (S_ISDIR(entry.mode)) {
+            directories.emplace(path, i);
+        }
+
+        result->totalSize += entry.size;
+    }
+
+    if (verbose) {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        std::cerr << "Scanned " << result->entries.size() << " entries in " << scanner.directoriesCount()
+                  << " directories (" << result->totalSize << " bytes) with " << threads << " threads in "
+                  << elapsed.count() << " ms" << std::endl;
+    }
+
+    return result.release();
+}
+
+void appdir_scan_free(appdir_scan_t* scan) {
+    delete scan;
+}
+
+const appdir_entry_t* appdir_scan_root(const appdir_scan_t* scan) {
+    return &scan->root;
+}
+
+size_t appdir_scan_entries_count(const appdir_scan_t* scan) {
+    return scan->entries.size();
+}
+
+const appdir_entry_t* appdir_scan_entry(const appdir_scan_t* scan, size_t index) {
+    if (index >= scan->entries.size()) {
+        return nullptr;
+    }
+    return &scan->entries[index];
+}
+
+const appdir_entry_t* appdir_scan_find(const appdir_scan_t* scan, const char* path) {
+    const auto it = std::lower_bound(scan->entries.begin(), scan->entries.end(), path, [](const auto& entry, const char* value) {
+        return strcmp(entry.path, value) < 0;
+    });
+
+    if (it == scan->entries.end() || strcmp(it->path, path) != 0) {
+        return nullptr;
+    }
+
+    return &*it;
+}
+
+size_t appdir_scan_find_name(const appdir_scan_t* scan, const char* name, const size_t** indexes) {
+    std::call_once(scan->nameIndexBuilt, [scan]() {
+        scan->nameIndex.resize(scan->entries.size());
+        for (size_t i = 0; i < scan->entries.size(); ++i) {
+            scan->nameIndex[i] = i;
+        }
+
+        // stable, so that entries with the same name stay in path order
+        std::stable_sort(scan->nameIndex.begin(), scan->nameIndex.end(), [scan](size_t a, size_t b) {
+            return strcmp(scan->entries[a].name, scan->entries[b].name) < 0;
+        });
+    });
+
+    const auto first = std::lower_bound(scan->nameIndex.begin(), scan->nameIndex.end(), name, [scan](size_t index, const char* value) {
+        return strcmp(scan->entries[index].name, value) < 0;
+    });
+    const auto last = std::upper_bound(first, scan->nameIndex.end(), name, [scan](const char* value, size_t index) {
+        return strcmp(value, scan->entries[index].name) < 0;
+    });
+
+    *indexes = scan->nameIndex.data() + (first - scan->nameIndex.begin());
+    return static_cast<size_t>(last - first);
+}
+
+uint64_t appdir_scan_total_size(const appdir_scan_t* scan) {
+    return scan->totalSize;
+}
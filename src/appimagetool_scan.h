@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Classification of the entries found while scanning an AppDir. Multiple flags may apply to the same entry.
+ */
+enum appdir_entry_flags {
+    // regular file in the AppDir's top level directory ending in .desktop
+    APPDIR_ENTRY_DESKTOP_FILE = 1 << 0,
+    // regular file in the AppDir's top level directory ending in .png, .svg or .xpm
+    APPDIR_ENTRY_ICON = 1 << 1,
+    // regular file in usr/share/metainfo ending in .xml
+    APPDIR_ENTRY_APPSTREAM = 1 << 2,
+    // executable or shared library (*.so.*) whose ELF header has been read, requires APPDIR_SCAN_PROBE_ELF
+    APPDIR_ENTRY_ELF = 1 << 3,
+};
+
+/**
+ * Options for appdir_scan.
+ */
+enum appdir_scan_options {
+    // read the ELF headers of executables and shared libraries (*.so.*), this opens every such file
+    APPDIR_SCAN_PROBE_ELF = 1 << 0,
+    // stat every entry, including directories and symlinks, and record the metadata tree hashes and squashfs images
+    // are made of
+    APPDIR_SCAN_METADATA = 1 << 1,
+};
+
+// parent of the entries in the AppDir's top level directory
+#define APPDIR_SCAN_ROOT SIZE_MAX
+
+typedef struct {
+    // path relative to the AppDir, without leading slash
+    const char* path;
+    // last component of the path
+    const char* name;
+    // index of the directory the entry is in, or APPDIR_SCAN_ROOT
+    size_t parent;
+    // st_mode of the entry itself (symlinks are not followed), only the type for directories and symlinks unless
+    // APPDIR_SCAN_METADATA is given
+    uint32_t mode;
+    uint32_t flags;
+    // size of regular files, 0 otherwise
+    uint64_t size;
+    // the following fields are only valid with APPDIR_SCAN_METADATA
+    // modification and status change times in nanoseconds since the epoch
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t device;
+    uint64_t inode;
+    // device number of character and block devices
+    uint64_t rdev;
+    // fields of the ELF header, only valid if APPDIR_ENTRY_ELF is set
+    uint8_t elf_class;
+    uint8_t elf_data;
+    uint16_t elf_type;
+    uint16_t elf_machine;
+} appdir_entry_t;
+
+typedef struct appdir_scan appdir_scan_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Walk the given AppDir once, using multiple threads, and collect everything later stages need to know about it.
+ * Symlinks are recorded but not followed. Directories are recorded like all other entries, except for the AppDir
+ * itself, see appdir_scan_root.
+ * @param threads number of threads to use, 0 picks a default suitable for network file systems
+ * @param options bitwise or of appdir_scan_options values
+ * @return scan result, or NULL on errors. Must be freed with appdir_scan_free.
+ */
+appdir_scan_t* appdir_scan(const char* root, unsigned int threads, int options, bool verbose);
+
+void appdir_scan_free(appdir_scan_t* scan);
+
+/**
+ * The AppDir itself, with an empty path. Its metadata is only valid with APPDIR_SCAN_METADATA.
+ */
+const appdir_entry_t* appdir_scan_root(const appdir_scan_t* scan);
+
+/**
+ * Entries are sorted by path.
+ */
+size_t appdir_scan_entries_count(const appdir_scan_t* scan);
+
+const appdir_entry_t* appdir_scan_entry(const appdir_scan_t* scan, size_t index);
+
+/**
+ * Look up an entry by its path relative to the AppDir.
+ * @return entry, or NULL if there is no such entry
+ */
+const appdir_entry_t* appdir_scan_find(const appdir_scan_t* scan, const char* path);
+
+/**
+ * Look up the entries with the given name in all directories of the AppDir. The index this uses is built on the first
+ * call, which is safe to make from multiple threads.
+ * @param indexes receives the indexes of the matching entries, in path order; valid until the scan is freed
+ * @return number of matching entries
+ */
+size_t appdir_scan_find_name(const appdir_scan_t* scan, const char* name, const size_t** indexes);
+
+/**
+ * Sum of the sizes of all regular files in the AppDir.
+ */
+uint64_t appdir_scan_total_size(const appdir_scan_t* scan);
+
+#ifdef __cplusplus
+}
+#endif
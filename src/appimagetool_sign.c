@@ -7,35 +7,64 @@
 #include <gcrypt.h>
 #include <gpgme.h>
 
+#include <glib.h>
+
+#include "appimagetool_hash.h"
+#include "appimagetool_output.h"
 #include "appimagetool_sign.h"
 #include "util.h"
 
-// used to identify calls to the callback
-static const char gpgme_hook[] = "appimagetool gpgme hook";
 static const char signature_elf_section[] = ".sha256_sig";
 static const char key_elf_section[] = ".sig_key";
+static const char gpgme_minimum_required_version[] = "1.10.0";
 
-char* get_passphrase_from_environment() {
-    return getenv("APPIMAGETOOL_SIGN_PASSPHRASE");
-}
+// it's possible to use a single macro to error-check both gpgme and gcrypt, since both originate from the gpg project
+// the error types gcry_error_t and gpgme_error_t are both aliases for gpg_error_t
+#define gpg_check_call(signing, call_to_function) \
+    { \
+        gpg_error_t error = (call_to_function); \
+        if (error != GPG_ERR_NO_ERROR) { \
+            fprintf(stderr, "[sign] %s: call failed: %s\n", #call_to_function, gpgme_strerror(error)); \
+            gpg_release_resources(signing); \
+            return false; \
+        } \
+    }
+
+// all of these are from gpg based libraries, and are used exclusively in the code below
+// every call of sign_appimage has its own, so that several AppImages can be signed concurrently
+typedef struct {
+    gpgme_ctx_t ctx;
+    gpgme_data_t appimage_file_data;
+    gpgme_data_t sig_data;
+    // we support just a single key at the moment
+    gpgme_key_t key;
+    gpgme_data_t key_data;
+    // passing the passphrase via the environment is at least better than using a CLI parameter
+    const char* passphrase;
+    // signed by gpgme, which does not copy it
+    char* hex_digest;
+    // whether this call holds gpg_session_mutex
+    bool locked;
+} signing_t;
+
+// concurrent builds (e.g., a batch) hash their AppImages in parallel, but talk to gpg-agent one after another, so that
+// the agent asks for the passphrase once and serves the following signatures from its cache
+static GMutex gpg_session_mutex;
 
 gpgme_error_t gpgme_passphrase_callback(void* hook, const char* uid_hint, const char* passphrase_info, int prev_was_valid, int fd) {
     (void) passphrase_info;
     (void) prev_was_valid;
 
-    assert(hook == gpgme_hook);
+    const signing_t* signing = hook;
 
-    // passing the passphrase via the environment is at least better than using a CLI parameter
-    char* passphrase_from_env = get_passphrase_from_environment();
-
-    if (passphrase_from_env == NULL) {
+    if (signing->passphrase == NULL) {
         fprintf(stderr, "[sign] no passphrase available from environment\n");
         return GPG_ERR_NO_PASSPHRASE;
     }
 
     fprintf(stderr, "[sign] providing passphrase for key %s\n", uid_hint);
 
-    gpgme_io_writen(fd, passphrase_from_env, strlen(passphrase_from_env));
+    gpgme_io_writen(fd, signing->passphrase, strlen(signing->passphrase));
 
     // need to write a newline character according to the docs
     // maybe this would have solved the hanging issues we had with gpg(2) as a subprocess when writing to stdin...?
@@ -45,137 +74,81 @@ gpgme_error_t gpgme_passphrase_callback(void* hook, const char* uid_hint, const
 }
 
 gpgme_error_t gpgme_status_callback(void* hook, const char* keyword, const char* args) {
-    assert(hook == gpgme_hook);
+    (void) hook;
 
     fprintf(stderr, "[gpgme] %s: %s\n", keyword, args);
     return GPG_ERR_NO_ERROR;
 }
 
-// all of these are from gpg based libraries, and are used exclusively in the code below
-// whenever there is an error in sign_appimage, we can free() up these resources
-static gpgme_ctx_t gpgme_ctx = NULL;
-static gpgme_data_t gpgme_appimage_file_data = NULL;
-static gpgme_data_t gpgme_sig_data = NULL;
-// we support just a single key at the moment
-static gpgme_key_t gpgme_key = NULL;
-static gpgme_data_t gpgme_key_data = NULL;
-
 // this little helper can be called wherever the resources above must be released
-void gpg_release_resources() {
-    if (gpgme_appimage_file_data != NULL) {
-        gpgme_data_release(gpgme_appimage_file_data);
-        gpgme_appimage_file_data = NULL;
+static void gpg_release_resources(signing_t* signing) {
+    if (signing->appimage_file_data != NULL) {
+        gpgme_data_release(signing->appimage_file_data);
+        signing->appimage_file_data = NULL;
     }
-    if (gpgme_sig_data != NULL) {
-        gpgme_data_release(gpgme_sig_data);
-        gpgme_sig_data = NULL;
+    if (signing->sig_data != NULL) {
+        gpgme_data_release(signing->sig_data);
+        signing->sig_data = NULL;
     }
-    if (gpgme_ctx != NULL) {
-        gpgme_release(gpgme_ctx);
-        gpgme_ctx = NULL;
+    if (signing->ctx != NULL) {
+        gpgme_release(signing->ctx);
+        signing->ctx = NULL;
     }
-    if (gpgme_key != NULL) {
-        gpgme_key_release(gpgme_key);
-        gpgme_key = NULL;
+    if (signing->key != NULL) {
+        gpgme_key_release(signing->key);
+        signing->key = NULL;
     }
-    if (gpgme_key_data != NULL) {
-        gpgme_data_release(gpgme_key_data);
-        gpgme_key_data = NULL;
+    if (signing->key_data != NULL) {
+        gpgme_data_release(signing->key_data);
+        signing->key_data = NULL;
     }
-}
-
-char* calculate_sha256_hex_digest(char* filename) {
-    // algo is defined by the spec
-    static const int hash_algo = GCRY_MD_SHA256;
-
-    init_gcrypt();
-
-    // open file and feed data chunk wise to gcrypt
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "[sign] could not calculate digest: opening file %s failed", filename);
-        gpg_release_resources();
-        return NULL;
-    }
-
-    gcry_md_hd_t gcry_md_handle = NULL;
-
-    gpg_check_call(gcry_md_open(&gcry_md_handle, hash_algo, 0));
-
-    // 4k chunks should work well enough
-    char read_buffer[4096 * sizeof(char)];
-
-    for (;;) {
-        size_t bytes_read = fread(read_buffer, sizeof(char), sizeof(read_buffer), file);
-
-        // if we have an error, we can stop immediately
-        if (ferror(file) != 0) {
-            fprintf(stderr, "[sign] failed to read chunk for hashing from file %s\n", filename);
-            fclose(file);
-            gcry_md_close(gcry_md_handle);
-            return NULL;
-        }
-
-        gcry_md_write(gcry_md_handle, read_buffer, bytes_read);
-
-        // once we read all the data, we can stop
-        if (feof(file) != 0) {
-            break;
-        }
+    free(signing->hex_digest);
+    signing->hex_digest = NULL;
+    if (signing->locked) {
+        g_mutex_unlock(&gpg_session_mutex);
+        signing->locked = false;
     }
+}
 
-    // done, we can close the file
-    // since we do no longer have to worry about the file pointer, we can use gpg_check_call just fine below
-    if (fclose(file) != 0) {
-        fprintf(stderr, "[sign] failed to close hashed file %s\n", filename);
-        gcry_md_close(gcry_md_handle);
-        return NULL;
-    }
-
-    gpg_check_call(gcry_md_final(gcry_md_handle));
-
-    // conveniently, we can ask gcrypt for the digest size
-    unsigned int digest_size = gcry_md_get_algo_dlen(hash_algo);
-
-    // read raw digest (i.e., memory-readable, not hexlified like, e.g., sha256sum would return)
-    unsigned char* digest_in_ctx = gcry_md_read(gcry_md_handle, hash_algo);
+char* calculate_sha256_hex_digest(char* filename, bool verbose) {
+    // algo is defined by the spec, the hash pass uses SHA-256 for exactly this purpose
+    appimage_hashes_t hashes;
 
-    if (digest_in_ctx == NULL) {
-        fprintf(stderr, "[sign] gcry_md_read failed\n");
-        gcry_md_close(gcry_md_handle);
+    if (!appimage_hash_file(filename, APPIMAGE_HASH_SHA256, NULL, &hashes, verbose)) {
+        fprintf(stderr, "[sign] could not calculate digest of file %s\n", filename);
         return NULL;
     }
 
     // create "human-readable" version for the output
     // the method allocates a suitable string buffer
-    // needs to be done before releasing the handle since this destroys digest_in_ctx
-    char* out_buffer = appimage_hexlify((const char*) digest_in_ctx, digest_size);
-
-    // release all resources and return the result to the caller
-    gcry_md_close(gcry_md_handle);
-
-    return out_buffer;
+    return appimage_hexlify(hashes.sha256, APPIMAGE_SHA256_DIGEST_SIZE);
 }
 
-bool add_signers(const char* key_id) {
+bool add_signers(signing_t* signing, const char* key_id) {
     // if a key id is specified, we ask gpgme to use this key explicitly, otherwise we use the first key in gpgme's list
     if (key_id != NULL) {
         // we could use the list stuff below, but using gpgme_get_key is a lot easier...
-        gpg_check_call(gpgme_get_key(gpgme_ctx, key_id, &gpgme_key, true));
+        gpg_check_call(signing, gpgme_get_key(signing->ctx, key_id, &signing->key, true));
     } else {
         // searching the "first available secret key" is a little complex in gpgme...
         // since we are just looking for the first one, we don't need a loop at least
-        gpg_check_call(gpgme_op_keylist_start(gpgme_ctx, NULL, true));
-        gpg_check_call(gpgme_op_keylist_next(gpgme_ctx, &gpgme_key));
+        gpg_check_call(signing, gpgme_op_keylist_start(signing->ctx, NULL, true));
+        gpg_check_call(signing, gpgme_op_keylist_next(signing->ctx, &signing->key));
     }
 
-    fprintf(stderr, "[sign] using key with fingerprint %s, issuer name %s\n", gpgme_key->fpr, gpgme_key->uids->name);
-    gpg_check_call(gpgme_signers_add(gpgme_ctx, gpgme_key));
+    fprintf(stderr, "[sign] using key with fingerprint %s, issuer name %s\n", signing->key->fpr, signing->key->uids->name);
+    gpg_check_call(signing, gpgme_signers_add(signing->ctx, signing->key));
 
     return true;
 }
 
-bool embed_data_in_elf_section(const char* filename, const char* elf_section, gpgme_data_t data, bool verbose) {
+bool embed_data_in_elf_section(
+    appimage_output_t* output,
+    const appimage_elf_sections_t* sections,
+    const char* elf_section,
+    gpgme_data_t data,
+    bool verbose
+) {
     // first up: find the ELF section in the AppImage file
     unsigned long key_section_offset = 0;
     unsigned long key_section_length = 0;
@@ -184,16 +157,10 @@ bool embed_data_in_elf_section(const char* filename, const char* elf_section, gp
         fprintf(stderr, "[sign] embedding data in ELF section %s\n", elf_section);
     }
 
-    bool rv = appimage_get_elf_section_offset_and_length(
-        filename,
-        elf_section,
-        &key_section_offset,
-        &key_section_length
-    );
+    appimage_elf_sections_find(sections, elf_section, &key_section_offset, &key_section_length);
 
-    if (!rv || key_section_offset == 0 || key_section_length == 0) {
+    if (key_section_offset == 0 || key_section_length == 0) {
         fprintf(stderr, "[sign] could not determine offset for signature\n");
-        gpg_release_resources();
         return false;
     }
 
@@ -206,7 +173,6 @@ bool embed_data_in_elf_section(const char* filename, const char* elf_section, gp
     const off_t data_size = gpgme_data_seek(data, 0, SEEK_END);
     if (data_size < 0) {
         fprintf(stderr, "[sign] failed to detect size of signature\n");
-        gpg_release_resources();
         return false;
     }
 
@@ -217,13 +183,11 @@ bool embed_data_in_elf_section(const char* filename, const char* elf_section, gp
     // rewind so we can later read the data
     if (gpgme_data_seek(data, 0, SEEK_SET) < 0) {
         fprintf(stderr, "[sign] failed to rewind data object\n");
-        gpg_release_resources();
         return false;
     }
 
     if (data_size > key_section_length) {
         fprintf(stderr, "[sign] cannot embed key in AppImage: size exceeds reserved ELF section size\n");
-        gpg_release_resources();
         return false;
     }
 
@@ -244,8 +208,7 @@ bool embed_data_in_elf_section(const char* filename, const char* elf_section, gp
         // error
         if (bytes_read < 0) {
             fprintf(stderr, "[sign] failed to read from data object\n");
-            gpg_release_resources();
-            return false;
+                return false;
         }
 
         total_bytes_read += bytes_read;
@@ -258,78 +221,68 @@ bool embed_data_in_elf_section(const char* filename, const char* elf_section, gp
             total_bytes_read,
             data_size
         );
-        gpg_release_resources();
-        return false;
-    }
-
-    FILE* destinationfp = fopen(filename, "r+");
-
-    if (destinationfp == NULL) {
-        fprintf(stderr, "[sign] failed to open the destination file for writing\n");
-        gpg_release_resources();
         return false;
     }
 
-    if (fseek(destinationfp, (long) key_section_offset, SEEK_SET) < 0) {
-        fprintf(stderr, "[sign] fseek failed: %s\n", strerror(errno));
-        gpg_release_resources();
-        fclose(destinationfp);
-        return false;
-    }
-
-    // write at once
-    if (fwrite(data_buffer, sizeof(char), data_size, destinationfp) != data_size) {
-        fprintf(stderr, "[sign] failed to write signature to AppImage file\n");
-        gpg_release_resources();
-        fclose(destinationfp);
-        return false;
-    }
-
-    // done -> release file descriptor
-    if (fclose(destinationfp) != 0) {
-        fprintf(stderr, "[sign] failed to close file descriptor: %s\n", strerror(errno));
-        gpg_release_resources();
-        return false;
-    }
+    // written along with the other sections patched after the squashfs image has been created
+    appimage_output_patch(output, key_section_offset, data_buffer, (size_t) data_size);
 
     return true;
 }
 
-bool sign_appimage(char* appimage_filename, char* key_id, bool verbose) {
+bool sign_appimage(
+    appimage_output_t* output,
+    const char* key_id,
+    const char* passphrase,
+    const appimage_elf_sections_t* sections,
+    bool verbose
+) {
     fprintf(stderr, "[sign] signing requested\n");
 
     // like gcrypt, gpgme must be initialized
-    {
-        static const char gpgme_minimum_required_version[] = "1.10.0";
-        const char* gpgme_version = gpgme_check_version(gpgme_minimum_required_version);
-
-        if (gpgme_version == NULL) {
-            fprintf(stderr, "[sign] could not initialize gpgme (>= %s)\n", gpgme_minimum_required_version);
-            gpg_release_resources();
-            return false;
-        } else {
-            fprintf(stderr, "[sign] found gpgme version %s\n", gpgme_version);
-        }
+    if (!init_gpgme()) {
+        fprintf(stderr, "[sign] could not initialize gpgme (>= %s)\n", gpgme_minimum_required_version);
+        return false;
     }
 
+    fprintf(stderr, "[sign] found gpgme version %s\n", gpgme_check_version(NULL));
+
+    signing_t signing = {
+        .ctx = NULL,
+        .appimage_file_data = NULL,
+        .sig_data = NULL,
+        .key = NULL,
+        .key_data = NULL,
+        .passphrase = passphrase,
+        .hex_digest = NULL,
+        .locked = false,
+    };
+
     // as per the spec, an SHA256 hash is signed and the signature is then embedded in the AppImage
-    char* hex_digest = calculate_sha256_hex_digest(appimage_filename);
-    if (hex_digest == NULL) {
-        gpg_release_resources();
+    // the hash covers the sections patched so far, e.g., the MD5 digest
+    if (!appimage_output_flush(output)) {
+        return false;
+    }
+
+    signing.hex_digest = calculate_sha256_hex_digest((char*) appimage_output_path(output), verbose);
+    if (signing.hex_digest == NULL) {
         return false;
     }
 
-    fprintf(stderr, "[sign] calculated digest: %s\n", hex_digest);
+    fprintf(stderr, "[sign] calculated digest: %s\n", signing.hex_digest);
 
-    gpg_check_call(gpgme_new(&gpgme_ctx));
+    g_mutex_lock(&gpg_session_mutex);
+    signing.locked = true;
+
+    gpg_check_call(&signing, gpgme_new(&signing.ctx));
 
 
     // make sure we have a compatible agent around
     {
         gpgme_engine_info_t engine_info;
-        gpg_check_call(gpgme_get_engine_info(&engine_info));
+        gpg_check_call(&signing, gpgme_get_engine_info(&engine_info));
 
-        while (engine_info && engine_info->protocol != gpgme_get_protocol(gpgme_ctx)) {
+        while (engine_info && engine_info->protocol != gpgme_get_protocol(signing.ctx)) {
             engine_info = engine_info->next;
         }
 
@@ -337,9 +290,10 @@ bool sign_appimage(char* appimage_filename, char* key_id, bool verbose) {
             fprintf(
                 stderr,
                 "[sign] could not detect gpg version for an unknown reason (engine name: %s)\n",
-                gpgme_get_protocol_name(engine_info->protocol)
+                gpgme_get_protocol_name(gpgme_get_protocol(signing.ctx))
             );
-            exit(1);
+            gpg_release_resources(&signing);
+            return false;
         }
 
         fprintf(
@@ -364,7 +318,8 @@ bool sign_appimage(char* appimage_filename, char* key_id, bool verbose) {
                 }
             } else {
                 fprintf(stderr, "[sign] error: unsupported engine version, aborting\n");
-                exit(1);
+                gpg_release_resources(&signing);
+                return false;
             }
         } else {
             fprintf(stderr, "[sign] warning: failed to validate gpg version, expect problems\n");
@@ -374,45 +329,44 @@ bool sign_appimage(char* appimage_filename, char* key_id, bool verbose) {
     if (verbose) {
         // this should significantly increase the amount of logging we see in the status callback
         fprintf(stderr, "[sign] running in verbose mode, enabling full-status flag on gpgme context\n");
-        gpg_check_call(gpgme_set_ctx_flag(gpgme_ctx, "full-status", "1"));
+        gpg_check_call(&signing, gpgme_set_ctx_flag(signing.ctx, "full-status", "1"));
     }
 
     // we want an ASCII armored signature of plain text (hex string)
-    gpgme_set_textmode(gpgme_ctx, true);
-    gpgme_set_armor(gpgme_ctx, true);
+    gpgme_set_textmode(signing.ctx, true);
+    gpgme_set_armor(signing.ctx, true);
 
     // in case the user provides a passphrase in the environment, we have to set the pinentry mode to loopback, like with the CLI
-    if (get_passphrase_from_environment() != NULL) {
+    if (passphrase != NULL) {
         fprintf(stderr, "[sign] passphrase available from environment, setting pinentry mode to loopback\n");
-        gpgme_set_pinentry_mode(gpgme_ctx, GPGME_PINENTRY_MODE_LOOPBACK);
-        gpgme_set_passphrase_cb(gpgme_ctx, gpgme_passphrase_callback, (void*) gpgme_hook);
+        gpgme_set_pinentry_mode(signing.ctx, GPGME_PINENTRY_MODE_LOOPBACK);
+        gpgme_set_passphrase_cb(signing.ctx, gpgme_passphrase_callback, &signing);
     }
 
     // implement some fancy logging with log prefixes and stuff
-    gpgme_set_status_cb(gpgme_ctx, gpgme_status_callback, (void*) gpgme_hook);
+    gpgme_set_status_cb(signing.ctx, gpgme_status_callback, &signing);
 
-    if (!add_signers(key_id)) {
-        gpg_release_resources();
+    if (!add_signers(&signing, key_id)) {
         return false;
     }
 
-    assert(gpgme_key != NULL);
+    assert(signing.key != NULL);
 
     // we don't have to let gpgme copy the data since we can ensure the buffer remains valid the entire time
-    gpg_check_call(gpgme_data_new_from_mem(&gpgme_appimage_file_data, hex_digest, strlen(hex_digest), 0));
+    gpg_check_call(&signing, gpgme_data_new_from_mem(&signing.appimage_file_data, signing.hex_digest, strlen(signing.hex_digest), 0));
 
     // we further need an out buffer to store the signature, we let gpgme handle the allocation
-    gpg_check_call(gpgme_data_new(&gpgme_sig_data));
+    gpg_check_call(&signing, gpgme_data_new(&signing.sig_data));
 
     // now, we can sign the data
-    gpg_check_call(gpgme_op_sign(gpgme_ctx, gpgme_appimage_file_data, gpgme_sig_data, GPGME_SIG_MODE_DETACH));
+    gpg_check_call(&signing, gpgme_op_sign(signing.ctx, signing.appimage_file_data, signing.sig_data, GPGME_SIG_MODE_DETACH));
 
-    gpgme_sign_result_t sign_result = gpgme_op_sign_result(gpgme_ctx);
+    gpgme_sign_result_t sign_result = gpgme_op_sign_result(signing.ctx);
 
     if (sign_result == NULL) {
         fprintf(stderr, "[sign] signing failed\n");
-        gpg_release_resources();
-        exit(1);
+        gpg_release_resources(&signing);
+        return false;
     }
 
     // we expect exactly one signature
@@ -427,47 +381,140 @@ bool sign_appimage(char* appimage_filename, char* key_id, bool verbose) {
     );
 
     fprintf(stderr, "[sign] embedding signature in AppImage\n");
-    if (!embed_data_in_elf_section(appimage_filename, signature_elf_section, gpgme_sig_data, verbose)) {
+    if (!embed_data_in_elf_section(output, sections, signature_elf_section, signing.sig_data, verbose)) {
         fprintf(stderr, "[sign] failed to embed signature in AppImage\n");
-        gpg_release_resources();
+        gpg_release_resources(&signing);
         return false;
     }
 
     // exporting the key to a gpgme data object is relatively easy
-    gpgme_data_new(&gpgme_key_data);
-    gpgme_key_t keys_to_export[] = {gpgme_key, NULL};
-    gpg_check_call(gpgme_op_export_keys(gpgme_ctx, keys_to_export, 0, gpgme_key_data));
+    gpgme_data_new(&signing.key_data);
+    gpgme_key_t keys_to_export[] = {signing.key, NULL};
+    gpg_check_call(&signing, gpgme_op_export_keys(signing.ctx, keys_to_export, 0, signing.key_data));
 
     fprintf(stderr, "[sign] embedding key in AppImage\n");
-    if (!embed_data_in_elf_section(appimage_filename, key_elf_section, gpgme_key_data, verbose)) {
+    if (!embed_data_in_elf_section(output, sections, key_elf_section, signing.key_data, verbose)) {
         fprintf(stderr, "[sign] failed to embed key in AppImage\n");
-        gpg_release_resources();
+        gpg_release_resources(&signing);
         return false;
     }
 
-    gpg_release_resources();
+    gpg_release_resources(&signing);
     return true;
 }
 
-bool init_gcrypt() {
-    static bool gcrypt_initialized = false;
+/* Size of an ELF section of the runtime, 0 if it is missing */
+static unsigned long section_length(const appimage_elf_sections_t* sections, const char* name) {
+    unsigned long offset = 0;
+    unsigned long length = 0;
+
+    appimage_elf_sections_find(sections, name, &offset, &length);
+    return offset != 0 ? length : 0;
+}
+
+bool check_signing_preconditions(const char* key_id, const appimage_elf_sections_t* sections, bool verbose) {
+    // no ASCII armored detached signature is smaller than this, whatever the key's algorithm (the armor alone takes
+    // about 60 bytes, an Ed25519 signature takes about 230 bytes in total)
+    static const unsigned long minimum_signature_length = 128;
 
-    if (gcrypt_initialized) {
-        return true;
+    const unsigned long signature_length = section_length(sections, signature_elf_section);
+    if (signature_length < minimum_signature_length) {
+        fprintf(
+            stderr, "[sign] runtime's %s section is missing or too small (found %lu bytes, minimum required: %lu bytes)\n",
+            signature_elf_section, signature_length, minimum_signature_length
+        );
+        return false;
     }
 
-    static const char gcrypt_minimum_required_version[] = "1.8.1";
-    const char* gcrypt_version = gcry_check_version(gcrypt_minimum_required_version);
+    const unsigned long key_length = section_length(sections, key_elf_section);
+    if (key_length == 0) {
+        fprintf(stderr, "[sign] runtime has no %s section\n", key_elf_section);
+        return false;
+    }
 
-    if (gcrypt_version == NULL) {
-        fprintf(stderr, "[sign] could not initialize gcrypt (>= %s)\n", gcrypt_minimum_required_version);
-        gpg_release_resources();
+    if (!init_gpgme()) {
+        fprintf(stderr, "[sign] could not initialize gpgme (>= %s)\n", gpgme_minimum_required_version);
         return false;
-    } else {
-        fprintf(stderr, "[sign] found gcrypt version %s\n", gcrypt_version);
     }
 
-    gcrypt_initialized = true;
+    signing_t signing = {
+        .ctx = NULL,
+        .appimage_file_data = NULL,
+        .sig_data = NULL,
+        .key = NULL,
+        .key_data = NULL,
+        .passphrase = NULL,
+        .hex_digest = NULL,
+        .locked = false,
+    };
+
+    g_mutex_lock(&gpg_session_mutex);
+    signing.locked = true;
+
+    gpg_check_call(&signing, gpgme_new(&signing.ctx));
+
+    // the same lookup as when signing, without asking for the passphrase
+    if (!add_signers(&signing, key_id)) {
+        return false;
+    }
+
+    // the public key is embedded as is, so its size is known now already
+    gpgme_set_armor(signing.ctx, true);
+    gpg_check_call(&signing, gpgme_data_new(&signing.key_data));
+    gpgme_key_t keys_to_export[] = {signing.key, NULL};
+    gpg_check_call(&signing, gpgme_op_export_keys(signing.ctx, keys_to_export, 0, signing.key_data));
+
+    const off_t exported_length = gpgme_data_seek(signing.key_data, 0, SEEK_END);
+    gpg_release_resources(&signing);
+
+    if (exported_length < 0 || (unsigned long) exported_length > key_length) {
+        fprintf(
+            stderr, "[sign] public key does not fit into the runtime's %s section (%lld bytes, %lu bytes available)\n",
+            key_elf_section, (long long) exported_length, key_length
+        );
+        return false;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "[sign] public key takes up %lld of %lu bytes in %s\n", (long long) exported_length, key_length, key_elf_section);
+    }
+
     return true;
 }
 
+/* gpgme_check_version must be called once before gpgme is used by several threads, which the once-initialization
+ * takes care of, a value of 1 means success, 2 failure */
+bool init_gpgme() {
+    static gsize gpgme_initialized = 0;
+
+    if (g_once_init_enter(&gpgme_initialized)) {
+        bool success = gpgme_check_version(gpgme_minimum_required_version) != NULL;
+
+        // gpgme runs gpg to determine the engine's version once, and caches the result
+        gpgme_engine_info_t engine_info;
+        success = success && gpgme_get_engine_info(&engine_info) == GPG_ERR_NO_ERROR;
+
+        g_once_init_leave(&gpgme_initialized, success ? 1 : 2);
+    }
+
+    return gpgme_initialized == 1;
+}
+
+bool init_gcrypt() {
+    static gsize gcrypt_initialized = 0;
+
+    if (g_once_init_enter(&gcrypt_initialized)) {
+        static const char gcrypt_minimum_required_version[] = "1.8.1";
+        const char* gcrypt_version = gcry_check_version(gcrypt_minimum_required_version);
+
+        if (gcrypt_version == NULL) {
+            fprintf(stderr, "[sign] could not initialize gcrypt (>= %s)\n", gcrypt_minimum_required_version);
+        } else {
+            fprintf(stderr, "[sign] found gcrypt version %s\n", gcrypt_version);
+        }
+
+        g_once_init_leave(&gcrypt_initialized, gcrypt_version != NULL ? 1 : 2);
+    }
+
+    return gcrypt_initialized == 1;
+}
@@ -1,27 +1,41 @@
 #pragma once
 
-bool sign_appimage(char* appimage_filename, char* key_id, bool verbose);
+#include "appimagetool_elf.h"
+#include "appimagetool_output.h"
 
 /**
- * Release resources held due to the initialization of GPG related libraries.
- * Should be called every time before the application is terminated if any such functionality was used.
+ * Sign an AppImage and embed the signature and the public key in its ELF sections.
+ * Pending patches are applied before the digest is calculated, the signature and the key are added to the patch plan.
+ * All gpgme state is local to the call, so several AppImages can be signed concurrently.
+ * @param passphrase passphrase of the key, usually from $APPIMAGETOOL_SIGN_PASSPHRASE, NULL lets gpg ask for it
+ * @param sections section table of the AppImage's runtime, used to locate the .sha256_sig and .sig_key sections
  */
-void gpg_release_resources();
+bool sign_appimage(
+    appimage_output_t* output,
+    const char* key_id,
+    const char* passphrase,
+    const appimage_elf_sections_t* sections,
+    bool verbose
+);
 
-// it's possible to use a single macro to error-check both gpgme and gcrypt, since both originate from the gpg project
-// the error types gcry_error_t and gpgme_error_t are both aliases for gpg_error_t
-#define gpg_check_call(call_to_function) \
-    { \
-        gpg_error_t error = (call_to_function); \
-        if (error != GPG_ERR_NO_ERROR) { \
-            fprintf(stderr, "[sign] %s: call failed: %s\n", #call_to_function, gpgme_strerror(error)); \
-            gpg_release_resources(); \
-            return false; \
-        } \
-    }
+/**
+ * Check ahead of the build that signing can succeed: the runtime has the sections for the signature and the key, the
+ * key can be found (the first secret key if key_id is NULL), and the public key fits into its section. The passphrase
+ * is not needed for this.
+ * @return true on success, false otherwise, the reason is printed
+ */
+bool check_signing_preconditions(const char* key_id, const appimage_elf_sections_t* sections, bool verbose);
+
+/**
+ * Init gpgme and detect the gpg engine ahead of signing, e.g., once in the daemon rather than in every job.
+ * Thread safe, gpgme is initialized only once.
+ * @return true on success, false otherwise
+ */
+bool init_gpgme();
 
 /**
  * Init libgcrypt. Must be done once in every application if one wants to use this library.
+ * Thread safe, later calls return the result of the first one.
  * @return true on success, false otherwise
  */
 bool init_gcrypt();
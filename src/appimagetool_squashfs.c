@@ -0,0 +1,867 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <sqfs/block_processor.h>
+#include <sqfs/block_writer.h>
+#include <sqfs/compressor.h>
+#include <sqfs/dir_writer.h>
+#include <sqfs/error.h>
+#include <sqfs/frag_table.h>
+#include <sqfs/id_table.h>
+#include <sqfs/inode.h>
+#include <sqfs/io.h>
+#include <sqfs/meta_writer.h>
+#include <sqfs/super.h>
+
+#include "appimagetool_block_cache.h"
+#include "appimagetool_squashfs.h"
+
+// the block writer pads the image to this size, like mksquashfs does
+static const size_t device_block_size = 4096;
+
+static const size_t read_buffer_size = 1024 * 1024;
+
+/*
+ * sqfs_file_t implementation which places the image at an offset within the destination file
+ */
+typedef struct {
+    sqfs_file_t base;
+    int fd;
+    uint64_t offset;
+    uint64_t size;
+} offset_file_t;
+
+static void offset_file_destroy(sqfs_object_t* object) {
+    // the file is owned by write_squashfs
+    (void) object;
+}
+
+static int offset_file_read_at(sqfs_file_t* base, sqfs_u64 offset, void* buffer, size_t size) {
+    offset_file_t* file = (offset_file_t*) base;
+
+    if (offset + size > file->size) {
+        return SQFS_ERROR_OUT_OF_BOUNDS;
+    }
+
+    char* position = buffer;
+    while (size > 0) {
+        ssize_t bytes_read = pread(file->fd, position, size, (off_t) (file->offset + offset));
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return SQFS_ERROR_IO;
+        }
+        if (bytes_read == 0) {
+            return SQFS_ERROR_OUT_OF_BOUNDS;
+        }
+        position += bytes_read;
+        offset += (sqfs_u64) bytes_read;
+        size -= (size_t) bytes_read;
+    }
+
+    return 0;
+}
+
+static int offset_file_write_at(sqfs_file_t* base, sqfs_u64 offset, const void* buffer, size_t size) {
+    offset_file_t* file = (offset_file_t*) base;
+
+    const char* position = buffer;
+    size_t remaining = size;
+    sqfs_u64 current = offset;
+
+    while (remaining > 0) {
+        ssize_t bytes_written = pwrite(file->fd, position, remaining, (off_t) (file->offset + current));
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return SQFS_ERROR_IO;
+        }
+        position += bytes_written;
+        current += (sqfs_u64) bytes_written;
+        remaining -= (size_t) bytes_written;
+    }
+
+    if (offset + size > file->size) {
+        file->size = offset + size;
+    }
+
+    return 0;
+}
+
+static sqfs_u64 offset_file_get_size(const sqfs_file_t* base) {
+    const offset_file_t* file = (const offset_file_t*) base;
+    return file->size;
+}
+
+static int offset_file_truncate(sqfs_file_t* base, sqfs_u64 size) {
+    offset_file_t* file = (offset_file_t*) base;
+
+    if (ftruncate(file->fd, (off_t) (file->offset + size)) != 0) {
+        return SQFS_ERROR_IO;
+    }
+
+    file->size = size;
+    return 0;
+}
+
+/* In-memory representation of the source directory tree */
+typedef struct tree_node {
+    char* name;
+    char* path;
+    struct stat st;
+    char* link_target;
+    struct tree_node** children;
+    size_t children_count;
+    sqfs_u32 inode_number;
+    sqfs_u64 inode_ref;
+    // set by the block processor for regular files, it may be reallocated until the processor has finished
+    sqfs_inode_generic_t* inode;
+} tree_node_t;
+
+typedef struct {
+    const squashfs_writer_options_t* options;
+    bool verbose;
+    dev_t excluded_dev;
+    ino_t excluded_ino;
+    sqfs_u32 inode_count;
+    sqfs_u16 root_id_index;
+    sqfs_block_processor_t* processor;
+    sqfs_meta_writer_t* inode_writer;
+    sqfs_dir_writer_t* dir_writer;
+    char* buffer;
+    uint64_t files_count;
+    uint64_t bytes_read;
+} writer_t;
+
+static void tree_node_free(tree_node_t* node) {
+    if (node == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < node->children_count; ++i) {
+        tree_node_free(node->children[i]);
+    }
+
+    free(node->children);
+    free(node->name);
+    free(node->path);
+    free(node->link_target);
+    free(node->inode);
+    free(node);
+}
+
+static int compare_tree_nodes(const void* a, const void* b) {
+    const tree_node_t* node_a = *(const tree_node_t* const*) a;
+    const tree_node_t* node_b = *(const tree_node_t* const*) b;
+    // the directory writer expects entries in this order
+    return strcmp(node_a->name, node_b->name);
+}
+
+static tree_node_t* create_node(const char* path, const char* name, const struct stat* st) {
+    tree_node_t* node = calloc(1, sizeof(tree_node_t));
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->name = strdup(name);
+    node->path = strdup(path);
+    node->st = *st;
+
+    if (node->name == NULL || node->path == NULL) {
+        tree_node_free(node);
+        return NULL;
+    }
+
+    if (S_ISLNK(node->st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t length = readlink(path, target, sizeof(target) - 1);
+        if (length < 0) {
+            fprintf(stderr, "Failed to read symlink %s: %s\n", path, strerror(errno));
+            tree_node_free(node);
+            return NULL;
+        }
+        target[length] = '\0';
+        node->link_target = strdup(target);
+    }
+
+    return node;
+}
+
+static tree_node_t* create_scanned_node(const char* source, const appdir_entry_t* entry) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", source, entry->path) >= (int) sizeof(path)) {
+        fprintf(stderr, "Path too long: %s/%s\n", source, entry->path);
+        return NULL;
+    }
+
+    struct stat st = {
+        .st_mode = entry->mode,
+        .st_size = (off_t) entry->size,
+        .st_mtime = (time_t) (entry->mtime_ns / 1000000000),
+        .st_rdev = (dev_t) entry->rdev,
+        .st_dev = (dev_t) entry->device,
+        .st_ino = (ino_t) entry->inode,
+    };
+
+    // the root's path is the source itself
+    return create_node(entry->path[0] == '\0' ? source : path, entry->name, &st);
+}
+
+static bool add_child(tree_node_t* parent, tree_node_t* child) {
+    tree_node_t** children = realloc(parent->children, (parent->children_count + 1) * sizeof(tree_node_t*));
+    if (children == NULL) {
+        return false;
+    }
+
+    parent->children = children;
+    parent->children[parent->children_count++] = child;
+    return true;
+}
+
+/* Build the tree from the scan of the source directory, whose entries are sorted by path, so every directory comes
+ * before its entries, which come in the order the directory writer expects */
+static tree_node_t* build_tree(writer_t* writer, const char* source, const appdir_scan_t* scan) {
+    const size_t count = appdir_scan_entries_count(scan);
+
+    tree_node_t* root = create_scanned_node(source, appdir_scan_root(scan));
+    // nodes of the directories, by the index of their entries
+    tree_node_t** directories = calloc(count > 0 ? count : 1, sizeof(tree_node_t*));
+
+    if (root == NULL || directories == NULL) {
+        free(directories);
+        tree_node_free(root);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const appdir_entry_t* entry = appdir_scan_entry(scan, i);
+        tree_node_t* parent = entry->parent == APPDIR_SCAN_ROOT ? root : directories[entry->parent];
+
+        // like mksquashfs, never include the image being written in itself
+        if (parent == NULL || ((dev_t) entry->device == writer->excluded_dev && (ino_t) entry->inode == writer->excluded_ino)) {
+            continue;
+        }
+
+        tree_node_t* node = create_scanned_node(source, entry);
+        if (node == NULL || !add_child(parent, node)) {
+            tree_node_free(node);
+            free(directories);
+            tree_node_free(root);
+            return NULL;
+        }
+
+        if (S_ISDIR(entry->mode)) {
+            directories[i] = node;
+        }
+    }
+
+    free(directories);
+    return root;
+}
+
+/* Add an overlay entry to the scanned tree, replacing the node at its path if there is one */
+static bool apply_overlay_entry(writer_t* writer, tree_node_t* root, const squashfs_overlay_entry_t* entry) {
+    char* path = strdup(entry->path);
+    if (path == NULL) {
+        return false;
+    }
+
+    // walk down to the parent directory
+    tree_node_t* parent = root;
+    char* name = path;
+    for (char* separator; parent != NULL && (separator = strchr(name, '/')) != NULL; name = separator + 1) {
+        *separator = '\0';
+
+        tree_node_t* directory = NULL;
+        for (size_t i = 0; i < parent->children_count; ++i) {
+            if (strcmp(parent->children[i]->name, name) == 0 && S_ISDIR(parent->children[i]->st.st_mode)) {
+                directory = parent->children[i];
+                break;
+            }
+        }
+        parent = directory;
+    }
+
+    if (parent == NULL || name[0] == '\0') {
+        fprintf(stderr, "Cannot add %s to squashfs, its directory does not exist\n", entry->path);
+        free(path);
+        return false;
+    }
+
+    tree_node_t* node = NULL;
+    struct stat st;
+    if (entry->contents_path != NULL) {
+        if (lstat(entry->contents_path, &st) != 0) {
+            fprintf(stderr, "Failed to stat %s: %s\n", entry->contents_path, strerror(errno));
+        } else {
+            node = create_node(entry->contents_path, name, &st);
+        }
+    } else if ((node = calloc(1, sizeof(tree_node_t))) != NULL) {
+        node->name = strdup(name);
+        node->path = strdup(entry->path);
+        node->link_target = strdup(entry->link_target);
+        node->st.st_mode = S_IFLNK | 0777;
+
+        if (node->name == NULL || node->path == NULL || node->link_target == NULL) {
+            tree_node_free(node);
+            node = NULL;
+        }
+    }
+    free(path);
+
+    if (node == NULL) {
+        return false;
+    }
+
+    // generated by the build, so their time would differ between builds of the same AppDir
+    node->st.st_mtime = writer->options->fixed_time >= 0 ? (time_t) writer->options->fixed_time : 0;
+
+    for (size_t i = 0; i < parent->children_count; ++i) {
+        if (strcmp(parent->children[i]->name, node->name) == 0) {
+            tree_node_free(parent->children[i]);
+            parent->children[i] = node;
+            return true;
+        }
+    }
+
+    if (!add_child(parent, node)) {
+        tree_node_free(node);
+        return false;
+    }
+
+    qsort(parent->children, parent->children_count, sizeof(tree_node_t*), compare_tree_nodes);
+
+    return true;
+}
+
+// squashfs expects the children of a directory to have lower inode numbers than the directory itself
+static void assign_inode_numbers(writer_t* writer, tree_node_t* node) {
+    for (size_t i = 0; i < node->children_count; ++i) {
+        assign_inode_numbers(writer, node->children[i]);
+    }
+
+    node->inode_number = ++writer->inode_count;
+}
+
+static bool cancelled(const writer_t* writer) {
+    const squashfs_writer_options_t* options = writer->options;
+    return options->cancel_callback != NULL && options->cancel_callback(options->cancel_callback_data);
+}
+
+static bool add_file_data(writer_t* writer, tree_node_t* node) {
+    sqfs_u32 flags = 0;
+
+    if (writer->options->no_fragments) {
+        flags |= SQFS_BLK_DONT_FRAGMENT;
+    }
+
+    // files spanning at least one full block start on a device block boundary
+    if (writer->options->align_large_files && (size_t) node->st.st_size >= writer->options->block_size) {
+        flags |= SQFS_BLK_ALIGN;
+    }
+
+    int ret = sqfs_block_processor_begin_file(writer->processor, &node->inode, NULL, flags);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to add %s to squashfs: error %d\n", node->path, ret);
+        return false;
+    }
+
+    int fd = open(node->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", node->path, strerror(errno));
+        return false;
+    }
+
+    bool success = true;
+
+    for (;;) {
+        ssize_t bytes_read = read(fd, writer->buffer, read_buffer_size);
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to read %s: %s\n", node->path, strerror(errno));
+            success = false;
+            break;
+        }
+
+        if (bytes_read == 0) {
+            break;
+        }
+
+        // the block processor hands full blocks over to its worker threads, and writes out finished ones in order
+        ret = sqfs_block_processor_append(writer->processor, writer->buffer, (size_t) bytes_read);
+        if (ret != 0) {
+            fprintf(stderr, "Failed to compress %s: error %d\n", node->path, ret);
+            success = false;
+            break;
+        }
+
+        writer->bytes_read += (uint64_t) bytes_read;
+    }
+
+    close(fd);
+
+    ret = sqfs_block_processor_end_file(writer->processor);
+    if (success && ret != 0) {
+        fprintf(stderr, "Failed to add %s to squashfs: error %d\n", node->path, ret);
+        success = false;
+    }
+
+    writer->files_count++;
+    return success;
+}
+
+// write the contents of all regular files in the same order mksquashfs would, i.e., depth first
+static bool add_tree_data(writer_t* writer, tree_node_t* node) {
+    if (S_ISREG(node->st.st_mode)) {
+        if (cancelled(writer)) {
+            return false;
+        }
+
+        return add_file_data(writer, node);
+    }
+
+    for (size_t i = 0; i < node->children_count; ++i) {
+        if (!add_tree_data(writer, node->children[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static sqfs_inode_generic_t* create_inode(tree_node_t* node) {
+    const size_t payload_size = node->link_target != NULL ? strlen(node->link_target) : 0;
+
+    sqfs_inode_generic_t* inode = calloc(1, sizeof(sqfs_inode_generic_t) + payload_size);
+    if (inode == NULL) {
+        return NULL;
+    }
+
+    switch (node->st.st_mode & S_IFMT) {
+        case S_IFLNK:
+            inode->base.type = SQFS_INODE_SLINK;
+            inode->data.slink.nlink = 1;
+            inode->data.slink.target_size = (sqfs_u32) payload_size;
+            memcpy(inode->extra, node->link_target, payload_size);
+            inode->payload_bytes_available = (sqfs_u32) payload_size;
+            inode->payload_bytes_used = (sqfs_u32) payload_size;
+            break;
+        case S_IFBLK:
+        case S_IFCHR:
+            inode->base.type = S_ISBLK(node->st.st_mode) ? SQFS_INODE_BDEV : SQFS_INODE_CDEV;
+            inode->data.dev.nlink = 1;
+            // same encoding the kernel's squashfs driver uses (new_decode_dev)
+            inode->data.dev.devno = (sqfs_u32) (
+                (minor(node->st.st_rdev) & 0xff) | (major(node->st.st_rdev) << 8) | ((minor(node->st.st_rdev) & ~0xffu) << 12)
+            );
+            break;
+        case S_IFIFO:
+            inode->base.type = SQFS_INODE_FIFO;
+            inode->data.ipc.nlink = 1;
+            break;
+        case S_IFSOCK:
+            inode->base.type = SQFS_INODE_SOCKET;
+            inode->data.ipc.nlink = 1;
+            break;
+        default:
+            free(inode);
+            return NULL;
+    }
+
+    return inode;
+}
+
+static void set_inode_attributes(const writer_t* writer, const tree_node_t* node, sqfs_inode_generic_t* inode) {
+    // -root-owned
+    inode->base.uid_idx = writer->root_id_index;
+    inode->base.gid_idx = writer->root_id_index;
+    inode->base.mode = (sqfs_u16) node->st.st_mode;
+    inode->base.inode_number = node->inode_number;
+
+    if (writer->options->fixed_time >= 0) {
+        inode->base.mod_time = (sqfs_u32) writer->options->fixed_time;
+    } else {
+        inode->base.mod_time = (sqfs_u32) node->st.st_mtime;
+    }
+}
+
+static bool write_inode(writer_t* writer, tree_node_t* node, sqfs_inode_generic_t* inode) {
+    sqfs_u64 block;
+    sqfs_u32 offset;
+    sqfs_meta_writer_get_position(writer->inode_writer, &block, &offset);
+    node->inode_ref = (block << 16) | offset;
+
+    set_inode_attributes(writer, node, inode);
+
+    int ret = sqfs_meta_writer_write_inode(writer->inode_writer, inode);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write inode for %s: error %d\n", node->path, ret);
+        return false;
+    }
+
+    return true;
+}
+
+// post-order traversal, a directory listing can only be written once the inode references of all entries are known
+static bool write_tree_metadata(writer_t* writer, tree_node_t* node, sqfs_u32 parent_inode_number) {
+    if (S_ISREG(node->st.st_mode)) {
+        return write_inode(writer, node, node->inode);
+    }
+
+    if (!S_ISDIR(node->st.st_mode)) {
+        sqfs_inode_generic_t* inode = create_inode(node);
+        if (inode == NULL) {
+            fprintf(stderr, "Unsupported file type: %s\n", node->path);
+            return false;
+        }
+
+        bool success = write_inode(writer, node, inode);
+        free(inode);
+        return success;
+    }
+
+    size_t subdirectories_count = 0;
+
+    for (size_t i = 0; i < node->children_count; ++i) {
+        if (!write_tree_metadata(writer, node->children[i], node->inode_number)) {
+            return false;
+        }
+
+        if (S_ISDIR(node->children[i]->st.st_mode)) {
+            subdirectories_count++;
+        }
+    }
+
+    int ret = sqfs_dir_writer_begin(writer->dir_writer, 0);
+
+    for (size_t i = 0; ret == 0 && i < node->children_count; ++i) {
+        const tree_node_t* child = node->children[i];
+        ret = sqfs_dir_writer_add_entry(
+            writer->dir_writer, child->name, child->inode_number, child->inode_ref, (sqfs_u16) child->st.st_mode
+        );
+    }
+
+    if (ret == 0) {
+        ret = sqfs_dir_writer_end(writer->dir_writer);
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write directory listing for %s: error %d\n", node->path, ret);
+        return false;
+    }
+
+    sqfs_inode_generic_t* inode = sqfs_dir_writer_create_inode(
+        writer->dir_writer, subdirectories_count + 2, 0xFFFFFFFF, parent_inode_number
+    );
+    if (inode == NULL) {
+        fprintf(stderr, "Failed to create directory inode for %s\n", node->path);
+        return false;
+    }
+
+    bool success = write_inode(writer, node, inode);
+    free(inode);
+    return success;
+}
+
+bool squashfs_compressor_supported(const char* compressor) {
+    int id = sqfs_compressor_id_from_name(compressor);
+    if (id < 0) {
+        return false;
+    }
+
+    // libsquashfs can be built without some of the compressors
+    sqfs_compressor_config_t config;
+    if (sqfs_compressor_config_init(&config, (SQFS_COMPRESSOR) id, SQFS_DEFAULT_BLOCK_SIZE, 0) != 0) {
+        return false;
+    }
+
+    sqfs_compressor_t* compressor_instance = NULL;
+    if (sqfs_compressor_create(&config, &compressor_instance) != 0) {
+        return false;
+    }
+
+    sqfs_destroy(compressor_instance);
+    return true;
+}
+
+static unsigned int default_workers_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned int) cpus : 1;
+}
+
+bool write_squashfs(
+    const char* source,
+    const appdir_scan_t* scan,
+    const char* destination,
+    uint64_t offset,
+    const squashfs_writer_options_t* options,
+    bool verbose
+) {
+    bool success = false;
+
+    writer_t writer = {
+        .options = options,
+        .verbose = verbose,
+    };
+
+    offset_file_t file = {
+        .fd = -1,
+        .offset = offset,
+        .size = 0,
+    };
+    file.base.base.destroy = offset_file_destroy;
+    file.base.read_at = offset_file_read_at;
+    file.base.write_at = offset_file_write_at;
+    file.base.get_size = offset_file_get_size;
+    file.base.truncate = offset_file_truncate;
+
+    tree_node_t* root = NULL;
+    sqfs_compressor_t* compressor = NULL;
+    appimage_block_cache_t* block_cache = NULL;
+    // compresses the data blocks, the metadata is always compressed by the plain compressor
+    sqfs_compressor_t* data_compressor = NULL;
+    sqfs_block_writer_t* block_writer = NULL;
+    sqfs_frag_table_t* fragment_table = NULL;
+    sqfs_id_table_t* id_table = NULL;
+    sqfs_meta_writer_t* directory_writer_meta = NULL;
+
+    const int compressor_id = sqfs_compressor_id_from_name(options->compressor);
+    if (compressor_id < 0) {
+        fprintf(stderr, "Unsupported squashfs compressor: %s\n", options->compressor);
+        return false;
+    }
+
+    file.fd = open(destination, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file.fd < 0) {
+        fprintf(stderr, "Failed to open %s for writing: %s\n", destination, strerror(errno));
+        return false;
+    }
+
+    struct stat destination_stat;
+    if (fstat(file.fd, &destination_stat) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", destination, strerror(errno));
+        goto cleanup;
+    }
+    writer.excluded_dev = destination_stat.st_dev;
+    writer.excluded_ino = destination_stat.st_ino;
+
+    root = build_tree(&writer, source, scan);
+    if (root == NULL) {
+        goto cleanup;
+    }
+
+    if (!S_ISDIR(root->st.st_mode)) {
+        fprintf(stderr, "%s is not a directory\n", source);
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < options->overlay_count; ++i) {
+        if (!apply_overlay_entry(&writer, root, &options->overlay[i])) {
+            goto cleanup;
+        }
+    }
+
+    assign_inode_numbers(&writer, root);
+
+    sqfs_super_t super;
+    const sqfs_u32 image_time = options->fixed_time >= 0 ? (sqfs_u32) options->fixed_time : 0;
+    if (sqfs_super_init(&super, options->block_size, image_time, (SQFS_COMPRESSOR) compressor_id) != 0) {
+        fprintf(stderr, "Invalid squashfs block size: %zu\n", options->block_size);
+        goto cleanup;
+    }
+
+    sqfs_compressor_config_t compressor_config;
+    sqfs_compressor_config_init(&compressor_config, (SQFS_COMPRESSOR) compressor_id, options->block_size, 0);
+    if (compressor_id == SQFS_COMP_XZ) {
+        // equivalent to mksquashfs' -Xdict-size 100%
+        compressor_config.opt.xz.dict_size = (sqfs_u32) options->block_size;
+    }
+
+    int ret = sqfs_compressor_create(&compressor_config, &compressor);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to create %s compressor: error %d\n", options->compressor, ret);
+        goto cleanup;
+    }
+
+    // placeholder, the final superblock is written once all tables are in place
+    if (sqfs_super_write(&super, &file.base) != 0) {
+        fprintf(stderr, "Failed to write squashfs superblock\n");
+        goto cleanup;
+    }
+
+    ret = compressor->write_options(compressor, &file.base);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to write compressor options: error %d\n", ret);
+        goto cleanup;
+    }
+    if (ret > 0) {
+        super.flags |= SQFS_FLAG_COMPRESSOR_OPTIONS;
+    }
+
+    // the image is the same with or without the block cache, so it is merely skipped when it cannot be used
+    if (options->block_cache_directory != NULL) {
+        block_cache = appimage_block_cache_open(options->block_cache_directory, options->block_cache_size, verbose);
+        data_compressor = block_cache != NULL ? appimage_block_cache_wrap(block_cache, compressor) : NULL;
+        if (data_compressor == NULL) {
+            fprintf(stderr, "Warning: not using the block cache in %s\n", options->block_cache_directory);
+        }
+    }
+
+    block_writer = sqfs_block_writer_create(&file.base, device_block_size, 0);
+    fragment_table = sqfs_frag_table_create(0);
+    id_table = sqfs_id_table_create(0);
+
+    if (block_writer == NULL || fragment_table == NULL || id_table == NULL) {
+        fprintf(stderr, "Failed to set up squashfs writer\n");
+        goto cleanup;
+    }
+
+    if (sqfs_id_table_id_to_index(id_table, 0, &writer.root_id_index) != 0) {
+        fprintf(stderr, "Failed to set up squashfs ID table\n");
+        goto cleanup;
+    }
+
+    const unsigned int workers = options->workers > 0 ? options->workers : default_workers_count();
+
+    // every block in flight takes up to twice the block size, uncompressed and compressed
+    size_t backlog = (size_t) workers * 10;
+    if (options->memory_limit > 0) {
+        const uint64_t affordable = options->memory_limit / (2 * options->block_size);
+        backlog = affordable < workers ? workers : (affordable < backlog ? (size_t) affordable : backlog);
+    }
+
+    // idle workers pick up the next queued block, so a single large file is spread over all threads as well
+    writer.processor = sqfs_block_processor_create(
+        options->block_size, data_compressor != NULL ? data_compressor : compressor, workers, backlog, block_writer, fragment_table
+    );
+    writer.buffer = malloc(read_buffer_size);
+
+    if (writer.processor == NULL || writer.buffer == NULL) {
+        fprintf(stderr, "Failed to set up squashfs block processor\n");
+        goto cleanup;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Compressing with %s, block size %zu, %u threads, up to %zu blocks in flight\n", options->compressor, options->block_size, workers, backlog);
+    }
+
+    if (!add_tree_data(&writer, root)) {
+        goto cleanup;
+    }
+
+    ret = sqfs_block_processor_finish(writer.processor);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write squashfs data blocks: error %d\n", ret);
+        goto cleanup;
+    }
+
+    if (cancelled(&writer)) {
+        goto cleanup;
+    }
+
+    // inodes are written straight to the file, the directory table follows the inode table and is kept in memory until then
+    super.inode_table_start = offset_file_get_size(&file.base);
+
+    writer.inode_writer = sqfs_meta_writer_create(&file.base, compressor, 0);
+    directory_writer_meta = sqfs_meta_writer_create(&file.base, compressor, SQFS_META_WRITER_KEEP_IN_MEMORY);
+    writer.dir_writer = directory_writer_meta != NULL ? sqfs_dir_writer_create(directory_writer_meta, 0) : NULL;
+
+    if (writer.inode_writer == NULL || writer.dir_writer == NULL) {
+        fprintf(stderr, "Failed to set up squashfs metadata writers\n");
+        goto cleanup;
+    }
+
+    // the root directory's parent inode number is, by convention, one past the last inode
+    if (!write_tree_metadata(&writer, root, writer.inode_count + 1)) {
+        goto cleanup;
+    }
+
+    if (sqfs_meta_writer_flush(writer.inode_writer) != 0 || sqfs_meta_writer_flush(directory_writer_meta) != 0) {
+        fprintf(stderr, "Failed to write squashfs inode table\n");
+        goto cleanup;
+    }
+
+    super.root_inode_ref = root->inode_ref;
+    super.inode_count = writer.inode_count;
+    super.directory_table_start = offset_file_get_size(&file.base);
+
+    if (sqfs_meta_writer_write_to_file(directory_writer_meta) != 0) {
+        fprintf(stderr, "Failed to write squashfs directory table\n");
+        goto cleanup;
+    }
+
+    if (sqfs_frag_table_write(fragment_table, &file.base, &super, compressor) != 0 ||
+        sqfs_id_table_write(id_table, &file.base, &super, compressor) != 0) {
+        fprintf(stderr, "Failed to write squashfs lookup tables\n");
+        goto cleanup;
+    }
+
+    super.bytes_used = offset_file_get_size(&file.base);
+
+    // pad the image the same way mksquashfs does
+    if (super.bytes_used % device_block_size != 0) {
+        static const char padding[4096] = {0};
+        const size_t padding_size = device_block_size - (super.bytes_used % device_block_size);
+        if (offset_file_write_at(&file.base, super.bytes_used, padding, padding_size) != 0) {
+            fprintf(stderr, "Failed to pad squashfs image\n");
+            goto cleanup;
+        }
+    }
+
+    if (sqfs_super_write(&super, &file.base) != 0) {
+        fprintf(stderr, "Failed to write squashfs superblock\n");
+        goto cleanup;
+    }
+
+    if (verbose) {
+        fprintf(
+            stderr, "Wrote %u inodes, %lu files with %lu bytes of data, squashfs image size %lu bytes\n",
+            writer.inode_count, (unsigned long) writer.files_count, (unsigned long) writer.bytes_read,
+            (unsigned long) super.bytes_used
+        );
+    }
+
+    success = true;
+
+cleanup:
+    if (writer.dir_writer != NULL)
+        sqfs_destroy(writer.dir_writer);
+    if (directory_writer_meta != NULL)
+        sqfs_destroy(directory_writer_meta);
+    if (writer.inode_writer != NULL)
+        sqfs_destroy(writer.inode_writer);
+    if (writer.processor != NULL)
+        sqfs_destroy(writer.processor);
+    if (id_table != NULL)
+        sqfs_destroy(id_table);
+    if (fragment_table != NULL)
+        sqfs_destroy(fragment_table);
+    if (block_writer != NULL)
+        sqfs_destroy(block_writer);
+    if (data_compressor != NULL)
+        sqfs_destroy(data_compressor);
+    appimage_block_cache_free(block_cache);
+    if (compressor != NULL)
+        sqfs_destroy(compressor);
+    free(writer.buffer);
+    tree_node_free(root);
+
+    if (close(file.fd) != 0 && success) {
+        fprintf(stderr, "Failed to close %s: %s\n", destination, strerror(errno));
+        success = false;
+    }
+
+    return success;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "appimagetool_scan.h"
+
+/**
+ * Polled between files. Returning true aborts the build.
+ */
+typedef bool (*squashfs_cancel_callback_t)(void* user_data);
+
+/**
+ * A file of the image which is not taken from the source directory, and replaces the source's one if it has one.
+ */
+typedef struct {
+    // path relative to the source directory, its parent directory must exist there
+    const char* path;
+    // file the contents, mode and modification time are taken from, NULL for a symlink
+    const char* contents_path;
+    // target of the symlink, used if contents_path is NULL
+    const char* link_target;
+} squashfs_overlay_entry_t;
+
+typedef struct {
+    // compressor name as used by mksquashfs' -comp
+    const char* compressor;
+    // maximum size of a data block
+    size_t block_size;
+    // number of compression threads, 0 uses one thread per CPU
+    unsigned int workers;
+    // memory the blocks waiting for or being compressed may take up, 0 for no limit
+    uint64_t memory_limit;
+    // value used for the image's and all inodes' modification times, negative to use the files' times and 0 for the image
+    int64_t fixed_time;
+    // store the tail ends of files in blocks of their own instead of packing them together into fragment blocks
+    bool no_fragments;
+    // let files of at least one block start on a 4 KiB boundary, so that their data is found at aligned offsets
+    bool align_large_files;
+    // store of compressed data blocks reused across builds, see appimagetool_block_cache.h, NULL disables it
+    const char* block_cache_directory;
+    // bytes the stored blocks may take up, 0 for no limit
+    uint64_t block_cache_size;
+    // files added to the image, or replacing the source directory's ones, so that the source is never modified
+    const squashfs_overlay_entry_t* overlay;
+    size_t overlay_count;
+    squashfs_cancel_callback_t cancel_callback;
+    void* cancel_callback_data;
+} squashfs_writer_options_t;
+
+/**
+ * Check whether the in-process writer supports the given compressor.
+ */
+bool squashfs_compressor_supported(const char* compressor);
+
+/**
+ * Build a squashfs image of the given directory in-process, equivalent to
+ * mksquashfs source destination -offset offset -root-owned -noappend.
+ * The destination is created or truncated. The first offset bytes are left for the runtime.
+ * @param scan scan of source made with APPDIR_SCAN_METADATA, the image contains the entries found by it
+ * @return true on success, false otherwise
+ */
+bool write_squashfs(
+    const char* source,
+    const appdir_scan_t* scan,
+    const char* destination,
+    uint64_t offset,
+    const squashfs_writer_options_t* options,
+    bool verbose
+);
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "appimagetool_stages.h"
+
+typedef enum {
+    STAGE_PENDING,
+    STAGE_RUNNING,
+    STAGE_SUCCEEDED,
+    STAGE_FAILED,
+    STAGE_SKIPPED,
+} stage_state_t;
+
+typedef struct {
+    const char* name;
+    stage_function_t function;
+    void* user_data;
+    int* dependencies;
+    size_t dependencies_count;
+    stage_state_t state;
+    gint64 start_time;
+    gint64 end_time;
+} stage_t;
+
+struct stage_scheduler {
+    GMutex mutex;
+    GCond cond;
+    GPtrArray* stages;
+    unsigned int max_parallel;
+    bool verbose;
+    bool cancelled;
+    stage_cancel_handler_t cancel_handler;
+    void* cancel_handler_data;
+};
+
+static void stage_free(gpointer data) {
+    stage_t* stage = data;
+    g_free(stage->dependencies);
+    g_free(stage);
+}
+
+stage_scheduler_t* stage_scheduler_new(unsigned int max_parallel, bool verbose) {
+    stage_scheduler_t* scheduler = g_new0(stage_scheduler_t, 1);
+    g_mutex_init(&scheduler->mutex);
+    g_cond_init(&scheduler->cond);
+    scheduler->stages = g_ptr_array_new_with_free_func(stage_free);
+    scheduler->max_parallel = max_parallel > 0 ? max_parallel : 1;
+    scheduler->verbose = verbose;
+    return scheduler;
+}
+
+void stage_scheduler_free(stage_scheduler_t* scheduler) {
+    if (scheduler == NULL) {
+        return;
+    }
+
+    g_ptr_array_free(scheduler->stages, TRUE);
+    g_cond_clear(&scheduler->cond);
+    g_mutex_clear(&scheduler->mutex);
+    g_free(scheduler);
+}
+
+int stage_scheduler_add(
+    stage_scheduler_t* scheduler,
+    const char* name,
+    stage_function_t function,
+    void* user_data,
+    const int* dependencies,
+    size_t dependencies_count
+) {
+    stage_t* stage = g_new0(stage_t, 1);
+    stage->name = name;
+    stage->function = function;
+    stage->user_data = user_data;
+    stage->state = STAGE_PENDING;
+    stage->start_time = -1;
+    stage->end_time = -1;
+
+    if (dependencies_count > 0) {
+        stage->dependencies = g_new(int, dependencies_count);
+        for (size_t i = 0; i < dependencies_count; ++i) {
+            // dependencies must have been added before, this also rules out cycles
+            g_assert(dependencies[i] >= 0 && (guint) dependencies[i] < scheduler->stages->len);
+            stage->dependencies[i] = dependencies[i];
+        }
+        stage->dependencies_count = dependencies_count;
+    }
+
+    g_ptr_array_add(scheduler->stages, stage);
+    return (int) scheduler->stages->len - 1;
+}
+
+void stage_scheduler_set_cancel_handler(stage_scheduler_t* scheduler, stage_cancel_handler_t handler, void* user_data) {
+    scheduler->cancel_handler = handler;
+    scheduler->cancel_handler_data = user_data;
+}
+
+bool stage_scheduler_cancelled(stage_scheduler_t* scheduler) {
+    g_mutex_lock(&scheduler->mutex);
+    bool cancelled = scheduler->cancelled;
+    g_mutex_unlock(&scheduler->mutex);
+    return cancelled;
+}
+
+// must be called with the mutex held
+// returns the first stage whose dependencies have succeeded, and marks stages whose dependencies failed as skipped
+static stage_t* find_runnable_stage(stage_scheduler_t* scheduler) {
+    for (guint i = 0; i < scheduler->stages->len; ++i) {
+        stage_t* stage = g_ptr_array_index(scheduler->stages, i);
+
+        if (stage->state != STAGE_PENDING) {
+            continue;
+        }
+
+        if (scheduler->cancelled) {
+            stage->state = STAGE_SKIPPED;
+            continue;
+        }
+
+        bool ready = true;
+
+        for (size_t j = 0; j < stage->dependencies_count; ++j) {
+            const stage_t* dependency = g_ptr_array_index(scheduler->stages, stage->dependencies[j]);
+
+            if (dependency->state == STAGE_FAILED || dependency->state == STAGE_SKIPPED) {
+                stage->state = STAGE_SKIPPED;
+                ready = false;
+                break;
+            }
+
+            if (dependency->state != STAGE_SUCCEEDED) {
+                ready = false;
+            }
+        }
+
+        if (ready) {
+            return stage;
+        }
+    }
+
+    return NULL;
+}
+
+// must be called with the mutex held
+static bool all_stages_done(stage_scheduler_t* scheduler) {
+    for (guint i = 0; i < scheduler->stages->len; ++i) {
+        const stage_t* stage = g_ptr_array_index(scheduler->stages, i);
+
+        if (stage->state == STAGE_PENDING || stage->state == STAGE_RUNNING) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static gpointer worker_thread(gpointer data) {
+    stage_scheduler_t* scheduler = data;
+
+    g_mutex_lock(&scheduler->mutex);
+
+    for (;;) {
+        stage_t* stage = find_runnable_stage(scheduler);
+
+        if (stage == NULL) {
+            if (all_stages_done(scheduler)) {
+                break;
+            }
+
+            // wait for a running stage to finish, this might make further stages runnable
+            g_cond_wait(&scheduler->cond, &scheduler->mutex);
+            continue;
+        }
+
+        stage->state = STAGE_RUNNING;
+        stage->start_time = g_get_monotonic_time();
+        g_mutex_unlock(&scheduler->mutex);
+
+        if (scheduler->verbose) {
+            fprintf(stderr, "Starting stage %s\n", stage->name);
+        }
+
+        const bool success = stage->function(scheduler, stage->user_data);
+
+        g_mutex_lock(&scheduler->mutex);
+        stage->end_time = g_get_monotonic_time();
+        stage->state = success ? STAGE_SUCCEEDED : STAGE_FAILED;
+
+        if (scheduler->verbose) {
+            fprintf(
+                stderr, "Stage %s %s after %.3f s\n",
+                stage->name, success ? "finished" : "failed", (double) (stage->end_time - stage->start_time) / 1e6
+            );
+        }
+
+        // fail fast: stop scheduling new stages and let the running ones know
+        if (!success && !scheduler->cancelled) {
+            scheduler->cancelled = true;
+
+            if (scheduler->cancel_handler != NULL) {
+                scheduler->cancel_handler(scheduler->cancel_handler_data);
+            }
+        }
+
+        g_cond_broadcast(&scheduler->cond);
+    }
+
+    g_mutex_unlock(&scheduler->mutex);
+    return NULL;
+}
+
+bool stage_scheduler_run(stage_scheduler_t* scheduler) {
+    const unsigned int workers_count = MIN(scheduler->max_parallel, scheduler->stages->len);
+
+    GThread** workers = g_new0(GThread*, workers_count);
+
+    for (unsigned int i = 0; i < workers_count; ++i) {
+        workers[i] = g_thread_new("stage-worker", worker_thread, scheduler);
+    }
+
+    for (unsigned int i = 0; i < workers_count; ++i) {
+        g_thread_join(workers[i]);
+    }
+
+    g_free(workers);
+
+    bool success = true;
+
+    for (guint i = 0; i < scheduler->stages->len; ++i) {
+        const stage_t* stage = g_ptr_array_index(scheduler->stages, i);
+
+        if (stage->state != STAGE_SUCCEEDED) {
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+long stage_scheduler_duration(stage_scheduler_t* scheduler, int stage_id) {
+    const stage_t* stage = g_ptr_array_index(scheduler->stages, stage_id);
+
+    if (stage->start_time < 0 || stage->end_time < 0) {
+        return -1;
+    }
+
+    return (long) (stage->end_time - stage->start_time);
+}
+
+size_t stage_scheduler_count(stage_scheduler_t* scheduler) {
+    return scheduler->stages->len;
+}
+
+const char* stage_scheduler_name(stage_scheduler_t* scheduler, int stage_id) {
+    const stage_t* stage = g_ptr_array_index(scheduler->stages, stage_id);
+    return stage->name;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Runs the stages of the packaging pipeline concurrently, respecting the dependencies between them.
+ * At most max_parallel stages run at the same time. As soon as a stage fails, no further stages are started, and
+ * running stages are asked to cancel (see stage_scheduler_set_cancel_handler and stage_scheduler_cancelled).
+ */
+typedef struct stage_scheduler stage_scheduler_t;
+
+/**
+ * Stage implementation. Must not call exit(), but report errors by returning false.
+ */
+typedef bool (*stage_function_t)(stage_scheduler_t* scheduler, void* user_data);
+
+typedef void (*stage_cancel_handler_t)(void* user_data);
+
+stage_scheduler_t* stage_scheduler_new(unsigned int max_parallel, bool verbose);
+
+void stage_scheduler_free(stage_scheduler_t* scheduler);
+
+/**
+ * Add a stage to the pipeline. Stages must be added before the scheduler is run.
+ * @param dependencies IDs of stages which must have finished successfully before this stage can start
+ * @return ID of the new stage
+ */
+int stage_scheduler_add(
+    stage_scheduler_t* scheduler,
+    const char* name,
+    stage_function_t function,
+    void* user_data,
+    const int* dependencies,
+    size_t dependencies_count
+);
+
+/**
+ * Set a function which is called once when the first stage fails, e.g., to terminate running subprocesses.
+ */
+void stage_scheduler_set_cancel_handler(stage_scheduler_t* scheduler, stage_cancel_handler_t handler, void* user_data);
+
+/**
+ * Whether the pipeline has been cancelled. Long-running stages should check this regularly.
+ */
+bool stage_scheduler_cancelled(stage_scheduler_t* scheduler);
+
+/**
+ * Run all stages and wait for them to finish.
+ * @return true if all stages succeeded, false otherwise
+ */
+bool stage_scheduler_run(stage_scheduler_t* scheduler);
+
+/**
+ * Time a stage took to run in microseconds, or -1 if it has not been run.
+ */
+long stage_scheduler_duration(stage_scheduler_t* scheduler, int stage_id);
+
+/**
+ * Number of stages added, their IDs range from 0 to the count - 1.
+ */
+size_t stage_scheduler_count(stage_scheduler_t* scheduler);
+
+const char* stage_scheduler_name(stage_scheduler_t* scheduler, int stage_id);
@@ -0,0 +1,345 @@
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "appimagetool_build.h"
+#include "appimagetool_cache.h"
+#include "appimagetool_watch.h"
+
+// changes are collected until the AppDir has been quiet for this long, editors often write files in several steps
+#define QUIET_PERIOD_MS 150
+
+// number of changed paths listed when a rebuild starts
+#define MAX_LISTED_PATHS 3
+
+static const uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO |
+    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+typedef enum {
+    WAIT_CHANGED,
+    WAIT_INTERRUPTED,
+    WAIT_FAILED,
+} wait_result_t;
+
+typedef struct {
+    int inotify_fd;
+    int signal_fd;
+    gchar* root;
+    // where the build keeps the content hashes of the AppDir's files, so that only changed files are read
+    gchar* file_hash_directory;
+    // watch descriptor to the directory's path relative to the root, "" for the root itself
+    GHashTable* directories;
+    // paths relative to the root which have changed since the last build started
+    GHashTable* changed_paths;
+    bool warned_about_limit;
+} watcher_t;
+
+/* Watch a directory and all directories below it, symlinks are not followed */
+static void watch_tree(watcher_t* watcher, const char* relative_path) {
+    gchar* path = relative_path[0] == '\0' ? g_strdup(watcher->root) : g_build_filename(watcher->root, relative_path, NULL);
+
+    const int wd = inotify_add_watch(watcher->inotify_fd, path, watch_mask);
+    if (wd < 0) {
+        // the directory may be gone already, which the event of its removal reports
+        if (errno == ENOSPC && !watcher->warned_about_limit) {
+            fprintf(stderr, "Warning: cannot watch all directories of the AppDir, consider raising fs.inotify.max_user_watches\n");
+            watcher->warned_about_limit = true;
+        }
+        g_free(path);
+        return;
+    }
+    g_hash_table_insert(watcher->directories, GINT_TO_POINTER(wd), g_strdup(relative_path));
+
+    DIR* dir = opendir(path);
+    g_free(path);
+    if (dir == NULL) {
+        return;
+    }
+
+    const struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        gchar* child = relative_path[0] == '\0' ? g_strdup(entry->d_name) : g_build_filename(relative_path, entry->d_name, NULL);
+
+        // not all file systems report the type of the entries
+        bool is_directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            gchar* child_path = g_build_filename(watcher->root, child, NULL);
+            struct stat child_stat;
+            is_directory = lstat(child_path, &child_stat) == 0 && S_ISDIR(child_stat.st_mode);
+            g_free(child_path);
+        }
+
+        if (is_directory)
+            watch_tree(watcher, child);
+        g_free(child);
+    }
+    closedir(dir);
+}
+
+/* Read the pending events, record the changed paths and watch new directories */
+static bool read_events(watcher_t* watcher) {
+    // aligned as required for struct inotify_event
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    const ssize_t length = read(watcher->inotify_fd, buffer, sizeof(buffer));
+    if (length < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return true;
+        }
+        fprintf(stderr, "Failed to read inotify events: %s\n", strerror(errno));
+        return false;
+    }
+
+    for (const char* position = buffer; position < buffer + length;) {
+        const struct inotify_event* event = (const struct inotify_event*) position;
+        position += sizeof(struct inotify_event) + event->len;
+
+        // events have been dropped, the next rebuild compares the whole AppDir anyway, but new directories are missed
+        if (event->mask & IN_Q_OVERFLOW) {
+            watch_tree(watcher, "");
+            g_hash_table_add(watcher->changed_paths, g_strdup("(overflow)"));
+            continue;
+        }
+
+        const gchar* directory = g_hash_table_lookup(watcher->directories, GINT_TO_POINTER(event->wd));
+        if (directory == NULL) {
+            continue;
+        }
+
+        if (event->mask & IN_IGNORED) {
+            g_hash_table_remove(watcher->directories, GINT_TO_POINTER(event->wd));
+            continue;
+        }
+
+        gchar* path = event->len > 0 && directory[0] != '\0' ? g_build_filename(directory, event->name, NULL)
+                                                              : g_strdup(event->len > 0 ? event->name : directory);
+
+        if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+            watch_tree(watcher, path);
+        }
+
+        g_hash_table_add(watcher->changed_paths, path);
+    }
+
+    return true;
+}
+
+/* Wait for changes, then for the AppDir to become quiet */
+static wait_result_t wait_for_changes(watcher_t* watcher) {
+    int timeout = -1;
+
+    while (true) {
+        struct pollfd fds[2] = {
+            {.fd = watcher->inotify_fd, .events = POLLIN},
+            {.fd = watcher->signal_fd, .events = POLLIN},
+        };
+
+        const int ready = poll(fds, 2, timeout);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            return WAIT_FAILED;
+        }
+
+        if (fds[1].revents != 0) {
+            return WAIT_INTERRUPTED;
+        }
+
+        if (ready == 0) {
+            return WAIT_CHANGED;
+        }
+
+        if (!read_events(watcher)) {
+            return WAIT_FAILED;
+        }
+
+        if (g_hash_table_size(watcher->changed_paths) > 0) {
+            timeout = QUIET_PERIOD_MS;
+        }
+    }
+}
+
+static void print_changed_paths(watcher_t* watcher) {
+    GList* paths = g_list_sort(g_hash_table_get_keys(watcher->changed_paths), (GCompareFunc) strcmp);
+    const guint count = g_hash_table_size(watcher->changed_paths);
+
+    GString* listed = g_string_new(NULL);
+    guint index = 0;
+    for (const GList* path = paths; path != NULL && index < MAX_LISTED_PATHS; path = path->next, ++index) {
+        g_string_append_printf(listed, "%s%s", index > 0 ? ", " : "", (const char*) path->data);
+    }
+    if (count > MAX_LISTED_PATHS) {
+        g_string_append_printf(listed, ", ...");
+    }
+
+    fprintf(stderr, "\n%u path%s changed (%s), rebuilding\n", count, count == 1 ? "" : "s", listed->str);
+
+    g_string_free(listed, TRUE);
+    g_list_free(paths);
+}
+
+/* Scan and hash the AppDir the way the build does, so that both can be handed over to it
+ * Returns the scan, or NULL on errors */
+static appdir_scan_t* hash_appdir(const watcher_t* watcher, appimage_tree_hashes_t* hashes) {
+    appdir_scan_t* scan = appdir_scan(watcher->root, 0, APPDIR_SCAN_METADATA | APPDIR_SCAN_PROBE_ELF, false);
+    if (scan == NULL) {
+        return NULL;
+    }
+
+    if (!appimage_tree_hash(watcher->root, scan, g_get_num_processors(), watcher->file_hash_directory, hashes, false)) {
+        appdir_scan_free(scan);
+        return NULL;
+    }
+
+    return scan;
+}
+
+int appimage_watch_run(const appimagetool_options_t* options) {
+    appimagetool_options_t watch_options = *options;
+
+    // rebuilds are only fast if the compressed blocks of unchanged files are reused, which mksquashfs cannot do
+    if (watch_options.squashfs_backend == NULL) {
+#ifdef HAVE_LIBSQUASHFS
+        watch_options.squashfs_backend = "libsquashfs";
+#else
+        fprintf(
+            stderr, "This build of appimagetool does not support the libsquashfs backend watching relies on, use "
+            "--squashfs-backend mksquashfs to rebuild the entire AppImage on every change\n"
+        );
+        return 1;
+#endif
+    }
+
+    // the cache is what makes rebuilds fast, a private one is used if none is given
+    gchar* cache_directory = NULL;
+    if (watch_options.cache_directory == NULL) {
+        gchar* parent = g_build_filename(g_get_user_cache_dir(), "appimagetool", NULL);
+        g_mkdir_with_parents(parent, 0755);
+        cache_directory = g_build_filename(parent, "watch", NULL);
+        g_free(parent);
+        watch_options.cache_directory = cache_directory;
+    }
+
+    watcher_t watcher = {
+        .inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC),
+        .signal_fd = -1,
+        .root = options->working_directory != NULL && !g_path_is_absolute(options->source)
+            ? g_build_filename(options->working_directory, options->source, NULL)
+            : g_strdup(options->source),
+        .file_hash_directory = options->working_directory != NULL && !g_path_is_absolute(watch_options.cache_directory)
+            ? g_build_filename(options->working_directory, watch_options.cache_directory, "file-hashes", NULL)
+            : g_build_filename(watch_options.cache_directory, "file-hashes", NULL),
+        .directories = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free),
+        .changed_paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL),
+    };
+
+    // SIGINT and SIGTERM end watching while waiting for changes, during a build they terminate appimagetool as usual
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    watcher.signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    appimagetool_context_t* context = NULL;
+    // scan of the AppDir for the next build
+    appdir_scan_t* scan = NULL;
+    wait_result_t result = WAIT_FAILED;
+
+    if (watcher.inotify_fd < 0 || watcher.signal_fd < 0) {
+        fprintf(stderr, "Failed to set up watching %s: %s\n", watcher.root, strerror(errno));
+        goto cleanup;
+    }
+
+    // changes made while a build is running are picked up by the next one
+    watch_tree(&watcher, "");
+    if (g_hash_table_size(watcher.directories) == 0) {
+        fprintf(stderr, "Failed to watch %s: %s\n", watcher.root, strerror(errno));
+        goto cleanup;
+    }
+
+    context = appimagetool_context_new();
+    // the hashes the last build started from, compared without the times, so that touching files does not rebuild
+    char built_hash[APPIMAGE_CACHE_KEY_LENGTH + 1] = "";
+    appimage_tree_hashes_t hashes;
+    scan = hash_appdir(&watcher, &hashes);
+
+    while (true) {
+        g_hash_table_remove_all(watcher.changed_paths);
+
+        // the state the build starts from, changes made while it is running cause another build; the build uses the
+        // same scan and hashes rather than scanning and hashing the AppDir again
+        if (scan != NULL) {
+            memcpy(built_hash, hashes.without_times, sizeof(built_hash));
+            appimagetool_context_use_scan(context, scan, &hashes);
+            scan = NULL;
+        } else {
+            built_hash[0] = '\0';
+        }
+
+        const gint64 start = g_get_monotonic_time();
+        if (appimagetool_build(context, &watch_options)) {
+            fprintf(
+                stderr, "Built %s in %.2f s, watching %s for changes\n", appimagetool_context_destination(context),
+                (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC, watcher.root
+            );
+
+            // the runtime has been downloaded now, or taken from the cache
+            watch_options.offline = true;
+        } else {
+            fprintf(stderr, "%s\nWatching %s for changes\n", appimagetool_context_error(context), watcher.root);
+        }
+
+        // signals are only handled here, a build can be interrupted like any other
+        sigprocmask(SIG_BLOCK, &signals, NULL);
+
+        while ((result = wait_for_changes(&watcher)) == WAIT_CHANGED) {
+            scan = hash_appdir(&watcher, &hashes);
+            if (scan == NULL || strcmp(hashes.without_times, built_hash) != 0) {
+                break;
+            }
+            appdir_scan_free(scan);
+            scan = NULL;
+            g_hash_table_remove_all(watcher.changed_paths);
+        }
+
+        sigprocmask(SIG_UNBLOCK, &signals, NULL);
+
+        if (result != WAIT_CHANGED) {
+            break;
+        }
+
+        print_changed_paths(&watcher);
+    }
+
+    fprintf(stderr, "Stopped watching %s\n", watcher.root);
+
+cleanup:
+    appdir_scan_free(scan);
+    appimagetool_context_free(context);
+    if (watcher.inotify_fd >= 0)
+        close(watcher.inotify_fd);
+    if (watcher.signal_fd >= 0)
+        close(watcher.signal_fd);
+    g_hash_table_destroy(watcher.directories);
+    g_hash_table_destroy(watcher.changed_paths);
+    g_free(watcher.root);
+    g_free(watcher.file_hash_directory);
+    g_free(cache_directory);
+
+    return result == WAIT_INTERRUPTED ? 0 : 1;
+}
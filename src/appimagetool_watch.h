@@ -0,0 +1,22 @@
+#pragma once
+
+#include "appimagetool.h"
+
+/**
+ * Development mode: build the AppImage, then build it again whenever the AppDir changes.
+ *
+ * Changes are picked up with inotify on every directory of the AppDir. Events are collected until the AppDir has been
+ * quiet for a moment, so that saving many files at once causes one rebuild. A rebuild only starts if the Merkle hash
+ * of the AppDir differs from the one the last build started from, so that merely touching files does not cause one.
+ * The build uses the scan and the hashes made for this comparison, instead of scanning and hashing the AppDir again.
+ *
+ * All builds share one context and a build cache (the one given in the options, or one in the user's cache directory),
+ * so that unchanged work is reused: validations of unchanged desktop and AppStream files are skipped, the content
+ * hashes of unchanged files are taken from the cache's index, and only the blocks of changed files are compressed.
+ * Unless another backend is given, the libsquashfs backend is used; without it, watching fails. After the first successful build, the runtime is taken from the local cache without
+ * contacting the server. Every AppImage is published atomically, so the previous one stays usable until the next one
+ * is complete.
+ *
+ * @return exit code: 0 if interrupted by SIGINT or SIGTERM while waiting for changes, 1 if watching fails
+ */
+int appimage_watch_run(const appimagetool_options_t* options);
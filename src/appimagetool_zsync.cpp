@@ -0,0 +1,611 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <gcrypt.h>
+
+#include "appimagetool_zsync.h"
+
+extern "C" {
+#include "appimagetool_sign.h"
+}
+
+namespace {
+    // the version of zsyncmake whose output we reproduce, clients check this for compatibility
+    constexpr char zsyncVersion[] = "0.6.2";
+
+    // below this amount of data, starting threads costs more than it saves
+    constexpr size_t minimumBytesPerThread = 256 * 1024;
+
+    constexpr size_t rsumSize = 4;
+    constexpr size_t md4Size = 16;
+    constexpr size_t sha1Size = 20;
+
+    struct BlockSum {
+        std::array<uint8_t, rsumSize> rsum;
+        std::array<uint8_t, md4Size> md4;
+    };
+
+    // zsync's weak checksum, a variant of Adler-32 without modulus, stored in network byte order
+    void calculateRsum(const uint8_t* data, size_t size, uint8_t* rsum) {
+        uint16_t a = 0;
+        uint16_t b = 0;
+
+        for (size_t i = 0; i < size; ++i) {
+            a += data[i];
+            b += static_cast<uint16_t>((size - i) * data[i]);
+        }
+
+        rsum[0] = a >> 8;
+        rsum[1] = a & 0xff;
+        rsum[2] = b >> 8;
+        rsum[3] = b & 0xff;
+    }
+
+    uint32_t rsumValue(const uint8_t* rsum) {
+        return (static_cast<uint32_t>(rsum[0]) << 24) | (rsum[1] << 16) | (rsum[2] << 8) | rsum[3];
+    }
+
+    void calculateBlockSum(const char* data, size_t blockSize, BlockSum& sum) {
+        calculateRsum(reinterpret_cast<const uint8_t*>(data), blockSize, sum.rsum.data());
+        gcry_md_hash_buffer(GCRY_MD_MD4, sum.md4.data(), data, blockSize);
+    }
+
+    /**
+     * Split [0, count) into contiguous ranges, one per thread, and call function(begin, end) for each of them.
+     * The calling thread processes the first range itself.
+     */
+    template<typename Function>
+    void forEachRangeInParallel(size_t count, size_t threadCount, const Function& function) {
+        const size_t perThread = (count + threadCount - 1) / std::max<size_t>(threadCount, 1);
+
+        if (count == 0) {
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t begin = perThread; begin < count; begin += perThread) {
+            workers.emplace_back(function, begin, std::min(begin + perThread, count));
+        }
+
+        function(0, std::min(perThread, count));
+
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    bool isValidBlockSize(size_t blockSize) {
+        return blockSize >= 512 && blockSize <= 1024 * 1024 && (blockSize & (blockSize - 1)) == 0;
+    }
+
+    // RFC 2822 date like zsyncmake writes it, independent of the current locale
+    std::string formatMTime(time_t mtime) {
+        static constexpr const char* days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+        static constexpr const char* months[] = {
+            "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+        };
+
+        struct tm tm{};
+        if (gmtime_r(&mtime, &tm) == nullptr) {
+            return {};
+        }
+
+        char buffer[64];
+        snprintf(
+            buffer, sizeof(buffer), "%s, %02d %s %04d %02d:%02d:%02d +0000",
+            days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec
+        );
+        return buffer;
+    }
+
+    /**
+     * Read-only private mapping of an entire file.
+     */
+    class MappedFile {
+    private:
+        const uint8_t* _data = nullptr;
+        size_t _size = 0;
+        bool _valid = false;
+
+    public:
+        explicit MappedFile(const char* path) {
+            const int fd = open(path, O_RDONLY | O_CLOEXEC);
+            struct stat st{};
+
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+                if (fd >= 0) {
+                    close(fd);
+                }
+                return;
+            }
+
+            _size = static_cast<size_t>(st.st_size);
+
+            if (_size > 0) {
+                void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if (data == MAP_FAILED) {
+                    std::cerr << "Failed to map " << path << ": " << strerror(errno) << std::endl;
+                    close(fd);
+                    return;
+                }
+
+                _data = static_cast<const uint8_t*>(data);
+                madvise(data, _size, MADV_SEQUENTIAL);
+            }
+
+            close(fd);
+            _valid = true;
+        }
+
+        ~MappedFile() {
+            if (_data != nullptr) {
+                munmap(const_cast<uint8_t*>(_data), _size);
+            }
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        [[nodiscard]] const uint8_t* data() const {
+            return _data;
+        }
+
+        [[nodiscard]] size_t size() const {
+            return _size;
+        }
+
+        [[nodiscard]] bool valid() const {
+            return _valid;
+        }
+    };
+}
+
+struct appimage_zsync {
+    unsigned long length = 0;
+    size_t blockSize = 0;
+    unsigned int threads = 1;
+
+    // hash lengths as chosen by zsyncmake
+    int seqMatches = 1;
+    int rsumLength = 2;
+    int checksumLength = 16;
+
+    std::vector<BlockSum> sums;
+    std::vector<bool> calculated;
+
+    // data streamed so far, and the beginning of a block which has not been received completely yet
+    unsigned long streamed = 0;
+    std::vector<char> partialBlock;
+    bool outOfOrder = false;
+
+    // calculate the sums of count complete blocks, splitting the work among the threads
+    void calculateBlocks(const char* data, size_t firstBlock, size_t count) {
+        const auto calculateSums = [this, data, firstBlock](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                calculateBlockSum(data + i * blockSize, blockSize, sums[firstBlock + i]);
+            }
+        };
+
+        const size_t usefulThreads = std::max<size_t>(1, count * blockSize / minimumBytesPerThread);
+        forEachRangeInParallel(count, std::min<size_t>(threads, usefulThreads), calculateSums);
+
+        // vector<bool> packs bits, hence the flags are not set by the threads themselves
+        for (size_t i = 0; i < count; ++i) {
+            calculated[firstBlock + i] = true;
+        }
+    }
+
+    void calculatePaddedBlock(const char* data, size_t size, size_t index) {
+        std::vector<char> block(blockSize, '\0');
+        std::memcpy(block.data(), data, size);
+        calculateBlockSum(block.data(), blockSize, sums[index]);
+        calculated[index] = true;
+    }
+};
+
+size_t appimage_zsync_default_block_size(unsigned long length) {
+    return length < 100000000 ? 2048 : 4096;
+}
+
+appimage_zsync_t* appimage_zsync_new(unsigned long length, size_t block_size, unsigned int threads) {
+    if (length == 0 || !init_gcrypt()) {
+        return nullptr;
+    }
+
+    if (block_size != 0 && !isValidBlockSize(block_size)) {
+        std::cerr << "Invalid zsync block size: " << block_size << std::endl;
+        return nullptr;
+    }
+
+    auto* zsync = new appimage_zsync{};
+    zsync->length = length;
+
+    // the following choices replicate zsyncmake, so that the output is identical
+    zsync->blockSize = block_size != 0 ? block_size : appimage_zsync_default_block_size(length);
+
+    const double len = static_cast<double>(length);
+    const double blocks = static_cast<double>(length / zsync->blockSize);
+
+    zsync->seqMatches = length > zsync->blockSize ? 2 : 1;
+
+    zsync->rsumLength = static_cast<int>(std::ceil(
+        ((std::log(len) + std::log(static_cast<double>(zsync->blockSize))) / std::log(2.0) - 8.6) / zsync->seqMatches / 8
+    ));
+    zsync->rsumLength = std::clamp(zsync->rsumLength, 2, 4);
+
+    zsync->checksumLength = static_cast<int>(std::ceil(
+        (20 + (std::log(len) + std::log(1 + blocks)) / std::log(2.0)) / zsync->seqMatches / 8
+    ));
+    const int checksumLength2 = static_cast<int>((7.9 + (20 + std::log(1 + blocks) / std::log(2.0))) / 8);
+    zsync->checksumLength = std::min(std::max(zsync->checksumLength, checksumLength2), static_cast<int>(md4Size));
+
+    const size_t blockCount = (length + zsync->blockSize - 1) / zsync->blockSize;
+    zsync->sums.resize(blockCount);
+    zsync->calculated.resize(blockCount, false);
+
+    zsync->threads = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+
+    return zsync;
+}
+
+void appimage_zsync_free(appimage_zsync_t* zsync) {
+    delete zsync;
+}
+
+void appimage_zsync_update(const char* buffer, size_t size, unsigned long position, void* user_data) {
+    auto* zsync = static_cast<appimage_zsync_t*>(user_data);
+
+    if (zsync->outOfOrder) {
+        return;
+    }
+
+    if (position != zsync->streamed || position + size > zsync->length) {
+        // the block checksums cannot be trusted anymore, appimage_zsync_write reports this
+        zsync->outOfOrder = true;
+        return;
+    }
+
+    const char* data = buffer;
+    size_t remaining = size;
+
+    // complete a block started by a previous call first
+    if (!zsync->partialBlock.empty()) {
+        const size_t missing = std::min(zsync->blockSize - zsync->partialBlock.size(), remaining);
+        zsync->partialBlock.insert(zsync->partialBlock.end(), data, data + missing);
+        data += missing;
+        remaining -= missing;
+
+        if (zsync->partialBlock.size() == zsync->blockSize) {
+            const size_t index = zsync->streamed / zsync->blockSize;
+            zsync->calculatePaddedBlock(zsync->partialBlock.data(), zsync->blockSize, index);
+            zsync->partialBlock.clear();
+        }
+    }
+
+    const unsigned long dataPosition = position + (data - buffer);
+
+    if (remaining > 0) {
+        const size_t fullBlocks = remaining / zsync->blockSize;
+        zsync->calculateBlocks(data, dataPosition / zsync->blockSize, fullBlocks);
+        zsync->partialBlock.assign(data + fullBlocks * zsync->blockSize, data + remaining);
+    }
+
+    zsync->streamed += size;
+
+    // like zsyncmake, the last block is padded with zeroes
+    if (zsync->streamed == zsync->length && !zsync->partialBlock.empty()) {
+        zsync->calculatePaddedBlock(zsync->partialBlock.data(), zsync->partialBlock.size(), zsync->sums.size() - 1);
+        zsync->partialBlock.clear();
+    }
+}
+
+bool appimage_zsync_rehash_range(appimage_zsync_t* zsync, int fd, unsigned long offset, unsigned long length) {
+    if (length == 0) {
+        return true;
+    }
+
+    if (offset + length > zsync->length) {
+        std::cerr << "Range to rehash exceeds the file" << std::endl;
+        return false;
+    }
+
+    const size_t firstBlock = offset / zsync->blockSize;
+    const size_t lastBlock = (offset + length - 1) / zsync->blockSize;
+
+    std::vector<char> block(zsync->blockSize);
+
+    for (size_t index = firstBlock; index <= lastBlock; ++index) {
+        std::fill(block.begin(), block.end(), '\0');
+
+        const off_t blockOffset = static_cast<off_t>(index * zsync->blockSize);
+        const size_t expected = std::min<unsigned long>(zsync->blockSize, zsync->length - blockOffset);
+
+        size_t done = 0;
+        while (done < expected) {
+            const auto bytesRead = pread(fd, block.data() + done, expected - done, blockOffset + static_cast<off_t>(done));
+
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytesRead <= 0) {
+                std::cerr << "Failed to read block for zsync checksums: " << strerror(errno) << std::endl;
+                return false;
+            }
+
+            done += static_cast<size_t>(bytesRead);
+        }
+
+        calculateBlockSum(block.data(), zsync->blockSize, zsync->sums[index]);
+        zsync->calculated[index] = true;
+    }
+
+    return true;
+}
+
+bool appimage_zsync_write(
+    const appimage_zsync_t* zsync,
+    const char* path,
+    const char* filename,
+    const char* url,
+    long mtime,
+    const char* sha1
+) {
+    if (zsync->outOfOrder || std::find(zsync->calculated.begin(), zsync->calculated.end(), false) != zsync->calculated.end()) {
+        std::cerr << "Not all zsync block checksums have been calculated" << std::endl;
+        return false;
+    }
+
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        std::cerr << "Failed to open " << path << " for writing: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // header order as written by zsyncmake
+    fprintf(file, "zsync: %s\n", zsyncVersion);
+    fprintf(file, "Filename: %s\n", filename);
+    if (mtime >= 0) {
+        const auto formatted = formatMTime(static_cast<time_t>(mtime));
+        if (!formatted.empty()) {
+            fprintf(file, "MTime: %s\n", formatted.c_str());
+        }
+    }
+    fprintf(file, "Blocksize: %zu\n", zsync->blockSize);
+    fprintf(file, "Length: %lu\n", zsync->length);
+    fprintf(file, "Hash-Lengths: %d,%d,%d\n", zsync->seqMatches, zsync->rsumLength, zsync->checksumLength);
+    fprintf(file, "URL: %s\n", url);
+
+    fputs("SHA-1: ", file);
+    for (size_t i = 0; i < sha1Size; ++i) {
+        fprintf(file, "%02x", static_cast<uint8_t>(sha1[i]));
+    }
+    fputs("\n\n", file);
+
+    // only the last rsumLength bytes of the rsum and the first checksumLength bytes of the MD4 digest are stored
+    for (const auto& sum : zsync->sums) {
+        fwrite(sum.rsum.data() + rsumSize - zsync->rsumLength, 1, zsync->rsumLength, file);
+        fwrite(sum.md4.data(), 1, zsync->checksumLength, file);
+    }
+
+    const bool success = !ferror(file);
+
+    if (fclose(file) != 0 || !success) {
+        std::cerr << "Failed to write " << path << std::endl;
+        unlink(path);
+        return false;
+    }
+
+    return true;
+}
+
+bool appimage_zsync_estimate_delta(
+    const char* old_path,
+    const char* new_path,
+    size_t block_size,
+    unsigned int threads,
+    appimage_zsync_delta_region_t* regions,
+    size_t regions_count,
+    appimage_zsync_delta_t* delta
+) {
+    const MappedFile oldFile(old_path);
+    const MappedFile newFile(new_path);
+
+    if (!oldFile.valid() || !newFile.valid()) {
+        return false;
+    }
+
+    const size_t blockSize = block_size != 0 ? block_size : appimage_zsync_default_block_size(newFile.size());
+
+    if (!isValidBlockSize(blockSize)) {
+        std::cerr << "Invalid zsync block size: " << blockSize << std::endl;
+        return false;
+    }
+
+    const size_t blockCount = (newFile.size() + blockSize - 1) / blockSize;
+    const size_t threadCount = std::max(1u, threads != 0 ? threads : std::thread::hardware_concurrency());
+
+    if (blockCount > UINT32_MAX) {
+        std::cerr << "Too many blocks, use a larger block size" << std::endl;
+        return false;
+    }
+
+    // like in the control file, the last block is padded with zeroes
+    std::vector<uint8_t> lastBlock(blockSize, 0);
+    if (blockCount > 0) {
+        const size_t lastBlockOffset = (blockCount - 1) * blockSize;
+        std::memcpy(lastBlock.data(), newFile.data() + lastBlockOffset, newFile.size() - lastBlockOffset);
+    }
+
+    const auto blockData = [&](size_t index) {
+        return index == blockCount - 1 ? lastBlock.data() : newFile.data() + index * blockSize;
+    };
+
+    // the blocks of the new file in a hash table of their weak checksums, plus a bitmap to rule out most offsets
+    // quickly: the bitmap has at least 16 bits per block and fits into the cache far better than the table
+    // the table has about one block per bucket, and is sorted by hash, so that the buckets are ranges of it
+    unsigned filterBits = 16;
+    while (filterBits < 28 && (size_t{1} << filterBits) < blockCount * 16) {
+        ++filterBits;
+    }
+    const unsigned bucketBits = filterBits - 4;
+
+    const auto hash = [](uint32_t rsum) {
+        return rsum * 2654435761u;
+    };
+    const auto filterIndex = [filterBits](uint32_t hashValue) {
+        return hashValue >> (32 - filterBits);
+    };
+    const auto bucketIndex = [bucketBits](uint32_t hashValue) {
+        return hashValue >> (32 - bucketBits);
+    };
+
+    std::vector<std::pair<uint32_t, uint32_t>> blocksByRsum(blockCount);
+    std::vector<uint64_t> filter((size_t{1} << filterBits) / 64, 0);
+    std::vector<uint32_t> bucketStarts((size_t{1} << bucketBits) + 1, 0);
+
+    forEachRangeInParallel(blockCount, threadCount, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            uint8_t rsum[rsumSize];
+            calculateRsum(blockData(i), blockSize, rsum);
+            blocksByRsum[i] = {rsumValue(rsum), static_cast<uint32_t>(i)};
+        }
+    });
+
+    std::sort(blocksByRsum.begin(), blocksByRsum.end(), [&hash](const auto& lhs, const auto& rhs) {
+        return hash(lhs.first) < hash(rhs.first);
+    });
+
+    for (const auto& [value, index] : blocksByRsum) {
+        filter[filterIndex(hash(value)) / 64] |= uint64_t{1} << (filterIndex(hash(value)) % 64);
+        bucketStarts[bucketIndex(hash(value)) + 1]++;
+    }
+
+    for (size_t i = 1; i < bucketStarts.size(); ++i) {
+        bucketStarts[i] += bucketStarts[i - 1];
+    }
+
+    std::unique_ptr<std::atomic<bool>[]> reused(new std::atomic<bool>[blockCount]());
+
+    // every thread searches a contiguous range of offsets in the old file
+    // everything used per byte is copied into locals, so that the compiler can keep it in registers
+    const auto search = [&](size_t begin, size_t end) {
+        const uint8_t* const old = oldFile.data();
+        const uint64_t* const filterBitmap = filter.data();
+        const uint32_t* const buckets = bucketStarts.data();
+        const std::pair<uint32_t, uint32_t>* const table = blocksByRsum.data();
+        const size_t length = blockSize;
+
+        uint16_t a = 0;
+        uint16_t b = 0;
+
+        const auto initialize = [old, length](size_t offset, uint16_t& a, uint16_t& b) {
+            uint8_t rsum[rsumSize];
+            calculateRsum(old + offset, length, rsum);
+            a = static_cast<uint16_t>((rsum[0] << 8) | rsum[1]);
+            b = static_cast<uint16_t>((rsum[2] << 8) | rsum[3]);
+        };
+
+        size_t offset = begin;
+        if (offset < end) {
+            initialize(offset, a, b);
+        }
+
+        while (offset < end) {
+            const uint32_t value = (static_cast<uint32_t>(a) << 16) | b;
+            const uint32_t hashValue = hash(value);
+            bool matched = false;
+
+            if ((filterBitmap[filterIndex(hashValue) / 64] & (uint64_t{1} << (filterIndex(hashValue) % 64))) != 0) {
+                const size_t bucket = bucketIndex(hashValue);
+
+                for (size_t i = buckets[bucket]; i < buckets[bucket + 1]; ++i) {
+                    // comparing the data is exact, where the client relies on the (truncated) MD4 sums
+                    if (table[i].first == value && std::memcmp(old + offset, blockData(table[i].second), length) == 0) {
+                        reused[table[i].second].store(true, std::memory_order_relaxed);
+                        matched = true;
+                    }
+                }
+            }
+
+            // like the client, continue right after a matching block
+            if (matched) {
+                offset += length;
+                if (offset < end) {
+                    initialize(offset, a, b);
+                }
+                continue;
+            }
+
+            if (offset + 1 < end) {
+                const uint8_t out = old[offset];
+                const uint8_t in = old[offset + length];
+                a = static_cast<uint16_t>(a - out + in);
+                b = static_cast<uint16_t>(b - length * out + a);
+            }
+
+            ++offset;
+        }
+    };
+
+    if (oldFile.size() >= blockSize && blockCount > 0) {
+        forEachRangeInParallel(oldFile.size() - blockSize + 1, threadCount, search);
+    }
+
+    // the padded last block only occurs at the end of a file, so compare it with the end of the old file, too
+    const size_t lastBlockLength = newFile.size() - (blockCount > 0 ? (blockCount - 1) * blockSize : 0);
+    if (blockCount > 0 && oldFile.size() >= lastBlockLength &&
+        std::memcmp(oldFile.data() + oldFile.size() - lastBlockLength, lastBlock.data(), lastBlockLength) == 0) {
+        reused[blockCount - 1].store(true, std::memory_order_relaxed);
+    }
+
+    delta->block_size = blockSize;
+    delta->blocks_count = blockCount;
+    delta->reused_blocks_count = 0;
+    delta->new_length = newFile.size();
+    delta->download_size = 0;
+
+    for (size_t i = 0; i < regions_count; ++i) {
+        regions[i].download_size = 0;
+    }
+
+    for (size_t i = 0; i < blockCount; ++i) {
+        if (reused[i].load(std::memory_order_relaxed)) {
+            delta->reused_blocks_count++;
+            continue;
+        }
+
+        const unsigned long blockBegin = i * blockSize;
+        const unsigned long blockEnd = std::min<unsigned long>(blockBegin + blockSize, newFile.size());
+        delta->download_size += blockEnd - blockBegin;
+
+        for (size_t j = 0; j < regions_count; ++j) {
+            const unsigned long begin = std::max(blockBegin, regions[j].offset);
+            const unsigned long end = std::min(blockEnd, regions[j].offset + regions[j].length);
+            if (begin < end) {
+                regions[j].download_size += end - begin;
+            }
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Generator for .zsync control files, compatible with zsyncmake 0.6.2 and all zsync clients.
+ *
+ * The block checksums are calculated from data passed to appimage_zsync_update, which can be used as an
+ * appimage_hash_observer_t, so that they are calculated while the file is streamed through the hashing engine anyway.
+ * Blocks which are modified afterwards (e.g., ELF sections patched during signing) must be recalculated with
+ * appimage_zsync_rehash_range before writing the control file.
+ */
+typedef struct appimage_zsync appimage_zsync_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Result of appimage_zsync_estimate_delta.
+ */
+typedef struct {
+    size_t block_size;
+    size_t blocks_count;
+    // blocks of the new file a zsync client finds in the old file
+    size_t reused_blocks_count;
+    unsigned long new_length;
+    // bytes of the new file which have to be downloaded
+    unsigned long download_size;
+} appimage_zsync_delta_t;
+
+/**
+ * Byte range of the new file, e.g., a part of the squashfs image, whose share of the download
+ * appimage_zsync_estimate_delta reports.
+ */
+typedef struct {
+    unsigned long offset;
+    unsigned long length;
+    // set by appimage_zsync_estimate_delta: the bytes of blocks which have to be downloaded that lie in the region
+    unsigned long download_size;
+} appimage_zsync_delta_region_t;
+
+/**
+ * Block size used for AppImages built in zsync friendly mode. It lines up with the 4 KiB boundaries the libsquashfs
+ * backend aligns files to, so that every block of an unchanged file is found by clients.
+ */
+#define APPIMAGE_ZSYNC_FRIENDLY_BLOCK_SIZE 4096
+
+/**
+ * Block size zsyncmake picks for a file of the given size.
+ */
+size_t appimage_zsync_default_block_size(unsigned long length);
+
+/**
+ * @param length size of the file the control file is generated for
+ * @param block_size power of two between 512 bytes and 1 MiB, or 0 to pick the block size like zsyncmake does
+ * @param threads number of threads used to calculate block checksums, 0 uses all cores
+ * @return generator, or NULL on errors. Must be freed with appimage_zsync_free.
+ */
+appimage_zsync_t* appimage_zsync_new(unsigned long length, size_t block_size, unsigned int threads);
+
+void appimage_zsync_free(appimage_zsync_t* zsync);
+
+/**
+ * Calculate the checksums of all blocks covered by the given data. Data must be passed in order, without gaps.
+ * Compatible with appimage_hash_observer_t, user_data is the generator.
+ */
+void appimage_zsync_update(const char* buffer, size_t size, unsigned long position, void* user_data);
+
+/**
+ * Recalculate the checksums of all blocks overlapping the given byte range from the file.
+ * @return true on success, false otherwise
+ */
+bool appimage_zsync_rehash_range(appimage_zsync_t* zsync, int fd, unsigned long offset, unsigned long length);
+
+/**
+ * Write the control file. All blocks of the file must have been calculated.
+ * @param filename value of the Filename header, i.e., the name clients save the file as
+ * @param url value of the URL header, relative to the control file or absolute
+ * @param mtime modification time of the file, negative values omit the MTime header
+ * @param sha1 raw SHA-1 digest (20 bytes) of the final file
+ * @return true on success, false otherwise
+ */
+bool appimage_zsync_write(
+    const appimage_zsync_t* zsync,
+    const char* path,
+    const char* filename,
+    const char* url,
+    long mtime,
+    const char* sha1
+);
+
+/**
+ * Estimate how much of the new file a zsync client which has the old file needs to download, by searching the old
+ * file for all blocks of the new one at every byte offset, like the client does.
+ * @param block_size block size of the control file, 0 picks the block size like zsyncmake does
+ * @param threads number of threads used to search the old file, 0 uses all cores
+ * @param regions optional regions of the new file to break the download down by, may overlap
+ * @return true on success, false otherwise
+ */
+bool appimage_zsync_estimate_delta(
+    const char* old_path,
+    const char* new_path,
+    size_t block_size,
+    unsigned int threads,
+    appimage_zsync_delta_region_t* regions,
+    size_t regions_count,
+    appimage_zsync_delta_t* delta
+);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Calculate the type 2 digest with the original chunked implementation, see digest_reference.c.
+ * @param digest receives the 16 bytes of the digest
+ */
+bool appimage_type2_digest_md5_reference(const char* path, char* digest);
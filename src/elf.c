@@ -7,17 +7,14 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <memory.h>
-#include <sys/mman.h>
 
 #include "light_elf.h"
 #include "light_byteswap.h"
+#include "appimagetool_elf.h"
 
 
 typedef Elf32_Nhdr Elf_Nhdr;
 
-static char *fname;
-static Elf64_Ehdr ehdr;
-
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define ELFDATANATIVE ELFDATA2LSB
 #elif __BYTE_ORDER == __BIG_ENDIAN
@@ -26,28 +23,28 @@ static Elf64_Ehdr ehdr;
 #error "Unknown machine endian"
 #endif
 
-static uint16_t file16_to_cpu(uint16_t val)
+static uint16_t file16_to_cpu(const Elf64_Ehdr* ehdr, uint16_t val)
 {
-    if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
+    if (ehdr->e_ident[EI_DATA] != ELFDATANATIVE)
         val = bswap_16(val);
     return val;
 }
 
-static uint32_t file32_to_cpu(uint32_t val)
+static uint32_t file32_to_cpu(const Elf64_Ehdr* ehdr, uint32_t val)
 {
-    if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
+    if (ehdr->e_ident[EI_DATA] != ELFDATANATIVE)
         val = bswap_32(val);
     return val;
 }
 
-static uint64_t file64_to_cpu(uint64_t val)
+static uint64_t file64_to_cpu(const Elf64_Ehdr* ehdr, uint64_t val)
 {
-    if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE)
+    if (ehdr->e_ident[EI_DATA] != ELFDATANATIVE)
         val = bswap_64(val);
     return val;
 }
 
-static off_t read_elf32(FILE* fd)
+static off_t read_elf32(const char* fname, Elf64_Ehdr* ehdr, FILE* fd)
 {
     Elf32_Ehdr ehdr32;
     Elf32_Shdr shdr32;
@@ -63,11 +60,16 @@ static off_t read_elf32(FILE* fd)
         return -1;
     }
 
-    ehdr.e_shoff		= file32_to_cpu(ehdr32.e_shoff);
-    ehdr.e_shentsize	= file16_to_cpu(ehdr32.e_shentsize);
-    ehdr.e_shnum		= file16_to_cpu(ehdr32.e_shnum);
+    ehdr->e_shoff		= file32_to_cpu(ehdr, ehdr32.e_shoff);
+    ehdr->e_shentsize	= file16_to_cpu(ehdr, ehdr32.e_shentsize);
+    ehdr->e_shnum		= file16_to_cpu(ehdr, ehdr32.e_shnum);
+
+    if (ehdr->e_shnum == 0) {
+        fprintf(stderr, "%s has no section headers\n", fname);
+        return -1;
+    }
 
-    last_shdr_offset = ehdr.e_shoff + (ehdr.e_shentsize * (ehdr.e_shnum - 1));
+    last_shdr_offset = ehdr->e_shoff + (ehdr->e_shentsize * (ehdr->e_shnum - 1));
     fseeko(fd, last_shdr_offset, SEEK_SET);
     ret = fread(&shdr32, 1, sizeof(shdr32), fd);
     if (ret < 0 || (size_t)ret != sizeof(shdr32)) {
@@ -77,12 +79,12 @@ static off_t read_elf32(FILE* fd)
     }
 
     /* ELF ends either with the table of section headers (SHT) or with a section. */
-    sht_end = ehdr.e_shoff + (ehdr.e_shentsize * ehdr.e_shnum);
-    last_section_end = file64_to_cpu(shdr32.sh_offset) + file64_to_cpu(shdr32.sh_size);
+    sht_end = ehdr->e_shoff + (ehdr->e_shentsize * ehdr->e_shnum);
+    last_section_end = file32_to_cpu(ehdr, shdr32.sh_offset) + file32_to_cpu(ehdr, shdr32.sh_size);
     return sht_end > last_section_end ? sht_end : last_section_end;
 }
 
-static off_t read_elf64(FILE* fd)
+static off_t read_elf64(const char* fname, Elf64_Ehdr* ehdr, FILE* fd)
 {
     Elf64_Ehdr ehdr64;
     Elf64_Shdr shdr64;
@@ -98,11 +100,16 @@ static off_t read_elf64(FILE* fd)
         return -1;
     }
 
-    ehdr.e_shoff		= file64_to_cpu(ehdr64.e_shoff);
-    ehdr.e_shentsize	= file16_to_cpu(ehdr64.e_shentsize);
-    ehdr.e_shnum		= file16_to_cpu(ehdr64.e_shnum);
+    ehdr->e_shoff		= file64_to_cpu(ehdr, ehdr64.e_shoff);
+    ehdr->e_shentsize	= file16_to_cpu(ehdr, ehdr64.e_shentsize);
+    ehdr->e_shnum		= file16_to_cpu(ehdr, ehdr64.e_shnum);
 
-    last_shdr_offset = ehdr.e_shoff + (ehdr.e_shentsize * (ehdr.e_shnum - 1));
+    if (ehdr->e_shnum == 0) {
+        fprintf(stderr, "%s has no section headers\n", fname);
+        return -1;
+    }
+
+    last_shdr_offset = ehdr->e_shoff + (ehdr->e_shentsize * (ehdr->e_shnum - 1));
     fseeko(fd, last_shdr_offset, SEEK_SET);
     ret = fread(&shdr64, 1, sizeof(shdr64), fd);
     if (ret < 0 || ret != sizeof(shdr64)) {
@@ -112,60 +119,57 @@ static off_t read_elf64(FILE* fd)
     }
 
     /* ELF ends either with the table of section headers (SHT) or with a section. */
-    sht_end = ehdr.e_shoff + (ehdr.e_shentsize * ehdr.e_shnum);
-    last_section_end = file64_to_cpu(shdr64.sh_offset) + file64_to_cpu(shdr64.sh_size);
+    sht_end = ehdr->e_shoff + (ehdr->e_shentsize * ehdr->e_shnum);
+    last_section_end = file64_to_cpu(ehdr, shdr64.sh_offset) + file64_to_cpu(ehdr, shdr64.sh_size);
     return sht_end > last_section_end ? sht_end : last_section_end;
 }
 
+/* Return the size of an ELF file, i.e., the offset at which the data appended to it begins (e.g., the squashfs image
+ * of an AppImage), or -1 on errors */
+ssize_t appimage_get_elf_size(const char* path) {
+    off_t size = -1;
+    FILE* fd;
+    // only the fields needed to find the end of the file are filled in
+    Elf64_Ehdr ehdr;
 
-/* Return the offset, and the length of an ELF section with a given name in a given ELF file */
-bool appimage_get_elf_section_offset_and_length(const char* fname, const char* section_name, unsigned long* offset, unsigned long* length) {
-    uint8_t* data;
-    int i;
-    int fd = open(fname, O_RDONLY);
-    size_t map_size = (size_t) lseek(fd, 0, SEEK_END);
-
-    data = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
-    close(fd);
-
-    // this trick works as both 32 and 64 bit ELF files start with the e_ident[EI_NINDENT] section
-    unsigned char class = data[EI_CLASS];
-
-    if (class == ELFCLASS32) {
-        Elf32_Ehdr* elf;
-        Elf32_Shdr* shdr;
-
-        elf = (Elf32_Ehdr*) data;
-        shdr = (Elf32_Shdr*) (data + ((Elf32_Ehdr*) elf)->e_shoff);
-
-        char* strTab = (char*) (data + shdr[elf->e_shstrndx].sh_offset);
-        for (i = 0; i < elf->e_shnum; i++) {
-            if (strcmp(&strTab[shdr[i].sh_name], section_name) == 0) {
-                *offset = shdr[i].sh_offset;
-                *length = shdr[i].sh_size;
-            }
-        }
-    } else if (class == ELFCLASS64) {
-        Elf64_Ehdr* elf;
-        Elf64_Shdr* shdr;
-
-        elf = (Elf64_Ehdr*) data;
-        shdr = (Elf64_Shdr*) (data + elf->e_shoff);
-
-        char* strTab = (char*) (data + shdr[elf->e_shstrndx].sh_offset);
-        for (i = 0; i < elf->e_shnum; i++) {
-            if (strcmp(&strTab[shdr[i].sh_name], section_name) == 0) {
-                *offset = shdr[i].sh_offset;
-                *length = shdr[i].sh_size;
-            }
-        }
+    if ((fd = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fread(ehdr.e_ident, 1, EI_NIDENT, fd) != EI_NIDENT) {
+        fprintf(stderr, "Read of e_ident from %s failed: %s\n", path, strerror(errno));
+        fclose(fd);
+        return -1;
+    }
+
+    if (ehdr.e_ident[EI_DATA] != ELFDATA2LSB && ehdr.e_ident[EI_DATA] != ELFDATA2MSB) {
+        fprintf(stderr, "Unknown ELF data order %u\n", ehdr.e_ident[EI_DATA]);
+    } else if (ehdr.e_ident[EI_CLASS] == ELFCLASS32) {
+        size = read_elf32(path, &ehdr, fd);
+    } else if (ehdr.e_ident[EI_CLASS] == ELFCLASS64) {
+        size = read_elf64(path, &ehdr, fd);
     } else {
-        fprintf(stderr, "Platforms other than 32-bit/64-bit are currently not supported!");
-        munmap(data, map_size);
+        fprintf(stderr, "Unknown ELF class %u\n", ehdr.e_ident[EI_CLASS]);
+    }
+
+    fclose(fd);
+    return size;
+}
+
+/* Return the offset, and the length of an ELF section with a given name in a given ELF file
+ * If the section does not exist, offset and length are left untouched
+ * Callers which need several sections should use appimage_elf_sections_open and parse the file only once */
+bool appimage_get_elf_section_offset_and_length(const char* fname, const char* section_name, unsigned long* offset, unsigned long* length) {
+    appimage_elf_sections_t* sections = appimage_elf_sections_open(fname);
+
+    if (sections == NULL) {
         return false;
     }
 
-    munmap(data, map_size);
+    appimage_elf_sections_find(sections, section_name, offset, length);
+    appimage_elf_sections_free(sections);
+
     return true;
 }
 
@@ -0,0 +1,91 @@
+/*
+ * Throughput benchmark for the type 2 MD5 digest
+ *
+ * Compares the hashing engine with the original chunk based implementation in digest_reference.c, which is used as
+ * is. Fails if the digests differ.
+ *
+ * Usage: appimagetool-hash-benchmark <AppImage> [iterations]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "appimagetool_hash.h"
+#include "digest_reference.h"
+#include "util.h"
+
+static bool engine_type2_digest_md5(const char* path, char* digest) {
+    appimage_hashes_t hashes;
+
+    if (!appimage_hash_file(path, APPIMAGE_HASH_TYPE2_MD5, NULL, &hashes, false))
+        return false;
+
+    memcpy(digest, hashes.type2_md5, APPIMAGE_MD5_DIGEST_SIZE);
+    return true;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// run one implementation several times, report the best throughput, which is the one least affected by noise
+static bool run(const char* name, bool (*digest_function)(const char*, char*), const char* path, off_t size, int iterations, char* digest) {
+    double best = -1;
+
+    for (int i = 0; i < iterations; ++i) {
+        const double start = now();
+        if (!digest_function(path, digest)) {
+            fprintf(stderr, "%s: failed to calculate digest\n", name);
+            return false;
+        }
+        const double elapsed = now() - start;
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    char* hex = appimage_hexlify(digest, APPIMAGE_MD5_DIGEST_SIZE);
+    printf("%-10s %s  %8.3f s  %8.1f MiB/s\n", name, hex, best, (double) size / (1024 * 1024) / best);
+    free(hex);
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <AppImage> [iterations]\n", argv[0]);
+        return 2;
+    }
+
+    const char* path = argv[1];
+    const int iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return 2;
+    }
+
+    char reference_digest[APPIMAGE_MD5_DIGEST_SIZE];
+    char engine_digest[APPIMAGE_MD5_DIGEST_SIZE];
+
+    // warm up the page cache, all implementations should be limited by hashing, not by the disk
+    engine_type2_digest_md5(path, engine_digest);
+
+    if (!run("reference", appimage_type2_digest_md5_reference, path, st.st_size, iterations, reference_digest) ||
+        !run("engine", engine_type2_digest_md5, path, st.st_size, iterations, engine_digest)) {
+        return 1;
+    }
+
+    if (memcmp(reference_digest, engine_digest, APPIMAGE_MD5_DIGEST_SIZE) != 0) {
+        fprintf(stderr, "Digest of the engine differs from the one of the original implementation\n");
+        return 1;
+    }
+
+    return 0;
+}
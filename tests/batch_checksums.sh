@@ -0,0 +1,56 @@
+#!/bin/sh
+# Two artifacts of a batch are published into the same directory at the same time, both must end up in the
+# checksum lists
+# usage: batch_checksums.sh APPIMAGETOOL RUNTIME
+
+set -eu
+
+appimagetool="$1"
+runtime="$2"
+
+for tool in file mksquashfs desktop-file-validate; do
+    if ! command -v "$tool" > /dev/null; then
+        echo "$tool is not installed, skipping"
+        exit 77
+    fi
+done
+
+workdir="$(mktemp -d)"
+trap 'rm -rf "$workdir"' EXIT
+
+for name in One Two; do
+    appdir="$workdir/$name.AppDir"
+    mkdir -p "$appdir"
+    printf '#!/bin/sh\necho %s\n' "$name" > "$appdir/AppRun"
+    chmod +x "$appdir/AppRun"
+    printf '[Desktop Entry]\nType=Application\nName=%s\nExec=AppRun\nIcon=%s\nCategories=Utility;\n' "$name" "$name" \
+        > "$appdir/$name.desktop"
+    printf 'not really a PNG' > "$appdir/$name.png"
+done
+
+mkdir "$workdir/out"
+cat > "$workdir/manifest.json" <<MANIFEST
+{
+    "parallel": 2,
+    "artifacts": [
+        {"appdir": "One.AppDir", "arch": "x86_64", "destination": "out/One.AppImage"},
+        {"appdir": "Two.AppDir", "arch": "x86_64", "destination": "out/Two.AppImage"}
+    ]
+}
+MANIFEST
+
+"$appimagetool" --batch "$workdir/manifest.json" --runtime-file "$runtime" --checksums --no-appstream
+
+cd "$workdir/out"
+for list in SHA256SUMS MD5SUMS; do
+    for name in One Two; do
+        if ! grep -q "  $name.AppImage\$" "$list"; then
+            echo "$name.AppImage is missing from $list:"
+            cat "$list"
+            exit 1
+        fi
+    done
+done
+
+sha256sum -c SHA256SUMS
+md5sum -c MD5SUMS
@@ -0,0 +1,226 @@
+/*
+ * Blocks taken from the block store must be exactly what the compressor returns for them, or the squashfs image
+ * differs from one built without the store. The blocks are passed to the store's compressor and to a plain one, and
+ * the results are compared when the store is empty, when it has the blocks, after it has been reopened by another
+ * build, and after entries have been damaged. The store's compressor wraps one which counts the blocks it
+ * compresses, which tells hits and misses apart.
+ */
+
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "appimagetool_block_cache.h"
+
+#define BLOCK_SIZE (128 * 1024)
+#define BLOCKS_COUNT 4
+
+/* Passes the blocks on to a real compressor, counting them */
+typedef struct {
+    sqfs_compressor_t base;
+    sqfs_compressor_t* compressor;
+} counting_compressor_t;
+
+static unsigned int compressed_blocks = 0;
+
+static sqfs_compressor_t* new_counting_compressor(sqfs_compressor_t* compressor);
+
+static void destroy_counting_compressor(sqfs_object_t* object) {
+    counting_compressor_t* self = (counting_compressor_t*) object;
+    sqfs_destroy(self->compressor);
+    free(self);
+}
+
+static sqfs_object_t* copy_counting_compressor(const sqfs_object_t* object) {
+    const counting_compressor_t* self = (const counting_compressor_t*) object;
+    sqfs_compressor_t* copy = sqfs_copy(self->compressor);
+    return copy != NULL ? (sqfs_object_t*) new_counting_compressor(copy) : NULL;
+}
+
+static void get_configuration(const sqfs_compressor_t* base, sqfs_compressor_config_t* configuration) {
+    const sqfs_compressor_t* compressor = ((const counting_compressor_t*) base)->compressor;
+    compressor->get_configuration(compressor, configuration);
+}
+
+static sqfs_s32 do_block(sqfs_compressor_t* base, const sqfs_u8* input, sqfs_u32 size, sqfs_u8* output, sqfs_u32 output_size) {
+    sqfs_compressor_t* compressor = ((counting_compressor_t*) base)->compressor;
+    ++compressed_blocks;
+    return compressor->do_block(compressor, input, size, output, output_size);
+}
+
+static sqfs_compressor_t* new_counting_compressor(sqfs_compressor_t* compressor) {
+    counting_compressor_t* self = malloc(sizeof(counting_compressor_t));
+    self->base = *compressor;
+    self->base.base.destroy = destroy_counting_compressor;
+    self->base.base.copy = copy_counting_compressor;
+    self->base.get_configuration = get_configuration;
+    self->base.do_block = do_block;
+    self->compressor = compressor;
+    return &self->base;
+}
+
+static bool check(bool condition, const char* description) {
+    fprintf(stderr, "%s: %s\n", description, condition ? "ok" : "FAILED");
+    return condition;
+}
+
+/* Compressible blocks, one of them all zeros, and one of random data which the compressor leaves uncompressed */
+static void generate(sqfs_u8 blocks[BLOCKS_COUNT][BLOCK_SIZE]) {
+    uint32_t state = 1;
+
+    for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+        state = state * 1103515245 + 12345;
+        blocks[0][i] = (sqfs_u8) "appimagetool "[i % 13];
+        blocks[1][i] = 0;
+        blocks[2][i] = (sqfs_u8) (state >> 16);
+        blocks[3][i] = (sqfs_u8) ((state >> 16) % 4);
+    }
+}
+
+/* Compress all blocks with both compressors, the results must be identical */
+static bool compress_all(sqfs_compressor_t* cached, sqfs_compressor_t* plain, sqfs_u8 blocks[BLOCKS_COUNT][BLOCK_SIZE]) {
+    static sqfs_u8 cached_output[BLOCK_SIZE];
+    static sqfs_u8 plain_output[BLOCK_SIZE];
+    bool success = true;
+
+    for (int i = 0; i < BLOCKS_COUNT; ++i) {
+        const sqfs_s32 cached_result = cached->do_block(cached, blocks[i], BLOCK_SIZE, cached_output, BLOCK_SIZE);
+        const sqfs_s32 plain_result = plain->do_block(plain, blocks[i], BLOCK_SIZE, plain_output, BLOCK_SIZE);
+
+        if (cached_result != plain_result || (cached_result > 0 && memcmp(cached_output, plain_output, (size_t) cached_result) != 0)) {
+            fprintf(stderr, "Block %d: got %d bytes from the store's compressor, %d bytes from the plain one\n", i, (int) cached_result, (int) plain_result);
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+/* Open the store like a build does, and compress the blocks with it; returns how many blocks had to be compressed */
+static int build(const char* directory, uint64_t max_size, sqfs_compressor_t* plain, sqfs_u8 blocks[BLOCKS_COUNT][BLOCK_SIZE], bool* identical) {
+    appimage_block_cache_t* cache = appimage_block_cache_open(directory, max_size, false);
+    if (cache == NULL) {
+        return -1;
+    }
+
+    sqfs_compressor_t* counting = new_counting_compressor(sqfs_copy(plain));
+    sqfs_compressor_t* cached = appimage_block_cache_wrap(cache, counting);
+    sqfs_destroy(counting);
+
+    if (cached == NULL) {
+        appimage_block_cache_free(cache);
+        return -1;
+    }
+
+    // the probe compressed by the wrapper does not count, and copies of the compressor share the store
+    sqfs_compressor_t* copy = sqfs_copy(cached);
+    compressed_blocks = 0;
+    *identical = compress_all(copy, plain, blocks);
+    const int result = (int) compressed_blocks;
+
+    sqfs_destroy(copy);
+    sqfs_destroy(cached);
+    appimage_block_cache_free(cache);
+    return result;
+}
+
+static int entries_count = 0;
+static char damaged_entry[PATH_MAX];
+
+static int count_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void) ftw;
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        ++entries_count;
+        snprintf(damaged_entry, sizeof(damaged_entry), "%s", path);
+    }
+    return 0;
+}
+
+static int count_entries(const char* directory) {
+    entries_count = 0;
+    nftw(directory, count_entry, 16, FTW_PHYS);
+    return entries_count;
+}
+
+/* Flip a byte of the compressed block in the last entry found */
+static bool damage_entry(void) {
+    FILE* file = fopen(damaged_entry, "r+b");
+    if (file == NULL) {
+        perror(damaged_entry);
+        return false;
+    }
+
+    bool success = fseek(file, -1, SEEK_END) == 0;
+    const int byte = success ? fgetc(file) : EOF;
+    success = byte != EOF && fseek(file, -1, SEEK_END) == 0 && fputc(byte ^ 0xff, file) != EOF;
+    return fclose(file) == 0 && success;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    return remove(path);
+}
+
+int main(void) {
+    char directory[] = "/tmp/appimagetool-block-cache-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    char store[PATH_MAX];
+    char small_store[PATH_MAX];
+    snprintf(store, sizeof(store), "%s/store", directory);
+    snprintf(small_store, sizeof(small_store), "%s/small", directory);
+
+    sqfs_compressor_config_t configuration;
+    sqfs_compressor_t* plain = NULL;
+    if (sqfs_compressor_config_init(&configuration, SQFS_COMP_GZIP, BLOCK_SIZE, 0) != 0 ||
+        sqfs_compressor_create(&configuration, &plain) != 0) {
+        fprintf(stderr, "Failed to create the compressor\n");
+        return 1;
+    }
+
+    static sqfs_u8 blocks[BLOCKS_COUNT][BLOCK_SIZE];
+    generate(blocks);
+
+    bool identical = false;
+    bool success = true;
+
+    success = check(build(store, 0, plain, blocks, &identical) == BLOCKS_COUNT && identical, "empty store, all blocks compressed") && success;
+    success = check(count_entries(store) == BLOCKS_COUNT, "empty store, all blocks added") && success;
+    success = check(build(store, 0, plain, blocks, &identical) == 0 && identical, "filled store, no block compressed") && success;
+
+    success = success && damage_entry();
+    success = check(build(store, 0, plain, blocks, &identical) == 1 && identical, "damaged entry, block compressed again") && success;
+    success = check(build(store, 0, plain, blocks, &identical) == 0 && identical, "damaged entry, replaced") && success;
+
+    // another configuration must not use the entries of this one
+    sqfs_compressor_config_t other_configuration;
+    sqfs_compressor_t* other = NULL;
+    if (sqfs_compressor_config_init(&other_configuration, SQFS_COMP_GZIP, BLOCK_SIZE, 0) == 0) {
+        other_configuration.level = 1;
+        if (sqfs_compressor_create(&other_configuration, &other) == 0) {
+            success = check(build(store, 0, other, blocks, &identical) == BLOCKS_COUNT && identical, "other configuration, all blocks compressed") && success;
+            sqfs_destroy(other);
+        }
+    }
+
+    // entries which do not fit into the store are evicted once the build is done
+    success = check(build(small_store, 1, plain, blocks, &identical) == BLOCKS_COUNT && identical, "small store, all blocks compressed") && success;
+    success = check(count_entries(small_store) == 0, "small store, evicted to its size") && success;
+
+    sqfs_destroy(plain);
+    nftw(directory, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return success ? 0 : 1;
+}
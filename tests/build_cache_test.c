@@ -0,0 +1,320 @@
+/*
+ * Keys and hashes of the build cache must only change when the inputs do: a key which changes between identical
+ * builds makes every build a miss, one which does not change when an input does publishes a wrong AppImage. The tree
+ * hash is checked with and without the modification times, with and without the index of content hashes, since the
+ * watch mode relies on the hash without times ignoring touched files. The cache itself is checked for misses, hits,
+ * publishing copies which are independent of the entries, and eviction of the least recently used entries.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "appimagetool_cache.h"
+#include "appimagetool_scan.h"
+
+// the entries are padded to this size, so that the cache's size limit can be expressed in entries
+#define ENTRY_SIZE 4096
+
+static bool check(bool condition, const char* description) {
+    fprintf(stderr, "%s: %s\n", description, condition ? "ok" : "FAILED");
+    return condition;
+}
+
+static bool write_file(const char* path, const char* contents, size_t size) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    const size_t length = strlen(contents);
+    bool success = fwrite(contents, 1, length, file) == length;
+    for (size_t i = length; success && i < size; ++i) {
+        success = fputc('\0', file) != EOF;
+    }
+
+    return fclose(file) == 0 && success;
+}
+
+static bool fd_contains(int fd, const char* expected) {
+    char contents[64] = {0};
+    const ssize_t bytes_read = pread(fd, contents, sizeof(contents) - 1, 0);
+    return bytes_read >= 0 && strcmp(contents, expected) == 0;
+}
+
+static void key_of(const char* name, const char* value, const char* file_name, const char* path, char hex[APPIMAGE_CACHE_KEY_LENGTH + 1]) {
+    appimage_cache_key_t* key = appimage_cache_key_new();
+    appimage_cache_key_add_string(key, name, value);
+    appimage_cache_key_add_file(key, file_name, path);
+    appimage_cache_key_finish(key, hex);
+}
+
+static bool check_keys(const char* directory) {
+    char empty_file[PATH_MAX];
+    char runtime[PATH_MAX];
+    char missing_file[PATH_MAX];
+    snprintf(empty_file, sizeof(empty_file), "%s/empty", directory);
+    snprintf(runtime, sizeof(runtime), "%s/runtime", directory);
+    snprintf(missing_file, sizeof(missing_file), "%s/missing", directory);
+
+    if (!write_file(empty_file, "", 0) || !write_file(runtime, "runtime", 0)) {
+        return false;
+    }
+
+    char key[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    char same_key[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    char other_key[APPIMAGE_CACHE_KEY_LENGTH + 1];
+    bool success = true;
+
+    key_of("comp", "zstd", "runtime", runtime, key);
+    key_of("comp", "zstd", "runtime", runtime, same_key);
+    success = check(strlen(key) == APPIMAGE_CACHE_KEY_LENGTH && strcmp(key, same_key) == 0, "same inputs, same key") && success;
+
+    key_of("comp", "xz", "runtime", runtime, other_key);
+    success = check(strcmp(key, other_key) != 0, "changed value, different key") && success;
+
+    key_of("sign-key", "zstd", "runtime", runtime, other_key);
+    success = check(strcmp(key, other_key) != 0, "changed name, different key") && success;
+
+    // the names and values must not run into each other
+    key_of("com", "pzstd", "runtime", runtime, other_key);
+    success = check(strcmp(key, other_key) != 0, "value moved into the name, different key") && success;
+
+    key_of("comp", NULL, "runtime", runtime, key);
+    key_of("comp", "", "runtime", runtime, other_key);
+    success = check(strcmp(key, other_key) != 0, "NULL and empty string, different keys") && success;
+
+    key_of("comp", "zstd", "runtime", missing_file, key);
+    key_of("comp", "zstd", "runtime", empty_file, other_key);
+    success = check(strcmp(key, other_key) != 0, "missing and empty file, different keys") && success;
+
+    key_of("comp", "zstd", "runtime", NULL, same_key);
+    success = check(strcmp(key, same_key) == 0, "NULL path and missing file, same key") && success;
+
+    unlink(empty_file);
+    unlink(runtime);
+    return success;
+}
+
+static bool tree_hash(const char* appdir, const char* index_directory, appimage_tree_hashes_t* hashes) {
+    appdir_scan_t* scan = appdir_scan(appdir, 2, APPDIR_SCAN_METADATA, false);
+    if (scan == NULL) {
+        fprintf(stderr, "Failed to scan %s\n", appdir);
+        return false;
+    }
+
+    const bool success = appimage_tree_hash(appdir, scan, 2, index_directory, hashes, false);
+    appdir_scan_free(scan);
+
+    if (!success) {
+        fprintf(stderr, "Failed to hash %s\n", appdir);
+    }
+    return success;
+}
+
+static bool set_mtime(const char* path, time_t seconds) {
+    const struct timespec times[2] = {{0, UTIME_OMIT}, {seconds, 0}};
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+static bool check_tree_hash(const char* directory) {
+    char appdir[PATH_MAX];
+    char usr[PATH_MAX];
+    char bin[PATH_MAX];
+    char app[PATH_MAX];
+    char link[PATH_MAX];
+    char index_directory[PATH_MAX];
+    snprintf(appdir, sizeof(appdir), "%s/AppDir", directory);
+    snprintf(usr, sizeof(usr), "%s/usr", appdir);
+    snprintf(bin, sizeof(bin), "%s/bin", usr);
+    snprintf(app, sizeof(app), "%s/app", bin);
+    snprintf(link, sizeof(link), "%s/AppRun", appdir);
+    snprintf(index_directory, sizeof(index_directory), "%s/index", directory);
+
+    if (mkdir(appdir, 0755) != 0 || mkdir(usr, 0755) != 0 || mkdir(bin, 0755) != 0 ||
+        !write_file(app, "#!/bin/sh\necho one\n", 0) || symlink("usr/bin/app", link) != 0 || !set_mtime(app, 1000000000)) {
+        perror("Failed to create the AppDir");
+        return false;
+    }
+
+    appimage_tree_hashes_t hashes;
+    appimage_tree_hashes_t again;
+    appimage_tree_hashes_t indexed;
+    appimage_tree_hashes_t indexed_again;
+
+    if (!tree_hash(appdir, NULL, &hashes) || !tree_hash(appdir, NULL, &again) ||
+        !tree_hash(appdir, index_directory, &indexed) || !tree_hash(appdir, index_directory, &indexed_again)) {
+        return false;
+    }
+
+    bool success = true;
+    success = check(
+        strcmp(hashes.with_times, again.with_times) == 0 && strcmp(hashes.without_times, again.without_times) == 0,
+        "unchanged tree, same hashes"
+    ) && success;
+    success = check(strcmp(hashes.with_times, hashes.without_times) != 0, "hashes with and without times differ") && success;
+    success = check(
+        strcmp(hashes.with_times, indexed.with_times) == 0 && strcmp(hashes.without_times, indexed.without_times) == 0 &&
+        strcmp(indexed.with_times, indexed_again.with_times) == 0 && strcmp(indexed.without_times, indexed_again.without_times) == 0,
+        "hashes from the index, same hashes"
+    ) && success;
+
+    // touched: only the hash with times changes
+    appimage_tree_hashes_t touched;
+    if (!set_mtime(app, 1000000001) || !tree_hash(appdir, index_directory, &touched)) {
+        return false;
+    }
+    success = check(strcmp(hashes.with_times, touched.with_times) != 0, "touched file, different hash with times") && success;
+    success = check(strcmp(hashes.without_times, touched.without_times) == 0, "touched file, same hash without times") && success;
+
+    // changed contents of the same size, with the original time: the index must not return the old contents' hash
+    appimage_tree_hashes_t changed;
+    if (!write_file(app, "#!/bin/sh\necho two\n", 0) || !set_mtime(app, 1000000000) || !tree_hash(appdir, index_directory, &changed)) {
+        return false;
+    }
+    success = check(
+        strcmp(hashes.with_times, changed.with_times) != 0 && strcmp(hashes.without_times, changed.without_times) != 0,
+        "changed contents, different hashes"
+    ) && success;
+
+    // a different symlink target
+    appimage_tree_hashes_t relinked;
+    if (unlink(link) != 0 || symlink("usr/bin/./app", link) != 0 || !tree_hash(appdir, index_directory, &relinked)) {
+        return false;
+    }
+    success = check(strcmp(changed.without_times, relinked.without_times) != 0, "changed symlink target, different hash") && success;
+
+    return success;
+}
+
+static int lookup(appimage_build_cache_t* cache, const char* key, const char* expected) {
+    const int fd = appimage_build_cache_lookup(cache, key);
+    if (fd >= 0 && !fd_contains(fd, expected)) {
+        fprintf(stderr, "Entry %s does not contain \"%s\"\n", key, expected);
+        close(fd);
+        return -2;
+    }
+    return fd;
+}
+
+static bool check_cache(const char* directory) {
+    char cache_directory[PATH_MAX];
+    char built[PATH_MAX];
+    char destination[PATH_MAX];
+    snprintf(cache_directory, sizeof(cache_directory), "%s/cache", directory);
+    snprintf(built, sizeof(built), "%s/built.AppImage", directory);
+    snprintf(destination, sizeof(destination), "%s/published.AppImage", directory);
+
+    // room for two entries
+    appimage_build_cache_t* cache = appimage_build_cache_open(cache_directory, ENTRY_SIZE * 5 / 2, false);
+    if (cache == NULL) {
+        return false;
+    }
+
+    const char* keys[3] = {
+        "1111111111111111111111111111111111111111111111111111111111111111",
+        "2222222222222222222222222222222222222222222222222222222222222222",
+        "3333333333333333333333333333333333333333333333333333333333333333",
+    };
+    const char* contents[3] = {"AppImage one", "AppImage two", "AppImage three"};
+
+    bool success = check(lookup(cache, keys[0], contents[0]) == -1, "empty cache, miss");
+
+    success = success && write_file(built, contents[0], ENTRY_SIZE) && appimage_build_cache_store(cache, keys[0], built);
+    int fd = lookup(cache, keys[0], contents[0]);
+    success = check(fd >= 0, "stored entry, hit") && success;
+
+    // the published AppImage must be a file of its own, changing it must not change the entry
+    if (fd >= 0) {
+        struct stat entry_stat;
+        struct stat destination_stat;
+        success = check(
+            appimage_build_cache_publish(fd, destination) && stat(destination, &destination_stat) == 0 &&
+            fstat(fd, &entry_stat) == 0 && destination_stat.st_ino != entry_stat.st_ino &&
+            destination_stat.st_size == ENTRY_SIZE && (destination_stat.st_mode & 0111) != 0,
+            "published entry, separate executable file"
+        ) && success;
+        close(fd);
+
+        success = success && write_file(destination, "modified", 0);
+        fd = lookup(cache, keys[0], contents[0]);
+        success = check(fd >= 0, "modified published AppImage, entry unchanged") && success;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    success = check(lookup(cache, keys[1], contents[1]) == -1, "other key, miss") && success;
+
+    // the second entry fits, the third evicts the least recently used one, which is the second since the first has
+    // been looked up after it
+    usleep(10000);
+    success = success && write_file(built, contents[1], ENTRY_SIZE) && appimage_build_cache_store(cache, keys[1], built);
+    usleep(10000);
+    fd = lookup(cache, keys[0], contents[0]);
+    if (fd >= 0) {
+        close(fd);
+    }
+    usleep(10000);
+    success = success && write_file(built, contents[2], ENTRY_SIZE) && appimage_build_cache_store(cache, keys[2], built);
+
+    fd = lookup(cache, keys[0], contents[0]);
+    success = check(fd >= 0, "recently used entry, kept") && success;
+    if (fd >= 0) {
+        close(fd);
+    }
+    success = check(lookup(cache, keys[1], contents[1]) == -1, "least recently used entry, evicted") && success;
+    fd = lookup(cache, keys[2], contents[2]);
+    success = check(fd >= 0, "newest entry, kept") && success;
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    appimage_build_cache_free(cache);
+
+    // entries are plain files, another process opening the same directory sees them
+    cache = appimage_build_cache_open(cache_directory, 0, false);
+    fd = cache != NULL ? lookup(cache, keys[2], contents[2]) : -1;
+    success = check(fd >= 0, "reopened cache, hit") && success;
+    if (fd >= 0) {
+        close(fd);
+    }
+    appimage_build_cache_free(cache);
+
+    return success;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    return remove(path);
+}
+
+int main(void) {
+    char directory[] = "/tmp/appimagetool-build-cache-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    bool success = check_keys(directory);
+    success = check_tree_hash(directory) && success;
+    success = check_cache(directory) && success;
+
+    nftw(directory, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,285 @@
+/*
+ * Jobs submitted to the build daemon must behave like appimagetool run by the client: the job sees the client's
+ * arguments, environment and working directory, its output goes to the client's streams and the client gets its exit
+ * code. The daemon must not run more jobs at once than it has workers, must not be held up by a client which stops
+ * sending halfway through its request, and must shut down cleanly on SIGTERM.
+ *
+ * The daemon runs in a child process with a job function of this test instead of appimagetool's.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "appimagetool_daemon.h"
+
+#define WORKERS 2
+#define SLEEP_MS 300
+
+static char socket_path[PATH_MAX];
+
+/* The job function of the daemon, argv[1] selects what the job does */
+static int job(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], "exit") == 0) {
+        return atoi(argv[2]);
+    }
+
+    if (argc == 3 && strcmp(argv[1], "environment") == 0) {
+        char cwd[PATH_MAX];
+        const char* value = getenv("APPIMAGETOOL_DAEMON_TEST");
+        return getcwd(cwd, sizeof(cwd)) != NULL && strcmp(cwd, argv[2]) == 0 && value != NULL && strcmp(value, "client") == 0 ? 0 : 1;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "print") == 0) {
+        printf("output of the job\n");
+        return 0;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "sleep") == 0) {
+        usleep(SLEEP_MS * 1000);
+        return 0;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "stage") == 0) {
+        appimage_daemon_report_stage("squashfs", 1500);
+        return appimage_daemon_is_worker() ? 0 : 1;
+    }
+
+    return 2;
+}
+
+static bool check(bool condition, const char* description) {
+    fprintf(stderr, "%s: %s\n", description, condition ? "ok" : "FAILED");
+    return condition;
+}
+
+static long elapsed_ms(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int connect_to_daemon(void) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool wait_for_daemon(void) {
+    for (int attempt = 0; attempt < 500; ++attempt) {
+        const int fd = connect_to_daemon();
+        if (fd >= 0) {
+            close(fd);
+            return true;
+        }
+        usleep(10000);
+    }
+
+    fprintf(stderr, "The daemon does not accept connections on %s\n", socket_path);
+    return false;
+}
+
+/* Submit a job in a child process, so that several can run at the same time, and return its pid */
+static pid_t submit_in_background(char* const argv[]) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+        _exit(appimage_daemon_submit(socket_path, argv));
+    }
+    return pid;
+}
+
+static int wait_for_exit_code(pid_t pid) {
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+/* Submit a job, or request the metrics if argv is NULL, with the standard output captured */
+static int run_captured(char* const argv[], char* output, size_t output_size) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        const int result = argv != NULL ? appimage_daemon_submit(socket_path, argv) : appimage_daemon_print_metrics(socket_path);
+        fflush(stdout);
+        _exit(result);
+    }
+    close(pipe_fds[1]);
+
+    size_t length = 0;
+    ssize_t bytes_read;
+    while (length < output_size - 1 && (bytes_read = read(pipe_fds[0], output + length, output_size - 1 - length)) != 0) {
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            break;
+        }
+        length += (size_t) bytes_read;
+    }
+    output[length] = '\0';
+    close(pipe_fds[0]);
+
+    return wait_for_exit_code(pid);
+}
+
+static bool check_jobs(const char* directory) {
+    bool success = true;
+
+    char* exit_zero[] = {"appimagetool", "exit", "0", NULL};
+    char* exit_three[] = {"appimagetool", "exit", "3", NULL};
+    success = check(appimage_daemon_submit(socket_path, exit_zero) == 0, "successful job, exit code 0") && success;
+    success = check(appimage_daemon_submit(socket_path, exit_three) == 3, "failing job, its exit code") && success;
+
+    // the job runs where the client is, with the client's environment
+    char* environment[] = {"appimagetool", "environment", (char*) directory, NULL};
+    setenv("APPIMAGETOOL_DAEMON_TEST", "client", 1);
+    if (chdir(directory) != 0) {
+        perror(directory);
+        return false;
+    }
+    success = check(appimage_daemon_submit(socket_path, environment) == 0, "client's working directory and environment") && success;
+    if (chdir("/") != 0) {
+        perror("/");
+        return false;
+    }
+    success = check(appimage_daemon_submit(socket_path, environment) == 1, "changed working directory, seen by the job") && success;
+
+    char output[256];
+    char* print[] = {"appimagetool", "print", NULL};
+    success = check(
+        run_captured(print, output, sizeof(output)) == 0 && strcmp(output, "output of the job\n") == 0,
+        "job's output, written to the client's standard output"
+    ) && success;
+
+    return success;
+}
+
+static bool check_workers(void) {
+    // with WORKERS jobs at a time, the jobs take three rounds
+    const int jobs_count = 2 * WORKERS + 1;
+    char* sleep_job[] = {"appimagetool", "sleep", NULL};
+    pid_t pids[2 * WORKERS + 1];
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < jobs_count; ++i) {
+        pids[i] = submit_in_background(sleep_job);
+    }
+
+    bool all_succeeded = true;
+    for (int i = 0; i < jobs_count; ++i) {
+        all_succeeded = wait_for_exit_code(pids[i]) == 0 && all_succeeded;
+    }
+
+    const long duration = elapsed_ms(&start);
+    fprintf(stderr, "%d jobs of %d ms took %ld ms\n", jobs_count, SLEEP_MS, duration);
+
+    bool success = check(all_succeeded, "more jobs than workers, all finished");
+    success = check(duration >= 3 * SLEEP_MS, "more jobs than workers, queued") && success;
+    return success;
+}
+
+static bool check_stalled_client(void) {
+    // a client which has sent part of a header and then stops
+    const int stalled_fd = connect_to_daemon();
+    if (stalled_fd < 0 || write(stalled_fd, "AIA", 3) != 3) {
+        perror("Failed to connect the stalled client");
+        return false;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char* exit_zero[] = {"appimagetool", "exit", "0", NULL};
+    const int exit_code = appimage_daemon_submit(socket_path, exit_zero);
+    const long duration = elapsed_ms(&start);
+
+    close(stalled_fd);
+    return check(exit_code == 0 && duration < 1000, "stalled client, other jobs not held up");
+}
+
+static bool check_metrics(void) {
+    char* stage[] = {"appimagetool", "stage", NULL};
+    bool success = check(appimage_daemon_submit(socket_path, stage) == 0, "job, run in a worker");
+
+    char metrics[16384];
+    success = check(run_captured(NULL, metrics, sizeof(metrics)) == 0, "metrics, received") && success;
+
+    // two of the jobs above have failed, all others have succeeded
+    success = check(strstr(metrics, "appimagetool_daemon_workers 2\n") != NULL, "metrics, number of workers") && success;
+    success = check(strstr(metrics, "appimagetool_daemon_jobs_total{result=\"failed\"} 2\n") != NULL, "metrics, failed jobs") && success;
+    success = check(strstr(metrics, "appimagetool_daemon_jobs_running 0\n") != NULL, "metrics, no running jobs") && success;
+    success = check(
+        strstr(metrics, "appimagetool_daemon_stage_duration_seconds_count{stage=\"squashfs\"} 1\n") != NULL,
+        "metrics, reported stage"
+    ) && success;
+
+    if (!success) {
+        fprintf(stderr, "%s", metrics);
+    }
+    return success;
+}
+
+int main(void) {
+    char directory[] = "/tmp/appimagetool-daemon-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s/socket", directory);
+
+    fflush(stderr);
+    const pid_t daemon_pid = fork();
+    if (daemon_pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (daemon_pid == 0) {
+        _exit(appimage_daemon_run(socket_path, WORKERS, job));
+    }
+
+    bool success = wait_for_daemon();
+    if (success) {
+        success = check_jobs(directory);
+        success = check_workers() && success;
+        success = check_stalled_client() && success;
+        success = check_metrics() && success;
+    }
+
+    kill(daemon_pid, SIGTERM);
+    success = check(wait_for_exit_code(daemon_pid) == 0, "SIGTERM, daemon exits with 0") && success;
+    success = check(access(socket_path, F_OK) != 0, "SIGTERM, socket removed") && success;
+
+    unlink(socket_path);
+    rmdir(directory);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,13 @@
+/*
+ * Stand-in for the type 2 runtime: an ELF file with the sections appimagetool fills in, with the same sizes as in
+ * the real runtime. Allows building AppImages in the tests without downloading a runtime. The AppImages cannot run.
+ */
+
+__attribute__((section(".upd_info"), used)) static char update_information[1024];
+__attribute__((section(".sha256_sig"), used)) static char signature[1024];
+__attribute__((section(".sig_key"), used)) static char signature_key[8192];
+__attribute__((section(".digest_md5"), used)) static char digest_md5[16];
+
+int main(void) {
+    return 127;
+}
@@ -0,0 +1,287 @@
+/*
+ * Runtime download and cache revalidation against a local HTTP server, using APPIMAGETOOL_RUNTIME_BASE_URL.
+ * The server, the cache directory and the proxy settings are passed in the build's environment, the process'
+ * environment must not be used.
+ *
+ * The server answers one request per fetch_runtime call. It responds with 304 Not Modified when the request's
+ * If-None-Match or If-Modified-Since header matches the runtime it serves, so a runtime returned after a 304 response
+ * can only have come from the cache.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <ftw.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "appimagetool_fetch_runtime.h"
+
+typedef struct {
+    // what the server serves, etag and last_modified may be NULL
+    const char* body;
+    const char* etag;
+    const char* last_modified;
+
+    // what the last request looked like, empty strings if the header was not sent
+    char path[256];
+    char if_none_match[256];
+    char if_modified_since[256];
+    int status;
+} server_t;
+
+static int listen_fd = -1;
+
+// environment of the builds the runtimes are fetched for
+static const char* environment[4];
+
+static void header_value(const char* request, const char* name, char* value, size_t value_size) {
+    value[0] = '\0';
+
+    for (const char* line = strstr(request, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, strlen(name)) != 0 || line[strlen(name)] != ':') {
+            continue;
+        }
+
+        const char* start = line + strlen(name) + 1;
+        start += strspn(start, " ");
+        const size_t length = strcspn(start, "\r\n");
+        snprintf(value, value_size, "%.*s", (int) length, start);
+        return;
+    }
+}
+
+static bool send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        const ssize_t result = send(fd, data, size, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        data += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+
+static void* serve_one_request(void* data) {
+    server_t* server = data;
+
+    const int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        perror("accept");
+        return NULL;
+    }
+
+    char request[8192];
+    size_t length = 0;
+    while (length < sizeof(request) - 1) {
+        const ssize_t result = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (result <= 0) {
+            break;
+        }
+        length += (size_t) result;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    sscanf(request, "GET %255s", server->path);
+    header_value(request, "If-None-Match", server->if_none_match, sizeof(server->if_none_match));
+    header_value(request, "If-Modified-Since", server->if_modified_since, sizeof(server->if_modified_since));
+
+    // like common servers, ignore If-Modified-Since when If-None-Match is present
+    bool not_modified;
+    if (server->if_none_match[0] != '\0') {
+        not_modified = server->etag != NULL && strcmp(server->if_none_match, server->etag) == 0;
+    } else {
+        not_modified = server->last_modified != NULL && strcmp(server->if_modified_since, server->last_modified) == 0;
+    }
+    server->status = not_modified ? 304 : 200;
+
+    char headers[1024];
+    int headers_length = snprintf(headers, sizeof(headers), "HTTP/1.1 %s\r\nConnection: close\r\n", not_modified ? "304 Not Modified" : "200 OK");
+    if (server->etag != NULL) {
+        headers_length += snprintf(headers + headers_length, sizeof(headers) - headers_length, "ETag: %s\r\n", server->etag);
+    }
+    if (server->last_modified != NULL) {
+        headers_length += snprintf(headers + headers_length, sizeof(headers) - headers_length, "Last-Modified: %s\r\n", server->last_modified);
+    }
+    if (!not_modified) {
+        headers_length += snprintf(headers + headers_length, sizeof(headers) - headers_length, "Content-Length: %zu\r\n", strlen(server->body));
+    }
+    headers_length += snprintf(headers + headers_length, sizeof(headers) - headers_length, "\r\n");
+
+    if (send_all(fd, headers, (size_t) headers_length) && !not_modified) {
+        send_all(fd, server->body, strlen(server->body));
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static bool runtime_is(int fd, size_t size, const char* expected) {
+    char contents[256] = {0};
+    const ssize_t bytes_read = pread(fd, contents, sizeof(contents) - 1, 0);
+
+    if (bytes_read < 0 || size != strlen(expected) || strcmp(contents, expected) != 0) {
+        fprintf(stderr, "Got runtime \"%s\" of size %zu, expected \"%s\"\n", contents, size, expected);
+        return false;
+    }
+
+    return true;
+}
+
+/* Fetch the runtime for arch while the server handles the request, and check what was sent and returned */
+static bool fetch(server_t* server, const char* arch, int expected_status, const char* expected_condition, const char* expected_body) {
+    memset(server->path, 0, sizeof(server->path));
+    server->status = 0;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_one_request, server) != 0) {
+        fprintf(stderr, "Failed to start the server thread\n");
+        return false;
+    }
+
+    char arch_copy[32];
+    snprintf(arch_copy, sizeof(arch_copy), "%s", arch);
+
+    size_t size = 0;
+    int fd = -1;
+    const bool fetched = fetch_runtime(arch_copy, environment, &size, &fd, false, false);
+    pthread_join(thread, NULL);
+
+    if (!fetched) {
+        fprintf(stderr, "Failed to fetch the runtime for %s\n", arch);
+        return false;
+    }
+
+    char expected_path[64];
+    snprintf(expected_path, sizeof(expected_path), "/runtime-%s", arch);
+
+    const char* condition = server->if_none_match[0] != '\0' ? server->if_none_match : server->if_modified_since;
+
+    bool success = runtime_is(fd, size, expected_body);
+    if (strcmp(server->path, expected_path) != 0) {
+        fprintf(stderr, "Requested %s, expected %s\n", server->path, expected_path);
+        success = false;
+    }
+    if (strcmp(condition, expected_condition) != 0) {
+        fprintf(stderr, "Revalidated with \"%s\", expected \"%s\"\n", condition, expected_condition);
+        success = false;
+    }
+    if (server->status != expected_status) {
+        fprintf(stderr, "Server responded with %d, expected %d\n", server->status, expected_status);
+        success = false;
+    }
+
+    close(fd);
+    return success;
+}
+
+/* In offline mode, the cached runtime must be returned without connecting to the server */
+static bool fetch_offline(const char* arch, const char* expected_body) {
+    char arch_copy[32];
+    snprintf(arch_copy, sizeof(arch_copy), "%s", arch);
+
+    size_t size = 0;
+    int fd = -1;
+    if (!fetch_runtime(arch_copy, environment, &size, &fd, true, false)) {
+        fprintf(stderr, "Failed to fetch the runtime for %s in offline mode\n", arch);
+        return false;
+    }
+
+    bool success = runtime_is(fd, size, expected_body);
+    close(fd);
+
+    struct pollfd pending = {.fd = listen_fd, .events = POLLIN};
+    if (poll(&pending, 1, 0) != 0) {
+        fprintf(stderr, "Connected to the server in offline mode\n");
+        success = false;
+    }
+
+    return success;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    return remove(path);
+}
+
+int main(void) {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t address_length = sizeof(address);
+
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listen_fd, 4) != 0 ||
+        getsockname(listen_fd, (struct sockaddr*) &address, &address_length) != 0) {
+        perror("Failed to set up the server");
+        return 1;
+    }
+
+    char cache_home[] = "/tmp/appimagetool-fetch-runtime-XXXXXX";
+    if (mkdtemp(cache_home) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    char base_url[128];
+    snprintf(base_url, sizeof(base_url), "APPIMAGETOOL_RUNTIME_BASE_URL=http://127.0.0.1:%d", ntohs(address.sin_port));
+    char cache_home_variable[128];
+    snprintf(cache_home_variable, sizeof(cache_home_variable), "XDG_CACHE_HOME=%s", cache_home);
+
+    environment[0] = base_url;
+    environment[1] = cache_home_variable;
+    // a proxy configured for the process must not be used either
+    environment[2] = "no_proxy=*";
+    environment[3] = NULL;
+
+    // the process' environment points elsewhere, so that using it makes the test fail
+    setenv("APPIMAGETOOL_RUNTIME_BASE_URL", "http://127.0.0.1:1", 1);
+    setenv("XDG_CACHE_HOME", "/nonexistent", 1);
+
+    fetch_runtime_init();
+
+    server_t server = {.body = "runtime one", .etag = "\"one\""};
+    bool success =
+        // empty cache: downloaded
+        fetch(&server, "x86_64", 200, "", "runtime one") &&
+        // revalidated with the ETag, reused from the cache
+        fetch(&server, "x86_64", 304, "\"one\"", "runtime one") &&
+        fetch_offline("x86_64", "runtime one");
+
+    // changed on the server: downloaded again, and the cache now revalidates the new one
+    server = (server_t) {.body = "runtime two", .etag = "\"two\""};
+    success = success &&
+        fetch(&server, "x86_64", 200, "\"one\"", "runtime two") &&
+        fetch(&server, "x86_64", 304, "\"two\"", "runtime two") &&
+        fetch_offline("x86_64", "runtime two");
+
+    // a server which only sends Last-Modified, the cache is per architecture
+    server = (server_t) {.body = "runtime three", .last_modified = "Wed, 21 Oct 2015 07:28:00 GMT"};
+    success = success &&
+        fetch(&server, "aarch64", 200, "", "runtime three") &&
+        fetch(&server, "aarch64", 304, "Wed, 21 Oct 2015 07:28:00 GMT", "runtime three") &&
+        fetch_offline("x86_64", "runtime two");
+
+    close(listen_fd);
+    nftw(cache_home, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    return success ? 0 : 1;
+}
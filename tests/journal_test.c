@@ -0,0 +1,165 @@
+/*
+ * A build may only continue after a checkpoint of an earlier one if its inputs are the same and the partially built
+ * AppImage is still in the state the checkpoint has recorded. Continuing in any other case produces a broken AppImage
+ * which looks fine, so the journal is checked for the cases in which it must not resume as well: changed keys of the
+ * squashfs image or of the later stages, a modified partial file, a damaged journal and a removed one.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "appimagetool_journal.h"
+
+static bool check(bool condition, const char* description) {
+    fprintf(stderr, "%s: %s\n", description, condition ? "ok" : "FAILED");
+    return condition;
+}
+
+static void make_keys(appimage_checkpoint_keys_t keys, char variant) {
+    for (int checkpoint = 0; checkpoint < APPIMAGE_CHECKPOINT_COUNT; ++checkpoint) {
+        memset(keys[checkpoint], '0' + checkpoint, APPIMAGE_CACHE_KEY_LENGTH);
+        keys[checkpoint][0] = variant;
+        keys[checkpoint][APPIMAGE_CACHE_KEY_LENGTH] = '\0';
+    }
+}
+
+static bool append(const char* path, const char* text) {
+    FILE* file = fopen(path, "ab");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    const bool success = fputs(text, file) >= 0;
+    return fclose(file) == 0 && success;
+}
+
+/* Reopen the journal like the next build does, and check where it would continue */
+static bool resumes_at(const char* destination, const appimage_checkpoint_keys_t keys, appimage_checkpoint_t expected, const char* expected_partial_path) {
+    appimage_journal_t* journal = appimage_journal_open(destination);
+    const char* partial_path = NULL;
+    const appimage_checkpoint_t checkpoint = appimage_journal_resume_point(journal, keys, &partial_path);
+
+    bool success = checkpoint == expected;
+    if (!success) {
+        fprintf(
+            stderr, "Resumed at %s, expected %s\n", appimage_checkpoint_name(checkpoint), appimage_checkpoint_name(expected)
+        );
+    }
+    if (expected != APPIMAGE_CHECKPOINT_NONE && (partial_path == NULL || strcmp(partial_path, expected_partial_path) != 0)) {
+        fprintf(stderr, "Got partial file %s, expected %s\n", partial_path != NULL ? partial_path : "(none)", expected_partial_path);
+        success = false;
+    }
+
+    appimage_journal_free(journal);
+    return success;
+}
+
+/* Write a stage's data to the partial file and record its checkpoint */
+static bool run_stage(appimage_journal_t* journal, const char* partial_path, appimage_checkpoint_t checkpoint, const appimage_checkpoint_keys_t keys) {
+    const int fd = open(partial_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(partial_path);
+        return false;
+    }
+
+    const char* name = appimage_checkpoint_name(checkpoint);
+    bool success = write(fd, name, strlen(name)) == (ssize_t) strlen(name) &&
+        appimage_journal_record(journal, checkpoint, keys[checkpoint], fd);
+
+    close(fd);
+    return success;
+}
+
+int main(void) {
+    char directory[] = "/tmp/appimagetool-journal-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    char destination[PATH_MAX];
+    char partial_path[PATH_MAX];
+    char other_partial_path[PATH_MAX];
+    char journal_path[PATH_MAX];
+    snprintf(destination, sizeof(destination), "%s/Test-x86_64.AppImage", directory);
+    snprintf(partial_path, sizeof(partial_path), "%s/.Test-x86_64.AppImage.partial", directory);
+    snprintf(other_partial_path, sizeof(other_partial_path), "%s/.Test-x86_64.AppImage.partial2", directory);
+    snprintf(journal_path, sizeof(journal_path), "%s/.Test-x86_64.AppImage.journal", directory);
+
+    appimage_checkpoint_keys_t keys;
+    appimage_checkpoint_keys_t other_keys;
+    make_keys(keys, 'a');
+    make_keys(other_keys, 'b');
+
+    bool success = check(resumes_at(destination, keys, APPIMAGE_CHECKPOINT_NONE, NULL), "no journal, start over");
+
+    // a build which has failed after writing the sections
+    appimage_journal_t* journal = appimage_journal_open(destination);
+    success = success && appimage_journal_start(journal, partial_path) &&
+        run_stage(journal, partial_path, APPIMAGE_CHECKPOINT_SQUASHFS, keys) &&
+        run_stage(journal, partial_path, APPIMAGE_CHECKPOINT_RUNTIME, keys) &&
+        run_stage(journal, partial_path, APPIMAGE_CHECKPOINT_SECTIONS, keys);
+    appimage_journal_free(journal);
+
+    success = check(resumes_at(destination, keys, APPIMAGE_CHECKPOINT_SECTIONS, partial_path), "same keys, continue after the last checkpoint") && success;
+
+    appimage_checkpoint_keys_t changed_keys;
+    memcpy(changed_keys, keys, sizeof(changed_keys));
+    strcpy(changed_keys[APPIMAGE_CHECKPOINT_SECTIONS], other_keys[APPIMAGE_CHECKPOINT_SECTIONS]);
+    success = check(resumes_at(destination, changed_keys, APPIMAGE_CHECKPOINT_SQUASHFS, partial_path), "changed update information, continue after the squashfs image") && success;
+
+    memcpy(changed_keys, keys, sizeof(changed_keys));
+    strcpy(changed_keys[APPIMAGE_CHECKPOINT_RUNTIME], other_keys[APPIMAGE_CHECKPOINT_RUNTIME]);
+    success = check(resumes_at(destination, changed_keys, APPIMAGE_CHECKPOINT_SQUASHFS, partial_path), "changed runtime, continue after the squashfs image") && success;
+
+    memcpy(changed_keys, keys, sizeof(changed_keys));
+    strcpy(changed_keys[APPIMAGE_CHECKPOINT_SQUASHFS], other_keys[APPIMAGE_CHECKPOINT_SQUASHFS]);
+    success = check(resumes_at(destination, changed_keys, APPIMAGE_CHECKPOINT_NONE, NULL), "changed AppDir, start over") && success;
+
+    // a stage recorded again drops the checkpoints after it
+    journal = appimage_journal_open(destination);
+    success = success && run_stage(journal, partial_path, APPIMAGE_CHECKPOINT_RUNTIME, keys);
+    appimage_journal_free(journal);
+    success = check(resumes_at(destination, keys, APPIMAGE_CHECKPOINT_RUNTIME, partial_path), "stage recorded again, later checkpoints dropped") && success;
+
+    // entries after a damaged one are ignored, the ones before it remain usable
+    success = success && append(journal_path, "sections garbage\n") &&
+        append(journal_path, "digest 4444444444444444444444444444444444444444444444444444444444444444 1 1 1\n");
+    success = check(resumes_at(destination, keys, APPIMAGE_CHECKPOINT_RUNTIME, partial_path), "damaged entry, earlier checkpoints kept") && success;
+
+    // the partial file is not in the recorded state anymore
+    success = success && append(partial_path, "modified");
+    success = check(resumes_at(destination, keys, APPIMAGE_CHECKPOINT_NONE, NULL), "modified partial file, start over") && success;
+
+    // a new build replaces the partial file of the earlier one
+    journal = appimage_journal_open(destination);
+    success = success && appimage_journal_start(journal, other_partial_path) &&
+        run_stage(journal, other_partial_path, APPIMAGE_CHECKPOINT_SQUASHFS, other_keys);
+    appimage_journal_free(journal);
+    success = check(access(partial_path, F_OK) != 0, "new build, earlier partial file removed") && success;
+    success = check(resumes_at(destination, other_keys, APPIMAGE_CHECKPOINT_SQUASHFS, other_partial_path), "new build, continue after its own checkpoint") && success;
+    success = check(resumes_at(destination, keys, APPIMAGE_CHECKPOINT_NONE, NULL), "new build, old keys start over") && success;
+
+    // published: nothing to continue anymore
+    journal = appimage_journal_open(destination);
+    appimage_journal_remove(journal);
+    appimage_journal_free(journal);
+    success = check(access(journal_path, F_OK) != 0, "removed journal, file deleted") && success;
+    success = check(resumes_at(destination, other_keys, APPIMAGE_CHECKPOINT_NONE, NULL), "removed journal, start over") && success;
+
+    unlink(partial_path);
+    unlink(other_partial_path);
+    unlink(journal_path);
+    rmdir(directory);
+
+    return success ? 0 : 1;
+}
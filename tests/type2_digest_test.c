@@ -0,0 +1,145 @@
+/*
+ * The type 2 MD5 digest embedded in .digest_md5 must not change: validators calculate it with the original chunked
+ * implementation, which is built into this test from digest_reference.c. The digest of the hashing engine is compared
+ * with it for files generated here byte by byte: a minimal 64-bit ELF file whose only sections are the ones the digest
+ * skips, followed by pseudo-random data. The layouts cover the cases in which the original implementation does
+ * unexpected things, e.g., sections spanning several chunks, a section at the start of a chunk, two sections starting
+ * in the same chunk, and a file size which is not a multiple of 4 KiB.
+ */
+
+#include <elf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "digest_reference.h"
+#include "util.h"
+
+#define SECTION_COUNT 3
+
+static const char section_names[] = "\0.shstrtab\0.digest_md5\0.sha256_sig\0.sig_key";
+
+// offsets of the names in section_names, and the sizes the sections have in the runtime
+static const Elf64_Word section_name_offsets[SECTION_COUNT] = {11, 23, 35};
+static const Elf64_Xword section_sizes[SECTION_COUNT] = {16, 1024, 8192};
+
+typedef struct {
+    const char* name;
+    size_t size;
+    // offsets of .digest_md5, .sha256_sig and .sig_key, all of them past the first chunk
+    Elf64_Off offsets[SECTION_COUNT];
+} layout_t;
+
+static const layout_t layouts[] = {
+    {"separate chunks", 30000, {5000, 9000, 14100}},
+    {"adjacent like in the runtime", 70001, {47360, 37120, 38144}},
+    {"section at a chunk boundary", 40960, {6000, 10000, 16384}},
+    {"two sections in one chunk", 9 * 1024 * 1024 + 123, {8200, 8300, 20000}},
+    {"three sections in one chunk", 5 * 1024 * 1024, {12300, 12400, 13500}},
+};
+
+static void generate(const layout_t* layout, unsigned char* contents, unsigned char section_value) {
+    uint32_t state = 1;
+    for (size_t i = 0; i < layout->size; ++i) {
+        state = state * 1103515245 + 12345;
+        contents[i] = (unsigned char) (state >> 16);
+    }
+
+    for (size_t i = 0; i < SECTION_COUNT; ++i) {
+        memset(contents + layout->offsets[i], section_value, section_sizes[i]);
+    }
+
+    const Elf64_Off headers_offset = sizeof(Elf64_Ehdr);
+    const Elf64_Off names_offset = headers_offset + (2 + SECTION_COUNT) * sizeof(Elf64_Shdr);
+
+    Elf64_Ehdr ehdr = {
+        .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT},
+        .e_type = ET_EXEC,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_shoff = headers_offset,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = 2 + SECTION_COUNT,
+        .e_shstrndx = 1,
+    };
+    memcpy(contents, &ehdr, sizeof(ehdr));
+
+    Elf64_Shdr shdrs[2 + SECTION_COUNT] = {
+        [1] = {.sh_name = 1, .sh_type = SHT_STRTAB, .sh_offset = names_offset, .sh_size = sizeof(section_names)},
+    };
+    for (size_t i = 0; i < SECTION_COUNT; ++i) {
+        shdrs[i + 2] = (Elf64_Shdr) {
+            .sh_name = section_name_offsets[i],
+            .sh_type = SHT_PROGBITS,
+            .sh_offset = layout->offsets[i],
+            .sh_size = section_sizes[i],
+        };
+    }
+    memcpy(contents + headers_offset, shdrs, sizeof(shdrs));
+    memcpy(contents + names_offset, section_names, sizeof(section_names));
+}
+
+static bool write_file(const char* path, const unsigned char* contents, size_t size) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    const bool success = fwrite(contents, 1, size, file) == size;
+    return fclose(file) == 0 && success;
+}
+
+static bool check(const char* path, const layout_t* layout, unsigned char section_value) {
+    unsigned char* contents = malloc(layout->size);
+    generate(layout, contents, section_value);
+    const bool written = write_file(path, contents, layout->size);
+    free(contents);
+
+    if (!written) {
+        return false;
+    }
+
+    char digest[16];
+    char reference_digest[16];
+    if (!appimage_type2_digest_md5(path, digest) || !appimage_type2_digest_md5_reference(path, reference_digest)) {
+        fprintf(stderr, "%s: failed to calculate the digests\n", layout->name);
+        return false;
+    }
+
+    char* hex = appimage_hexlify(digest, sizeof(digest));
+    char* reference_hex = appimage_hexlify(reference_digest, sizeof(reference_digest));
+
+    const bool matches = strcmp(hex, reference_hex) == 0;
+    fprintf(
+        stderr, "%s, sections filled with 0x%02x: %s, reference %s%s\n",
+        layout->name, section_value, hex, reference_hex, matches ? "" : " (MISMATCH)"
+    );
+
+    free(hex);
+    free(reference_hex);
+    return matches;
+}
+
+int main(void) {
+    char path[] = "/tmp/appimagetool-type2-digest-XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    bool success = true;
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+        success = check(path, &layouts[i], 0x00) && success;
+        success = check(path, &layouts[i], 0xa5) && success;
+    }
+
+    unlink(path);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/*
+ * The zsync control files must be identical to the ones zsyncmake 0.6.2 writes, since clients rely on the hash
+ * lengths it picks. Files of sizes around the block size, where the number of sequential matches changes, and of sizes
+ * which are not a multiple of it are generated here and passed to both. Skipped when zsyncmake is not installed.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "appimagetool_hash.h"
+#include "appimagetool_zsync.h"
+
+#define SKIPPED 77
+
+extern char** environ;
+
+static const unsigned long sizes[] = {1, 1000, 2047, 2048, 2049, 3000, 4096, 4097, 10007, 65536 + 123, 1024 * 1024};
+
+static bool write_file(const char* path, unsigned long size) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    uint32_t state = (uint32_t) size;
+    for (unsigned long i = 0; i < size; ++i) {
+        state = state * 1103515245 + 12345;
+        fputc((int) (state >> 16) & 0xff, file);
+    }
+
+    return fclose(file) == 0;
+}
+
+static char* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    char* contents = NULL;
+    *size = 0;
+    char buffer[65536];
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        contents = realloc(contents, *size + bytes_read);
+        memcpy(contents + *size, buffer, bytes_read);
+        *size += bytes_read;
+    }
+
+    fclose(file);
+    return contents;
+}
+
+/* Returns the exit code of zsyncmake, or SKIPPED if it cannot be found */
+static int run_zsyncmake(const char* input, const char* output) {
+    char* const argv[] = {"zsyncmake", "-u", "file.bin", "-o", (char*) output, (char*) input, NULL};
+
+    pid_t pid;
+    const int error = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+    if (error == ENOENT) {
+        return SKIPPED;
+    }
+    if (error != 0) {
+        fprintf(stderr, "Failed to run zsyncmake: %s\n", strerror(error));
+        return 1;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+        return 1;
+    }
+    return WEXITSTATUS(status);
+}
+
+static bool write_control_file(const char* input, const char* output) {
+    size_t size;
+    char* contents = read_file(input, &size);
+    struct stat st;
+    appimage_hashes_t hashes;
+
+    if (contents == NULL || stat(input, &st) != 0 || !appimage_hash_file(input, APPIMAGE_HASH_SHA1, NULL, &hashes, false)) {
+        free(contents);
+        return false;
+    }
+
+    appimage_zsync_t* zsync = appimage_zsync_new(size, 0, 2);
+    bool success = zsync != NULL;
+    if (success) {
+        appimage_zsync_update(contents, size, 0, zsync);
+        success = appimage_zsync_write(zsync, output, "file.bin", "file.bin", (long) st.st_mtime, hashes.sha1);
+    }
+
+    appimage_zsync_free(zsync);
+    free(contents);
+    return success;
+}
+
+static int check(const char* directory, unsigned long size) {
+    char input[PATH_MAX];
+    char expected_path[PATH_MAX];
+    char actual_path[PATH_MAX];
+    snprintf(input, sizeof(input), "%s/file.bin", directory);
+    snprintf(expected_path, sizeof(expected_path), "%s/zsyncmake.zsync", directory);
+    snprintf(actual_path, sizeof(actual_path), "%s/appimagetool.zsync", directory);
+
+    if (!write_file(input, size)) {
+        return 1;
+    }
+
+    const int zsyncmake_result = run_zsyncmake(input, expected_path);
+    if (zsyncmake_result != 0) {
+        unlink(input);
+        if (zsyncmake_result != SKIPPED) {
+            fprintf(stderr, "%lu bytes: zsyncmake has failed\n", size);
+        }
+        return zsyncmake_result;
+    }
+
+    if (!write_control_file(input, actual_path)) {
+        fprintf(stderr, "%lu bytes: failed to write the control file\n", size);
+        return 1;
+    }
+
+    size_t expected_size = 0;
+    size_t actual_size = 0;
+    char* expected = read_file(expected_path, &expected_size);
+    char* actual = read_file(actual_path, &actual_size);
+
+    const bool matches = expected != NULL && actual != NULL && expected_size == actual_size &&
+        memcmp(expected, actual, expected_size) == 0;
+    fprintf(stderr, "%lu bytes: %s\n", size, matches ? "identical" : "DIFFERENT");
+
+    free(expected);
+    free(actual);
+    unlink(input);
+    unlink(expected_path);
+    unlink(actual_path);
+    return matches ? 0 : 1;
+}
+
+int main(void) {
+    char directory[] = "/tmp/appimagetool-zsync-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && result != SKIPPED; ++i) {
+        const int size_result = check(directory, sizes[i]);
+        if (size_result == SKIPPED) {
+            fprintf(stderr, "zsyncmake is not installed, skipping\n");
+        }
+        if (size_result != 0) {
+            result = size_result;
+        }
+    }
+
+    rmdir(directory);
+    return result;
+}